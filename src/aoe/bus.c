@@ -49,6 +49,7 @@ typedef struct S_AOE_BUS S_AOE_BUS;
 /* TODO: Remove this pull from aoe/driver.c */
 extern NTSTATUS STDCALL AoeBusDevCtlScan(IN PIRP);
 extern NTSTATUS STDCALL AoeBusDevCtlShow(IN PIRP);
+extern NTSTATUS STDCALL AoeBusDevCtlStats(IN PIRP);
 extern NTSTATUS STDCALL AoeBusDevCtlMount(IN PIRP);
 extern VOID AoeStop(void);
 
@@ -124,6 +125,9 @@ NTSTATUS STDCALL AoeBusDevCtl(
         case IOCTL_AOE_UMOUNT:
           return AoeBusDevCtlDetach_(irp);
 
+        case IOCTL_AOE_STATS:
+          return AoeBusDevCtlStats(irp);
+
         default:
           DBG("Unsupported IOCTL\n");
           return WvlIrpComplete(irp, 0, STATUS_NOT_SUPPORTED);
@@ -34,6 +34,7 @@
 #include "wv_stdlib.h"
 #include "wv_string.h"
 #include "irp.h"
+#include "copy.h"
 #include "driver.h"
 #include "bus.h"
 #include "device.h"
@@ -41,12 +42,54 @@
 #include "disk.h"
 #include "mount.h"
 #include "aoe.h"
+#include "tagtable.h"
+#include "merge.h"
 #include "registry.h"
 #include "protocol.h"
 #include "debug.h"
 
 #define AOEPROTOCOLVER 1
 
+/* Per-disk congestion window limits, in tags. */
+#define AOE_M_WINDOW_MIN_ 1
+#define AOE_M_WINDOW_INIT_ 16
+#define AOE_M_WINDOW_MAX_ 1024
+
+/* Initial capacity of the retransmit timer heap, in tags. */
+#define AOE_M_TIMER_HEAP_INIT_ 256
+
+/* How long to wait before retrying after a failed send: 10 ms. */
+#define AOE_M_SEND_RETRY_ 100000LL
+
+/* How often to probe for AoE targets: 10 s. */
+#define AOE_M_PROBE_INTERVAL_ 100000000LL
+
+/* How often to update the per-second worker statistics: 1 s. */
+#define AOE_M_STATS_INTERVAL_ 10000000LL
+
+/* The most free objects each per-disk pool keeps for reuse. */
+#define AOE_M_TAG_POOL_MAX_ 256
+#define AOE_M_REQUEST_POOL_MAX_ 64
+
+/* AoE commands. */
+#define AOE_M_CMD_ATA_ 0
+#define AOE_M_CMD_CONFIG_ 1
+
+/* The most sectors an AoE ATA header's one-byte count can ask for. */
+#define AOE_M_MAX_SECTORS_ 255
+
+/* How long to wait for a Query Config reply: 250 ms. */
+#define AOE_M_CONFIG_TIMEOUT_ 2500000LL
+
+/* Sectors per packet for a target which doesn't report them. */
+#define AOE_M_CONFIG_SECTORS_DEFAULT_ 2
+
+/* Timeouts in a row after which a path is taken to be dead. */
+#define AOE_M_PATH_TIMEOUTS_ 3
+
+/* How recently a target must have answered a probe to use its path. */
+#define AOE_M_PATH_FRESH_ (3 * AOE_M_PROBE_INTERVAL_)
+
 /* From aoe/bus.c */
 extern WVL_S_BUS_T AoeBusMain;
 extern NTSTATUS AoeBusCreate(IN PDRIVER_OBJECT);
@@ -67,6 +110,7 @@ static VOID AoeProcessAbft_(void);
 static AOE_SP_DISK AoeDiskCreatePdo_(void);
 static WVL_F_DISK_IO AoeDiskIo_;
 static WVL_F_DISK_MAX_XFER_LEN AoeDiskMaxXferLen_;
+static WVL_F_DISK_MAX_XFER_LEN AoeDiskMaxInFlightLen_;
 static BOOLEAN STDCALL AoeDiskInit_(AOE_SP_DISK);
 static WVL_F_DISK_CLOSE AoeDiskClose_;
 static WVL_F_DISK_UNIT_NUM AoeDiskUnitNum_;
@@ -141,21 +185,71 @@ struct AOE_PACKET_ {
     UCHAR Data[];
   } __attribute__((__packed__));
 typedef struct AOE_PACKET_ AOE_S_PACKET_, * AOE_SP_PACKET_;
+
+/** AoE Query Config arguments, following the common AoE header. */
+struct AOE_CONFIG_ {
+    /* The most requests the target will queue. */
+    UINT16 BufferCount;
+    UINT16 FirmwareVersion;
+    /* The most sectors the target takes in one request. */
+    UCHAR SectorCount;
+    UCHAR Command:4;
+    UCHAR Version:4;
+    UINT16 ConfigStringLength;
+
+    UCHAR ConfigString[];
+  } __attribute__((__packed__));
+typedef struct AOE_CONFIG_ AOE_S_CONFIG_, * AOE_SP_CONFIG_;
 #ifdef _MSC_VER
 #  pragma pack()
 #endif
 
+/* The size of the common AoE header, up to a command's arguments. */
+#define AOE_M_HEADER_SIZE_ \
+  (FIELD_OFFSET(AOE_S_PACKET_, Tag) + sizeof (UINT32))
+
 /** An I/O request. */
 typedef struct AOE_IO_REQ_ {
     WVL_E_DISK_IO_MODE Mode;
     UINT32 SectorCount;
     PUCHAR Buffer;
     PIRP Irp;
-    UINT32 TagCount;
+    /* Tags not yet finished with.  The last one completes the IRP. */
+    LONG TagCount;
     UINT32 TotalTags;
+    /* The status to complete the IRP with. */
+    NTSTATUS Status;
   } AOE_S_IO_REQ_, * AOE_SP_IO_REQ_;
 
-/** A work item "tag". */
+/** A pool object header, just before the object itself. */
+typedef struct AOE_POOL_OBJ_ {
+    /* The pool which the object belongs to. */
+    struct AOE_POOL_ * Pool;
+    /* The next free object, while the object is free. */
+    struct AOE_POOL_OBJ_ * Next;
+  } AOE_S_POOL_OBJ_, * AOE_SP_POOL_OBJ_;
+
+/** A pool of fixed-size objects. */
+typedef struct AOE_POOL_ {
+    KSPIN_LOCK Lock;
+    /* Free objects, ready for reuse. */
+    AOE_SP_POOL_OBJ_ Free;
+    UINT32 FreeCount;
+    UINT32 FreeMax;
+    /* The size of each object, excluding its header. */
+    UINT32 Size;
+    /* Set when the owner is done; the last object out frees the pool. */
+    BOOLEAN Closed;
+    AOE_S_POOL_STATS Stats;
+  } AOE_S_POOL_, * AOE_SP_POOL_;
+
+/**
+ * A work item "tag".
+ *
+ * Each tag is followed by its frame header: PROTOCOL_M_HEADER_SIZE bytes
+ * for the Ethernet header, then the AoE header which packet_data points
+ * to.  Write data is sent straight from the request's buffer.
+ */
 typedef struct AOE_WORK_TAG_ {
     AOE_E_TAG_TYPE_ type;
     AOE_SP_DISK aoe_disk;
@@ -167,8 +261,28 @@ typedef struct AOE_WORK_TAG_ {
     LARGE_INTEGER SendTime;
     UINT32 BufferOffset;
     UINT32 SectorCount;
+    /* Has this tag been sent more than once? */
+    BOOLEAN Resent;
+    /* This tag's retransmit timeout, doubled on each resend. */
+    LONGLONG Rto;
+    /* When this tag is next due for a resend, while it awaits a reply. */
+    AOE_S_TIMER Timer;
+    /* One reference for the owner, plus one per send NDIS hasn't finished. */
+    LONG RefCount;
+    /* Sends which NDIS hasn't finished.  The frame can't change until 0. */
+    LONG SendsPending;
+    /* The path this tag was last sent on, if the disk has paths yet. */
+    AOE_SP_PATH Path;
+    /* The first sector of this tag's I/O. */
+    LONGLONG Lba;
+    /* When this tag was queued. */
+    LARGE_INTEGER QueueTime;
+    /* The next tag whose sectors are carried in this tag's frame. */
+    struct AOE_WORK_TAG_ * Merged;
     struct AOE_WORK_TAG_ * next;
     struct AOE_WORK_TAG_ * previous;
+    /* This tag's entry in the tag table, while it awaits a reply. */
+    AOE_S_TAG_ENTRY TableEntry;
   } AOE_S_WORK_TAG_, * AOE_SP_WORK_TAG_;
 
 /** A disk search. */
@@ -190,11 +304,22 @@ static KSPIN_LOCK AoeTargetListLock_;
 static BOOLEAN AoeStop_ = FALSE;
 static KSPIN_LOCK AoeLock_;
 static KEVENT AoeSignal_;
-static AOE_SP_WORK_TAG_ AoeTagListFirst_ = NULL;
-static AOE_SP_WORK_TAG_ AoeTagListLast_ = NULL;
+/* Disks with unsent tags, in the order they gained them. */
+static AOE_SP_DISK AoeDiskQueueFirst_ = NULL;
+static AOE_SP_DISK AoeDiskQueueLast_ = NULL;
+/* Sent tags awaiting a reply, as a binary min-heap by deadline. */
+static AOE_S_TIMER_HEAP AoeTimerHeap_ = { NULL, 0, 0 };
+/* Sent tags awaiting a reply, indexed by tag ID. */
+static AOE_S_TAG_TABLE AoeTagTable_;
 static AOE_SP_WORK_TAG_ AoeProbeTag_ = NULL;
 static AOE_SP_DISK_SEARCH_ AoeDiskSearchList_ = NULL;
 static LONG AoePendingTags_ = 0;
+/* The next tag ID to assign.  Only used by the worker thread. */
+static UINT32 AoeNextTagId_ = 1;
+/* Worker thread statistics.  Protected by AoeLock_. */
+static AOE_S_STATS AoeStats_;
+/* How long an undersized frame may wait for more sectors, in 100 ns units. */
+static LONGLONG AoeMergeWindow_ = 0;
 static HANDLE AoeThreadHandle_;
 static PETHREAD AoeThreadObj_ = NULL;
 static BOOLEAN AoeStarted_ = FALSE;
@@ -209,7 +334,929 @@ typedef enum AOE_CLEANUP_ {
     AoeCleanupThreadRef_,
     AoeCleanupAll_
   } AOE_E_CLEANUP_, * AOE_EP_CLEANUP_;
-  
+
+/**
+ * Create an object pool.
+ *
+ * @v size              The size of each object.
+ * @v free_max          The most free objects to keep for reuse.
+ * @ret AOE_SP_POOL_    The new pool, or NULL on failure.
+ */
+static AOE_SP_POOL_ AoePoolCreate_(IN UINT32 size, IN UINT32 free_max) {
+    AOE_SP_POOL_ pool;
+
+    pool = wv_mallocz(sizeof *pool);
+    if (pool == NULL) {
+        DBG("Couldn't allocate pool\n");
+        return NULL;
+      }
+    KeInitializeSpinLock(&pool->Lock);
+    pool->FreeMax = free_max;
+    pool->Size = size;
+    return pool;
+  }
+
+/**
+ * Allocate an object from a pool.
+ *
+ * @v pool              The pool to allocate from.
+ * @v fresh             Set to TRUE if the object is new, and zero-filled,
+ *                      or to FALSE if it's being reused, as it was freed.
+ * @ret PVOID           The object, or NULL on failure.
+ */
+static PVOID AoePoolAlloc_(IN AOE_SP_POOL_ pool, OUT PBOOLEAN fresh) {
+    AOE_SP_POOL_OBJ_ obj;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&pool->Lock, &irql);
+    obj = pool->Free;
+    if (obj != NULL) {
+        pool->Free = obj->Next;
+        pool->FreeCount--;
+        pool->Stats.Hits++;
+      } else {
+        pool->Stats.Misses++;
+      }
+    if (++pool->Stats.InUse > pool->Stats.HighWater)
+      pool->Stats.HighWater = pool->Stats.InUse;
+    KeReleaseSpinLock(&pool->Lock, irql);
+
+    *fresh = FALSE;
+    if (obj == NULL) {
+        obj = wv_mallocz(sizeof *obj + pool->Size);
+        if (obj == NULL) {
+            DBG("Couldn't allocate pool object\n");
+            KeAcquireSpinLock(&pool->Lock, &irql);
+            pool->Stats.InUse--;
+            KeReleaseSpinLock(&pool->Lock, irql);
+            return NULL;
+          }
+        obj->Pool = pool;
+        *fresh = TRUE;
+      }
+    obj->Next = NULL;
+    return obj + 1;
+  }
+
+/**
+ * Return an object to its pool.
+ *
+ * @v ptr               The object to free.
+ *
+ * If the pool has been closed and this was its last object, the pool
+ * itself is freed.
+ */
+static VOID AoePoolFree_(IN PVOID ptr) {
+    AOE_SP_POOL_OBJ_ obj = (AOE_SP_POOL_OBJ_) ptr - 1;
+    AOE_SP_POOL_ pool = obj->Pool;
+    BOOLEAN free_pool = FALSE;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&pool->Lock, &irql);
+    pool->Stats.InUse--;
+    if (!pool->Closed && pool->FreeCount < pool->FreeMax) {
+        obj->Next = pool->Free;
+        pool->Free = obj;
+        pool->FreeCount++;
+        obj = NULL;
+      }
+    free_pool = pool->Closed && pool->Stats.InUse == 0;
+    KeReleaseSpinLock(&pool->Lock, irql);
+
+    wv_free(obj);
+    if (free_pool)
+      wv_free(pool);
+  }
+
+/**
+ * Close a pool.
+ *
+ * @v pool              The pool to close.  May be NULL.
+ *
+ * Free objects are released now.  Objects still in use are released as
+ * they are freed, and the last one frees the pool.
+ */
+static VOID AoePoolClose_(IN AOE_SP_POOL_ pool) {
+    AOE_SP_POOL_OBJ_ obj, next;
+    BOOLEAN free_pool;
+    KIRQL irql;
+
+    if (pool == NULL)
+      return;
+    KeAcquireSpinLock(&pool->Lock, &irql);
+    pool->Closed = TRUE;
+    obj = pool->Free;
+    pool->Free = NULL;
+    pool->FreeCount = 0;
+    free_pool = pool->Stats.InUse == 0;
+    KeReleaseSpinLock(&pool->Lock, irql);
+
+    for (; obj != NULL; obj = next) {
+        next = obj->Next;
+        wv_free(obj);
+      }
+    if (free_pool)
+      wv_free(pool);
+  }
+
+/**
+ * Fetch a pool's statistics.
+ *
+ * @v pool              The pool.  May be NULL.
+ * @v stats             Filled with the pool's statistics, or zeroes.
+ */
+static VOID AoePoolGetStats_(
+    IN AOE_SP_POOL_ pool,
+    OUT AOE_SP_POOL_STATS stats
+  ) {
+    KIRQL irql;
+
+    if (pool == NULL) {
+        RtlZeroMemory(stats, sizeof *stats);
+        return;
+      }
+    KeAcquireSpinLock(&pool->Lock, &irql);
+    *stats = pool->Stats;
+    KeReleaseSpinLock(&pool->Lock, irql);
+  }
+
+/**
+ * Create a disk's tag and request pools.
+ *
+ * @v aoe_disk          The disk.
+ * @ret BOOLEAN         FALSE if the pools couldn't be created.
+ */
+static BOOLEAN AoeDiskPoolsCreate_(IN AOE_SP_DISK aoe_disk) {
+    if (aoe_disk->TagPool == NULL) {
+        aoe_disk->TagPool = AoePoolCreate_(
+            sizeof (AOE_S_WORK_TAG_) +
+              PROTOCOL_M_HEADER_SIZE +
+              sizeof (AOE_S_PACKET_),
+            AOE_M_TAG_POOL_MAX_
+          );
+      }
+    if (aoe_disk->RequestPool == NULL) {
+        aoe_disk->RequestPool = AoePoolCreate_(
+            sizeof (AOE_S_IO_REQ_),
+            AOE_M_REQUEST_POOL_MAX_
+          );
+      }
+    return aoe_disk->TagPool != NULL && aoe_disk->RequestPool != NULL;
+  }
+
+/**
+ * Allocate a tag and its frame from a disk's tag pool.
+ *
+ * @v aoe_disk          The disk which the tag is for.
+ * @ret AOE_SP_WORK_TAG_ The tag, or NULL on failure.
+ *
+ * The AoE header's version and target address are preformatted when a
+ * frame is first created, and kept when the frame is reused.  The rest
+ * of the tag and AoE header are zeroed.
+ */
+static AOE_SP_WORK_TAG_ AoeTagAlloc_(IN AOE_SP_DISK aoe_disk) {
+    AOE_SP_WORK_TAG_ tag;
+    AOE_SP_PACKET_ packet;
+    BOOLEAN fresh;
+
+    if (aoe_disk->TagPool == NULL)
+      return NULL;
+    tag = AoePoolAlloc_(aoe_disk->TagPool, &fresh);
+    if (tag == NULL)
+      return NULL;
+    packet = (AOE_SP_PACKET_) ((PUCHAR) (tag + 1) + PROTOCOL_M_HEADER_SIZE);
+    if (fresh) {
+        packet->Ver = AOEPROTOCOLVER;
+        packet->Major = htons((UINT16) aoe_disk->Major);
+        packet->Minor = (UCHAR) aoe_disk->Minor;
+      } else {
+        RtlZeroMemory(tag, sizeof *tag);
+        RtlZeroMemory(
+            &packet->Command,
+            sizeof *packet - FIELD_OFFSET(AOE_S_PACKET_, Command)
+          );
+      }
+    tag->aoe_disk = aoe_disk;
+    tag->packet_data = packet;
+    tag->RefCount = 1;
+    return tag;
+  }
+
+/**
+ * Take a reference to a tag while NDIS sends its frame.
+ *
+ * @v tag               The tag.
+ */
+static VOID AoeTagReference_(IN AOE_SP_WORK_TAG_ tag) {
+    InterlockedIncrement(&tag->RefCount);
+  }
+
+/**
+ * Note that one of a request's tags is finished with.
+ *
+ * @v request           The request.
+ * @v disk              The disk which the request is for.
+ *
+ * When the last tag is finished with, the IRP is completed with the
+ * request's status and the request is freed.
+ */
+static VOID AoeRequestTagDone_(
+    IN AOE_SP_IO_REQ_ request,
+    IN WVL_SP_DISK_T disk
+  ) {
+    if (InterlockedDecrement(&request->TagCount) != 0)
+      return;
+    WvlIrpComplete(
+        request->Irp,
+        NT_SUCCESS(request->Status) ?
+          request->SectorCount * disk->SectorSize :
+          0,
+        request->Status
+      );
+    AoePoolFree_(request);
+  }
+
+/**
+ * Drop a reference to a tag, returning it to its pool if it was the last.
+ *
+ * @v tag               The tag.
+ *
+ * A tag's owner calls this instead of freeing it, since NDIS might
+ * still be sending its frame, or reading write data from the request's
+ * buffer.  For the same reason, a request's IRP is only completed once
+ * all of its tags are gone.
+ */
+static VOID AoeTagFree_(IN AOE_SP_WORK_TAG_ tag) {
+    AOE_SP_IO_REQ_ request;
+    WVL_SP_DISK_T disk;
+    AOE_SP_WORK_TAG_ merged, next;
+
+    if (InterlockedDecrement(&tag->RefCount) != 0)
+      return;
+    request = tag->request_ptr;
+    disk = tag->aoe_disk->disk;
+    merged = tag->Merged;
+    AoePoolFree_(tag);
+    if (request != NULL)
+      AoeRequestTagDone_(request, disk);
+
+    /* Tags merged into the frame were only waiting for it. */
+    while (merged != NULL) {
+        next = merged->Merged;
+        merged->Merged = NULL;
+        AoeTagFree_(merged);
+        merged = next;
+      }
+  }
+
+/**
+ * Set the status for a tag's requests.
+ *
+ * @v tag               The tag.
+ * @v status            The status to complete the requests' IRPs with.
+ *
+ * This includes the requests of tags merged into the tag's frame.
+ */
+static VOID AoeTagSetStatus_(IN AOE_SP_WORK_TAG_ tag, IN NTSTATUS status) {
+    for (; tag != NULL; tag = tag->Merged) {
+        if (tag->request_ptr != NULL)
+          tag->request_ptr->Status = status;
+      }
+  }
+
+/**
+ * Note that NDIS is done sending a tag's frame.
+ *
+ * @v PacketContext     The tag which was passed to Protocol_SendFrame.
+ */
+VOID STDCALL aoe__send_complete(IN PVOID PacketContext) {
+    AOE_SP_WORK_TAG_ tag = PacketContext;
+
+    InterlockedDecrement(&tag->SendsPending);
+    AoeTagFree_(tag);
+  }
+
+/**
+ * Send a tag's frame.
+ *
+ * @v tag               The tag to send.
+ * @ret BOOLEAN         FALSE if the frame couldn't be sent.
+ *
+ * The frame's Ethernet header is filled in for the tag's path, so the
+ * tag mustn't have a send pending.
+ */
+static BOOLEAN AoeTagSend_(IN AOE_SP_WORK_TAG_ tag) {
+    AOE_SP_IO_REQ_ request = tag->request_ptr;
+    PROTOCOL_S_PAYLOAD payload[AOE_M_MERGE_MAX];
+    UINT32 payload_count = 0;
+    AOE_SP_WORK_TAG_ walker;
+
+    /*
+     * Write data goes straight from the requests' buffers: this tag's,
+     * then those of any tags merged into its frame.
+     */
+    if (request != NULL && request->Mode == WvlDiskIoModeWrite) {
+        for (walker = tag; walker != NULL; walker = walker->Merged) {
+            payload[payload_count].Data =
+              walker->request_ptr->Buffer + walker->BufferOffset;
+            payload[payload_count].Size =
+              walker->SectorCount * tag->aoe_disk->disk->SectorSize;
+            payload_count++;
+          }
+      }
+    AoeTagReference_(tag);
+    InterlockedIncrement(&tag->SendsPending);
+    if (!Protocol_SendFrame(
+        tag->Path ? tag->Path->ClientMac : tag->aoe_disk->ClientMac,
+        tag->Path ? tag->Path->ServerMac : tag->aoe_disk->ServerMac,
+        (PUCHAR) tag->packet_data,
+        tag->PacketSize,
+        payload,
+        payload_count,
+        tag
+      )) {
+        InterlockedDecrement(&tag->SendsPending);
+        AoeTagFree_(tag);
+        return FALSE;
+      }
+    return TRUE;
+  }
+
+/**
+ * Add a disk to the end of the queue of disks with unsent tags.
+ *
+ * @v aoe_disk          The disk to add.  Nothing happens if it's queued.
+ *
+ * The caller must hold AoeLock_.
+ */
+static VOID AoeDiskQueuePush_(IN AOE_SP_DISK aoe_disk) {
+    if (aoe_disk->Queued)
+      return;
+    aoe_disk->Queued = TRUE;
+    aoe_disk->NextQueued = NULL;
+    if (AoeDiskQueueLast_ == NULL)
+      AoeDiskQueueFirst_ = aoe_disk;
+      else
+      AoeDiskQueueLast_->NextQueued = aoe_disk;
+    AoeDiskQueueLast_ = aoe_disk;
+  }
+
+/**
+ * Append a chain of tags to a disk's queue of unsent tags.
+ *
+ * @v first             The first tag in the chain.
+ * @v last              The last tag in the chain.
+ *
+ * All tags in the chain must be for the same disk.  If the disk had no
+ * unsent tags, it is added to the queue of disks with unsent tags, and
+ * the worker thread is woken.  The caller must hold AoeLock_.
+ */
+static VOID AoeTagQueueAppend_(
+    IN AOE_SP_WORK_TAG_ first,
+    IN AOE_SP_WORK_TAG_ last
+  ) {
+    AOE_SP_DISK aoe_disk = first->aoe_disk;
+    AOE_SP_WORK_TAG_ tag;
+
+    for (tag = first; tag != last; tag = tag->next)
+      AoeStats_.QueueDepth++;
+    AoeStats_.QueueDepth++;
+
+    first->previous = aoe_disk->TagQueueLast;
+    last->next = NULL;
+    if (aoe_disk->TagQueueLast == NULL)
+      aoe_disk->TagQueueFirst = first;
+      else
+      aoe_disk->TagQueueLast->next = first;
+    aoe_disk->TagQueueLast = last;
+    AoeDiskQueuePush_(aoe_disk);
+    KeSetEvent(&AoeSignal_, 0, FALSE);
+  }
+
+/**
+ * Remove a tag from its disk's queue of unsent tags.
+ *
+ * @v tag               The tag to remove.
+ *
+ * The disk stays in the queue of disks with unsent tags, even if this
+ * was its last unsent tag; the worker thread drops such disks.  The
+ * caller must hold AoeLock_.
+ */
+static VOID AoeTagQueueRemove_(IN AOE_SP_WORK_TAG_ tag) {
+    AOE_SP_DISK aoe_disk = tag->aoe_disk;
+
+    if (tag->previous == NULL)
+      aoe_disk->TagQueueFirst = tag->next;
+      else
+      tag->previous->next = tag->next;
+    if (tag->next == NULL)
+      aoe_disk->TagQueueLast = tag->previous;
+      else
+      tag->next->previous = tag->previous;
+    tag->next = tag->previous = NULL;
+    AoeStats_.QueueDepth--;
+  }
+
+/**
+ * Merge unsent tags whose sectors follow on from a tag into its frame.
+ *
+ * @v tag               The unsent tag at the front of its disk's queue.
+ * @v max_sectors       The most sectors the frame may carry.
+ * @v frame             Filled in with the frame's I/O, for AoeMergeHold.
+ *
+ * AoeMergePick decides which of the tags at the start of the disk's
+ * queue to merge.  Merged tags leave the queue and are finished with
+ * along with the tag.  The caller must hold AoeLock_.
+ */
+static VOID AoeTagMerge_(
+    IN AOE_SP_WORK_TAG_ tag,
+    IN UINT32 max_sectors,
+    OUT AOE_SP_MERGE_IO frame
+  ) {
+    AOE_SP_WORK_TAG_ queued[AOE_M_MERGE_SCAN];
+    AOE_S_MERGE_IO ios[AOE_M_MERGE_SCAN];
+    UINT32 picks[AOE_M_MERGE_MAX];
+    AOE_SP_WORK_TAG_ walker, last = tag;
+    UINT32 count = 1, scanned, picked, i;
+
+    frame->Lba = tag->Lba;
+    frame->Sectors = tag->SectorCount;
+    frame->Kind = AOE_M_MERGE_NONE;
+    if (tag->type != AoeTagTypeIo_)
+      return;
+    frame->Kind = tag->request_ptr->Mode;
+    /* The tag might have merged some already, while it was held. */
+    while (last->Merged != NULL) {
+        last = last->Merged;
+        frame->Sectors += last->SectorCount;
+        count++;
+      }
+
+    for (
+        walker = tag->next, scanned = 0;
+        walker != NULL && scanned < AOE_M_MERGE_SCAN;
+        walker = walker->next, scanned++
+      ) {
+        queued[scanned] = walker;
+        ios[scanned].Lba = walker->Lba;
+        ios[scanned].Sectors = walker->SectorCount;
+        ios[scanned].Kind = walker->type == AoeTagTypeIo_ ?
+          walker->request_ptr->Mode :
+          AOE_M_MERGE_NONE;
+      }
+    picked = AoeMergePick(frame, count, ios, scanned, max_sectors, picks);
+    for (i = 0; i < picked; i++) {
+        walker = queued[picks[i]];
+        AoeTagQueueRemove_(walker);
+        last->Merged = walker;
+        last = walker;
+      }
+    AoeStats_.Merges += picked;
+    tag->packet_data->Count = (UCHAR) frame->Sectors;
+  }
+
+/**
+ * Take the first disk from the queue of disks with unsent tags.
+ *
+ * @ret aoe_disk        The disk, or NULL if the queue is empty.
+ *
+ * The caller must hold AoeLock_.
+ */
+static AOE_SP_DISK AoeDiskQueuePop_(void) {
+    AOE_SP_DISK aoe_disk = AoeDiskQueueFirst_;
+
+    if (aoe_disk == NULL)
+      return NULL;
+    AoeDiskQueueFirst_ = aoe_disk->NextQueued;
+    if (AoeDiskQueueFirst_ == NULL)
+      AoeDiskQueueLast_ = NULL;
+    aoe_disk->NextQueued = NULL;
+    aoe_disk->Queued = FALSE;
+    return aoe_disk;
+  }
+
+/**
+ * Make sure the retransmit timer heap has room for one more tag.
+ *
+ * @ret BOOLEAN         FALSE if the heap needed to grow and couldn't.
+ *
+ * The caller must hold AoeLock_.
+ */
+static BOOLEAN AoeTimerHeapReserve_(void) {
+    AOE_SP_TIMER * timers;
+    UINT32 capacity;
+
+    if (AoeTimerHeap_.Count < AoeTimerHeap_.Capacity)
+      return TRUE;
+    capacity = AoeTimerHeap_.Capacity ?
+      AoeTimerHeap_.Capacity * 2 :
+      AOE_M_TIMER_HEAP_INIT_;
+    timers = wv_malloc(capacity * sizeof *timers);
+    if (timers == NULL) {
+        DBG("Couldn't grow retransmit timer heap\n");
+        return FALSE;
+      }
+    if (AoeTimerHeap_.Count) {
+        RtlCopyMemory(
+            timers,
+            AoeTimerHeap_.Timers,
+            AoeTimerHeap_.Count * sizeof *timers
+          );
+      }
+    wv_free(AoeTimerHeap_.Timers);
+    AoeTimerHeap_.Timers = timers;
+    AoeTimerHeap_.Capacity = capacity;
+    return TRUE;
+  }
+
+/**
+ * Find the sent tag which is due for a resend soonest.
+ *
+ * @ret tag             The tag, or NULL if no tags await a reply.
+ *
+ * The caller must hold AoeLock_.
+ */
+static AOE_SP_WORK_TAG_ AoeTimerHeapFirst_(void) {
+    AOE_SP_TIMER timer = AoeTimerHeapFirst(&AoeTimerHeap_);
+
+    if (timer == NULL)
+      return NULL;
+    return CONTAINING_RECORD(timer, AOE_S_WORK_TAG_, Timer);
+  }
+
+/**
+ * Add a freshly-sent tag to the tag table.
+ *
+ * @v tag               The tag to add.  Its ID and deadline must already
+ *                      be assigned.
+ *
+ * The caller must hold AoeLock_ and have reserved timer heap space with
+ * AoeTimerHeapReserve_.
+ */
+static VOID AoeTagTableInsert_(IN AOE_SP_WORK_TAG_ tag) {
+    tag->TableEntry.Id = tag->Id;
+    tag->TableEntry.Major = tag->packet_data->Major;
+    tag->TableEntry.Minor = tag->packet_data->Minor;
+    AoeTagTableInsert(&AoeTagTable_, &tag->TableEntry);
+
+    AoeTimerHeapPush(&AoeTimerHeap_, &tag->Timer);
+    AoePendingTags_++;
+    tag->aoe_disk->InFlight++;
+    if (tag->Path)
+      tag->Path->InFlight++;
+  }
+
+/**
+ * Find a sent tag in the tag table.
+ *
+ * @v id                The tag ID from the AoE reply.
+ * @v major             The major address from the AoE reply (network order).
+ * @v minor             The minor address from the AoE reply.
+ * @ret tag             The matching tag, or NULL if none was found.
+ *
+ * The caller must hold AoeLock_.
+ */
+static AOE_SP_WORK_TAG_ AoeTagTableFind_(
+    IN UINT32 id,
+    IN UINT16 major,
+    IN UCHAR minor
+  ) {
+    AOE_SP_TAG_ENTRY entry;
+
+    entry = AoeTagTableFind(&AoeTagTable_, id, major, minor);
+    if (entry == NULL)
+      return NULL;
+    return CONTAINING_RECORD(entry, AOE_S_WORK_TAG_, TableEntry);
+  }
+
+/**
+ * Remove a sent tag from the tag table.
+ *
+ * @v tag               The tag to remove.
+ *
+ * The caller must hold AoeLock_.
+ */
+static VOID AoeTagTableRemove_(IN AOE_SP_WORK_TAG_ tag) {
+    if (!AoeTagTableRemove(&AoeTagTable_, &tag->TableEntry)) {
+        DBG("Tag %p not found in its tag table bucket!!\n", tag);
+        return;
+      }
+    AoeTimerHeapRemove(&AoeTimerHeap_, &tag->Timer);
+
+    AoePendingTags_--;
+    if (AoePendingTags_ < 0)
+      DBG("AoePendingTags_ < 0!!\n");
+    tag->aoe_disk->InFlight--;
+    if (tag->Path)
+      tag->Path->InFlight--;
+  }
+
+/**
+ * Remove a tag from whichever of the unsent queue or tag table holds it.
+ *
+ * @v tag               The tag to remove.
+ *
+ * The caller must hold AoeLock_.
+ */
+static VOID AoeTagUnlink_(IN AOE_SP_WORK_TAG_ tag) {
+    if (tag->Id == 0)
+      AoeTagQueueRemove_(tag);
+      else
+      AoeTagTableRemove_(tag);
+  }
+
+/**
+ * Check if a tag is still queued or awaiting a reply.
+ *
+ * @v aoe_disk          The disk which the tag was for.
+ * @v tag               The tag to look for.  It need not be valid.
+ * @ret BOOLEAN         TRUE if the tag was found, else FALSE.
+ *
+ * The caller must hold AoeLock_.  This walks every outstanding tag, so
+ * it is only for the rare disk search clean-up path.
+ */
+static BOOLEAN AoeTagIsOutstanding_(
+    IN AOE_SP_DISK aoe_disk,
+    IN AOE_SP_WORK_TAG_ tag
+  ) {
+    AOE_SP_WORK_TAG_ walker;
+    UINT32 i;
+
+    for (walker = aoe_disk->TagQueueFirst; walker; walker = walker->next) {
+        if (walker == tag)
+          return TRUE;
+      }
+    for (i = 0; i < AoeTimerHeap_.Count; i++) {
+        if (AoeTimerHeap_.Timers[i] == &tag->Timer)
+          return TRUE;
+      }
+    return FALSE;
+  }
+
+/**
+ * Open a disk's congestion window after a timely reply.
+ *
+ * @v aoe_disk          The disk which replied.
+ *
+ * Below the threshold, the window grows by one tag per reply, doubling
+ * each round trip.  Above it, the window grows by one tag per window's
+ * worth of replies.  The caller must hold AoeLock_.
+ */
+static VOID AoeDiskWindowOpen_(IN AOE_SP_DISK aoe_disk) {
+    if (aoe_disk->Window >= aoe_disk->WindowMax)
+      return;
+    if (aoe_disk->Window < aoe_disk->WindowThreshold) {
+        aoe_disk->Window++;
+        return;
+      }
+    if (++aoe_disk->WindowAcks >= aoe_disk->Window) {
+        aoe_disk->WindowAcks = 0;
+        aoe_disk->Window++;
+      }
+  }
+
+/**
+ * Halve a disk's congestion window after a retransmit.
+ *
+ * @v aoe_disk          The disk which needed a retransmit.
+ * @v tag               The tag which was retransmitted.
+ * @v now               The current time.
+ *
+ * The window is only cut once for all tags which were already in
+ * flight at the time of the previous cut.  The caller must hold
+ * AoeLock_.
+ */
+static VOID AoeDiskWindowCut_(
+    IN AOE_SP_DISK aoe_disk,
+    IN AOE_SP_WORK_TAG_ tag,
+    IN LARGE_INTEGER now
+  ) {
+    if (tag->FirstSendTime.QuadPart < aoe_disk->WindowCutTime.QuadPart)
+      return;
+    aoe_disk->WindowCutTime = now;
+    aoe_disk->Window /= 2;
+    if (aoe_disk->Window < AOE_M_WINDOW_MIN_)
+      aoe_disk->Window = AOE_M_WINDOW_MIN_;
+    aoe_disk->WindowThreshold = aoe_disk->Window;
+    aoe_disk->WindowAcks = 0;
+  }
+
+/**
+ * Add a path to a disk, unless the disk already has it.
+ *
+ * @v aoe_disk          The disk to add the path to.
+ * @v client_mac        The client NIC's MAC address.
+ * @v server_mac        The server's MAC address.
+ * @v mtu               The client NIC's MTU.
+ * @ret AOE_SP_PATH     The path, or NULL if the disk has no room for it.
+ *
+ * The caller must hold AoeLock_.
+ */
+static AOE_SP_PATH AoeDiskPathAdd_(
+    IN AOE_SP_DISK aoe_disk,
+    IN PUCHAR client_mac,
+    IN PUCHAR server_mac,
+    IN UINT32 mtu
+  ) {
+    AOE_SP_PATH path;
+    UINT32 i;
+
+    for (i = 0; i < aoe_disk->PathCount; i++) {
+        path = aoe_disk->Paths + i;
+        if (
+            wv_memcmpeq(path->ClientMac, client_mac, 6) &&
+            wv_memcmpeq(path->ServerMac, server_mac, 6)
+          )
+          return path;
+      }
+    if (aoe_disk->PathCount == AOE_M_PATHS)
+      return NULL;
+    path = aoe_disk->Paths + aoe_disk->PathCount++;
+    RtlZeroMemory(path, sizeof *path);
+    RtlCopyMemory(path->ClientMac, client_mac, 6);
+    RtlCopyMemory(path->ServerMac, server_mac, 6);
+    path->MTU = mtu;
+    DBG(
+        "e%d.%d: Path %d from %02x:%02x:%02x:%02x:%02x:%02x "
+          "to %02x:%02x:%02x:%02x:%02x:%02x\n",
+        aoe_disk->Major,
+        aoe_disk->Minor,
+        aoe_disk->PathCount - 1,
+        client_mac[0],
+        client_mac[1],
+        client_mac[2],
+        client_mac[3],
+        client_mac[4],
+        client_mac[5],
+        server_mac[0],
+        server_mac[1],
+        server_mac[2],
+        server_mac[3],
+        server_mac[4],
+        server_mac[5]
+      );
+    return path;
+  }
+
+/**
+ * Look for new or revived paths to a disk's target.
+ *
+ * @v aoe_disk          The disk whose paths should be updated.
+ * @v now               The current time.
+ *
+ * Paths come from the target list, which holds every (client NIC,
+ * server MAC) pair on which the target has answered a probe.  A NIC
+ * must be bound and take frames as large as the disk's MTU.  A dead
+ * path is revived once the target answers a probe on it again.  This
+ * does nothing until the disk has been found, nor more than once per
+ * probe interval.  The caller must hold AoeLock_.
+ */
+static VOID AoeDiskPathsScan_(
+    IN AOE_SP_DISK aoe_disk,
+    IN LARGE_INTEGER now
+  ) {
+    AOE_SP_TARGET_LIST_ walker;
+    AOE_SP_PATH path;
+    UINT32 mtu;
+    KIRQL irql;
+
+    if (aoe_disk->search_state != AoeSearchStateDone)
+      return;
+    if (now.QuadPart < aoe_disk->PathScanTime.QuadPart)
+      return;
+    aoe_disk->PathScanTime.QuadPart = now.QuadPart + AOE_M_PROBE_INTERVAL_;
+
+    /* The path which the disk was found on comes first. */
+    if (aoe_disk->PathCount == 0) {
+        AoeDiskPathAdd_(
+            aoe_disk,
+            aoe_disk->ClientMac,
+            aoe_disk->ServerMac,
+            aoe_disk->MTU
+          );
+      }
+
+    KeAcquireSpinLock(&AoeTargetListLock_, &irql);
+    for (walker = AoeTargetList_; walker; walker = walker->next) {
+        if (
+            walker->Target.Major != aoe_disk->Major ||
+            walker->Target.Minor != aoe_disk->Minor ||
+            walker->Target.ProbeTime.QuadPart + AOE_M_PATH_FRESH_ <
+              now.QuadPart
+          )
+          continue;
+        /* Frames are sized for the disk's MTU. */
+        mtu = Protocol_GetMTU(walker->Target.ClientMac);
+        if (mtu < aoe_disk->MTU)
+          continue;
+        path = AoeDiskPathAdd_(
+            aoe_disk,
+            walker->Target.ClientMac,
+            walker->Target.ServerMac,
+            mtu
+          );
+        if (
+            path &&
+            path->DeadTime.QuadPart &&
+            walker->Target.ProbeTime.QuadPart > path->DeadTime.QuadPart
+          ) {
+            DBG(
+                "e%d.%d: Path %d is back\n",
+                aoe_disk->Major,
+                aoe_disk->Minor,
+                path - aoe_disk->Paths
+              );
+            path->DeadTime.QuadPart = 0;
+            path->Timeouts = 0;
+          }
+      }
+    KeReleaseSpinLock(&AoeTargetListLock_, irql);
+  }
+
+/**
+ * Pick the path to send a disk's next tag on.
+ *
+ * @v aoe_disk          The disk sending the tag.
+ * @ret AOE_SP_PATH     The path, or NULL if the disk has no paths yet.
+ *
+ * Each live path is weighted by its round-trip time: the pick is the
+ * path which should finish its outstanding tags, plus this one, the
+ * soonest.  A path without an RTT sample yet is assumed to match the
+ * disk's.  If every path is dead, they are all tried anyway, so that
+ * requests keep being retried.  A path whose NIC's MTU is below the
+ * disk's is never picked.  The caller must hold AoeLock_.
+ */
+static AOE_SP_PATH AoeDiskPathPick_(IN AOE_SP_DISK aoe_disk) {
+    AOE_SP_PATH path, best = NULL;
+    LONGLONG cost, best_cost = 0;
+    BOOLEAN any_live = FALSE;
+    UINT32 i;
+
+    for (i = 0; i < aoe_disk->PathCount; i++) {
+        path = aoe_disk->Paths + i;
+        if (!path->DeadTime.QuadPart && path->MTU >= aoe_disk->MTU)
+          any_live = TRUE;
+      }
+    for (i = 0; i < aoe_disk->PathCount; i++) {
+        path = aoe_disk->Paths + i;
+        if (path->MTU < aoe_disk->MTU)
+          continue;
+        if (any_live && path->DeadTime.QuadPart)
+          continue;
+        cost = (path->Srtt ? path->Srtt : aoe_disk->Rtt.Srtt) + 1;
+        cost *= path->InFlight + 1;
+        if (best == NULL || cost < best_cost) {
+            best = path;
+            best_cost = cost;
+          }
+      }
+    return best;
+  }
+
+/**
+ * Take a path to be dead and fail its outstanding tags over.
+ *
+ * @v aoe_disk          The disk which the path belongs to.
+ * @v path              The dead path.
+ * @v now               The current time.
+ *
+ * Tags awaiting a reply on the path are made due for a resend now,
+ * which will pick another path, rather than waiting out their
+ * timeouts.  The caller must hold AoeLock_.
+ */
+static VOID AoeDiskPathDead_(
+    IN AOE_SP_DISK aoe_disk,
+    IN AOE_SP_PATH path,
+    IN LARGE_INTEGER now
+  ) {
+    AOE_SP_WORK_TAG_ tag;
+    UINT32 i;
+
+    if (path->DeadTime.QuadPart)
+      return;
+    DBG(
+        "e%d.%d: Path %d is dead\n",
+        aoe_disk->Major,
+        aoe_disk->Minor,
+        path - aoe_disk->Paths
+      );
+    path->DeadTime = now;
+    if (!path->InFlight)
+      return;
+
+    for (i = 0; i < AoeTimerHeap_.Count; i++) {
+        tag = CONTAINING_RECORD(
+            AoeTimerHeap_.Timers[i],
+            AOE_S_WORK_TAG_,
+            Timer
+          );
+        if (tag->Path == path && tag->Timer.Deadline > now.QuadPart)
+          tag->Timer.Deadline = now.QuadPart;
+      }
+    /* Deadlines only moved earlier, but restore heap order wholesale. */
+    AoeTimerHeapRebuild(&AoeTimerHeap_);
+  }
+
 static VOID AoeCleanup_(AOE_E_CLEANUP_ cleanup) {
     switch (cleanup) {
         default:
@@ -250,11 +1297,40 @@ static VOID AoeCleanup_(AOE_E_CLEANUP_ cleanup) {
         Protocol_Stop();
         case AoeCleanupProtocol_:
 
-        case AoeCleanupReg_:
+        case AoeCleanupReg_:
+
+        DBG("Done.\n");
+      }
+    return;
+  }
+
+/**
+ * Fetch the merge window from the Registry.
+ *
+ * @v RegistryPath      The driver's Registry path.
+ *
+ * The optional "MergeWindow" value is in microseconds.  Without it, a
+ * frame is only merged with tags which are already queued.
+ */
+static VOID AoeMergeWindowFetch_(IN PUNICODE_STRING RegistryPath) {
+    HANDLE reg_key;
+    UINT32 merge_window;
+    NTSTATUS status;
+
+    status = WvlRegOpenKey(RegistryPath->Buffer, &reg_key);
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't open Registry path!\n");
+        return;
+      }
 
-        DBG("Done.\n");
+    merge_window = 0;
+    status = WvlRegFetchDword(reg_key, L"MergeWindow", &merge_window);
+    if (NT_SUCCESS(status)) {
+        DBG("Merge window: %d microseconds\n", merge_window);
+        AoeMergeWindow_ = (LONGLONG) merge_window * 10;
       }
-    return;
+
+    WvlRegCloseKey(reg_key);
   }
 
 /**
@@ -289,6 +1365,7 @@ NTSTATUS STDCALL DriverEntry(
       } else {
         DBG("Registry updated\n");
       }
+    AoeMergeWindowFetch_(RegistryPath);
 
     /* Start up the protocol. */
     status = Protocol_Start();
@@ -333,6 +1410,9 @@ NTSTATUS STDCALL DriverEntry(
     KeInitializeSpinLock(&AoeLock_);
     KeInitializeEvent(&AoeSignal_, SynchronizationEvent, FALSE);
 
+    /* Empty the table of outstanding tags, which AoeLock_ protects. */
+    AoeTagTableInit(&AoeTagTable_);
+
     /* Establish the AoE bus. */
     status = AoeBusCreate(DriverObject);
     if (!NT_SUCCESS(status)) {
@@ -411,6 +1491,7 @@ static VOID STDCALL AoeUnload_(IN PDRIVER_OBJECT DriverObject) {
     NTSTATUS Status;
     AOE_SP_DISK_SEARCH_ disk_searcher, previous_disk_searcher;
     AOE_SP_WORK_TAG_ tag;
+    AOE_SP_DISK aoe_disk;
     KIRQL Irql, Irql2;
     AOE_SP_TARGET_LIST_ Walker, Next;
 
@@ -446,27 +1527,23 @@ static VOID STDCALL AoeUnload_(IN PDRIVER_OBJECT DriverObject) {
         wv_free(previous_disk_searcher);
       }
 
-    /* Cancel and free all tags in the global tag list. */
-    tag = AoeTagListFirst_;
-    while (tag != NULL) {
-        if (tag->request_ptr != NULL && --tag->request_ptr->TagCount == 0) {
-            tag->request_ptr->Irp->IoStatus.Information = 0;
-            tag->request_ptr->Irp->IoStatus.Status = STATUS_CANCELLED;
-            IoCompleteRequest(tag->request_ptr->Irp, IO_NO_INCREMENT);
-            wv_free(tag->request_ptr);
-          }
-        if (tag->next == NULL) {
-            wv_free(tag->packet_data);
-            wv_free(tag);
-            tag = NULL;
-          } else {
-            tag = tag->next;
-            wv_free(tag->previous->packet_data);
-            wv_free(tag->previous);
+    /* Cancel and free all unsent and outstanding tags. */
+    while ((aoe_disk = AoeDiskQueuePop_()) != NULL) {
+        while ((tag = aoe_disk->TagQueueFirst) != NULL) {
+            AoeTagQueueRemove_(tag);
+            AoeTagSetStatus_(tag, STATUS_CANCELLED);
+            AoeTagFree_(tag);
           }
       }
-    AoeTagListFirst_ = NULL;
-    AoeTagListLast_ = NULL;
+    while ((tag = AoeTimerHeapFirst_()) != NULL) {
+        AoeTagTableRemove_(tag);
+        AoeTagSetStatus_(tag, STATUS_CANCELLED);
+        AoeTagFree_(tag);
+      }
+    wv_free(AoeTimerHeap_.Timers);
+    AoeTimerHeap_.Timers = NULL;
+    AoeTimerHeap_.Capacity = 0;
+    RtlZeroMemory(&AoeStats_, sizeof AoeStats_);
 
     /* Release the global spin-lock. */
     KeReleaseSpinLock(&AoeLock_, Irql);
@@ -474,6 +1551,31 @@ static VOID STDCALL AoeUnload_(IN PDRIVER_OBJECT DriverObject) {
     DBG("Unloaded.\n");
   }
 
+/**
+ * Work out a disk's sectors per packet from its target and NIC limits.
+ *
+ * @v aoe_disk          The disk to update.
+ *
+ * A packet must fit in the NIC's frame, must not exceed what the
+ * target reported in its Query Config reply, and must be countable in
+ * the AoE ATA header's one-byte sector count.  The caller must hold
+ * the disk's spin-lock.
+ */
+static VOID AoeDiskMaxSectorsUpdate_(IN AOE_SP_DISK aoe_disk) {
+    UINT32 sector_size = aoe_disk->disk->SectorSize;
+    UINT32 max_sectors = 1;
+
+    if (sector_size && aoe_disk->MTU > sizeof (AOE_S_PACKET_))
+      max_sectors = (aoe_disk->MTU - sizeof (AOE_S_PACKET_)) / sector_size;
+    if (aoe_disk->ConfigSectors && aoe_disk->ConfigSectors < max_sectors)
+      max_sectors = aoe_disk->ConfigSectors;
+    if (max_sectors > AOE_M_MAX_SECTORS_)
+      max_sectors = AOE_M_MAX_SECTORS_;
+    if (max_sectors < 1)
+      max_sectors = 1;
+    aoe_disk->MaxSectorsPerPacket = max_sectors;
+  }
+
 /**
  * Search for disk parameters.
  *
@@ -486,10 +1588,9 @@ static BOOLEAN STDCALL AoeDiskInit_(IN AOE_SP_DISK aoe_disk) {
     AOE_SP_DISK_SEARCH_
       disk_searcher, disk_search_walker, previous_disk_searcher;
     LARGE_INTEGER Timeout, CurrentTime;
-    AOE_SP_WORK_TAG_ tag, tag_walker;
+    AOE_SP_WORK_TAG_ tag;
     KIRQL Irql, InnerIrql;
-    LARGE_INTEGER MaxSectorsPerPacketSendTime;
-    UINT32 MTU;
+    LARGE_INTEGER ConfigSendTime;
     WVL_SP_DISK_T disk_ptr = aoe_disk->disk;
 
     /* Allocate our disk search. */
@@ -550,6 +1651,11 @@ static BOOLEAN STDCALL AoeDiskInit_(IN AOE_SP_DISK aoe_disk) {
               } else {
                 /* We found the adapter to use, get MTU next. */
                 aoe_disk->MTU = Protocol_GetMTU(aoe_disk->ClientMac);
+                if (!AoeDiskPoolsCreate_(aoe_disk)) {
+                    /* Maybe next time around. */
+                    KeReleaseSpinLock(&aoe_disk->SpinLock, Irql);
+                    continue;
+                  }
                 aoe_disk->search_state = AoeSearchStateGetSize;
               }
           }
@@ -564,26 +1670,22 @@ static BOOLEAN STDCALL AoeDiskInit_(IN AOE_SP_DISK aoe_disk) {
             KeReleaseSpinLock(&aoe_disk->SpinLock, Irql);
             continue;
           }
-        if (aoe_disk->search_state ==
-          AoeSearchStateGettingMaxSectsPerPacket) {
+        if (aoe_disk->search_state == AoeSearchStateGettingConfig) {
             KeQuerySystemTime(&CurrentTime);
-            /*
-             * TODO: Make the below value a #defined constant:
-             * 2.500.000 * 100ns = 250.000.000 ns = 250ms 
-             */
             if (
                 CurrentTime.QuadPart >
-                MaxSectorsPerPacketSendTime.QuadPart + 2500000LL
+                ConfigSendTime.QuadPart + AOE_M_CONFIG_TIMEOUT_
               ) {
                 DBG(
-                    "No reply after 250ms for MaxSectorsPerPacket %d, "
-                      "giving up\n",
-                    aoe_disk->MaxSectorsPerPacket
+                    "No Query Config reply after 250ms, "
+                      "assuming %d sectors per packet\n",
+                    AOE_M_CONFIG_SECTORS_DEFAULT_
                   );
-                aoe_disk->MaxSectorsPerPacket--;
+                aoe_disk->ConfigSectors = AOE_M_CONFIG_SECTORS_DEFAULT_;
+                AoeDiskMaxSectorsUpdate_(aoe_disk);
                 aoe_disk->search_state = AoeSearchStateDone;
               } else {
-                /* Still getting the maximum sectors per packet count. */
+                /* Still getting the target's configuration. */
                 KeReleaseSpinLock(&aoe_disk->SpinLock, Irql);
                 continue;
               }
@@ -593,35 +1695,11 @@ static BOOLEAN STDCALL AoeDiskInit_(IN AOE_SP_DISK aoe_disk) {
             /* We've finished the disk search; perform clean-up. */
             KeAcquireSpinLock(&AoeLock_, &InnerIrql);
 
-            /* Tag clean-up: Find out if our tag is in the global tag list. */
-            tag_walker = AoeTagListFirst_;
-            while (tag_walker != NULL && tag_walker != tag)
-              tag_walker = tag_walker->next;
-            if (tag_walker != NULL) {
-                /*
-                 * We found it.  If it's at the beginning of the list, adjust
-                 * the list to point the the next tag.
-                 */
-                if (tag->previous == NULL)
-                  AoeTagListFirst_ = tag->next;
-                  else
-                  /* Remove our tag from the list. */
-                  tag->previous->next = tag->next;
-                /*
-                 * If we 're at the end of the list, adjust the list's end to
-                 * point to the penultimate tag.
-                 */
-                if (tag->next == NULL)
-                  AoeTagListLast_ = tag->previous;
-                  else
-                  /* Remove our tag from the list. */
-                  tag->next->previous = tag->previous;
-                AoePendingTags_--;
-                if (AoePendingTags_ < 0)
-                  DBG("AoePendingTags_ < 0!!\n");
+            /* Tag clean-up: Find out if our tag is still outstanding. */
+            if (AoeTagIsOutstanding_(aoe_disk, tag)) {
+                AoeTagUnlink_(tag);
                 /* Free our tag and its AoE packet. */
-                wv_free(tag->packet_data);
-                wv_free(tag);
+                AoeTagFree_(tag);
               } /* found tag. */
 
             /* Disk search clean-up. */
@@ -673,34 +1751,20 @@ static BOOLEAN STDCALL AoeDiskInit_(IN AOE_SP_DISK aoe_disk) {
         #if 0
         if (aoe_disk->search_state == AoeSearchStateDone)
         #endif
-        /* Establish our tag. */
-        if ((tag = wv_mallocz(sizeof *tag)) == NULL) {
+        /* Establish our tag and its AoE packet. */
+        if ((tag = AoeTagAlloc_(aoe_disk)) == NULL) {
             DBG("Couldn't allocate tag\n");
             KeReleaseSpinLock(&aoe_disk->SpinLock, Irql);
             /* Maybe next time around. */
             continue;
           }
         tag->type = AoeTagTypeSearchDrive_;
-        tag->aoe_disk = aoe_disk;
-
-        /* Establish our tag's AoE packet. */
         tag->PacketSize = sizeof (AOE_S_PACKET_);
-        if ((tag->packet_data = wv_mallocz(tag->PacketSize)) == NULL) {
-            DBG("Couldn't allocate tag->packet_data\n");
-            wv_free(tag);
-            tag = NULL;
-            KeReleaseSpinLock(&aoe_disk->SpinLock, Irql);
-            /* Maybe next time around. */
-            continue;
-          }
-        tag->packet_data->Ver = AOEPROTOCOLVER;
-        tag->packet_data->Major = htons((UINT16) aoe_disk->Major);
-        tag->packet_data->Minor = (UCHAR) aoe_disk->Minor;
-        tag->packet_data->ExtendedAFlag = TRUE;
 
         /* Initialize the packet appropriately based on our current phase. */
         switch (aoe_disk->search_state) {
             case AoeSearchStateGetSize:
+              tag->packet_data->ExtendedAFlag = TRUE;
               /* TODO: Make the below value into a #defined constant. */
               tag->packet_data->Cmd = 0xec;  /* IDENTIFY DEVICE */
               tag->packet_data->Count = 1;
@@ -708,29 +1772,24 @@ static BOOLEAN STDCALL AoeDiskInit_(IN AOE_SP_DISK aoe_disk) {
               break;
 
             case AoeSearchStateGetGeometry:
+              tag->packet_data->ExtendedAFlag = TRUE;
               /* TODO: Make the below value into a #defined constant. */
               tag->packet_data->Cmd = 0x24;  /* READ SECTOR */
               tag->packet_data->Count = 1;
               aoe_disk->search_state = AoeSearchStateGettingGeometry;
               break;
 
-            case AoeSearchStateGetMaxSectsPerPacket:
-              /* TODO: Make the below value into a #defined constant. */
-              tag->packet_data->Cmd = 0x24;  /* READ SECTOR */
-              tag->packet_data->Count = (UCHAR) (
-                  ++aoe_disk->MaxSectorsPerPacket
-                );
-              KeQuerySystemTime(&MaxSectorsPerPacketSendTime);
-              aoe_disk->search_state =
-                AoeSearchStateGettingMaxSectsPerPacket;
-              /* TODO: Make the below value into a #defined constant. */
-              aoe_disk->Timeout = 200000;
+            case AoeSearchStateGetConfig:
+              /* Ask for the target's limits; the arguments stay zeroed. */
+              tag->packet_data->Command = AOE_M_CMD_CONFIG_;
+              tag->PacketSize = AOE_M_HEADER_SIZE_ + sizeof (AOE_S_CONFIG_);
+              KeQuerySystemTime(&ConfigSendTime);
+              aoe_disk->search_state = AoeSearchStateGettingConfig;
               break;
 
             default:
               DBG("Undefined search_state!!\n");
-              wv_free(tag->packet_data);
-              wv_free(tag);
+              AoeTagFree_(tag);
               /* TODO: Do we need to nullify tag here? */
               KeReleaseSpinLock(&aoe_disk->SpinLock, Irql);
               continue;
@@ -738,16 +1797,8 @@ static BOOLEAN STDCALL AoeDiskInit_(IN AOE_SP_DISK aoe_disk) {
           }
 
         /* Enqueue our tag. */
-        tag->next = NULL;
         KeAcquireSpinLock(&AoeLock_, &InnerIrql);
-        if (AoeTagListFirst_ == NULL) {
-            AoeTagListFirst_ = tag;
-            tag->previous = NULL;
-          } else {
-            AoeTagListLast_->next = tag;
-            tag->previous = AoeTagListLast_;
-          }
-        AoeTagListLast_ = tag;
+        AoeTagQueueAppend_(tag, tag);
         KeReleaseSpinLock(&AoeLock_, InnerIrql);
         KeReleaseSpinLock(&aoe_disk->SpinLock, Irql);
       } /* while TRUE */
@@ -768,9 +1819,14 @@ static NTSTATUS STDCALL AoeDiskIo_(
     PHYSICAL_ADDRESS PhysicalAddress;
     PUCHAR PhysicalMemory;
     AOE_SP_DISK aoe_disk_ptr;
+    BOOLEAN fresh;
+    UINT32 max_sectors;
+    LARGE_INTEGER now;
 
     /* Establish pointer to the AoE disk. */
     aoe_disk_ptr = CONTAINING_RECORD(disk_ptr, AOE_S_DISK, disk);
+    /* An MTU change mustn't alter the split part-way through. */
+    max_sectors = aoe_disk_ptr->MaxSectorsPerPacket;
 
     if (AoeStop_) {
         /* Shutting down AoE; we can't service this request. */
@@ -790,7 +1846,10 @@ static NTSTATUS STDCALL AoeDiskIo_(
       }
 
     /* Allocate and zero-fill our request. */
-    if ((request_ptr = wv_mallocz(sizeof *request_ptr)) == NULL) {
+    request_ptr = NULL;
+    if (aoe_disk_ptr->RequestPool != NULL)
+      request_ptr = AoePoolAlloc_(aoe_disk_ptr->RequestPool, &fresh);
+    if (request_ptr == NULL) {
         DBG("Couldn't allocate for reques_ptr; bye!\n");
         irp->IoStatus.Information = 0;
         irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -799,75 +1858,57 @@ static NTSTATUS STDCALL AoeDiskIo_(
       }
 
     /* Initialize the request. */
+    RtlZeroMemory(request_ptr, sizeof *request_ptr);
     request_ptr->Mode = mode;
     request_ptr->SectorCount = sector_count;
     request_ptr->Buffer = buffer;
     request_ptr->Irp = irp;
     request_ptr->TagCount = 0;
+    request_ptr->Status = STATUS_SUCCESS;
 
     /* Split the requested sectors into packets in tags. */
-    for (i = 0; i < sector_count; i += aoe_disk_ptr->MaxSectorsPerPacket) {
-        /* Allocate each tag. */
-        if ((tag = wv_mallocz(sizeof *tag)) == NULL) {
+    KeQuerySystemTime(&now);
+    for (i = 0; i < sector_count; i += max_sectors) {
+        /* Allocate each tag and its AoE packet. */
+        if ((tag = AoeTagAlloc_(aoe_disk_ptr)) == NULL) {
             DBG("Couldn't allocate tag; bye!\n");
-            /* We failed while allocating tags; free the ones we built. */
+            request_ptr->Status = STATUS_INSUFFICIENT_RESOURCES;
+            if (new_tag_list == NULL) {
+                AoePoolFree_(request_ptr);
+                return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+              }
+            /*
+             * We failed while allocating tags; free the ones we built.
+             * The last one completes the IRP.
+             */
             tag = new_tag_list;
             while (tag != NULL) {
                 previous_tag = tag;
                 tag = tag->next;
-                wv_free(previous_tag->packet_data);
-                wv_free(previous_tag);
+                AoeTagFree_(previous_tag);
               }
-            wv_free(request_ptr);
-            irp->IoStatus.Information = 0;
-            irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-            IoCompleteRequest ( irp, IO_NO_INCREMENT );
             return STATUS_INSUFFICIENT_RESOURCES;
           } /* if !tag */
 
         /* Initialize each tag. */
         tag->type = AoeTagTypeIo_;
         tag->request_ptr = request_ptr;
-        tag->aoe_disk = aoe_disk_ptr;
         request_ptr->TagCount++;
         tag->Id = 0;
+        tag->Lba = start_sector + i;
+        tag->QueueTime = now;
         tag->BufferOffset = i * disk_ptr->SectorSize;
         tag->SectorCount = (
-            (sector_count - i) <
-            aoe_disk_ptr->MaxSectorsPerPacket ?
+            (sector_count - i) < max_sectors ?
             sector_count - i :
-            aoe_disk_ptr->MaxSectorsPerPacket
+            max_sectors
           );
 
-        /* Allocate and initialize each tag's AoE packet. */
+        /*
+         * Initialize each tag's AoE header.  Write data isn't copied;
+         * AoeTagSend_ chains it from the buffer.
+         */
         tag->PacketSize = sizeof (AOE_S_PACKET_);
-        if (mode == WvlDiskIoModeWrite)
-          tag->PacketSize += tag->SectorCount * disk_ptr->SectorSize;
-        if ((tag->packet_data = wv_mallocz(tag->PacketSize)) == NULL) {
-            DBG("Couldn't allocate tag->packet_data; bye!\n");
-            /*
-             * We failed while allocating an AoE packet; free
-             * the tags we built.
-             */
-            wv_free(tag);
-            tag = new_tag_list;
-            while (tag != NULL) {
-                previous_tag = tag;
-                tag = tag->next;
-                wv_free(previous_tag->packet_data);
-                wv_free(previous_tag);
-              }
-            wv_free(request_ptr);
-            irp->IoStatus.Information = 0;
-            irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-            IoCompleteRequest(irp, IO_NO_INCREMENT);
-            return STATUS_INSUFFICIENT_RESOURCES;
-          } /* if !tag->packet_data */
-        tag->packet_data->Ver = AOEPROTOCOLVER;
-        tag->packet_data->Major = htons ((UINT16) aoe_disk_ptr->Major);
-        tag->packet_data->Minor = (UCHAR) aoe_disk_ptr->Minor;
-        tag->packet_data->Tag = 0;
-        tag->packet_data->Command = 0;
         tag->packet_data->ExtendedAFlag = TRUE;
         if (mode == WvlDiskIoModeRead)
           tag->packet_data->Cmd = 0x24;  /* READ SECTOR */
@@ -883,14 +1924,6 @@ static NTSTATUS STDCALL AoeDiskIo_(
         tag->packet_data->Lba4 = (UCHAR) (((start_sector + i) >> 32) & 255);
         tag->packet_data->Lba5 = (UCHAR) (((start_sector + i) >> 40) & 255);
 
-        /* For a write request, copy from the buffer into the AoE packet. */
-        if (mode == WvlDiskIoModeWrite) {
-            RtlCopyMemory(
-                tag->packet_data->Data,
-                buffer + (tag->BufferOffset),
-                tag->SectorCount * disk_ptr->SectorSize
-              );
-          }
         /* Add this tag to the request's tag list. */
         tag->previous = previous_tag;
         tag->next = NULL;
@@ -906,22 +1939,14 @@ static NTSTATUS STDCALL AoeDiskIo_(
     /* Wait until we have the global spin-lock. */
     KeAcquireSpinLock(&AoeLock_, &Irql);
 
-    /* Enqueue our request's tag list to the global tag list. */
-    if (AoeTagListLast_ == NULL)
-      AoeTagListFirst_ = new_tag_list;
-      else {
-        AoeTagListLast_->next = new_tag_list;
-        new_tag_list->previous = AoeTagListLast_;
-      }
-    /* Adjust the global list to reflect our last tag. */
-    AoeTagListLast_ = tag;
+    /* Enqueue our request's tag list to the queue of unsent tags. */
+    AoeTagQueueAppend_(new_tag_list, tag);
 
     irp->IoStatus.Information = 0;
     irp->IoStatus.Status = STATUS_PENDING;
     IoMarkIrpPending(irp);
 
     KeReleaseSpinLock(&AoeLock_, Irql);
-    KeSetEvent(&AoeSignal_, 0, FALSE);
     return STATUS_PENDING;
   }
 
@@ -982,6 +2007,139 @@ static VOID STDCALL add_target(
     KeReleaseSpinLock(&AoeTargetListLock_, Irql);
   }
 
+/**
+ * Take a sent tag out of the tag table now that its reply has arrived.
+ *
+ * @v tag               The tag which was replied to.
+ * @v now               When the reply arrived.
+ *
+ * The caller must hold AoeLock_.
+ */
+static VOID AoeTagAcceptReply_(
+    IN AOE_SP_WORK_TAG_ tag,
+    IN LARGE_INTEGER now
+  ) {
+    AOE_SP_PATH path = tag->Path;
+    LONGLONG rtt = now.QuadPart - tag->FirstSendTime.QuadPart;
+
+    AoeTagTableRemove_(tag);
+    if (path) {
+        /* The path works. */
+        path->Timeouts = 0;
+        path->DeadTime.QuadPart = 0;
+      }
+    if (AoeRttSample(&tag->aoe_disk->Rtt, tag->Resent, rtt)) {
+        if (path && path->Srtt)
+          path->Srtt += (rtt - path->Srtt) / 8;
+          else if (path)
+          path->Srtt = rtt;
+        AoeDiskWindowOpen_(tag->aoe_disk);
+      }
+    /* The window has room again, so the worker might have tags to send. */
+    if (tag->aoe_disk->TagQueueFirst != NULL)
+      KeSetEvent(&AoeSignal_, 0, FALSE);
+  }
+
+/**
+ * Find where a read reply's data should go, from the reply's lookahead.
+ *
+ * @v Data              The start of the AoE packet.
+ * @v DataSize          The number of bytes of the AoE packet available.
+ * @v PacketSize        The AoE packet's full size.
+ * @v Offset            Filled with the offset of the data to transfer.
+ * @v Buffer            Filled with where the data should be transferred.
+ * @v BufferSize        Filled with how much data to transfer.
+ * @ret PVOID           Context for aoe__reply_transferred, or NULL if the
+ *                      reply should be received whole and given to
+ *                      aoe__reply instead.
+ *
+ * This lets the protocol layer transfer read data straight into the
+ * request's buffer.  The tag is referenced so that the IRP cannot be
+ * completed until the transfer is done.
+ */
+PVOID STDCALL aoe__reply_lookahead(
+    IN PUCHAR Data,
+    IN UINT32 DataSize,
+    IN UINT32 PacketSize,
+    OUT PUINT32 Offset,
+    OUT PUCHAR * Buffer,
+    OUT PUINT32 BufferSize
+  ) {
+    AOE_SP_PACKET_ reply = (AOE_SP_PACKET_) Data;
+    AOE_SP_WORK_TAG_ tag;
+    UINT32 size;
+    KIRQL irql;
+
+    if (
+        DataSize < sizeof *reply ||
+        !reply->ResponseFlag ||
+        reply->ErrorFlag ||
+        AoeProbeTag_->Id == reply->Tag
+      )
+      return NULL;
+
+    KeAcquireSpinLock(&AoeLock_, &irql);
+    tag = AoeTagTableFind_(reply->Tag, reply->Major, reply->Minor);
+    if (
+        tag == NULL ||
+        tag->type != AoeTagTypeIo_ ||
+        tag->request_ptr->Mode != WvlDiskIoModeRead ||
+        /* A merged frame's data goes to several buffers. */
+        tag->Merged != NULL
+      ) {
+        KeReleaseSpinLock(&AoeLock_, irql);
+        return NULL;
+      }
+    size = tag->SectorCount * tag->aoe_disk->disk->SectorSize;
+    if (PacketSize < sizeof *reply + size) {
+        KeReleaseSpinLock(&AoeLock_, irql);
+        return NULL;
+      }
+    AoeTagReference_(tag);
+    KeReleaseSpinLock(&AoeLock_, irql);
+
+    *Offset = sizeof *reply;
+    *Buffer = tag->request_ptr->Buffer + tag->BufferOffset;
+    *BufferSize = size;
+    return tag;
+  }
+
+/**
+ * Finish a read reply whose data was transferred into the request.
+ *
+ * @v Context           The context from aoe__reply_lookahead.
+ * @v Success           Whether the data was transferred.
+ *
+ * If the transfer failed, the tag stays outstanding and will be resent.
+ */
+VOID STDCALL aoe__reply_transferred(IN PVOID Context, IN BOOLEAN Success) {
+    AOE_SP_WORK_TAG_ tag = Context;
+    LARGE_INTEGER CurrentTime;
+    KIRQL irql;
+
+    KeQuerySystemTime(&CurrentTime);
+    KeAcquireSpinLock(&AoeLock_, &irql);
+    /* A duplicate reply might have beaten us to it. */
+    if (
+        !Success ||
+        AoeTagTableFind_(
+            tag->Id,
+            tag->packet_data->Major,
+            tag->packet_data->Minor
+          ) != tag
+      ) {
+        KeReleaseSpinLock(&AoeLock_, irql);
+        AoeTagFree_(tag);
+        return;
+      }
+    AoeTagAcceptReply_(tag, CurrentTime);
+    KeReleaseSpinLock(&AoeLock_, irql);
+
+    /* Drop our reference and the tag table's. */
+    AoeTagFree_(tag);
+    AoeTagFree_(tag);
+  }
+
 /**
  * Process an AoE reply.
  *
@@ -998,10 +2156,10 @@ NTSTATUS STDCALL aoe__reply(
   )
   {
     AOE_SP_PACKET_ reply = (AOE_SP_PACKET_) Data;
+    AOE_SP_CONFIG_ config;
     LONGLONG LBASize;
-    AOE_SP_WORK_TAG_ tag;
-    KIRQL Irql;
-    BOOLEAN Found = FALSE;
+    AOE_SP_WORK_TAG_ tag, walker;
+    KIRQL Irql, InnerIrql;
     LARGE_INTEGER CurrentTime;
     WVL_SP_DISK_T disk_ptr;
     AOE_SP_DISK aoe_disk_ptr;
@@ -1023,44 +2181,18 @@ NTSTATUS STDCALL aoe__reply(
         return STATUS_SUCCESS;
       }
 
+    KeQuerySystemTime(&CurrentTime);
+
     /* Wait until we have the global spin-lock. */
     KeAcquireSpinLock(&AoeLock_, &Irql);
 
-    /* Search for request tag. */
-    if (AoeTagListFirst_ == NULL) {
+    /* Look up the request tag by its ID. */
+    tag = AoeTagTableFind_(reply->Tag, reply->Major, reply->Minor);
+    if (tag == NULL) {
         KeReleaseSpinLock(&AoeLock_, Irql);
         return STATUS_SUCCESS;
       }
-    tag = AoeTagListFirst_;
-    while (tag != NULL) {
-        if (
-            (tag->Id == reply->Tag) &&
-            (tag->packet_data->Major == reply->Major) &&
-            (tag->packet_data->Minor == reply->Minor)
-          ) {
-            Found = TRUE;
-            break;
-          }
-        tag = tag->next;
-      } /* while tag */
-    if (!Found) {
-        KeReleaseSpinLock(&AoeLock_, Irql);
-        return STATUS_SUCCESS;
-      } else {
-        /* Remove the tag from the global tag list. */
-        if (tag->previous == NULL)
-          AoeTagListFirst_ = tag->next;
-          else
-          tag->previous->next = tag->next;
-        if (tag->next == NULL)
-          AoeTagListLast_ = tag->previous;
-          else
-          tag->next->previous = tag->previous;
-        AoePendingTags_--;
-        if (AoePendingTags_ < 0)
-          DBG("AoePendingTags_ < 0!!\n");
-        KeSetEvent(&AoeSignal_, 0, FALSE);
-      } /* if !Found */
+    AoeTagAcceptReply_(tag, CurrentTime);
     KeReleaseSpinLock(&AoeLock_, Irql);
 
     /* Establish pointers to the disk device and AoE disk. */
@@ -1084,15 +2216,6 @@ NTSTATUS STDCALL aoe__reply(
           );
       }
 
-    KeQuerySystemTime(&CurrentTime);
-    aoe_disk_ptr->Timeout -= (UINT32) ((
-        aoe_disk_ptr->Timeout -
-        (CurrentTime.QuadPart - tag->FirstSendTime.QuadPart)
-      ) / 1024);
-    /* TODO: Replace the values below with #defined constants. */
-    if (aoe_disk_ptr->Timeout > 100000000)
-      aoe_disk_ptr->Timeout = 100000000;
-
     switch (tag->type) {
         case AoeTagTypeSearchDrive_:
           KeAcquireSpinLock(&aoe_disk_ptr->SpinLock, &Irql);
@@ -1120,49 +2243,54 @@ NTSTATUS STDCALL aoe__reply(
                 disk_ptr->Cylinders =
                   disk_ptr->LBADiskSize /
                   (disk_ptr->Heads * disk_ptr->Sectors);
-                /* Next we are concerned with the max. sectors per packet. */
-                aoe_disk_ptr->search_state =
-                  AoeSearchStateGetMaxSectsPerPacket;
+                /* Next we are concerned with the target's limits. */
+                aoe_disk_ptr->search_state = AoeSearchStateGetConfig;
                 break;
 
-              case AoeSearchStateGettingMaxSectsPerPacket:
-                DataSize -= sizeof (AOE_S_PACKET_);
-                if (DataSize < (
-                    aoe_disk_ptr->MaxSectorsPerPacket *
-                    disk_ptr->SectorSize
-                  )) {
+              case AoeSearchStateGettingConfig:
+                config = (AOE_SP_CONFIG_) (Data + AOE_M_HEADER_SIZE_);
+                if (
+                    reply->ErrorFlag ||
+                    DataSize < AOE_M_HEADER_SIZE_ + sizeof *config ||
+                    !config->SectorCount
+                  ) {
                     DBG(
-                        "Packet size too low while getting "
-                          "MaxSectorsPerPacket (tried %d, got size of %d)\n",
-                        aoe_disk_ptr->MaxSectorsPerPacket,
-                        DataSize
+                        "Unusable Query Config reply, "
+                          "assuming %d sectors per packet\n",
+                        AOE_M_CONFIG_SECTORS_DEFAULT_
                       );
-                    aoe_disk_ptr->MaxSectorsPerPacket--;
-                    aoe_disk_ptr->search_state = AoeSearchStateDone;
-                  } else if (
-                    aoe_disk_ptr->MTU <
-                    (sizeof (AOE_S_PACKET_) +
-                    ((aoe_disk_ptr->MaxSectorsPerPacket + 1)
-                    * disk_ptr->SectorSize))
-                  ) {
-                      DBG(
-                          "Got MaxSectorsPerPacket %d at size of %d. "
-                            "MTU of %d reached\n",
-                          aoe_disk_ptr->MaxSectorsPerPacket,
-                          DataSize,
-                          aoe_disk_ptr->MTU
-                        );
-                      aoe_disk_ptr->search_state = AoeSearchStateDone;
-                    } else {
-                      DBG(
-                          "Got MaxSectorsPerPacket %d at size of %d, "
-                            "trying next...\n",
-                            aoe_disk_ptr->MaxSectorsPerPacket,
-                            DataSize
-                        );
-                      aoe_disk_ptr->search_state =
-                        AoeSearchStateGetMaxSectsPerPacket;
-                    }
+                    aoe_disk_ptr->ConfigSectors =
+                      AOE_M_CONFIG_SECTORS_DEFAULT_;
+                    aoe_disk_ptr->ConfigBuffers = 0;
+                  } else {
+                    aoe_disk_ptr->ConfigSectors = config->SectorCount;
+                    aoe_disk_ptr->ConfigBuffers = ntohs(config->BufferCount);
+                  }
+                AoeDiskMaxSectorsUpdate_(aoe_disk_ptr);
+                DBG(
+                    "Target takes %d sectors and %d buffers, MTU of %d "
+                      "gives MaxSectorsPerPacket %d\n",
+                    aoe_disk_ptr->ConfigSectors,
+                    aoe_disk_ptr->ConfigBuffers,
+                    aoe_disk_ptr->MTU,
+                    aoe_disk_ptr->MaxSectorsPerPacket
+                  );
+
+                /* Don't keep more tags in flight than the target queues. */
+                if (aoe_disk_ptr->ConfigBuffers) {
+                    KeAcquireSpinLock(&AoeLock_, &InnerIrql);
+                    if (aoe_disk_ptr->ConfigBuffers < AOE_M_WINDOW_MAX_)
+                      aoe_disk_ptr->WindowMax = aoe_disk_ptr->ConfigBuffers;
+                    if (aoe_disk_ptr->Window > aoe_disk_ptr->WindowMax)
+                      aoe_disk_ptr->Window = aoe_disk_ptr->WindowMax;
+                    if (
+                        aoe_disk_ptr->WindowThreshold >
+                        aoe_disk_ptr->WindowMax
+                      )
+                      aoe_disk_ptr->WindowThreshold = aoe_disk_ptr->WindowMax;
+                    KeReleaseSpinLock(&AoeLock_, InnerIrql);
+                  }
+                aoe_disk_ptr->search_state = AoeSearchStateDone;
                 break;
 
               default:
@@ -1174,26 +2302,24 @@ NTSTATUS STDCALL aoe__reply(
           break;
 
         case AoeTagTypeIo_:
-          /* If the reply is in response to a read request, get our data! */
-          if (tag->request_ptr->Mode == WvlDiskIoModeRead) {
-              RtlCopyMemory(
-                  tag->request_ptr->Buffer + (tag->BufferOffset),
-                  reply->Data,
-                  tag->SectorCount * disk_ptr->SectorSize
-                );
-            }
           /*
-           * If this is the last reply expected for the read request,
-           * complete the IRP and free the request.
+           * If the reply is in response to a read request, get our data!
+           * A merged frame's data is split between its tags, in order.
            */
-          if (InterlockedDecrement(&tag->request_ptr->TagCount) == 0) {
-              WvlIrpComplete(
-                  tag->request_ptr->Irp,
-                  tag->request_ptr->SectorCount * disk_ptr->SectorSize,
-                  STATUS_SUCCESS
-                );
-              wv_free(tag->request_ptr);
+          if (tag->request_ptr->Mode == WvlDiskIoModeRead) {
+              UINT32 offset = 0, size;
+
+              for (walker = tag; walker != NULL; walker = walker->Merged) {
+                  size = walker->SectorCount * disk_ptr->SectorSize;
+                  WvlCopyMemory(
+                      walker->request_ptr->Buffer + walker->BufferOffset,
+                      reply->Data + offset,
+                      size
+                    );
+                  offset += size;
+                }
             }
+          /* Freeing the request's last tag will complete the IRP. */
           break;
 
         default:
@@ -1201,41 +2327,291 @@ NTSTATUS STDCALL aoe__reply(
           break;
       } /* switch tag type. */
 
-    KeSetEvent(&AoeSignal_, 0, FALSE);
-    wv_free(tag->packet_data);
-    wv_free(tag);
+    AoeTagFree_(tag);
     return STATUS_SUCCESS;
   }
 
+/**
+ * Note a change in a NIC's maximum frame size.
+ *
+ * @v Mac               The NIC's MAC address.
+ * @v MTU               The NIC's new maximum frame size.
+ *
+ * Disks found on the NIC work out their sectors per packet again, using
+ * the target limits they already have.  Other disks' paths from the
+ * NIC take the new MTU, and a path whose MTU is now below its disk's
+ * stops being used; its outstanding tags are resent on another path.
+ * Called at PASSIVE_LEVEL.
+ */
+VOID STDCALL aoe__mtu_changed(IN PUCHAR Mac, IN UINT32 MTU) {
+    WVL_SP_BUS_NODE walker;
+    AOE_SP_PATH path;
+    LARGE_INTEGER now;
+    UINT32 i;
+    KIRQL irql;
+
+    /* The bus might not be up yet. */
+    if (AoeStop_ || !AoeBusMain.Fdo)
+      return;
+
+    walker = NULL;
+    while (walker = WvlBusGetNextNode(&AoeBusMain, walker)) {
+        AOE_SP_DISK aoe_disk = CONTAINING_RECORD(
+            walker,
+            AOE_S_DISK,
+            BusNode[0]
+          );
+
+        if (wv_memcmpeq(aoe_disk->ClientMac, Mac, 6)) {
+            KeAcquireSpinLock(&aoe_disk->SpinLock, &irql);
+            aoe_disk->MTU = MTU;
+            if (aoe_disk->search_state == AoeSearchStateDone)
+              AoeDiskMaxSectorsUpdate_(aoe_disk);
+            DBG(
+                "Disk %d: MTU of %d gives MaxSectorsPerPacket %d\n",
+                WvlBusGetNodeNum(aoe_disk->BusNode),
+                MTU,
+                aoe_disk->MaxSectorsPerPacket
+              );
+            KeReleaseSpinLock(&aoe_disk->SpinLock, irql);
+          }
+
+        KeAcquireSpinLock(&AoeLock_, &irql);
+        KeQuerySystemTime(&now);
+        for (i = 0; i < aoe_disk->PathCount; i++) {
+            path = aoe_disk->Paths + i;
+            if (!wv_memcmpeq(path->ClientMac, Mac, 6))
+              continue;
+            path->MTU = MTU;
+            if (MTU < aoe_disk->MTU)
+              AoeDiskPathDead_(aoe_disk, path, now);
+          }
+        KeReleaseSpinLock(&AoeLock_, irql);
+      }
+    /* Resend whatever was failed over. */
+    KeSetEvent(&AoeSignal_, 0, FALSE);
+  }
+
 VOID aoe__reset_probe(void) {
     AoeProbeTag_->SendTime.QuadPart = 0LL;
+    KeSetEvent(&AoeSignal_, 0, FALSE);
+  }
+
+/**
+ * Assign the next tag ID.
+ *
+ * @ret UINT32          The tag ID, which is never zero.
+ *
+ * Only the worker thread assigns tag IDs.
+ */
+static UINT32 AoeTagIdNext_(void) {
+    UINT32 id = AoeNextTagId_++;
+
+    if (AoeNextTagId_ == 0)
+      AoeNextTagId_++;
+    return id;
+  }
+
+/**
+ * Send unsent tags from the submission queue.
+ *
+ * @v now               The current time.
+ * @v send_failed       Set to TRUE if a send failed, else FALSE.
+ * @v hold_until        Set to when the earliest held frame must be sent,
+ *                      or to zero if no frame is held.
+ * @ret UINT32          The number of tags sent.
+ *
+ * Each queued disk gets one turn and sends, oldest first, until its
+ * congestion window is full.  Following tags are merged into each
+ * frame where they can be.  While the disk has tags in flight, a frame
+ * with room left is held for up to the merge window, in case more
+ * sectors for it arrive.  Each tag goes on whichever of the disk's
+ * paths is picked for it.  The caller must hold AoeLock_.
+ */
+static UINT32 AoeThreadSend_(
+    IN LARGE_INTEGER now,
+    OUT PBOOLEAN send_failed,
+    OUT PLARGE_INTEGER hold_until
+  ) {
+    AOE_SP_DISK last_disk = AoeDiskQueueLast_;
+    AOE_SP_DISK aoe_disk;
+    AOE_SP_WORK_TAG_ tag;
+    AOE_S_MERGE_IO frame;
+    UINT32 sent = 0;
+    LONGLONG hold;
+
+    *send_failed = FALSE;
+    hold_until->QuadPart = 0;
+    while (last_disk && (aoe_disk = AoeDiskQueuePop_()) != NULL) {
+        AoeDiskPathsScan_(aoe_disk, now);
+        while (
+            (tag = aoe_disk->TagQueueFirst) != NULL &&
+            aoe_disk->InFlight < aoe_disk->Window
+          ) {
+            if (!AoeTimerHeapReserve_()) {
+                *send_failed = TRUE;
+                break;
+              }
+            AoeTagMerge_(tag, aoe_disk->MaxSectorsPerPacket, &frame);
+            hold = tag->QueueTime.QuadPart + AoeMergeWindow_;
+            if (
+                AoeMergeHold(
+                    &frame,
+                    aoe_disk->MaxSectorsPerPacket,
+                    aoe_disk->InFlight,
+                    now.QuadPart,
+                    hold
+                  )
+              ) {
+                if (!hold_until->QuadPart || hold < hold_until->QuadPart)
+                  hold_until->QuadPart = hold;
+                break;
+              }
+            tag->Id = AoeTagIdNext_();
+            tag->packet_data->Tag = tag->Id;
+            tag->Path = AoeDiskPathPick_(aoe_disk);
+            if (!AoeTagSend_(tag)) {
+                /* The NIC might be gone; try another path next time. */
+                if (tag->Path)
+                  AoeDiskPathDead_(aoe_disk, tag->Path, now);
+                tag->Path = NULL;
+                tag->Id = 0;
+                *send_failed = TRUE;
+                break;
+              }
+            tag->FirstSendTime = now;
+            tag->SendTime = now;
+            tag->Rto = aoe_disk->Rtt.Rto;
+            tag->Timer.Deadline = now.QuadPart + tag->Rto;
+            AoeTagQueueRemove_(tag);
+            AoeTagTableInsert_(tag);
+            if (tag->type == AoeTagTypeIo_)
+              AoeStats_.SentSectors += frame.Sectors;
+            sent++;
+          }
+        /* Keep the disk's place if it still has unsent tags. */
+        if (aoe_disk->TagQueueFirst)
+          AoeDiskQueuePush_(aoe_disk);
+        if (aoe_disk == last_disk || *send_failed)
+          break;
+      }
+    AoeStats_.Sends += sent;
+    if (*send_failed)
+      AoeStats_.SendFails++;
+    return sent;
+  }
+
+/**
+ * Resend sent tags whose deadlines have passed, earliest first.
+ *
+ * @v now               The current time.
+ * @ret UINT32          The number of tags resent.
+ *
+ * A path with too many timeouts in a row is taken to be dead, and each
+ * resend picks its path afresh, so requests fail over to the paths
+ * which still work.  A tag whose last send NDIS hasn't finished isn't
+ * resent, since its frame is still in use; its timer is backed off as
+ * usual, and it's resent when next due.  The caller must hold AoeLock_.
+ */
+static UINT32 AoeThreadResend_(IN LARGE_INTEGER now) {
+    AOE_SP_WORK_TAG_ tag;
+    AOE_SP_DISK aoe_disk;
+    AOE_SP_PATH path;
+    UINT32 resent = 0;
+
+    while (
+        (tag = AoeTimerHeapFirst_()) != NULL &&
+        tag->Timer.Deadline <= now.QuadPart
+      ) {
+        aoe_disk = tag->aoe_disk;
+        path = tag->Path;
+        if (path && ++path->Timeouts >= AOE_M_PATH_TIMEOUTS_)
+          AoeDiskPathDead_(aoe_disk, path, now);
+
+        /* Back the tag's timer off, even if the resend fails. */
+        tag->Rto = AoeRttBackoff(&aoe_disk->Rtt, tag->Rto);
+        tag->Timer.Deadline = now.QuadPart + tag->Rto;
+        AoeTimerHeapChanged(&AoeTimerHeap_, &tag->Timer);
+
+        /* NDIS still has the frame, so leave its header alone. */
+        if (tag->SendsPending) {
+            AoeStats_.ResendsDeferred++;
+            continue;
+          }
+
+        /* Move the tag to the best path. */
+        tag->Path = AoeDiskPathPick_(aoe_disk);
+        if (path != tag->Path) {
+            if (path)
+              path->InFlight--;
+            if (tag->Path)
+              tag->Path->InFlight++;
+          }
+
+        if (!AoeTagSend_(tag)) {
+            if (tag->Path)
+              AoeDiskPathDead_(aoe_disk, tag->Path, now);
+            AoeStats_.ResendFails++;
+            break;
+          }
+        tag->SendTime = now;
+        tag->Resent = TRUE;
+        AoeDiskWindowCut_(aoe_disk, tag, now);
+        resent++;
+      }
+    AoeStats_.Resends += resent;
+    return resent;
+  }
+
+/**
+ * Broadcast a probe for AoE targets.
+ *
+ * @v now               The current time.
+ */
+static VOID AoeThreadProbe_(IN LARGE_INTEGER now) {
+    AoeProbeTag_->Id = AoeTagIdNext_();
+    AoeProbeTag_->packet_data->Tag = AoeProbeTag_->Id;
+    Protocol_Send(
+        "\xff\xff\xff\xff\xff\xff",
+        "\xff\xff\xff\xff\xff\xff",
+        (PUCHAR) AoeProbeTag_->packet_data,
+        AoeProbeTag_->PacketSize,
+        NULL
+      );
+    AoeProbeTag_->SendTime = now;
   }
 
+/**
+ * The AoE worker thread.
+ *
+ * The thread sleeps until it is signalled or until the earliest of its
+ * deadlines, then services only those work sources which are ready:
+ *   - the submission queue, when a disk has unsent tags and window room,
+ *     or when a held frame's merge window has passed,
+ *   - the retransmit timer heap, when a sent tag's deadline has passed,
+ *   - the probe deadline, when a new probe is due,
+ *   - the statistics deadline, when the per-second counters are due.
+ */
 static VOID STDCALL AoeThread_(IN PVOID StartContext) {
-    NTSTATUS status;
-    LARGE_INTEGER Timeout, CurrentTime, ProbeTime, ReportTime;
-    UINT32 NextTagId = 1;
+    LARGE_INTEGER Timeout, CurrentTime, StatsTime, WakeTime, HoldTime;
     AOE_SP_WORK_TAG_ tag;
+    BOOLEAN send_failed = FALSE;
     KIRQL Irql;
-    UINT32 Sends = 0;
-    UINT32 Resends = 0;
-    UINT32 ResendFails = 0;
-    UINT32 Fails = 0;
-    UINT32 RequestTimeout = 0;
-    WVL_SP_DISK_T disk_ptr;
-    AOE_SP_DISK aoe_disk_ptr;
+    UINT32 work;
+    UINT32 LastWakeups = 0;
+    UINT32 LastWork = 0;
 
     DBG("Entry\n");
 
-    ReportTime.QuadPart = 0LL;
-    ProbeTime.QuadPart = 0LL;
+    StatsTime.QuadPart = 0LL;
+    WakeTime.QuadPart = 0LL;
 
     while (TRUE) {
         /*
-         * TODO: Make the below value a #defined constant:
-         * 100.000 * 100ns = 10.000.000 ns = 10ms
+         * Sleep until signalled or until the next deadline.  A positive
+         * timeout is an absolute system time; zero doesn't wait at all.
          */
-        Timeout.QuadPart = -100000LL;
+        Timeout.QuadPart = WakeTime.QuadPart;
         KeWaitForSingleObject(
             &AoeSignal_,
             Executive,
@@ -1243,7 +2619,6 @@ static VOID STDCALL AoeThread_(IN PVOID StartContext) {
             FALSE,
             &Timeout
           );
-        KeResetEvent(&AoeSignal_);
         if (AoeStop_) {
             DBG("Stopping...\n");
             PsTerminateSystemThread(STATUS_SUCCESS);
@@ -1251,115 +2626,81 @@ static VOID STDCALL AoeThread_(IN PVOID StartContext) {
             return;
           }
         KeQuerySystemTime(&CurrentTime);
-        /* TODO: Make the below value a #defined constant. */
-        if (CurrentTime.QuadPart > (ReportTime.QuadPart + 10000000LL)) {
-            DBG(
-                "Sends: %d  Resends: %d  ResendFails: %d  Fails: %d  "
-                  "AoePendingTags_: %d  RequestTimeout: %d\n",
-                Sends,
-                Resends,
-                ResendFails,
-                Fails,
-                AoePendingTags_,
-                RequestTimeout
-              );
-            Sends = 0;
-            Resends = 0;
-            ResendFails = 0;
-            Fails = 0;
-            KeQuerySystemTime(&ReportTime);
+        work = 0;
+
+        /* Probe deadline. */
+        if (
+            CurrentTime.QuadPart >=
+            AoeProbeTag_->SendTime.QuadPart + AOE_M_PROBE_INTERVAL_
+          ) {
+            AoeThreadProbe_(CurrentTime);
+            work++;
           }
 
-        /* TODO: Make the below value a #defined constant. */
+        KeAcquireSpinLock(&AoeLock_, &Irql);
+        AoeStats_.Wakeups++;
+        if (work)
+          AoeStats_.Probes++;
+
+        /* Submission queue. */
+        HoldTime.QuadPart = 0;
+        if (AoeDiskQueueFirst_ != NULL)
+          work += AoeThreadSend_(CurrentTime, &send_failed, &HoldTime);
+          else
+          send_failed = FALSE;
+
+        /* Retransmit timer deadline. */
+        tag = AoeTimerHeapFirst_();
+        if (tag && tag->Timer.Deadline <= CurrentTime.QuadPart)
+          work += AoeThreadResend_(CurrentTime);
+
+        AoeStats_.Work += work;
+        if (work == 0)
+          AoeStats_.IdleWakeups++;
+        if (work > AoeStats_.MaxWork)
+          AoeStats_.MaxWork = work;
+
+        /* Statistics deadline. */
         if (
-            CurrentTime.QuadPart >
-            (AoeProbeTag_->SendTime.QuadPart + 100000000LL)
+            CurrentTime.QuadPart >=
+            StatsTime.QuadPart + AOE_M_STATS_INTERVAL_
           ) {
-            AoeProbeTag_->Id = NextTagId++;
-            if (NextTagId == 0)
-              NextTagId++;
-            AoeProbeTag_->packet_data->Tag = AoeProbeTag_->Id;
-            Protocol_Send(
-                "\xff\xff\xff\xff\xff\xff",
-                "\xff\xff\xff\xff\xff\xff",
-                (PUCHAR) AoeProbeTag_->packet_data,
-                AoeProbeTag_->PacketSize,
-                NULL
+            AoeStats_.WakeupsPerSec = AoeStats_.Wakeups - LastWakeups;
+            AoeStats_.WorkPerSec = AoeStats_.Work - LastWork;
+            LastWakeups = AoeStats_.Wakeups;
+            LastWork = AoeStats_.Work;
+            StatsTime = CurrentTime;
+            DBG(
+                "Wakeups/s: %d  Work/s: %d  Queued: %d  In flight: %d\n",
+                AoeStats_.WakeupsPerSec,
+                AoeStats_.WorkPerSec,
+                AoeStats_.QueueDepth,
+                AoePendingTags_
               );
-            KeQuerySystemTime(&AoeProbeTag_->SendTime);
           }
 
-        KeAcquireSpinLock(&AoeLock_, &Irql);
-        if (AoeTagListFirst_ == NULL) {
-            KeReleaseSpinLock(&AoeLock_, Irql);
-            continue;
+        /* Work out the earliest deadline. */
+        WakeTime.QuadPart = StatsTime.QuadPart + AOE_M_STATS_INTERVAL_;
+        if (
+            AoeProbeTag_->SendTime.QuadPart + AOE_M_PROBE_INTERVAL_ <
+            WakeTime.QuadPart
+          ) {
+            WakeTime.QuadPart =
+              AoeProbeTag_->SendTime.QuadPart + AOE_M_PROBE_INTERVAL_;
           }
-        tag = AoeTagListFirst_;
-        while (tag != NULL) {
-            /* Establish pointers to the disk and AoE disk. */
-            aoe_disk_ptr = tag->aoe_disk;
-            disk_ptr = aoe_disk_ptr->disk;
-      
-            RequestTimeout = aoe_disk_ptr->Timeout;
-            if (tag->Id == 0) {
-                #if 0
-                if (AoePendingTags_ <= 102400) {
-                  }
-                #endif
-                if (AoePendingTags_ <= 64) {
-                    if (AoePendingTags_ < 0)
-                      DBG("AoePendingTags_ < 0!!\n");
-                    tag->Id = NextTagId++;
-                    if (NextTagId == 0)
-                      NextTagId++;
-                    tag->packet_data->Tag = tag->Id;
-                    if (Protocol_Send(
-                        aoe_disk_ptr->ClientMac,
-                        aoe_disk_ptr->ServerMac,
-                        (PUCHAR) tag->packet_data,
-                        tag->PacketSize,
-                        tag
-                      )) {
-                        KeQuerySystemTime(&tag->FirstSendTime);
-                        KeQuerySystemTime(&tag->SendTime);
-                        AoePendingTags_++;
-                        Sends++;
-                      } else {
-                        Fails++;
-                        tag->Id = 0;
-                        break;
-                      } /* if send succeeds. */
-                    } /* if pending tags < 64 */
-              } else {
-                KeQuerySystemTime(&CurrentTime);
-                if (
-                    CurrentTime.QuadPart >
-                    (tag->SendTime.QuadPart + (LONGLONG) (aoe_disk_ptr->Timeout * 2))
-                  ) {
-                    if (Protocol_Send(
-                        aoe_disk_ptr->ClientMac,
-                        aoe_disk_ptr->ServerMac,
-                        (PUCHAR) tag->packet_data,
-                        tag->PacketSize,
-                        tag
-                      )) {
-                        KeQuerySystemTime(&tag->SendTime);
-                        aoe_disk_ptr->Timeout += aoe_disk_ptr->Timeout / 1000;
-                        if (aoe_disk_ptr->Timeout > 100000000)
-                          aoe_disk_ptr->Timeout = 100000000;
-                        Resends++;
-                      } else {
-                        ResendFails++;
-                        break;
-                      }
-                  }
-              } /* if tag ID == 0 */
-            tag = tag->next;
-            if (tag == AoeTagListFirst_) {
-                DBG("Taglist Cyclic!!\n");
-                break;
-              }
-          } /* while tag */
+        tag = AoeTimerHeapFirst_();
+        if (tag && tag->Timer.Deadline < WakeTime.QuadPart)
+          WakeTime.QuadPart = tag->Timer.Deadline;
+        if (
+            send_failed &&
+            CurrentTime.QuadPart + AOE_M_SEND_RETRY_ < WakeTime.QuadPart
+          )
+          WakeTime.QuadPart = CurrentTime.QuadPart + AOE_M_SEND_RETRY_;
+        if (HoldTime.QuadPart && HoldTime.QuadPart < WakeTime.QuadPart)
+          WakeTime = HoldTime;
+        /* Never ask for a relative or zero wait by accident. */
+        if (WakeTime.QuadPart <= 0)
+          WakeTime.QuadPart = 1;
         KeReleaseSpinLock(&AoeLock_, Irql);
       } /* while TRUE */
     DBG("Exit\n");
@@ -1375,6 +2716,18 @@ static UINT32 AoeDiskMaxXferLen_(IN WVL_SP_DISK_T disk) {
     return disk->SectorSize * aoe_disk->MaxSectorsPerPacket;
   }
 
+/* What the congestion window currently allows in flight. */
+static UINT32 AoeDiskMaxInFlightLen_(IN WVL_SP_DISK_T disk) {
+    AOE_SP_DISK aoe_disk = CONTAINING_RECORD(
+        disk,
+        AOE_S_DISK,
+        disk
+      );
+
+    return disk->SectorSize * aoe_disk->MaxSectorsPerPacket *
+      aoe_disk->Window;
+  }
+
 static NTSTATUS STDCALL AoeDiskPnpQueryId_(
     IN PDEVICE_OBJECT dev_obj,
     IN PIRP irp,
@@ -1515,6 +2868,13 @@ typedef struct AOE_ABFT AOE_S_ABFT, * AOE_SP_ABFT;
 #endif
 
 static VOID STDCALL AoeDiskClose_(IN WVL_SP_DISK_T disk_ptr) {
+    AOE_SP_DISK aoe_disk = CONTAINING_RECORD(disk_ptr, AOE_S_DISK, disk);
+
+    /* Any tags still being sent will free the pools when they're done. */
+    AoePoolClose_(aoe_disk->TagPool);
+    aoe_disk->TagPool = NULL;
+    AoePoolClose_(aoe_disk->RequestPool);
+    aoe_disk->RequestPool = NULL;
     return;
   }
 
@@ -1599,13 +2959,16 @@ static VOID AoeProcessAbft_(void) {
     aoe_disk->Major = AoEBootRecord.Major;
     aoe_disk->Minor = AoEBootRecord.Minor;
     aoe_disk->MaxSectorsPerPacket = 1;
-    aoe_disk->Timeout = 200000;          /* 20 ms. */
+    AoeRttInit(&aoe_disk->Rtt, 200000);  /* 20 ms. */
     aoe_disk->Boot = TRUE;
     if (!AoeDiskInit_(aoe_disk)) {
         DBG("Couldn't find AoE disk!\n");
         IoDeleteDevice(aoe_disk->Pdo);
         return;
       }
+    /* Keep writes in RAM, if asked to. */
+    if (WvlBootOverlayWanted())
+      WvlDiskOverlayCreate(aoe_disk->disk);
     AoeBusAddDev(aoe_disk);
     return;
 
@@ -1674,7 +3037,7 @@ NTSTATUS STDCALL AoeBusDevCtlScan(IN PIRP irp) {
   }
 
 NTSTATUS STDCALL AoeBusDevCtlShow(IN PIRP irp) {
-    UINT32 count;
+    UINT32 count, i;
     WVL_SP_BUS_NODE walker;
     AOE_SP_MOUNT_DISKS disks;
     wv_size_t size;
@@ -1696,6 +3059,7 @@ NTSTATUS STDCALL AoeBusDevCtlShow(IN PIRP irp) {
       }
     irp->IoStatus.Information = size;
     disks->Count = count;
+    disks->InFlight = AoePendingTags_;
 
     count = 0;
     walker = NULL;
@@ -1721,6 +3085,19 @@ NTSTATUS STDCALL AoeBusDevCtlShow(IN PIRP irp) {
         disks->Disk[count].Major = aoe_disk->Major;
         disks->Disk[count].Minor = aoe_disk->Minor;
         disks->Disk[count].LBASize = aoe_disk->disk->LBADiskSize;
+        disks->Disk[count].InFlight = aoe_disk->InFlight;
+        disks->Disk[count].Window = aoe_disk->Window;
+        disks->Disk[count].Paths = aoe_disk->PathCount;
+        disks->Disk[count].LivePaths = 0;
+        for (i = 0; i < aoe_disk->PathCount; i++) {
+            if (!aoe_disk->Paths[i].DeadTime.QuadPart)
+              disks->Disk[count].LivePaths++;
+          }
+        AoePoolGetStats_(aoe_disk->TagPool, &disks->Disk[count].TagPool);
+        AoePoolGetStats_(
+            aoe_disk->RequestPool,
+            &disks->Disk[count].RequestPool
+          );
         count++;
       }
     RtlCopyMemory(
@@ -1736,6 +3113,26 @@ NTSTATUS STDCALL AoeBusDevCtlShow(IN PIRP irp) {
     return WvlIrpComplete(irp, irp->IoStatus.Information, STATUS_SUCCESS);
   }
 
+NTSTATUS STDCALL AoeBusDevCtlStats(IN PIRP irp) {
+    AOE_S_STATS stats;
+    KIRQL irql;
+    ULONG size;
+    PIO_STACK_LOCATION io_stack_loc = IoGetCurrentIrpStackLocation(irp);
+
+    DBG("Got IOCTL_AOE_STATS...\n");
+
+    KeAcquireSpinLock(&AoeLock_, &irql);
+    stats = AoeStats_;
+    stats.InFlight = AoePendingTags_;
+    KeReleaseSpinLock(&AoeLock_, irql);
+
+    size = io_stack_loc->Parameters.DeviceIoControl.OutputBufferLength;
+    if (size > sizeof stats)
+      size = sizeof stats;
+    RtlCopyMemory(irp->AssociatedIrp.SystemBuffer, &stats, size);
+    return WvlIrpComplete(irp, size, STATUS_SUCCESS);
+  }
+
 NTSTATUS STDCALL AoeBusDevCtlMount(IN PIRP irp) {
     PUCHAR buffer = irp->AssociatedIrp.SystemBuffer;
     AOE_SP_DISK aoe_disk;
@@ -1766,7 +3163,7 @@ NTSTATUS STDCALL AoeBusDevCtlMount(IN PIRP irp) {
     aoe_disk->Major = *(PUINT16) (buffer + 6);
     aoe_disk->Minor = (UCHAR) buffer[8];
     aoe_disk->MaxSectorsPerPacket = 1;
-    aoe_disk->Timeout = 200000;             /* 20 ms. */
+    AoeRttInit(&aoe_disk->Rtt, 200000);     /* 20 ms. */
     aoe_disk->Boot = FALSE;
     if (!AoeDiskInit_(aoe_disk)) {
         DBG("Couldn't find AoE disk!\n");
@@ -1809,12 +3206,17 @@ static AOE_SP_DISK AoeDiskCreatePdo_(void) {
     aoe_disk->disk->Media = WvlDiskMediaTypeHard;
     aoe_disk->disk->disk_ops.Io = AoeDiskIo_;
     aoe_disk->disk->disk_ops.MaxXferLen = AoeDiskMaxXferLen_;
+    aoe_disk->disk->disk_ops.MaxInFlightLen = AoeDiskMaxInFlightLen_;
     aoe_disk->disk->disk_ops.Close = AoeDiskClose_;
     aoe_disk->disk->disk_ops.UnitNum = AoeDiskUnitNum_;
     aoe_disk->disk->disk_ops.PnpQueryId = AoeDiskPnpQueryId_;
     aoe_disk->disk->disk_ops.PnpQueryDevText = AoeDiskPnpQueryDevText_;
     aoe_disk->disk->ext = aoe_disk;
     aoe_disk->disk->DriverObj = AoeDriverObj_;
+    aoe_disk->disk->ReadAhead = TRUE;
+    aoe_disk->Window = AOE_M_WINDOW_INIT_;
+    aoe_disk->WindowThreshold = AOE_M_WINDOW_MAX_;
+    aoe_disk->WindowMax = AOE_M_WINDOW_MAX_;
 
     /* Set associations for the PDO, device, disk. */
     aoe_disk->Dev->IrpDispatch = AoeDiskIrpDispatch;
@@ -1876,6 +3278,7 @@ static NTSTATUS AoeDiskIrpDispatch(
               if (!aoe_disk->BusNode->Linked) {
                   /* Unlinked _and_ deleted */
                   DBG("Deleting AoE disk PDO: %p", dev_obj);
+                  WvlDiskOverlayFree(aoe_disk->disk);
                   IoDeleteDevice(dev_obj);
                 }
             }
@@ -1,6 +1,6 @@
 @echo off
 
-set c=driver.c bus.c protocol.c registry.c aoe.rc wv_stdlib.c wv_string.c
+set c=driver.c bus.c protocol.c registry.c tagtable.c rexmit.c merge.c aoe.rc wv_stdlib.c wv_string.c
 
 set name=AoE%bits%
 
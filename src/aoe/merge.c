@@ -0,0 +1,110 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * AoE frame merging.
+ */
+
+#include <stddef.h>
+
+#include "merge.h"
+
+/**
+ * Pick queued I/O to carry in a frame.
+ *
+ * @v frame             The frame so far.  Its sector count grows by the
+ *                      sectors picked.
+ * @v count             The number of I/Os the frame carries so far.
+ * @v queued            The I/O queued after the frame's, in order.
+ * @v queued_count      The number of queued I/Os, at most
+ *                      AOE_M_MERGE_SCAN.
+ * @v max_sectors       The most sectors the frame may carry.
+ * @v picks             Filled in with the positions in queued of the I/O
+ *                      picked, in the order their sectors follow on.
+ *                      Needs room for AOE_M_MERGE_MAX.
+ * @ret unsigned int    The number of I/Os picked.
+ *
+ * Queued I/O of the frame's kind is picked if its first sector is the
+ * frame's next one and it fits, in whatever order it was queued.
+ */
+unsigned int AoeMergePick(
+    AOE_SP_MERGE_IO frame,
+    unsigned int count,
+    const AOE_S_MERGE_IO * queued,
+    unsigned int queued_count,
+    unsigned int max_sectors,
+    unsigned int * picks
+  ) {
+    const AOE_S_MERGE_IO * io;
+    unsigned int picked = 0, i;
+    int merged = 1;
+
+    if (frame->Kind == AOE_M_MERGE_NONE)
+      return 0;
+    while (merged && frame->Sectors < max_sectors && count < AOE_M_MERGE_MAX) {
+        merged = 0;
+        for (i = 0; i < queued_count; i++) {
+            io = queued + i;
+            /* Picked I/O can't match again, since it has sectors. */
+            if (
+                io->Kind != frame->Kind ||
+                io->Sectors == 0 ||
+                io->Lba != frame->Lba + frame->Sectors ||
+                frame->Sectors + io->Sectors > max_sectors
+              )
+              continue;
+            picks[picked++] = i;
+            frame->Sectors += io->Sectors;
+            count++;
+            merged = 1;
+            break;
+          }
+      }
+    return picked;
+  }
+
+/**
+ * Decide whether to hold a frame back for more I/O to merge.
+ *
+ * @v frame             The frame, after merging.
+ * @v max_sectors       The most sectors the frame may carry.
+ * @v in_flight         The number of frames the disk has in flight.
+ * @v now               The time now.
+ * @v hold_until        When the frame's I/O was queued, plus the merge
+ *                      window.
+ * @ret int             1 to hold the frame, else 0.
+ *
+ * A frame which isn't full waits for the merge window, but only while
+ * the disk is busy anyway, so that lone I/O isn't delayed.
+ */
+int AoeMergeHold(
+    const AOE_S_MERGE_IO * frame,
+    unsigned int max_sectors,
+    unsigned int in_flight,
+    long long now,
+    long long hold_until
+  ) {
+    return
+      frame->Kind != AOE_M_MERGE_NONE &&
+      frame->Sectors < max_sectors &&
+      in_flight &&
+      now < hold_until;
+  }
@@ -51,6 +51,21 @@ extern NTSTATUS STDCALL aoe__reply (
   IN PUCHAR Data,
   IN UINT32 DataSize
  );
+extern VOID STDCALL aoe__send_complete (
+  IN PVOID PacketContext
+ );
+extern PVOID STDCALL aoe__reply_lookahead (
+  IN PUCHAR Data,
+  IN UINT32 DataSize,
+  IN UINT32 PacketSize,
+  OUT PUINT32 Offset,
+  OUT PUCHAR * Buffer,
+  OUT PUINT32 BufferSize
+ );
+extern VOID STDCALL aoe__reply_transferred (
+  IN PVOID Context,
+  IN BOOLEAN Success
+ );
 
 /** In this file */
 static VOID STDCALL Protocol_OpenAdapterComplete (
@@ -154,6 +169,11 @@ typedef struct _PROTOCOL_BINDINGCONTEXT
 } PROTOCOL_BINDINGCONTEXT,
 *PPROTOCOL_BINDINGCONTEXT;
 
+static NDIS_STATUS STDCALL Protocol_QueryMTU (
+  IN PPROTOCOL_BINDINGCONTEXT Context,
+  OUT PUINT32 MTU
+ );
+
 static KEVENT Protocol_Globals_StopEvent;
 static KSPIN_LOCK Protocol_Globals_SpinLock;
 static PPROTOCOL_BINDINGCONTEXT Protocol_Globals_BindingContextList = NULL;
@@ -332,7 +352,9 @@ Protocol_Send (
     }
 
   NdisChainBufferAtFront ( Packet, Buffer );
-  *(PVOID *) Packet->ProtocolReserved = PacketContext;
+  /* We own the copy, so Protocol_SendComplete frees it. */
+  ( ( PVOID * ) Packet->ProtocolReserved )[0] = NULL;
+  ( ( PVOID * ) Packet->ProtocolReserved )[1] = DataBuffer;
   NdisSend ( &Status, Context->BindingHandle, Packet );
   if ( Status != NDIS_STATUS_PENDING )
     Protocol_SendComplete ( Context, Packet, Status );
@@ -342,6 +364,120 @@ Protocol_Send (
   return TRUE;
 }
 
+/**
+ * Send a frame without copying it.
+ *
+ * @v SourceMac         The client NIC's MAC address.
+ * @v DestinationMac    The AoE server's MAC address.
+ * @v Data              The AoE header.  There must be PROTOCOL_M_HEADER_SIZE
+ *                      bytes of headroom before it for the Ethernet header.
+ * @v DataSize          The AoE header's size.
+ * @v Payload           Data to follow the header, or NULL.  This must be
+ *                      in non-paged or locked memory, and is chained to
+ *                      the header with its own NDIS buffer, not copied.
+ * @v PayloadSize       The payload's size.
+ * @v PacketContext     Passed to aoe__send_complete once NDIS is done with
+ *                      the frame.  Only then may the header or payload
+ *                      be reused.
+ * @ret BOOLEAN         FALSE if the frame couldn't be sent, in which case
+ *                      aoe__send_complete will not be called.
+ *
+ * Unlike Protocol_Send, this cannot broadcast to every NIC.
+ */
+BOOLEAN STDCALL
+Protocol_SendFrame (
+  IN PUCHAR SourceMac,
+  IN PUCHAR DestinationMac,
+  IN PUCHAR Data,
+  IN UINT32 DataSize,
+  IN PROTOCOL_SP_PAYLOAD Payload,
+  IN UINT32 PayloadCount,
+  IN PVOID PacketContext
+ )
+{
+  PPROTOCOL_BINDINGCONTEXT Context = Protocol_Globals_BindingContextList;
+  NDIS_STATUS Status;
+  PNDIS_PACKET Packet;
+  PNDIS_BUFFER Buffer;
+  PPROTOCOL_HEADER Header;
+  UINT32 Size = DataSize,
+    i;
+
+  while ( Context != NULL )
+    {
+      if (wv_memcmpeq(SourceMac, Context->Mac, 6)) break;
+      Context = Context->Next;
+    }
+  if ( Context == NULL )
+    {
+      DBG ( "Can't find NIC %02x:%02x:%02x:%02x:%02x:%02x\n", SourceMac[0],
+	    SourceMac[1], SourceMac[2], SourceMac[3], SourceMac[4],
+	    SourceMac[5] );
+      return FALSE;
+    }
+
+  for ( i = 0; i < PayloadCount; i++ )
+    Size += Payload[i].Size;
+  if ( Size > Context->MTU )
+    {
+      DBG ( "Tried to send oversized packet (size: %d, MTU: %d)\n",
+	    Size, Context->MTU );
+      return FALSE;
+    }
+
+  Header = ( PPROTOCOL_HEADER ) ( Data - sizeof ( PROTOCOL_HEADER ) );
+  RtlCopyMemory ( Header->SourceMac, SourceMac, 6 );
+  RtlCopyMemory ( Header->DestinationMac, DestinationMac, 6 );
+  Header->Protocol = htons ( AOEPROTOCOLID );
+
+  NdisAllocatePacket ( &Status, &Packet, Context->PacketPoolHandle );
+  if ( !NT_SUCCESS ( Status ) )
+    {
+      WvlError("Protocol_SendFrame NdisAllocatePacket", Status);
+      return FALSE;
+    }
+
+  NdisAllocateBuffer ( &Status, &Buffer, Context->BufferPoolHandle, Header,
+		       ( sizeof ( PROTOCOL_HEADER ) + DataSize ) );
+  if ( !NT_SUCCESS ( Status ) )
+    {
+      WvlError("Protocol_SendFrame NdisAllocateBuffer", Status);
+      NdisFreePacket ( Packet );
+      return FALSE;
+    }
+  NdisChainBufferAtFront ( Packet, Buffer );
+
+  /* Each piece of payload is sent from where it is */
+  for ( i = 0; i < PayloadCount; i++ )
+    {
+      if ( Payload[i].Size == 0 )
+	continue;
+      NdisAllocateBuffer ( &Status, &Buffer, Context->BufferPoolHandle,
+			   Payload[i].Data, Payload[i].Size );
+      if ( !NT_SUCCESS ( Status ) )
+	{
+	  WvlError("Protocol_SendFrame NdisAllocateBuffer (payload)", Status);
+	  NdisUnchainBufferAtFront ( Packet, &Buffer );
+	  while ( Buffer != NULL )
+	    {
+	      NdisFreeBuffer ( Buffer );
+	      NdisUnchainBufferAtFront ( Packet, &Buffer );
+	    }
+	  NdisFreePacket ( Packet );
+	  return FALSE;
+	}
+      NdisChainBufferAtBack ( Packet, Buffer );
+    }
+
+  /* The caller owns the frame; we only tell them when we're done. */
+  ( ( PVOID * ) Packet->ProtocolReserved )[0] = PacketContext;
+  ( ( PVOID * ) Packet->ProtocolReserved )[1] = NULL;
+  NdisSend ( &Status, Context->BindingHandle, Packet );
+  if ( Status != NDIS_STATUS_PENDING )
+    Protocol_SendComplete ( Context, Packet, Status );
+  return TRUE;
+}
+
 static VOID STDCALL
 Protocol_OpenAdapterComplete (
   IN NDIS_HANDLE ProtocolBindingContext,
@@ -375,24 +511,26 @@ Protocol_SendComplete (
  )
 {
   PNDIS_BUFFER Buffer;
-  PUCHAR DataBuffer;
+  PVOID PacketContext = ( ( PVOID * ) Packet->ProtocolReserved )[0];
+  PVOID DataBuffer = ( ( PVOID * ) Packet->ProtocolReserved )[1];
 #ifndef DEBUGALLPROTOCOLCALLS
   if ( !NT_SUCCESS ( Status ) && Status != NDIS_STATUS_NO_CABLE )
 #endif
     WvlError("Protocol_SendComplete", Status);
 
   NdisUnchainBufferAtFront ( Packet, &Buffer );
-  if ( Buffer != NULL )
+  if ( Buffer == NULL )
+    DBG ( "Buffer == NULL\n" );
+  while ( Buffer != NULL )
     {
-      DataBuffer = MmGetSystemAddressForMdlSafe ( Buffer, HighPagePriority );
-      wv_free(DataBuffer);
       NdisFreeBuffer ( Buffer );
-    }
-  else
-    {
-      DBG ( "Buffer == NULL\n" );
+      NdisUnchainBufferAtFront ( Packet, &Buffer );
     }
   NdisFreePacket ( Packet );
+  /* Free our copy, or hand the caller's frame back. */
+  wv_free(DataBuffer);
+  if ( PacketContext != NULL )
+    aoe__send_complete ( PacketContext );
 }
 
 static VOID STDCALL
@@ -407,12 +545,30 @@ Protocol_TransferDataComplete (
   PPROTOCOL_HEADER Header = NULL;
   PUCHAR Data = NULL;
   UINT32 HeaderSize,
-   DataSize;
+   DataSize = 0;
+  PVOID ReplyContext = ( ( PVOID * ) Packet->ProtocolReserved )[0];
 #ifndef DEBUGALLPROTOCOLCALLS
   if ( !NT_SUCCESS ( Status ) )
 #endif
     WvlError("Protocol_TransferDataComplete", Status);
 
+  /* Read data transferred straight into a request's buffer. */
+  if ( ReplyContext != NULL )
+    {
+      NdisUnchainBufferAtFront ( Packet, &Buffer );
+      if ( Buffer != NULL )
+	{
+	  NdisQueryBufferSafe ( Buffer, &Data, &DataSize, HighPagePriority );
+	  NdisFreeBuffer ( Buffer );
+	}
+      NdisFreePacket ( Packet );
+      aoe__reply_transferred ( ReplyContext, ( BOOLEAN ) (
+	  NT_SUCCESS ( Status ) && DataSize != 0 &&
+	  BytesTransferred == DataSize
+	) );
+      return;
+    }
+
   NdisUnchainBufferAtFront ( Packet, &Buffer );
   if ( Buffer != NULL )
     {
@@ -489,7 +645,10 @@ Protocol_Receive (
   PPROTOCOL_HEADER Header;
   PUCHAR HeaderCopy,
    Data;
-  UINT32 BytesTransferred;
+  UINT32 BytesTransferred,
+   Offset,
+   DataSize;
+  PVOID ReplyContext;
 #ifdef DEBUGALLPROTOCOLCALLS
   DBG ( "Entry\n" );
 #endif
@@ -510,6 +669,38 @@ Protocol_Receive (
       return NDIS_STATUS_SUCCESS;
     }
 
+  /* Transfer read data straight into the request's buffer, if we can. */
+  ReplyContext = aoe__reply_lookahead ( LookAheadBuffer, LookaheadBufferSize,
+					PacketSize, &Offset, &Data,
+					&DataSize );
+  if ( ReplyContext != NULL )
+    {
+      NdisAllocatePacket ( &Status, &Packet, Context->PacketPoolHandle );
+      if ( !NT_SUCCESS ( Status ) )
+	{
+	  WvlError("Protocol_Receive NdisAllocatePacket", Status);
+	  aoe__reply_transferred ( ReplyContext, FALSE );
+	  return NDIS_STATUS_NOT_ACCEPTED;
+	}
+      NdisAllocateBuffer ( &Status, &Buffer, Context->BufferPoolHandle, Data,
+			   DataSize );
+      if ( !NT_SUCCESS ( Status ) )
+	{
+	  WvlError("Protocol_Receive NdisAllocateBuffer (Request)", Status);
+	  NdisFreePacket ( Packet );
+	  aoe__reply_transferred ( ReplyContext, FALSE );
+	  return NDIS_STATUS_NOT_ACCEPTED;
+	}
+      NdisChainBufferAtFront ( Packet, Buffer );
+      ( ( PVOID * ) Packet->ProtocolReserved )[0] = ReplyContext;
+      NdisTransferData ( &Status, Context->BindingHandle, MacReceiveContext,
+			 Offset, DataSize, Packet, &BytesTransferred );
+      if ( Status != NDIS_STATUS_PENDING )
+	Protocol_TransferDataComplete ( ProtocolBindingContext, Packet, Status,
+					BytesTransferred );
+      return NDIS_STATUS_SUCCESS;
+    }
+
   if ((HeaderCopy = wv_malloc(HeaderBufferSize)) == NULL) {
       DBG("wv_malloc HeaderCopy\n");
       return NDIS_STATUS_NOT_ACCEPTED;
@@ -554,6 +745,7 @@ Protocol_Receive (
       return NDIS_STATUS_NOT_ACCEPTED;
     }
   NdisChainBufferAtBack ( Packet, Buffer );
+  ( ( PVOID * ) Packet->ProtocolReserved )[0] = NULL;
 
   NdisTransferData ( &Status, Context->BindingHandle, MacReceiveContext, 0,
 		     PacketSize, Packet, &BytesTransferred );
@@ -637,6 +829,7 @@ Protocol_BindAdapter (
       return;
     }
   Context->Next = NULL;
+  Context->MTU = 0;
   KeInitializeEvent ( &Context->Event, SynchronizationEvent, FALSE );
 
   NdisAllocatePacketPool(
@@ -751,19 +944,7 @@ Protocol_BindAdapter (
 	    Mac[3], Mac[4], Mac[5] );
     }
 
-  Request.RequestType = NdisRequestQueryInformation;
-  Request.DATA.QUERY_INFORMATION.Oid = OID_GEN_MAXIMUM_FRAME_SIZE;
-  Request.DATA.QUERY_INFORMATION.InformationBuffer = &MTU;
-  Request.DATA.QUERY_INFORMATION.InformationBufferLength = sizeof ( MTU );
-
-  KeResetEvent ( &Context->Event );
-  NdisRequest ( &Status, Context->BindingHandle, &Request );
-  if ( Status == NDIS_STATUS_PENDING )
-    {
-      KeWaitForSingleObject ( &Context->Event, Executive, KernelMode, FALSE,
-			      NULL );
-      Status = Context->Status;
-    }
+  Status = Protocol_QueryMTU ( Context, &MTU );
   if ( !NT_SUCCESS ( Status ) )
     {
       WvlError("Protocol_BindAdapter NdisRequest (MTU)", Status);
@@ -804,6 +985,9 @@ Protocol_BindAdapter (
     }
   KeReleaseSpinLock ( &Protocol_Globals_SpinLock, Irql );
 
+  /* The adapter might be back with a different MTU */
+  if ( Context->MTU != 0 )
+    aoe__mtu_changed ( Context->Mac, Context->MTU );
   aoe__reset_probe (  );
   *StatusOut = NDIS_STATUS_SUCCESS;
 #if defined(DEBUGMOSTPROTOCOLCALLS) || defined(DEBUGALLPROTOCOLCALLS)
@@ -863,12 +1047,40 @@ Protocol_UnbindAdapter (
 #endif
 }
 
+static NDIS_STATUS STDCALL
+Protocol_QueryMTU (
+  IN PPROTOCOL_BINDINGCONTEXT Context,
+  OUT PUINT32 MTU
+ )
+{
+  NDIS_STATUS Status;
+  NDIS_REQUEST Request;
+
+  Request.RequestType = NdisRequestQueryInformation;
+  Request.DATA.QUERY_INFORMATION.Oid = OID_GEN_MAXIMUM_FRAME_SIZE;
+  Request.DATA.QUERY_INFORMATION.InformationBuffer = MTU;
+  Request.DATA.QUERY_INFORMATION.InformationBufferLength = sizeof ( *MTU );
+
+  KeResetEvent ( &Context->Event );
+  NdisRequest ( &Status, Context->BindingHandle, &Request );
+  if ( Status == NDIS_STATUS_PENDING )
+    {
+      KeWaitForSingleObject ( &Context->Event, Executive, KernelMode, FALSE,
+			      NULL );
+      Status = Context->Status;
+    }
+  return Status;
+}
+
 static NDIS_STATUS STDCALL
 Protocol_PnPEvent (
   IN NDIS_HANDLE ProtocolBindingContext,
   IN PNET_PNP_EVENT NetPnPEvent
  )
 {
+  PPROTOCOL_BINDINGCONTEXT Context;
+  UINT32 MTU;
+
 #if defined(DEBUGMOSTPROTOCOLCALLS) || defined(DEBUGALLPROTOCOLCALLS)
   DBG ( "%s\n", Protocol_NetEventString ( NetPnPEvent->NetEvent ) );
 #endif
@@ -881,6 +1093,19 @@ Protocol_PnPEvent (
       DBG ( "No vector to NdisReEnumerateProtocolBindings\n" );
 #endif
     }
+  if ( ProtocolBindingContext != NULL
+       && NetPnPEvent->NetEvent == NetEventReconfigure )
+    {
+      /* The adapter's MTU might have changed */
+      Context = ( PPROTOCOL_BINDINGCONTEXT ) ProtocolBindingContext;
+      if ( NT_SUCCESS ( Protocol_QueryMTU ( Context, &MTU ) )
+	   && MTU != Context->MTU )
+	{
+	  DBG ( "MTU: %d -> %d\n", Context->MTU, MTU );
+	  Context->MTU = MTU;
+	  aoe__mtu_changed ( Context->Mac, MTU );
+	}
+    }
   if ( NetPnPEvent->NetEvent == NetEventQueryRemoveDevice )
     {
       return NDIS_STATUS_FAILURE;
@@ -0,0 +1,222 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * AoE retransmit timing.
+ */
+
+#include <stddef.h>
+
+#include "rexmit.h"
+
+/**
+ * Start a round-trip time estimate with no samples.
+ *
+ * @v rtt               The estimate to start.
+ * @v rto               The retransmit timeout to use until the first
+ *                      sample.
+ */
+void AoeRttInit(AOE_SP_RTT rtt, long long rto) {
+    rtt->Srtt = 0;
+    rtt->RttVar = 0;
+    rtt->Rto = rto;
+  }
+
+/**
+ * Fold a round-trip time sample into an estimate.
+ *
+ * @v rtt               The estimate.
+ * @v resent            Whether the tag which was replied to was resent.
+ * @v sample            The round-trip time since the tag was first sent.
+ * @ret int             1 if the sample was taken, else 0.
+ *
+ * This is the Jacobson/Karels estimator: the timeout is the smoothed
+ * RTT plus four times its mean deviation.  Samples from resent tags are
+ * not taken (Karn's rule), since a reply to a resent tag could be for
+ * any of its sends.
+ */
+int AoeRttSample(AOE_SP_RTT rtt, int resent, long long sample) {
+    long long err, rto;
+
+    if (resent)
+      return 0;
+    if (sample < 0)
+      sample = 0;
+    if (rtt->Srtt == 0 && rtt->RttVar == 0) {
+        /* First sample. */
+        rtt->Srtt = sample;
+        rtt->RttVar = sample / 2;
+      } else {
+        err = sample - rtt->Srtt;
+        rtt->Srtt += err / 8;
+        if (err < 0)
+          err = -err;
+        rtt->RttVar += (err - rtt->RttVar) / 4;
+      }
+    rto = rtt->Srtt + 4 * rtt->RttVar;
+    if (rto < AOE_M_RTO_MIN)
+      rto = AOE_M_RTO_MIN;
+    if (rto > AOE_M_RTO_MAX)
+      rto = AOE_M_RTO_MAX;
+    rtt->Rto = rto;
+    return 1;
+  }
+
+/**
+ * Back a tag's retransmit timeout off after it timed out.
+ *
+ * @v rtt               The estimate the tag's timeout came from.
+ * @v rto               The timeout which expired.
+ * @ret long long       The timeout for the resend.
+ *
+ * The backed-off timeout is kept for newly-sent tags, too, until a
+ * sample is taken.  Otherwise, once the round-trip time grows past the
+ * timeout, every tag would be resent and, by Karn's rule, no sample
+ * would ever be taken to raise the timeout.
+ */
+long long AoeRttBackoff(AOE_SP_RTT rtt, long long rto) {
+    rto *= 2;
+    if (rto > AOE_M_RTO_MAX)
+      rto = AOE_M_RTO_MAX;
+    if (rtt->Rto < rto)
+      rtt->Rto = rto;
+    return rto;
+  }
+
+/**
+ * Place a timer at a position in a heap.
+ *
+ * @v heap              The heap.
+ * @v i                 The heap position.
+ * @v timer             The timer to place there.
+ */
+static void AoeTimerHeapSet_(
+    AOE_SP_TIMER_HEAP heap,
+    unsigned int i,
+    AOE_SP_TIMER timer
+  ) {
+    heap->Timers[i] = timer;
+    timer->HeapIndex = i;
+  }
+
+/**
+ * Move a heap entry towards the root until its parent is due sooner.
+ *
+ * @v heap              The heap.
+ * @v i                 The heap position of the entry.
+ */
+static void AoeTimerHeapSiftUp_(AOE_SP_TIMER_HEAP heap, unsigned int i) {
+    AOE_SP_TIMER timer = heap->Timers[i];
+    unsigned int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (heap->Timers[parent]->Deadline <= timer->Deadline)
+          break;
+        AoeTimerHeapSet_(heap, i, heap->Timers[parent]);
+        i = parent;
+      }
+    AoeTimerHeapSet_(heap, i, timer);
+  }
+
+/**
+ * Move a heap entry away from the root until its children are due later.
+ *
+ * @v heap              The heap.
+ * @v i                 The heap position of the entry.
+ */
+static void AoeTimerHeapSiftDown_(AOE_SP_TIMER_HEAP heap, unsigned int i) {
+    AOE_SP_TIMER timer = heap->Timers[i];
+    unsigned int child;
+
+    while ((child = i * 2 + 1) < heap->Count) {
+        if (
+            child + 1 < heap->Count &&
+            heap->Timers[child + 1]->Deadline < heap->Timers[child]->Deadline
+          )
+          child++;
+        if (timer->Deadline <= heap->Timers[child]->Deadline)
+          break;
+        AoeTimerHeapSet_(heap, i, heap->Timers[child]);
+        i = child;
+      }
+    AoeTimerHeapSet_(heap, i, timer);
+  }
+
+/**
+ * Add a timer to a heap.
+ *
+ * @v heap              The heap.  It must have room for the timer.
+ * @v timer             The timer to add.  Its deadline must be set.
+ */
+void AoeTimerHeapPush(AOE_SP_TIMER_HEAP heap, AOE_SP_TIMER timer) {
+    AoeTimerHeapSet_(heap, heap->Count++, timer);
+    AoeTimerHeapSiftUp_(heap, timer->HeapIndex);
+  }
+
+/**
+ * Remove a timer from a heap.
+ *
+ * @v heap              The heap.
+ * @v timer             The timer to remove.
+ */
+void AoeTimerHeapRemove(AOE_SP_TIMER_HEAP heap, AOE_SP_TIMER timer) {
+    AOE_SP_TIMER last = heap->Timers[--heap->Count];
+
+    /* Fill the timer's slot with the last entry and restore order. */
+    if (last != timer) {
+        AoeTimerHeapSet_(heap, timer->HeapIndex, last);
+        AoeTimerHeapChanged(heap, last);
+      }
+  }
+
+/**
+ * Restore a heap's order after a timer's deadline has changed.
+ *
+ * @v heap              The heap.
+ * @v timer             The timer whose deadline changed.
+ */
+void AoeTimerHeapChanged(AOE_SP_TIMER_HEAP heap, AOE_SP_TIMER timer) {
+    AoeTimerHeapSiftUp_(heap, timer->HeapIndex);
+    AoeTimerHeapSiftDown_(heap, timer->HeapIndex);
+  }
+
+/**
+ * Restore a heap's order after many timers' deadlines have changed.
+ *
+ * @v heap              The heap.
+ */
+void AoeTimerHeapRebuild(AOE_SP_TIMER_HEAP heap) {
+    unsigned int i;
+
+    for (i = heap->Count / 2; i-- > 0; )
+      AoeTimerHeapSiftDown_(heap, i);
+  }
+
+/**
+ * Find the timer which is due soonest.
+ *
+ * @v heap              The heap.
+ * @ret timer           The timer, or NULL if the heap is empty.
+ */
+AOE_SP_TIMER AoeTimerHeapFirst(AOE_SP_TIMER_HEAP heap) {
+    return heap->Count ? heap->Timers[0] : NULL;
+  }
@@ -0,0 +1,99 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * AoE tag table.
+ */
+
+#include <stddef.h>
+
+#include "tagtable.h"
+
+/**
+ * Empty a tag table.
+ *
+ * @v table             The tag table to empty.
+ */
+void AoeTagTableInit(AOE_SP_TAG_TABLE table) {
+    unsigned int i;
+
+    for (i = 0; i < AOE_M_TAG_TABLE_SIZE; i++)
+      table->Buckets[i] = NULL;
+  }
+
+/**
+ * Add an entry to a tag table.
+ *
+ * @v table             The tag table to add to.
+ * @v entry             The entry to add.  Its ID and address must already
+ *                      be assigned.
+ */
+void AoeTagTableInsert(AOE_SP_TAG_TABLE table, AOE_SP_TAG_ENTRY entry) {
+    AOE_SP_TAG_ENTRY * bucket = table->Buckets + AOE_M_TAG_BUCKET(entry->Id);
+
+    entry->HashNext = *bucket;
+    *bucket = entry;
+  }
+
+/**
+ * Find an entry in a tag table.
+ *
+ * @v table             The tag table to search.
+ * @v id                The tag ID from the AoE reply.
+ * @v major             The major address from the AoE reply (network order).
+ * @v minor             The minor address from the AoE reply.
+ * @ret entry           The matching entry, or NULL if none was found.
+ */
+AOE_SP_TAG_ENTRY AoeTagTableFind(
+    AOE_SP_TAG_TABLE table,
+    unsigned int id,
+    unsigned short major,
+    unsigned char minor
+  ) {
+    AOE_SP_TAG_ENTRY entry = table->Buckets[AOE_M_TAG_BUCKET(id)];
+
+    while (entry != NULL) {
+        if (entry->Id == id && entry->Major == major && entry->Minor == minor)
+          break;
+        entry = entry->HashNext;
+      }
+    return entry;
+  }
+
+/**
+ * Remove an entry from a tag table.
+ *
+ * @v table             The tag table to remove from.
+ * @v entry             The entry to remove.
+ * @ret int             0 if the entry wasn't in its bucket, else 1.
+ */
+int AoeTagTableRemove(AOE_SP_TAG_TABLE table, AOE_SP_TAG_ENTRY entry) {
+    AOE_SP_TAG_ENTRY * link = table->Buckets + AOE_M_TAG_BUCKET(entry->Id);
+
+    while (*link != entry) {
+        if (*link == NULL)
+          return 0;
+        link = &(*link)->HashNext;
+      }
+    *link = entry->HashNext;
+    entry->HashNext = NULL;
+    return 1;
+  }
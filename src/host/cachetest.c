@@ -0,0 +1,522 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk cache map tests.
+ *
+ * Runs the map against a cache file in memory and a made-up image.
+ * Checks that a read is split into runs of cached and uncached blocks,
+ * that only uncached runs are fetched, as whole blocks and no more than
+ * the bounce buffer holds, and that they're fetched straight into the
+ * caller's buffer unless the read only covers part of them.  Checks that
+ * only blocks which were written are marked, that the bitmap is written
+ * back after the blocks are made durable, and that a file whose header
+ * doesn't match is started over with the header written last.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cachemap.h"
+#include "host.h"
+
+#define CACHE_TEST_M_BLOCK_ HTTPDISK_M_CACHE_BLOCK
+/* Not a whole number of blocks. */
+#define CACHE_TEST_M_IMAGE_ (CACHE_TEST_M_BLOCK_ * 40LL + 1000)
+#define CACHE_TEST_M_BOUNCE_ 4
+#define CACHE_TEST_M_OPS_ 64
+#define CACHE_TEST_M_FETCHES_ 16
+#define CACHE_TEST_M_ROUNDS_ 2000
+
+/* The error the test's routines report. */
+#define CACHE_TEST_E_IO_ (-100)
+
+/** A cache file in memory, and a log of what was done with it. */
+typedef struct CACHE_TEST_FILE_ {
+    unsigned char * Data;
+    long long Size;
+    /* Writes left before they start failing, or -1 for no limit. */
+    long WritesLeft;
+    /* Non-zero to fail reads. */
+    int ReadsFail;
+    /* 'R'ead, 'W'rite, 'S'ync and 'T'runcate, in order. */
+    char Ops[CACHE_TEST_M_OPS_ + 1];
+    unsigned int OpCount;
+    long long LastWrite;
+  } CACHE_TEST_S_FILE_;
+
+/** A fetch from the server. */
+typedef struct CACHE_TEST_FETCH_ {
+    long long Offset;
+    unsigned int Length;
+    void * Buffer;
+  } CACHE_TEST_S_FETCH_;
+
+static CACHE_TEST_S_FILE_ CacheTestFile_;
+static CACHE_TEST_S_FETCH_ CacheTestFetches_[CACHE_TEST_M_FETCHES_];
+static unsigned int CacheTestFetchCount_;
+static int CacheTestFetchFails_;
+
+/* A byte of the made-up image. */
+static unsigned char CacheTestByte_(long long offset) {
+    return (unsigned char) (offset ^ (offset >> 8) ^ (offset >> 16));
+  }
+
+static void CacheTestOp_(char op) {
+    if (CacheTestFile_.OpCount < CACHE_TEST_M_OPS_)
+      CacheTestFile_.Ops[CacheTestFile_.OpCount++] = op;
+    CacheTestFile_.Ops[CacheTestFile_.OpCount] = '\0';
+  }
+
+static void CacheTestLogReset_(void) {
+    CacheTestFile_.OpCount = 0;
+    CacheTestFile_.Ops[0] = '\0';
+    CacheTestFetchCount_ = 0;
+  }
+
+static long CacheTestRw_(
+    void * context,
+    int write,
+    long long offset,
+    unsigned int length,
+    void * buffer
+  ) {
+    CACHE_TEST_S_FILE_ * file = context;
+    unsigned char * data;
+
+    CacheTestOp_(write ? 'W' : 'R');
+    if (!write) {
+        if (
+            file->ReadsFail ||
+            offset > file->Size ||
+            length > file->Size - offset
+          )
+          return CACHE_TEST_E_IO_;
+        memcpy(buffer, file->Data + offset, length);
+        return 0;
+      }
+    if (!file->WritesLeft)
+      return CACHE_TEST_E_IO_;
+    if (file->WritesLeft > 0)
+      file->WritesLeft--;
+    if (offset + length > file->Size) {
+        data = realloc(file->Data, (size_t) (offset + length));
+        if (!data)
+          return CACHE_TEST_E_IO_;
+        memset(data + file->Size, 0, (size_t) (offset + length - file->Size));
+        file->Data = data;
+        file->Size = offset + length;
+      }
+    memcpy(file->Data + offset, buffer, length);
+    file->LastWrite = offset;
+    return 0;
+  }
+
+static long CacheTestSync_(void * context) {
+    (void) context;
+    CacheTestOp_('S');
+    return 0;
+  }
+
+static long CacheTestTruncate_(void * context, long long size) {
+    CACHE_TEST_S_FILE_ * file = context;
+
+    CacheTestOp_('T');
+    if (size < file->Size)
+      file->Size = size;
+    return 0;
+  }
+
+static long CacheTestFetch_(
+    void * context,
+    long long offset,
+    unsigned int length,
+    void * buffer
+  ) {
+    unsigned char * bytes = buffer;
+    unsigned int i;
+
+    (void) context;
+    if (CacheTestFetchCount_ < CACHE_TEST_M_FETCHES_) {
+        CacheTestFetches_[CacheTestFetchCount_].Offset = offset;
+        CacheTestFetches_[CacheTestFetchCount_].Length = length;
+        CacheTestFetches_[CacheTestFetchCount_].Buffer = buffer;
+      }
+    CacheTestFetchCount_++;
+    if (
+        CacheTestFetchFails_ ||
+        offset < 0 ||
+        offset + length > CACHE_TEST_M_IMAGE_
+      )
+      return CACHE_TEST_E_IO_;
+    for (i = 0; i < length; i++)
+      bytes[i] = CacheTestByte_(offset + i);
+    return 0;
+  }
+
+/* Set up a map over the test's file, with its buffers. */
+static void CacheTestMap_(HTTPDISK_SP_CACHE_MAP map) {
+    HttpdiskCacheMapInit(
+        map,
+        CACHE_TEST_M_IMAGE_,
+        CACHE_TEST_M_BOUNCE_,
+        &CacheTestFile_,
+        CacheTestRw_,
+        CacheTestSync_,
+        CacheTestTruncate_,
+        CacheTestFetch_
+      );
+    map->Bitmap = malloc(map->BitmapSize);
+    map->Bounce = malloc((size_t) map->BounceBlocks * map->BlockSize);
+    HOST_CHECK(map->Bitmap && map->Bounce);
+  }
+
+static void CacheTestUnmap_(HTTPDISK_SP_CACHE_MAP map) {
+    free(map->Bitmap);
+    free(map->Bounce);
+  }
+
+/* Open the test's file with a validator, as a disk would. */
+static long CacheTestLoad_(HTTPDISK_SP_CACHE_MAP map, const char * validator) {
+    static union {
+        HTTPDISK_S_CACHE_HEADER Header;
+        char Page[HTTPDISK_M_CACHE_PAGE];
+      } expected, scratch;
+    long status;
+
+    CacheTestMap_(map);
+    HttpdiskCacheMapHeader(
+        map,
+        validator,
+        "example.com",
+        "/disk.img",
+        &expected.Header
+      );
+    CacheTestLogReset_();
+    status = HttpdiskCacheMapLoad(map, &expected.Header, &scratch.Header);
+    if (status == 0) {
+        HOST_CHECK(!strcmp(CacheTestFile_.Ops, "RWSTW"));
+        HOST_CHECK(CacheTestFile_.LastWrite == 0);
+        HOST_CHECK(CacheTestFile_.Size == map->DataOffset);
+        HOST_CHECK(
+            !memcmp(CacheTestFile_.Data, expected.Page, sizeof expected.Page)
+          );
+      }
+    return status;
+  }
+
+static int CacheTestCached_(HTTPDISK_SP_CACHE_MAP map, unsigned int block) {
+    return (map->Bitmap[block / 8] >> (block % 8)) & 1;
+  }
+
+/* Read from the map and check what was read against the image. */
+static long CacheTestRead_(
+    HTTPDISK_SP_CACHE_MAP map,
+    long long offset,
+    unsigned int length,
+    unsigned char * buf
+  ) {
+    unsigned int i;
+    long status;
+
+    memset(buf, 0xCC, length);
+    status = HttpdiskCacheMapRead(map, offset, length, buf);
+    if (status < 0)
+      return status;
+    for (i = 0; i < length; i++) {
+        if (buf[i] != CacheTestByte_(offset + i)) {
+            HOST_CHECK(buf[i] == CacheTestByte_(offset + i));
+            break;
+          }
+      }
+    return status;
+  }
+
+static void CacheTestCheckFetch_(
+    unsigned int i,
+    unsigned int first,
+    unsigned int blocks,
+    void * buffer
+  ) {
+    long long end = (long long) (first + blocks) * CACHE_TEST_M_BLOCK_;
+
+    if (end > CACHE_TEST_M_IMAGE_)
+      end = CACHE_TEST_M_IMAGE_;
+    HOST_CHECK(
+        CacheTestFetches_[i].Offset ==
+          (long long) first * CACHE_TEST_M_BLOCK_
+      );
+    HOST_CHECK(
+        CacheTestFetches_[i].Length == end - CacheTestFetches_[i].Offset
+      );
+    HOST_CHECK(CacheTestFetches_[i].Buffer == buffer);
+  }
+
+/* A new file is started over, and kept only while its header matches. */
+static void CacheTestHeader_(void) {
+    HTTPDISK_S_CACHE_MAP map;
+    unsigned int block = CACHE_TEST_M_BLOCK_;
+    unsigned char * buf = malloc(block * 3);
+    unsigned int i;
+
+    HOST_CHECK(buf != NULL);
+    HOST_CHECK(CacheTestLoad_(&map, "\"v1\"") == 0);
+    HOST_CHECK(map.BlocksCached == 0);
+    HOST_CHECK(map.DataOffset % HTTPDISK_M_CACHE_PAGE == 0);
+    HOST_CHECK(map.Blocks == 41);
+    HOST_CHECK(CacheTestRead_(&map, block, 3 * block, buf) == 0);
+    HOST_CHECK(map.BlocksCached == 3);
+
+    /* Nothing is written back before a flush. */
+    CacheTestUnmap_(&map);
+    HOST_CHECK(CacheTestLoad_(&map, "\"v1\"") == 1);
+    HOST_CHECK(map.BlocksCached == 0);
+    HOST_CHECK(CacheTestRead_(&map, block, 3 * block, buf) == 0);
+    CacheTestLogReset_();
+    HOST_CHECK(HttpdiskCacheMapFlush(&map) == 0);
+    HOST_CHECK(!strcmp(CacheTestFile_.Ops, "SW"));
+    HOST_CHECK(CacheTestFile_.LastWrite == HTTPDISK_M_CACHE_PAGE);
+    HOST_CHECK(map.DirtyStart >= map.DirtyEnd);
+    /* A flush with nothing new does nothing. */
+    CacheTestLogReset_();
+    HOST_CHECK(HttpdiskCacheMapFlush(&map) == 0);
+    HOST_CHECK(CacheTestFile_.OpCount == 0);
+
+    /* The same header keeps what was cached. */
+    CacheTestUnmap_(&map);
+    HOST_CHECK(CacheTestLoad_(&map, "\"v1\"") == 1);
+    HOST_CHECK(map.BlocksCached == 3);
+    for (i = 1; i <= 3; i++)
+      HOST_CHECK(CacheTestCached_(&map, i));
+    CacheTestLogReset_();
+    HOST_CHECK(CacheTestRead_(&map, block, 3 * block, buf) == 0);
+    HOST_CHECK(CacheTestFetchCount_ == 0);
+
+    /* A changed image starts over, and the old blocks are released. */
+    CacheTestUnmap_(&map);
+    HOST_CHECK(CacheTestLoad_(&map, "\"v2\"") == 0);
+    HOST_CHECK(map.BlocksCached == 0);
+    for (i = 0; i < map.BitmapSize; i++) {
+        if (map.Bitmap[i])
+          break;
+      }
+    HOST_CHECK(i == map.BitmapSize);
+
+    /* Without a validator, the file is never kept. */
+    CacheTestUnmap_(&map);
+    HOST_CHECK(CacheTestLoad_(&map, "") == 0);
+    HOST_CHECK(CacheTestRead_(&map, 0, CACHE_TEST_M_BLOCK_, buf) == 0);
+    HOST_CHECK(HttpdiskCacheMapFlush(&map) == 0);
+    CacheTestUnmap_(&map);
+    HOST_CHECK(CacheTestLoad_(&map, "") == 0);
+    HOST_CHECK(map.BlocksCached == 0);
+
+    /* A failed start-over is reported. */
+    CacheTestUnmap_(&map);
+    CacheTestFile_.WritesLeft = 0;
+    HOST_CHECK(CacheTestLoad_(&map, "\"v3\"") == CACHE_TEST_E_IO_);
+    CacheTestFile_.WritesLeft = -1;
+
+    CacheTestUnmap_(&map);
+    free(buf);
+  }
+
+/* Reads are split into runs, and fetched whole blocks are kept. */
+static void CacheTestRuns_(void) {
+    HTTPDISK_S_CACHE_MAP map;
+    unsigned char * buf = malloc(CACHE_TEST_M_BLOCK_ * 20);
+    long long offset;
+    unsigned int i;
+
+    HOST_CHECK(buf != NULL);
+    HOST_CHECK(CacheTestLoad_(&map, "\"runs\"") == 0);
+
+    /* Whole blocks go straight into the buffer. */
+    CacheTestLogReset_();
+    HOST_CHECK(
+        CacheTestRead_(
+            &map,
+            2 * CACHE_TEST_M_BLOCK_,
+            2 * CACHE_TEST_M_BLOCK_,
+            buf
+          ) == 0
+      );
+    HOST_CHECK(CacheTestFetchCount_ == 1);
+    CacheTestCheckFetch_(0, 2, 2, buf);
+    HOST_CHECK(
+        CacheTestRead_(
+            &map,
+            6 * CACHE_TEST_M_BLOCK_,
+            CACHE_TEST_M_BLOCK_,
+            buf
+          ) == 0
+      );
+    HOST_CHECK(map.BlocksCached == 3);
+    HOST_CHECK(map.DirtyStart == 0 && map.DirtyEnd == 1);
+
+    /*
+     * Half of block 1 to half of block 8: 1 and 7-8 are fetched through
+     * the bounce buffer, 4-5 straight, and 2-3 and 6 come from the file.
+     */
+    offset = CACHE_TEST_M_BLOCK_ + CACHE_TEST_M_BLOCK_ / 2;
+    CacheTestLogReset_();
+    HOST_CHECK(
+        CacheTestRead_(&map, offset, 7 * CACHE_TEST_M_BLOCK_, buf) == 0
+      );
+    HOST_CHECK(CacheTestFetchCount_ == 3);
+    CacheTestCheckFetch_(0, 1, 1, map.Bounce);
+    CacheTestCheckFetch_(
+        1,
+        4,
+        2,
+        buf + (4 * CACHE_TEST_M_BLOCK_ - offset)
+      );
+    CacheTestCheckFetch_(2, 7, 2, map.Bounce);
+    HOST_CHECK(!strcmp(CacheTestFile_.Ops, "WRWRW"));
+    for (i = 0; i < 10; i++)
+      HOST_CHECK(CacheTestCached_(&map, i) == (i >= 1 && i <= 8));
+    HOST_CHECK(map.BlocksCached == 8);
+
+    /* A long uncached run is fetched in bounce-sized pieces. */
+    offset = 10 * CACHE_TEST_M_BLOCK_;
+    CacheTestLogReset_();
+    HOST_CHECK(
+        CacheTestRead_(&map, offset, 10 * CACHE_TEST_M_BLOCK_ - 1, buf) == 0
+      );
+    HOST_CHECK(CacheTestFetchCount_ == 3);
+    CacheTestCheckFetch_(0, 10, 4, buf);
+    CacheTestCheckFetch_(1, 14, 4, buf + 4 * CACHE_TEST_M_BLOCK_);
+    CacheTestCheckFetch_(2, 18, 2, map.Bounce);
+    HOST_CHECK(map.DirtyEnd == 3);
+
+    /* The partial last block. */
+    offset = CACHE_TEST_M_IMAGE_ - 100;
+    CacheTestLogReset_();
+    HOST_CHECK(CacheTestRead_(&map, offset, 100, buf) == 0);
+    HOST_CHECK(CacheTestFetchCount_ == 1);
+    CacheTestCheckFetch_(0, 40, 1, map.Bounce);
+    HOST_CHECK(CacheTestCached_(&map, 40));
+    HOST_CHECK(map.DirtyEnd == map.Blocks / 8 + 1);
+    CacheTestLogReset_();
+    HOST_CHECK(CacheTestRead_(&map, offset - 900, 1000, buf) == 0);
+    HOST_CHECK(CacheTestFetchCount_ == 0);
+
+    /* Flushed bitmaps match. */
+    HOST_CHECK(HttpdiskCacheMapFlush(&map) == 0);
+    HOST_CHECK(
+        !memcmp(
+            CacheTestFile_.Data + HTTPDISK_M_CACHE_PAGE,
+            map.Bitmap,
+            map.BitmapSize
+          )
+      );
+
+    CacheTestUnmap_(&map);
+    free(buf);
+  }
+
+/* Failures of the file or the server. */
+static void CacheTestFailures_(void) {
+    HTTPDISK_S_CACHE_MAP map;
+    unsigned char * buf = malloc(CACHE_TEST_M_BLOCK_ * 2);
+    long long offset = 3 * CACHE_TEST_M_BLOCK_;
+
+    HOST_CHECK(buf != NULL);
+    HOST_CHECK(CacheTestLoad_(&map, "\"fail\"") == 0);
+
+    /* A block which can't be written is read, but not marked. */
+    CacheTestFile_.WritesLeft = 0;
+    HOST_CHECK(CacheTestRead_(&map, offset, CACHE_TEST_M_BLOCK_, buf) == 0);
+    HOST_CHECK(!CacheTestCached_(&map, 3));
+    HOST_CHECK(map.BlocksCached == 0);
+    HOST_CHECK(map.DirtyStart >= map.DirtyEnd);
+    CacheTestFile_.WritesLeft = -1;
+
+    /* A cached block which can't be read is fetched instead. */
+    HOST_CHECK(CacheTestRead_(&map, offset, CACHE_TEST_M_BLOCK_, buf) == 0);
+    HOST_CHECK(CacheTestCached_(&map, 3));
+    CacheTestFile_.ReadsFail = 1;
+    CacheTestLogReset_();
+    HOST_CHECK(CacheTestRead_(&map, offset + 10, 100, buf) == 0);
+    HOST_CHECK(CacheTestFetchCount_ == 1);
+    CacheTestCheckFetch_(0, 3, 1, map.Bounce);
+    /* And isn't written again. */
+    HOST_CHECK(!strcmp(CacheTestFile_.Ops, "R"));
+    CacheTestFile_.ReadsFail = 0;
+
+    /* A failed fetch is reported, and nothing is marked. */
+    CacheTestFetchFails_ = 1;
+    HOST_CHECK(
+        HttpdiskCacheMapRead(
+            &map,
+            offset + CACHE_TEST_M_BLOCK_,
+            CACHE_TEST_M_BLOCK_,
+            buf
+          ) ==
+          CACHE_TEST_E_IO_
+      );
+    HOST_CHECK(!CacheTestCached_(&map, 4));
+    CacheTestFetchFails_ = 0;
+
+    CacheTestUnmap_(&map);
+    free(buf);
+  }
+
+/* Random reads, flushes and reopens against the image. */
+static void CacheTestRandom_(void) {
+    HTTPDISK_S_CACHE_MAP map;
+    unsigned int max = CACHE_TEST_M_BLOCK_ * 6;
+    unsigned char * buf = malloc(max);
+    unsigned long long cached;
+    unsigned int i, length;
+    long long offset;
+
+    HOST_CHECK(buf != NULL);
+    HostSeed(24);
+    HOST_CHECK(CacheTestLoad_(&map, "\"random\"") == 0);
+    for (i = 0; i < CACHE_TEST_M_ROUNDS_; i++) {
+        offset = HostRand() % CACHE_TEST_M_IMAGE_;
+        length = 1 + HostRand() % max;
+        if (length > CACHE_TEST_M_IMAGE_ - offset)
+          length = (unsigned int) (CACHE_TEST_M_IMAGE_ - offset);
+        HOST_CHECK(CacheTestRead_(&map, offset, length, buf) == 0);
+        if (HostRand() % 50 == 0) {
+            HOST_CHECK(HttpdiskCacheMapFlush(&map) == 0);
+            cached = map.BlocksCached;
+            CacheTestUnmap_(&map);
+            HOST_CHECK(CacheTestLoad_(&map, "\"random\"") == 1);
+            HOST_CHECK(map.BlocksCached == cached);
+          }
+      }
+    HOST_CHECK(map.Hits + map.Misses > 0);
+    CacheTestUnmap_(&map);
+    free(buf);
+  }
+
+int main(void) {
+    CacheTestFile_.WritesLeft = -1;
+    CacheTestHeader_();
+    CacheTestRuns_();
+    CacheTestFailures_();
+    CacheTestRandom_();
+    free(CacheTestFile_.Data);
+    return HostDone("cachetest");
+  }
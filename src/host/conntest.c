@@ -0,0 +1,495 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk connection pool tests.
+ *
+ * Runs the pool against a small HTTP server on the loopback interface,
+ * which serves byte ranges of a made-up image with keep-alive.  Checks
+ * that requests get the connections in turn and read the right bytes,
+ * that idle connections are probed and broken ones replaced, and that
+ * while the server is down, a connect is only tried once per wait,
+ * with the wait doubling up to its most.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "connpool.h"
+#include "host.h"
+
+/* The size of the made-up image. */
+#define CONN_TEST_M_IMAGE_ (1 << 20)
+
+/* The most connections the server keeps track of. */
+#define CONN_TEST_M_CLIENTS_ 64
+
+/* Where the test's clock starts, in 100 ns. */
+#define CONN_TEST_M_START_ (1000 * 10000000LL)
+
+/** The server. */
+typedef struct CONN_TEST_SERVER_ {
+    int Listener;
+    unsigned short Port;
+    pthread_t Thread;
+    pthread_mutex_t Lock;
+    int Clients[CONN_TEST_M_CLIENTS_];
+  } CONN_TEST_S_SERVER_;
+
+static CONN_TEST_S_SERVER_ ConnTestServer_ = {
+    -1,
+    0,
+    0,
+    PTHREAD_MUTEX_INITIALIZER,
+    {0}
+  };
+
+/* What the client side has done. */
+static unsigned int ConnTestConnects_;
+static unsigned int ConnTestProbes_;
+
+/* A byte of the made-up image. */
+static unsigned char ConnTestByte_(long long offset) {
+    return (unsigned char) (offset ^ (offset >> 8) ^ (offset >> 16));
+  }
+
+/*
+ * Receive a header into buf, ending with its blank line.  Anything
+ * after it is left in buf too.  Returns the bytes received, or -1.
+ */
+static int ConnTestRecvHeader_(
+    int sock,
+    char * buf,
+    int len,
+    int * header_len
+  ) {
+    int got = 0, n;
+    char * end;
+
+    while (got < len - 1) {
+        n = (int) recv(sock, buf + got, len - 1 - got, 0);
+        if (n <= 0)
+          return -1;
+        got += n;
+        buf[got] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+        if (end) {
+            *header_len = (int) (end + 4 - buf);
+            return got;
+          }
+      }
+    return -1;
+  }
+
+/* Serve one client's requests until it goes away. */
+static void * ConnTestServe_(void * arg) {
+    int sock = (int) (long) arg;
+    static const char range_field[] = "Range: bytes=";
+    char buf[2048];
+    unsigned char body[4096];
+    char * range;
+    long long start, end, i, len;
+    int header_len, n, slot;
+
+    while (ConnTestRecvHeader_(sock, buf, sizeof buf, &header_len) >= 0) {
+        if (!strncmp(buf, "HEAD ", 5)) {
+            n = snprintf(
+                buf,
+                sizeof buf,
+                "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n"
+                  "Connection: keep-alive\r\n\r\n",
+                CONN_TEST_M_IMAGE_
+              );
+            if (send(sock, buf, n, MSG_NOSIGNAL) != n)
+              break;
+            continue;
+          }
+        range = strstr(buf, range_field);
+        if (
+            strncmp(buf, "GET ", 4) ||
+            !range ||
+            sscanf(range + sizeof range_field - 1, "%lld-%lld", &start, &end)
+              != 2 ||
+            start > end ||
+            end >= CONN_TEST_M_IMAGE_
+          )
+          break;
+        len = end - start + 1;
+        n = snprintf(
+            buf,
+            sizeof buf,
+            "HTTP/1.1 206 Partial Content\r\nContent-Length: %lld\r\n"
+              "Content-Range: bytes %lld-%lld/%d\r\n"
+              "Connection: keep-alive\r\n\r\n",
+            len,
+            start,
+            end,
+            CONN_TEST_M_IMAGE_
+          );
+        if (send(sock, buf, n, MSG_NOSIGNAL) != n)
+          break;
+        while (len) {
+            n = len < (long long) sizeof body ? (int) len : (int) sizeof body;
+            for (i = 0; i < n; i++)
+              body[i] = ConnTestByte_(start + i);
+            if (send(sock, body, n, MSG_NOSIGNAL) != n)
+              break;
+            start += n;
+            len -= n;
+          }
+        if (len)
+          break;
+      }
+
+    pthread_mutex_lock(&ConnTestServer_.Lock);
+    for (slot = 0; slot < CONN_TEST_M_CLIENTS_; slot++) {
+        if (ConnTestServer_.Clients[slot] == sock)
+          ConnTestServer_.Clients[slot] = -1;
+      }
+    pthread_mutex_unlock(&ConnTestServer_.Lock);
+    close(sock);
+    return NULL;
+  }
+
+/* Accept clients until the listener is shut down. */
+static void * ConnTestAccept_(void * arg) {
+    pthread_t thread;
+    int sock, slot;
+
+    (void) arg;
+    while ((sock = accept(ConnTestServer_.Listener, NULL, NULL)) >= 0) {
+        pthread_mutex_lock(&ConnTestServer_.Lock);
+        for (slot = 0; slot < CONN_TEST_M_CLIENTS_; slot++) {
+            if (ConnTestServer_.Clients[slot] < 0)
+              break;
+          }
+        if (slot < CONN_TEST_M_CLIENTS_)
+          ConnTestServer_.Clients[slot] = sock;
+        pthread_mutex_unlock(&ConnTestServer_.Lock);
+        if (
+            slot == CONN_TEST_M_CLIENTS_ ||
+            pthread_create(&thread, NULL, ConnTestServe_, (void *) (long) sock)
+          ) {
+            shutdown(sock, SHUT_RDWR);
+            continue;
+          }
+        pthread_detach(thread);
+      }
+    return NULL;
+  }
+
+/* Start the server, on the same port as before if it ran before. */
+static int ConnTestStart_(void) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof addr;
+    int one = 1, slot;
+
+    for (slot = 0; slot < CONN_TEST_M_CLIENTS_; slot++)
+      ConnTestServer_.Clients[slot] = -1;
+    ConnTestServer_.Listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (ConnTestServer_.Listener < 0)
+      return 0;
+    setsockopt(
+        ConnTestServer_.Listener,
+        SOL_SOCKET,
+        SO_REUSEADDR,
+        &one,
+        sizeof one
+      );
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = ConnTestServer_.Port;
+    if (
+        bind(
+            ConnTestServer_.Listener,
+            (struct sockaddr *) &addr,
+            sizeof addr
+          ) ||
+        listen(ConnTestServer_.Listener, CONN_TEST_M_CLIENTS_) ||
+        getsockname(
+            ConnTestServer_.Listener,
+            (struct sockaddr *) &addr,
+            &addr_len
+          ) ||
+        pthread_create(&ConnTestServer_.Thread, NULL, ConnTestAccept_, NULL)
+      ) {
+        perror("conntest server");
+        close(ConnTestServer_.Listener);
+        return 0;
+      }
+    ConnTestServer_.Port = addr.sin_port;
+    return 1;
+  }
+
+/* Break every connection the server has. */
+static void ConnTestDrop_(void) {
+    int slot;
+
+    pthread_mutex_lock(&ConnTestServer_.Lock);
+    for (slot = 0; slot < CONN_TEST_M_CLIENTS_; slot++) {
+        if (ConnTestServer_.Clients[slot] >= 0)
+          shutdown(ConnTestServer_.Clients[slot], SHUT_RDWR);
+      }
+    pthread_mutex_unlock(&ConnTestServer_.Lock);
+  }
+
+/* Stop listening and break every connection. */
+static void ConnTestStop_(void) {
+    shutdown(ConnTestServer_.Listener, SHUT_RDWR);
+    pthread_join(ConnTestServer_.Thread, NULL);
+    close(ConnTestServer_.Listener);
+    ConnTestDrop_();
+  }
+
+/** The pool's routines, as conn.c has them for the driver. */
+
+static int ConnTestOpen_(void * context) {
+    struct sockaddr_in addr;
+    int sock;
+
+    (void) context;
+    ConnTestConnects_++;
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+      return -1;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = ConnTestServer_.Port;
+    if (connect(sock, (struct sockaddr *) &addr, sizeof addr)) {
+        close(sock);
+        return -1;
+      }
+    return sock;
+  }
+
+static int ConnTestProbe_(void * context, int sock) {
+    static const char head[] =
+      "HEAD /image HTTP/1.1\r\nHost: localhost\r\n"
+      "Connection: keep-alive\r\n\r\n";
+    char buf[512];
+    int len, header_len;
+
+    (void) context;
+    ConnTestProbes_++;
+    if (send(sock, head, sizeof head - 1, MSG_NOSIGNAL) != sizeof head - 1)
+      return 0;
+    len = ConnTestRecvHeader_(sock, buf, sizeof buf, &header_len);
+    return len >= 0 && len == header_len && !strncmp(buf, "HTTP/1.1 200", 12);
+  }
+
+static void ConnTestClose_(void * context, int sock) {
+    (void) context;
+    close(sock);
+  }
+
+/* Ask for a range, as HttpDiskRequestBlock does. */
+static int ConnTestRequest_(int sock, long long offset, int len) {
+    char buf[256];
+    int n;
+
+    n = snprintf(
+        buf,
+        sizeof buf,
+        "GET /image HTTP/1.1\r\nHost: localhost\r\n"
+          "Range: bytes=%lld-%lld\r\nConnection: keep-alive\r\n\r\n",
+        offset,
+        offset + len - 1
+      );
+    return send(sock, buf, n, MSG_NOSIGNAL) == n;
+  }
+
+/* Receive and check a range, as HttpDiskReceiveBlock does. */
+static int ConnTestReceive_(int sock, long long offset, int len) {
+    static unsigned char body[CONN_TEST_M_IMAGE_];
+    char buf[1024];
+    int got, header_len, n, i;
+
+    got = ConnTestRecvHeader_(sock, buf, sizeof buf, &header_len);
+    if (got < 0 || strncmp(buf, "HTTP/1.1 206", 12))
+      return 0;
+    got -= header_len;
+    memcpy(body, buf + header_len, got);
+    while (got < len) {
+        n = (int) recv(sock, body + got, len - got, 0);
+        if (n <= 0)
+          return 0;
+        got += n;
+      }
+    for (i = 0; i < len; i++) {
+        if (body[i] != ConnTestByte_(offset + i))
+          return 0;
+      }
+    return got == len;
+  }
+
+/* Check that each of a pool's connections is live, or each is broken. */
+static int ConnTestAll_(HTTPDISK_SP_CONN_POOL pool, int live) {
+    unsigned int i;
+
+    for (i = 0; i < pool->count; i++) {
+        if ((pool->conns[i].socket >= 0) != live)
+          return 0;
+      }
+    return 1;
+  }
+
+/** Requests take the connections in turn, and read the right bytes. */
+static void ConnTestRequests_(HTTPDISK_SP_CONN_POOL pool, long long now) {
+    HTTPDISK_SP_CONN conns[HTTPDISK_M_CONNS];
+    unsigned int count, i, j;
+    int fresh;
+
+    /* The first request waits for a connection. */
+    count = HttpdiskConnPoolTake(pool, now, conns, 2, &fresh);
+    HOST_CHECK(count == 1 && fresh && ConnTestConnects_ == 1);
+    HOST_CHECK(ConnTestRequest_(conns[0]->socket, 12345, 777));
+    HOST_CHECK(ConnTestReceive_(conns[0]->socket, 12345, 777));
+
+    /* The rest are connected between requests. */
+    HttpdiskConnPoolMaintain(pool, now);
+    HOST_CHECK(ConnTestConnects_ == pool->count);
+    HOST_CHECK(ConnTestAll_(pool, 1));
+
+    /* A read split over all of them, in flight at once. */
+    count = HttpdiskConnPoolTake(pool, now, conns, HTTPDISK_M_CONNS, &fresh);
+    HOST_CHECK(count == pool->count && !fresh);
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < i; j++)
+          HOST_CHECK(conns[i] != conns[j]);
+        HOST_CHECK(ConnTestRequest_(conns[i]->socket, i * 65536, 65536));
+      }
+    for (i = 0; i < count; i++)
+      HOST_CHECK(ConnTestReceive_(conns[i]->socket, i * 65536, 65536));
+
+    /* Single requests go round the connections. */
+    for (i = 0; i < 2 * pool->count; i++) {
+        HOST_CHECK(HttpdiskConnPoolTake(pool, now, conns + i, 1, &fresh));
+        if (i >= pool->count)
+          HOST_CHECK(conns[i] == conns[i - pool->count]);
+      }
+    HOST_CHECK(ConnTestConnects_ == pool->count);
+  }
+
+/** Idle connections are probed, and broken ones replaced. */
+static void ConnTestIdle_(HTTPDISK_SP_CONN_POOL pool, long long now) {
+    HTTPDISK_SP_CONN conn;
+    int fresh;
+
+    HttpdiskConnPoolMaintain(pool, now + HTTPDISK_M_CONN_IDLE - 1);
+    HOST_CHECK(ConnTestProbes_ == 0);
+    now += HTTPDISK_M_CONN_IDLE;
+    HttpdiskConnPoolMaintain(pool, now);
+    HOST_CHECK(ConnTestProbes_ == pool->count);
+    HOST_CHECK(ConnTestAll_(pool, 1));
+    HOST_CHECK(ConnTestConnects_ == pool->count);
+
+    /* The server times them out. */
+    ConnTestDrop_();
+    now += HTTPDISK_M_CONN_IDLE;
+    HttpdiskConnPoolMaintain(pool, now);
+    HOST_CHECK(ConnTestProbes_ == 2 * pool->count);
+    HOST_CHECK(ConnTestConnects_ == 2 * pool->count);
+    HOST_CHECK(ConnTestAll_(pool, 1));
+    HOST_CHECK(HttpdiskConnPoolTake(pool, now, &conn, 1, &fresh) == 1);
+    HOST_CHECK(ConnTestRequest_(conn->socket, 0, 4096));
+    HOST_CHECK(ConnTestReceive_(conn->socket, 0, 4096));
+  }
+
+/** While the server is down, a connect is only tried once per wait. */
+static void ConnTestDown_(HTTPDISK_SP_CONN_POOL pool, long long now) {
+    HTTPDISK_SP_CONN conn;
+    unsigned int connects;
+    long long wait;
+    int fresh;
+
+    ConnTestStop_();
+    connects = ConnTestConnects_;
+    now += HTTPDISK_M_CONN_IDLE;
+    HttpdiskConnPoolMaintain(pool, now);
+    HOST_CHECK(ConnTestAll_(pool, 0));
+    HOST_CHECK(ConnTestConnects_ == connects + 1);
+    HOST_CHECK(pool->retry_at == now + HTTPDISK_M_CONN_RETRY_MIN);
+
+    /* Requests fail at once until the wait is over. */
+    HOST_CHECK(!HttpdiskConnPoolTake(pool, now, &conn, 1, &fresh));
+    now = pool->retry_at - 1;
+    HOST_CHECK(!HttpdiskConnPoolTake(pool, now, &conn, 1, &fresh));
+    HttpdiskConnPoolMaintain(pool, now);
+    HOST_CHECK(ConnTestConnects_ == connects + 1);
+
+    /* Then one connect is tried, and the wait doubles up to its most. */
+    for (wait = 2 * HTTPDISK_M_CONN_RETRY_MIN; ; wait *= 2) {
+        if (wait > HTTPDISK_M_CONN_RETRY_MAX)
+          wait = HTTPDISK_M_CONN_RETRY_MAX;
+        now = pool->retry_at;
+        connects = ConnTestConnects_;
+        HOST_CHECK(!HttpdiskConnPoolTake(pool, now, &conn, 1, &fresh));
+        HttpdiskConnPoolMaintain(pool, now);
+        HOST_CHECK(ConnTestConnects_ == connects + 1);
+        HOST_CHECK(pool->retry_at == now + wait);
+        if (wait == HTTPDISK_M_CONN_RETRY_MAX)
+          break;
+      }
+
+    /* The server comes back. */
+    HOST_CHECK(ConnTestStart_());
+    now = pool->retry_at;
+    connects = ConnTestConnects_;
+    HOST_CHECK(HttpdiskConnPoolTake(pool, now, &conn, 1, &fresh) == 1);
+    HOST_CHECK(fresh && pool->retry_wait == HTTPDISK_M_CONN_RETRY_MIN);
+    HOST_CHECK(ConnTestRequest_(conn->socket, 99999, 1));
+    HOST_CHECK(ConnTestReceive_(conn->socket, 99999, 1));
+    HttpdiskConnPoolMaintain(pool, now);
+    HOST_CHECK(ConnTestAll_(pool, 1));
+    HOST_CHECK(ConnTestConnects_ == connects + pool->count);
+  }
+
+int main(void) {
+    HTTPDISK_S_CONN_POOL pool;
+
+    if (!ConnTestStart_())
+      return 1;
+    HttpdiskConnPoolInit(
+        &pool,
+        4,
+        NULL,
+        ConnTestOpen_,
+        ConnTestProbe_,
+        ConnTestClose_
+      );
+    ConnTestRequests_(&pool, CONN_TEST_M_START_);
+    ConnTestIdle_(&pool, CONN_TEST_M_START_);
+    ConnTestDown_(&pool, CONN_TEST_M_START_ + 4 * HTTPDISK_M_CONN_IDLE);
+    HttpdiskConnPoolCloseAll(&pool);
+    HOST_CHECK(ConnTestAll_(&pool, 0));
+    ConnTestStop_();
+    return HostDone("conntest");
+  }
@@ -0,0 +1,160 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Bulk copy benchmark.
+ *
+ * Times WvlCopyMemory, as the driver dispatches it on this CPU, and the
+ * portable WvlCopyMemoryReference, with the C library's memcpy for
+ * comparison, for sizes from a sector to 4 MiB.  Every copy is checked,
+ * with the buffers both aligned and misaligned.
+ *
+ * Usage: copybench [milliseconds per measurement]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ddk/ntddk.h"
+#include "winvblock.h"
+#include "copy.h"
+#include "host.h"
+
+/* The largest copy. */
+#define COPYBENCH_M_MAX_ (4 * 1024 * 1024)
+
+typedef void COPYBENCH_F_COPY_(void *, const void *, size_t);
+
+static void CopyBenchMemcpy_(void * dest, const void * src, size_t len) {
+    memcpy(dest, src, len);
+  }
+
+static void CopyBenchDispatched_(void * dest, const void * src, size_t len) {
+    WvlCopyMemory(dest, src, len);
+  }
+
+static void CopyBenchReference_(void * dest, const void * src, size_t len) {
+    WvlCopyMemoryReference(dest, src, len);
+  }
+
+static const struct {
+    const char * Name;
+    COPYBENCH_F_COPY_ * Copy;
+  } CopyBenchMethods_[] = {
+    { "WvlCopyMemory", CopyBenchDispatched_ },
+    { "Reference", CopyBenchReference_ },
+    { "memcpy", CopyBenchMemcpy_ },
+  };
+
+/** Check one copy, with the bytes around it. */
+static void CopyBenchCheck_(
+    COPYBENCH_F_COPY_ * copy,
+    unsigned char * dest,
+    const unsigned char * src,
+    size_t len,
+    size_t dest_off,
+    size_t src_off
+  ) {
+    memset(dest, 0xA5, len + dest_off + 16);
+    copy(dest + dest_off, src + src_off, len);
+    HOST_CHECK(memcmp(dest + dest_off, src + src_off, len) == 0);
+    HOST_CHECK(dest_off == 0 || dest[dest_off - 1] == 0xA5);
+    HOST_CHECK(dest[dest_off + len] == 0xA5);
+  }
+
+int main(int argc, char ** argv) {
+    static const size_t sizes[] = {
+        512, 4096, 65536, 256 * 1024, 1024 * 1024, COPYBENCH_M_MAX_
+      };
+    enum { methods = sizeof CopyBenchMethods_ / sizeof *CopyBenchMethods_ };
+    unsigned char * src, * dest;
+    double budget = 0.1, start, elapsed;
+    unsigned long reps, i;
+    unsigned int size, method, off;
+
+    if (argc > 1)
+      budget = atoi(argv[1]) / 1000.0;
+    /* Room for misalignment and the guard bytes. */
+    src = malloc(COPYBENCH_M_MAX_ + 64);
+    dest = malloc(COPYBENCH_M_MAX_ + 64);
+    if (!HOST_CHECK(src != NULL && dest != NULL))
+      return HostDone("copybench");
+    for (i = 0; i < COPYBENCH_M_MAX_ + 64; i++)
+      src[i] = (unsigned char) HostRand();
+
+    /* Odd lengths and alignments, to cover the heads and tails. */
+    for (method = 0; method < methods; method++) {
+        for (size = 0; size < 300; size++) {
+            for (off = 0; off < 8; off++) {
+                CopyBenchCheck_(
+                    CopyBenchMethods_[method].Copy,
+                    dest,
+                    src,
+                    size,
+                    off,
+                    (off * 3) & 7
+                  );
+              }
+          }
+      }
+
+    printf("%10s", "bytes");
+    for (method = 0; method < methods; method++)
+      printf(" %14s", CopyBenchMethods_[method].Name);
+    printf("   (MB/s)\n");
+    for (size = 0; size < sizeof sizes / sizeof *sizes; size++) {
+        printf("%10lu", (unsigned long) sizes[size]);
+        for (method = 0; method < methods; method++) {
+            /* Aligned and misaligned, and then time the aligned one. */
+            CopyBenchCheck_(
+                CopyBenchMethods_[method].Copy,
+                dest,
+                src,
+                sizes[size],
+                0,
+                0
+              );
+            CopyBenchCheck_(
+                CopyBenchMethods_[method].Copy,
+                dest,
+                src,
+                sizes[size],
+                16,
+                3
+              );
+            reps = 0;
+            start = HostNow();
+            do {
+                for (i = 0; i < 16; i++)
+                  CopyBenchMethods_[method].Copy(dest, src, sizes[size]);
+                reps += 16;
+                elapsed = HostNow() - start;
+              } while (elapsed < budget);
+            printf(" %14.0f", reps * (double) sizes[size] / elapsed / 1e6);
+          }
+        printf("\n");
+      }
+
+    free(src);
+    free(dest);
+    return HostDone("copybench");
+  }
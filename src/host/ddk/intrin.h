@@ -0,0 +1,66 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HOST_M_INTRIN_H_
+#  define HOST_M_INTRIN_H_
+
+/**
+ * @file
+ *
+ * The MSVC x86 intrinsics which copy.c uses, for GCC.
+ */
+
+static __inline void __movsb(
+    unsigned char * dest,
+    const unsigned char * src,
+    size_t count
+  ) {
+    __asm__ __volatile__(
+        "rep movsb"
+        : "+D" (dest), "+S" (src), "+c" (count)
+        :
+        : "memory"
+      );
+  }
+
+static __inline void __movsd(
+    unsigned int * dest,
+    const unsigned int * src,
+    size_t count
+  ) {
+    __asm__ __volatile__(
+        "rep movsl"
+        : "+D" (dest), "+S" (src), "+c" (count)
+        :
+        : "memory"
+      );
+  }
+
+static __inline void __cpuidex(int info[4], int leaf, int subleaf) {
+    __asm__ __volatile__(
+        "cpuid"
+        : "=a" (info[0]), "=b" (info[1]), "=c" (info[2]), "=d" (info[3])
+        : "a" (leaf), "c" (subleaf)
+      );
+  }
+
+static __inline void __cpuid(int info[4], int leaf) {
+    __cpuidex(info, leaf, 0);
+  }
+
+#endif  /* HOST_M_INTRIN_H_ */
@@ -0,0 +1,55 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HOST_M_NTDDK_H_
+#  define HOST_M_NTDDK_H_
+
+/**
+ * @file
+ *
+ * The few DDK definitions which copy.c uses, for building it on a host
+ * with GCC.  Nothing else should need this: the other modules the host
+ * harness builds don't include the DDK at all.
+ */
+
+#  include <stddef.h>
+
+#  define IN
+#  define OUT
+#  define STDCALL
+#  define __declspec(x)
+#  define TRUE 1
+#  define FALSE 0
+#  define NT_SUCCESS(Status_) ((NTSTATUS) (Status_) >= 0)
+
+typedef void VOID, * PVOID;
+typedef unsigned char UCHAR, * PUCHAR, BOOLEAN;
+typedef char CHAR, * PCHAR;
+typedef int LONG, * PLONG, NTSTATUS;
+typedef unsigned int ULONG, * PULONG, UINT32;
+typedef long long LONGLONG;
+typedef size_t SIZE_T, ULONG_PTR, * PULONG_PTR;
+typedef union {
+    LONGLONG QuadPart;
+  } LARGE_INTEGER;
+
+static __inline LONG InterlockedExchange(PLONG target, LONG value) {
+    return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+  }
+
+#endif  /* HOST_M_NTDDK_H_ */
@@ -0,0 +1,171 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Extent map fill-rate benchmark.
+ *
+ * Fills a sparse disk's extent map the way first writes do: each write
+ * to an extent that isn't in the map allocates a zeroed 64 KiB extent
+ * and a table if needed, inserts them and writes a sector.  The disk is
+ * filled in order and at random, and then read back at random.  The
+ * memory the map's tables take is reported next to the data's.
+ *
+ * Usage: extmapbench [MiB]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wv_stdlib.h"
+#include "extmap.h"
+#include "host.h"
+
+/* The size of an extent, as in sparse.h. */
+#define EXTMAPBENCH_M_EXTENT_SIZE_ (64 * 1024)
+
+/* The size of a write. */
+#define EXTMAPBENCH_M_SECTOR_ 512
+
+/* The default disk size, in MiB. */
+#define EXTMAPBENCH_M_DEFAULT_MIB_ 1024
+
+static void ExtMapBenchFree_(void * extent) {
+    wv_free(extent);
+  }
+
+/** Write a sector into an extent, allocating it the first time. */
+static unsigned char * ExtMapBenchWrite_(
+    WV_SP_EXTMAP map,
+    unsigned int index,
+    const unsigned char * sector
+  ) {
+    void ** table = NULL;
+    void * extent;
+    unsigned char * data = WvExtMapGet(map, index);
+
+    if (!data) {
+        if (!WvExtMapHasTable(map, index))
+          table = WvExtMapTableAlloc();
+        extent = wv_mallocz(EXTMAPBENCH_M_EXTENT_SIZE_);
+        data = WvExtMapInsert(map, index, &table, &extent);
+        wv_free(extent);
+        wv_free(table);
+        if (!data)
+          return NULL;
+      }
+    memcpy(data, sector, EXTMAPBENCH_M_SECTOR_);
+    return data;
+  }
+
+/** Fill a map in the given order and report the rate. */
+static void ExtMapBenchFill_(
+    const char * name,
+    const unsigned int * order,
+    unsigned int count
+  ) {
+    static unsigned char sector[EXTMAPBENCH_M_SECTOR_] = { 1 };
+    WV_S_EXTMAP map;
+    unsigned int i, tables = 0;
+    unsigned long sum = 0;
+    double start, fill, read;
+
+    if (!WvExtMapInit(&map, count)) {
+        fprintf(stderr, "extmapbench: can't set up %u extents\n", count);
+        HostFailures++;
+        return;
+      }
+    start = HostNow();
+    for (i = 0; i < count; i++) {
+        if (!ExtMapBenchWrite_(&map, order[i], sector)) {
+            fprintf(stderr, "extmapbench: out of memory\n");
+            HostFailures++;
+            break;
+          }
+      }
+    fill = HostNow() - start;
+
+    start = HostNow();
+    for (i = 0; i < count; i++) {
+        unsigned char * data = WvExtMapGet(&map, HostRand() % count);
+
+        sum += data ? data[0] : 0;
+      }
+    read = HostNow() - start;
+    HOST_CHECK(sum == count);
+
+    for (i = 0; i < map.TableCount; i++)
+      tables += map.Tables[i] != NULL;
+    printf(
+        "%-10s %8u %12.0f %10.1f %12.0f %9.4f%%\n",
+        name,
+        map.ExtentsUsed,
+        count / fill,
+        count * (EXTMAPBENCH_M_EXTENT_SIZE_ / 1048576.0) / fill,
+        count / read,
+        100.0 * (
+            map.TableCount * sizeof *map.Tables +
+            tables * WV_M_EXTMAP_TABLE_EXTENTS * sizeof (void *)
+          ) / ((double) map.ExtentsUsed * EXTMAPBENCH_M_EXTENT_SIZE_)
+      );
+    WvExtMapFree(&map, ExtMapBenchFree_);
+  }
+
+int main(int argc, char ** argv) {
+    unsigned long mib = EXTMAPBENCH_M_DEFAULT_MIB_;
+    unsigned int count, i, j, tmp;
+    unsigned int * order;
+
+    if (argc > 1)
+      mib = strtoul(argv[1], NULL, 0);
+    count = (unsigned int) (
+        mib * 1048576.0 / EXTMAPBENCH_M_EXTENT_SIZE_
+      );
+    order = malloc(count * sizeof *order);
+    if (!count || !order) {
+        fprintf(stderr, "usage: extmapbench [MiB]\n");
+        return EXIT_FAILURE;
+      }
+
+    printf("%lu MiB disk, %u extents of 64 KiB\n", mib, count);
+    printf(
+        "%-10s %8s %12s %10s %12s %10s\n",
+        "fill",
+        "extents",
+        "extents/s",
+        "MiB/s",
+        "lookups/s",
+        "overhead"
+      );
+    for (i = 0; i < count; i++)
+      order[i] = i;
+    ExtMapBenchFill_("sequential", order, count);
+    for (i = count - 1; i > 0; i--) {
+        j = HostRand() % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+      }
+    ExtMapBenchFill_("random", order, count);
+
+    free(order);
+    return HostDone("extmapbench");
+  }
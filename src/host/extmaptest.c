@@ -0,0 +1,176 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Extent map tests.
+ *
+ * Checks the map's bounds, that extents are found where they were put,
+ * that an insert which loses a race leaves the loser's allocations to
+ * the caller, and that emptying the map frees every extent once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "wv_stdlib.h"
+#include "extmap.h"
+#include "host.h"
+
+/* The number of extents the free callback has seen. */
+static unsigned int ExtMapTestFreed_;
+
+static void ExtMapTestFree_(void * extent) {
+    ExtMapTestFreed_++;
+    wv_free(extent);
+  }
+
+/** Check the sizes a map accepts. */
+static void ExtMapTestInit_(void) {
+    WV_S_EXTMAP map;
+
+    HOST_CHECK(!WvExtMapInit(&map, 0));
+    HOST_CHECK(!WvExtMapInit(&map, WV_M_EXTMAP_MAX_EXTENTS + 1));
+
+    HOST_CHECK(WvExtMapInit(&map, 1));
+    HOST_CHECK(map.TableCount == 1);
+    WvExtMapFree(&map, ExtMapTestFree_);
+
+    HOST_CHECK(WvExtMapInit(&map, WV_M_EXTMAP_TABLE_EXTENTS + 1));
+    HOST_CHECK(map.TableCount == 2);
+    WvExtMapFree(&map, ExtMapTestFree_);
+
+    HOST_CHECK(WvExtMapInit(&map, WV_M_EXTMAP_MAX_EXTENTS));
+    HOST_CHECK(
+        map.TableCount ==
+        WV_M_EXTMAP_MAX_EXTENTS / WV_M_EXTMAP_TABLE_EXTENTS
+      );
+    HOST_CHECK(!WvExtMapHasTable(&map, WV_M_EXTMAP_MAX_EXTENTS - 1));
+    HOST_CHECK(!WvExtMapGet(&map, WV_M_EXTMAP_MAX_EXTENTS - 1));
+    WvExtMapFree(&map, ExtMapTestFree_);
+    HOST_CHECK(!map.Tables);
+  }
+
+/** Fill a map at random, then empty it again. */
+static void ExtMapTestFill_(void) {
+    enum { count = 5 * WV_M_EXTMAP_TABLE_EXTENTS + 7 };
+    static unsigned int * shadow[count];
+    WV_S_EXTMAP map;
+    void ** table;
+    void * extent, * fresh;
+    unsigned int i, index, used = 0;
+
+    HOST_CHECK(WvExtMapInit(&map, count));
+    for (i = 0; i < 4 * count; i++) {
+        index = HostRand() % count;
+        if (HostRand() % 3) {
+            table = NULL;
+            if (!WvExtMapHasTable(&map, index))
+              table = WvExtMapTableAlloc();
+            fresh = extent = wv_malloc(sizeof index);
+            *(unsigned int *) fresh = index;
+            if (!shadow[index]) {
+                shadow[index] = fresh;
+                used++;
+              }
+            HOST_CHECK(
+                WvExtMapInsert(&map, index, &table, &extent) ==
+                shadow[index]
+              );
+            /* An extent already there is kept, and the new one isn't. */
+            HOST_CHECK(extent == (shadow[index] == fresh ? NULL : fresh));
+            wv_free(extent);
+            HOST_CHECK(!table);
+          } else {
+            extent = WvExtMapRemove(&map, index);
+            HOST_CHECK(extent == shadow[index]);
+            if (extent) {
+                HOST_CHECK(*(unsigned int *) extent == index);
+                shadow[index] = NULL;
+                used--;
+              }
+            wv_free(extent);
+          }
+        HOST_CHECK(map.ExtentsUsed == used);
+      }
+    for (i = 0; i < count; i++)
+      HOST_CHECK(WvExtMapGet(&map, i) == shadow[i]);
+
+    ExtMapTestFreed_ = 0;
+    WvExtMapFree(&map, ExtMapTestFree_);
+    HOST_CHECK(ExtMapTestFreed_ == used);
+    HOST_CHECK(map.ExtentsUsed == 0);
+  }
+
+/**
+ * Two writers race for the same extent.
+ *
+ * Both allocate without the lock; the first to insert wins and the
+ * second gets the winner's extent back, with its own table and extent
+ * left for it to free.
+ */
+static void ExtMapTestRace_(void) {
+    WV_S_EXTMAP map;
+    void ** table_a, ** table_b;
+    void * extent_a, * extent_b;
+    int a, b;
+
+    HOST_CHECK(WvExtMapInit(&map, 2 * WV_M_EXTMAP_TABLE_EXTENTS));
+    table_a = WvExtMapTableAlloc();
+    table_b = WvExtMapTableAlloc();
+    extent_a = &a;
+    extent_b = &b;
+
+    HOST_CHECK(WvExtMapInsert(&map, 3, &table_a, &extent_a) == &a);
+    HOST_CHECK(!table_a && !extent_a);
+    HOST_CHECK(WvExtMapInsert(&map, 3, &table_b, &extent_b) == &a);
+    HOST_CHECK(table_b && extent_b == &b);
+    HOST_CHECK(map.ExtentsUsed == 1);
+
+    /* A table is needed and not given. */
+    HOST_CHECK(!WvExtMapInsert(
+        &map,
+        WV_M_EXTMAP_TABLE_EXTENTS,
+        &table_a,
+        &extent_b
+      ));
+    HOST_CHECK(extent_b == &b);
+    HOST_CHECK(!WvExtMapHasTable(&map, WV_M_EXTMAP_TABLE_EXTENTS));
+
+    /* A table is given but not needed: the same table, another slot. */
+    HOST_CHECK(WvExtMapInsert(&map, 4, &table_b, &extent_b) == &b);
+    HOST_CHECK(table_b && !extent_b);
+    wv_free(table_b);
+
+    HOST_CHECK(WvExtMapRemove(&map, 3) == &a);
+    HOST_CHECK(WvExtMapRemove(&map, 3) == NULL);
+    HOST_CHECK(WvExtMapRemove(&map, 4) == &b);
+    HOST_CHECK(map.ExtentsUsed == 0);
+    ExtMapTestFreed_ = 0;
+    WvExtMapFree(&map, ExtMapTestFree_);
+    HOST_CHECK(ExtMapTestFreed_ == 0);
+  }
+
+int main(void) {
+    ExtMapTestInit_();
+    ExtMapTestFill_();
+    ExtMapTestRace_();
+    return HostDone("extmaptest");
+  }
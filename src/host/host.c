@@ -0,0 +1,188 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Host harness helpers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "host.h"
+
+/** The number of failed checks. */
+int HostFailures = 0;
+
+/** The pseudo-random number generator's state. */
+static unsigned int HostRandState_ = 2463534242u;
+
+/** The trace being replayed, in the order the requests were issued. */
+HOST_SP_TRACE_REQ HostTrace = NULL;
+unsigned long HostTraceCount = 0;
+static unsigned long HostTraceMax_ = 0;
+
+/**
+ * Report a failed check.
+ *
+ * @v ok                Whether the check passed.
+ * @v what              The checked condition, as text.
+ * @v file              The source file of the check.
+ * @v line              The source line of the check.
+ * @ret int             ok.
+ */
+int HostCheck(int ok, const char * what, const char * file, int line) {
+    if (!ok) {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+        HostFailures++;
+      }
+    return ok;
+  }
+
+/**
+ * Read a monotonic clock.
+ *
+ * @ret double          The time, in seconds.
+ */
+double HostNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+/**
+ * Produce a pseudo-random number.
+ *
+ * @ret unsigned int    The next number from a xorshift generator, so
+ *                      that runs can be repeated exactly.
+ */
+unsigned int HostRand(void) {
+    unsigned int x = HostRandState_;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return HostRandState_ = x;
+  }
+
+/**
+ * Restart the pseudo-random number generator.
+ *
+ * @v seed              The new state.  Zero is replaced by the default.
+ */
+void HostSeed(unsigned int seed) {
+    HostRandState_ = seed ? seed : 2463534242u;
+  }
+
+/**
+ * Report a program's checks.
+ *
+ * @v name              The program's name.
+ * @ret int             The program's exit status.
+ */
+int HostDone(const char * name) {
+    if (HostFailures) {
+        printf("%s: %d check(s) failed\n", name, HostFailures);
+        return 1;
+      }
+    printf("%s: ok\n", name);
+    return 0;
+  }
+
+/**
+ * Add a request to the end of the trace.
+ *
+ * @v time              When the request was issued, in microseconds.
+ * @v kind              0 for a read, 1 for a write.
+ * @v lba               The first sector.
+ * @v sectors           The number of sectors.
+ */
+void HostTraceAdd(
+    long long time,
+    int kind,
+    long long lba,
+    unsigned int sectors
+  ) {
+    HOST_SP_TRACE_REQ reqs;
+
+    if (HostTraceCount == HostTraceMax_) {
+        HostTraceMax_ = HostTraceMax_ ? HostTraceMax_ * 2 : 4096;
+        reqs = realloc(HostTrace, HostTraceMax_ * sizeof *reqs);
+        if (reqs == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+          }
+        HostTrace = reqs;
+      }
+    reqs = HostTrace + HostTraceCount++;
+    reqs->Time = time;
+    reqs->Kind = kind;
+    reqs->Lba = lba;
+    reqs->Sectors = sectors;
+  }
+
+/**
+ * Read a trace file into the trace.
+ *
+ * @v path              The file, or "-" for stdin.
+ * @ret int             1 if the file was read, else 0.
+ *
+ * Each line of the file is a request: the time it was issued in
+ * microseconds, R or W, the first sector and the number of sectors.
+ * Other lines are ignored.
+ */
+int HostTraceLoad(const char * path) {
+    FILE * file;
+    char line[256], op;
+    long long time, lba, last = 0;
+    unsigned int sectors;
+
+    file = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (file == NULL) {
+        perror(path);
+        return 0;
+      }
+    while (fgets(line, sizeof line, file)) {
+        if (
+            sscanf(line, "%lld %c %lld %u", &time, &op, &lba, &sectors) != 4 ||
+            (op != 'R' && op != 'W') ||
+            !sectors
+          )
+          continue;
+        /* Keep the requests in order, even if the trace isn't. */
+        if (time < last)
+          time = last;
+        last = time;
+        HostTraceAdd(time, op == 'W', lba, sectors);
+      }
+    if (file != stdin)
+      fclose(file);
+    return 1;
+  }
+
+/** Empty the trace. */
+void HostTraceFree(void) {
+    free(HostTrace);
+    HostTrace = NULL;
+    HostTraceCount = HostTraceMax_ = 0;
+  }
@@ -0,0 +1,59 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HOST_M_HOST_H_
+#  define HOST_M_HOST_H_
+
+/**
+ * @file
+ *
+ * Host harness helpers.
+ *
+ * The programs in this directory build WinVBlock's portable modules
+ * with the host's C compiler, to test and measure them without a
+ * Windows kernel.
+ */
+
+/* Check a condition, counting and reporting it if it's false. */
+#  define HOST_CHECK(Cond_) \
+  (HostCheck((Cond_) != 0, #Cond_, __FILE__, __LINE__))
+
+/** A traced I/O request. */
+typedef struct HOST_TRACE_REQ {
+    /* When the request was issued, in microseconds. */
+    long long Time;
+    long long Lba;
+    unsigned int Sectors;
+    /* 0 for a read, 1 for a write. */
+    int Kind;
+  } HOST_S_TRACE_REQ, * HOST_SP_TRACE_REQ;
+
+extern int HostFailures;
+extern HOST_SP_TRACE_REQ HostTrace;
+extern unsigned long HostTraceCount;
+
+extern int HostCheck(int, const char *, const char *, int);
+extern double HostNow(void);
+extern unsigned int HostRand(void);
+extern void HostSeed(unsigned int);
+extern int HostDone(const char *);
+extern void HostTraceAdd(long long, int, long long, unsigned int);
+extern int HostTraceLoad(const char *);
+extern void HostTraceFree(void);
+
+#endif  /* HOST_M_HOST_H_ */
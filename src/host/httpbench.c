@@ -0,0 +1,166 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk response header parsing benchmark.
+ *
+ * Every chunk HTTPDisk fetches has its response header parsed on the
+ * disk's thread, so this times HttpdiskHttpParse on the headers a few
+ * servers send for a range, and on a HEAD response, after checking
+ * what it finds in each.
+ *
+ * Usage: httpbench [milliseconds per measurement]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "httpparse.h"
+#include "host.h"
+
+/** A header to time, and what should be found in it. */
+typedef struct HTTP_BENCH_CASE_ {
+    const char * Name;
+    const char * Header;
+    int Status;
+    long long ContentLength;
+    long long RangeStart;
+    int KeepAlive;
+  } HTTP_BENCH_S_CASE_;
+
+static const HTTP_BENCH_S_CASE_ HttpBenchCases_[] = {
+    {
+        "nginx-206",
+        "HTTP/1.1 206 Partial Content\r\n"
+          "Server: nginx/1.24.0\r\n"
+          "Date: Sat, 17 Oct 2026 10:00:00 GMT\r\n"
+          "Content-Type: application/octet-stream\r\n"
+          "Content-Length: 65536\r\n"
+          "Last-Modified: Fri, 16 Oct 2026 09:00:00 GMT\r\n"
+          "Connection: keep-alive\r\n"
+          "ETag: \"6717a4c0-100000000\"\r\n"
+          "Content-Range: bytes 1048576-1114111/4294967296\r\n\r\n",
+        206,
+        65536,
+        1048576,
+        1
+      },
+    {
+        "apache-206",
+        "HTTP/1.1 206 Partial Content\r\n"
+          "Date: Sat, 17 Oct 2026 10:00:00 GMT\r\n"
+          "Server: Apache/2.4.58 (Unix)\r\n"
+          "Last-Modified: Fri, 16 Oct 2026 09:00:00 GMT\r\n"
+          "ETag: \"100000000-5f3a7c2e1b4c0\"\r\n"
+          "Accept-Ranges: bytes\r\n"
+          "Content-Length: 4096\r\n"
+          "Content-Range: bytes 0-4095/4294967296\r\n"
+          "Keep-Alive: timeout=5, max=100\r\n"
+          "Connection: Keep-Alive\r\n"
+          "Content-Type: application/octet-stream\r\n\r\n",
+        206,
+        4096,
+        0,
+        1
+      },
+    {
+        "cdn-206",
+        "HTTP/1.1 206 Partial Content\r\n"
+          "Content-Type: application/octet-stream\r\n"
+          "Content-Length: 262144\r\n"
+          "Connection: keep-alive\r\n"
+          "Content-Range: bytes 268435456-268697599/4294967296\r\n"
+          "Last-Modified: Fri, 16 Oct 2026 09:00:00 GMT\r\n"
+          "ETag: \"0a4d55a8d778e5022fab701977c5d840\"\r\n"
+          "Cache-Control: public, max-age=31536000, immutable\r\n"
+          "Accept-Ranges: bytes\r\n"
+          "Via: 1.1 varnish, 1.1 varnish\r\n"
+          "X-Cache: HIT, MISS\r\n"
+          "X-Cache-Hits: 12, 0\r\n"
+          "X-Served-By: cache-lhr7321-LHR, cache-yyz4528-YYZ\r\n"
+          "X-Timer: S1760695200.000000,VS0,VE1\r\n"
+          "Age: 86400\r\n"
+          "Strict-Transport-Security: max-age=31536000\r\n"
+          "Date: Sat, 17 Oct 2026 10:00:00 GMT\r\n\r\n",
+        206,
+        262144,
+        268435456,
+        1
+      },
+    {
+        "head-200",
+        "HTTP/1.1 200 OK\r\nContent-Length: 4294967296\r\n"
+          "Accept-Ranges: bytes\r\n\r\n",
+        200,
+        4294967296LL,
+        -1,
+        1
+      },
+  };
+
+int main(int argc, char ** argv) {
+    enum {
+        cases = sizeof HttpBenchCases_ / sizeof *HttpBenchCases_
+      };
+    const HTTP_BENCH_S_CASE_ * bench;
+    HTTPDISK_S_RESPONSE response;
+    double budget = 0.2, start, elapsed;
+    unsigned long reps, i;
+    unsigned int which;
+    long long sum = 0;
+    int len;
+
+    if (argc > 1)
+      budget = atoi(argv[1]) / 1000.0;
+
+    printf("%-12s %6s %12s %10s\n", "header", "bytes", "ns/header", "MB/s");
+    for (which = 0; which < cases; which++) {
+        bench = HttpBenchCases_ + which;
+        len = (int) strlen(bench->Header);
+        HOST_CHECK(HttpdiskHttpParse(bench->Header, len, &response));
+        HOST_CHECK(response.status == bench->Status);
+        HOST_CHECK(response.content_length == bench->ContentLength);
+        HOST_CHECK(response.range_start == bench->RangeStart);
+        HOST_CHECK(response.keep_alive == bench->KeepAlive);
+
+        reps = 0;
+        start = HostNow();
+        do {
+            for (i = 0; i < 1000; i++) {
+                HttpdiskHttpParse(bench->Header, len, &response);
+                sum += response.content_length;
+              }
+            reps += i;
+            elapsed = HostNow() - start;
+          } while (elapsed < budget);
+        printf(
+            "%-12s %6d %12.1f %10.1f\n",
+            bench->Name,
+            len,
+            elapsed * 1e9 / reps,
+            (double) len * reps / elapsed / 1e6
+          );
+      }
+    /* So that the parsing isn't optimized away. */
+    HOST_CHECK(sum != 0);
+    return HostDone("httpbench");
+  }
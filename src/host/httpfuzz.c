@@ -0,0 +1,275 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk response header fuzzer.
+ *
+ * Response headers come from the network, so HttpdiskHttpParse must
+ * never read outside the header it's given, and whatever it returns
+ * must make sense.  Each input is copied to a buffer of exactly its
+ * size, so that a build with -fsanitize=address catches stray reads.
+ *
+ * Built with -DHOST_M_LIBFUZZER (see "make fuzz"), this is a libFuzzer
+ * target.  Otherwise, it's a small fuzzer of its own, which mutates a
+ * few real response headers by flipping, replacing, inserting and
+ * deleting bytes and header fields.
+ *
+ * Usage: httpfuzz [-n runs] [-s seed] [file...]
+ *
+ *   -n   How many mutated headers to parse.  Default 200000.
+ *   -s   The seed for the mutations.  Default 1.
+ *
+ * Files given are parsed as they are, instead, to replay a finding.  A
+ * mutated header which fails is saved as httpfuzz.fail.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "httpparse.h"
+#include "host.h"
+
+/* The largest input, as for a disk's scratch buffer. */
+#define HTTP_FUZZ_M_MAX_ (4096 * 4)
+
+/* Where a failing input is saved. */
+#define HTTP_FUZZ_M_SAVE_ "httpfuzz.fail"
+
+#define HTTP_FUZZ_M_COUNT_(Array_) (sizeof (Array_) / sizeof *(Array_))
+
+/* Headers to start from. */
+static const char * const HttpFuzzSeeds_[] = {
+    "HTTP/1.1 206 Partial Content\r\n"
+      "Date: Sat, 17 Oct 2026 10:00:00 GMT\r\n"
+      "Content-Range: bytes 1048576-1114111/4294967296\r\n"
+      "Content-Length: 65536\r\n"
+      "ETag: \"5f3a-100000000\"\r\n"
+      "Last-Modified: Fri, 16 Oct 2026 09:00:00 GMT\r\n"
+      "Connection: keep-alive\r\n\r\n",
+    "HTTP/1.1 200 OK\r\nContent-Length: 4294967296\r\n"
+      "Accept-Ranges: bytes\r\n\r\n",
+    "HTTP/1.0 200 OK\r\nConnection: Keep-Alive\r\n"
+      "content-length:\t512\r\n\r\n",
+    "HTTP/1.1 416 Range Not Satisfiable\r\n"
+      "Content-Range: bytes */1024\r\nConnection: close\r\n\r\n",
+    "HTTP/1.1 206 x\nContent-Range:bytes 0-0/1\nETag:W/\"a\"\n\n",
+  };
+
+/* Pieces of headers to insert. */
+static const char * const HttpFuzzTokens_[] = {
+    "\r\n",
+    "\n",
+    " ",
+    "HTTP/1.",
+    "Content-Length: ",
+    "Content-Range: bytes ",
+    "ETag: ",
+    "Last-Modified: ",
+    "Connection: close",
+    "Connection: keep-alive",
+    "-",
+    "/",
+    "9223372036854775807",
+    "99999999999999999999",
+  };
+
+/*
+ * Parse one input, and check what came back.  Returns 0 if something
+ * was wrong.
+ */
+static int HttpFuzzOne_(const unsigned char * data, size_t size) {
+    HTTPDISK_S_RESPONSE response, again;
+    const char * header;
+    const char * end;
+    char * copy;
+    int ok, good;
+
+    if (size > HTTP_FUZZ_M_MAX_)
+      size = HTTP_FUZZ_M_MAX_;
+    copy = malloc(size ? size : 1);
+    if (!copy)
+      return 1;
+    memcpy(copy, data, size);
+    header = copy;
+    end = header + size;
+
+    /* For comparing them whole, padding and all. */
+    memset(&response, 0, sizeof response);
+    memset(&again, 0, sizeof again);
+    ok = HttpdiskHttpParse(header, (int) size, &response);
+    good =
+      (ok == 0 || ok == 1) &&
+      (ok ? response.status >= 0 : response.status == -1) &&
+      (response.keep_alive == 0 || response.keep_alive == 1) &&
+      response.content_length >= -1 &&
+      response.range_start >= -1 &&
+      response.range_end >= -1 &&
+      response.total >= -1 &&
+      (response.etag ?
+        response.etag >= header &&
+          response.etag_len >= 0 &&
+          response.etag_len <= end - response.etag :
+        !response.etag_len) &&
+      (response.modified ?
+        response.modified >= header &&
+          response.modified_len >= 0 &&
+          response.modified_len <= end - response.modified :
+        !response.modified_len);
+
+    /* The same header says the same thing. */
+    HttpdiskHttpParse(header, (int) size, &again);
+    good = good && !memcmp(&response, &again, sizeof response);
+    free(copy);
+    return good;
+  }
+
+#ifdef HOST_M_LIBFUZZER
+
+extern int LLVMFuzzerTestOneInput(const unsigned char *, size_t);
+
+int LLVMFuzzerTestOneInput(const unsigned char * data, size_t size) {
+    if (!HttpFuzzOne_(data, size))
+      abort();
+    return 0;
+  }
+
+#else  /* HOST_M_LIBFUZZER */
+
+/* Mutate a header in place.  Returns its new length. */
+static size_t HttpFuzzMutate_(unsigned char * buf, size_t len) {
+    static const char bytes[] = "\r\n\t :-/*0123456789\"Hh";
+    const char * token;
+    size_t at, n, mutations;
+
+    for (mutations = 1 + HostRand() % 8; mutations; mutations--) {
+        at = len ? HostRand() % (len + 1) : 0;
+        switch (HostRand() % 5) {
+            case 0:
+              if (at < len)
+                buf[at] ^= (unsigned char) (1 << HostRand() % 8);
+              break;
+
+            case 1:
+              if (at < len)
+                buf[at] = bytes[HostRand() % (sizeof bytes - 1)];
+              break;
+
+            case 2:
+              token = HttpFuzzTokens_[
+                  HostRand() % HTTP_FUZZ_M_COUNT_(HttpFuzzTokens_)
+                ];
+              n = strlen(token);
+              if (len + n > HTTP_FUZZ_M_MAX_)
+                break;
+              memmove(buf + at + n, buf + at, len - at);
+              memcpy(buf + at, token, n);
+              len += n;
+              break;
+
+            case 3:
+              n = 1 + HostRand() % 16;
+              if (at + n > len)
+                n = len - at;
+              memmove(buf + at, buf + at + n, len - at - n);
+              len -= n;
+              break;
+
+            default:
+              /* As if the header were cut short. */
+              len = at;
+          }
+      }
+    return len;
+  }
+
+/* Save a failing input, to be given back to us. */
+static void HttpFuzzSave_(const unsigned char * buf, size_t len) {
+    FILE * file;
+
+    file = fopen(HTTP_FUZZ_M_SAVE_, "wb");
+    if (!file || fwrite(buf, 1, len, file) != len) {
+        perror(HTTP_FUZZ_M_SAVE_);
+      } else {
+        fprintf(stderr, "httpfuzz: input saved to %s\n", HTTP_FUZZ_M_SAVE_);
+      }
+    if (file)
+      fclose(file);
+  }
+
+/* Parse a file as it is. */
+static int HttpFuzzFile_(const char * path) {
+    static unsigned char buf[HTTP_FUZZ_M_MAX_];
+    FILE * file;
+    size_t len;
+
+    file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return 0;
+      }
+    len = fread(buf, 1, sizeof buf, file);
+    fclose(file);
+    return HttpFuzzOne_(buf, len);
+  }
+
+int main(int argc, char ** argv) {
+    static unsigned char buf[HTTP_FUZZ_M_MAX_];
+    unsigned long runs = 200000, i;
+    const char * seed;
+    size_t len;
+    int opt;
+
+    HostSeed(1);
+    for (opt = 1; opt < argc - 1 && argv[opt][0] == '-'; opt += 2) {
+        switch (argv[opt][1]) {
+            case 'n':
+              runs = strtoul(argv[opt + 1], NULL, 0);
+              break;
+            case 's':
+              HostSeed(strtoul(argv[opt + 1], NULL, 0));
+              break;
+            default:
+              fprintf(stderr, "Unknown option %s\n", argv[opt]);
+              return 2;
+          }
+      }
+    if (opt < argc) {
+        for (; opt < argc; opt++)
+          HOST_CHECK(HttpFuzzFile_(argv[opt]));
+        return HostDone("httpfuzz");
+      }
+
+    for (i = 0; i < runs; i++) {
+        seed = HttpFuzzSeeds_[HostRand() % HTTP_FUZZ_M_COUNT_(HttpFuzzSeeds_)];
+        len = strlen(seed);
+        memcpy(buf, seed, len);
+        len = HttpFuzzMutate_(buf, len);
+        if (!HttpFuzzOne_(buf, len)) {
+            HttpFuzzSave_(buf, len);
+            HOST_CHECK(!"a mutated header parses sensibly");
+            break;
+          }
+      }
+    return HostDone("httpfuzz");
+  }
+
+#endif  /* HOST_M_LIBFUZZER */
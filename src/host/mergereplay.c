@@ -0,0 +1,382 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * AoE frame merging replay.
+ *
+ * Replays a block I/O trace through the AoE merge decisions, the way
+ * AoeDiskIo_ splits requests into tags and AoeThreadSend_ sends them,
+ * against a simulated clock and a target with a fixed round-trip time.
+ * It reports how many packets each megabyte took, with merging off and
+ * with a range of merge windows, and what the merging cost in latency.
+ *
+ * Usage: mergereplay [-m sectors] [-q frames] [-r rtt] [-w window] [trace]
+ *
+ *   -m   Sectors per packet, as the target's Query Config reply gives.
+ *        17 is a 9000-byte MTU and 2 a 1500-byte one.  Default 17.
+ *   -q   Frames the disk keeps in flight.  Default 16.
+ *   -r   Round-trip time, in microseconds.  Default 100.
+ *   -w   Only this merge window, in microseconds, instead of a range.
+ *
+ * Each line of the trace is an I/O request: the time it was issued in
+ * microseconds, R or W, the first sector and the number of sectors.
+ * Other lines are ignored.  A blktrace capture can be converted with:
+ *
+ *   blkparse -i sda -a issue -f "%T %t %d %S %n\n" |
+ *     awk '{ print $1 * 1000000 + int($2 / 1000), substr($3, 1, 1), $4, $5 }'
+ *
+ * Without a trace, a synthetic boot-like trace is used: a few files
+ * read sequentially in 4 KiB requests, side by side, among random
+ * 4 KiB reads and sequential log writes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "merge.h"
+#include "host.h"
+
+/* Times, in 100 ns units, as the driver keeps them. */
+#define MERGEREPLAY_M_US_ 10LL
+
+/* Time on the wire per sector at 1 Gb/s, in 100 ns units. */
+#define MERGEREPLAY_M_SECTOR_TIME_ 41LL
+
+/* The number of requests in the synthetic trace. */
+#define MERGEREPLAY_M_SYNTHETIC_ 50000
+
+/** An unsent tag. */
+typedef struct MERGEREPLAY_TAG_ {
+    AOE_S_MERGE_IO Io;
+    long long QueueTime;
+    /* The frame so far, once the tag has been held. */
+    unsigned int FrameSectors;
+    unsigned int FrameCount;
+    struct MERGEREPLAY_TAG_ * Next;
+    struct MERGEREPLAY_TAG_ * Previous;
+  } MERGEREPLAY_S_TAG_, * MERGEREPLAY_SP_TAG_;
+
+/** A frame in flight. */
+typedef struct MERGEREPLAY_FRAME_ {
+    long long Done;
+  } MERGEREPLAY_S_FRAME_, * MERGEREPLAY_SP_FRAME_;
+
+/** A replay's settings and results. */
+typedef struct MERGEREPLAY_RUN_ {
+    unsigned int MaxSectors;
+    unsigned int Window;
+    long long Rtt;
+    /* The merge window, or -1 for no merging. */
+    long long MergeWindow;
+    unsigned long Packets;
+    unsigned long long Sectors;
+    unsigned long Tags;
+    /* Total time from queueing to sending. */
+    long long QueueDelay;
+  } MERGEREPLAY_S_RUN_, * MERGEREPLAY_SP_RUN_;
+
+/** Make up a boot-like trace. */
+static void MergeReplaySynthesize_(void) {
+    enum { streams = 4 };
+    long long next[streams], log_lba = 8000000, time = 0;
+    unsigned long i;
+    unsigned int pick;
+
+    HostSeed(1);
+    for (pick = 0; pick < streams; pick++)
+      next[pick] = 100000 + pick * 1000000LL;
+    for (i = 0; i < MERGEREPLAY_M_SYNTHETIC_; i++) {
+        time += HostRand() % 40;
+        pick = HostRand() % 20;
+        if (pick < 14) {
+            /* A sequential read of one of the files. */
+            pick %= streams;
+            HostTraceAdd(time, 0, next[pick], 8);
+            next[pick] += 8;
+            /* Now and then, the reader moves on to another file. */
+            if (HostRand() % 256 == 0)
+              next[pick] = HostRand() % 4000000;
+          } else if (pick < 18) {
+            HostTraceAdd(time, 0, (HostRand() % 1000000) * 8, 8);
+          } else {
+            HostTraceAdd(time, 1, log_lba, 8);
+            log_lba += 8;
+          }
+      }
+  }
+
+/** Take a tag out of the unsent queue. */
+static void MergeReplayRemove_(
+    MERGEREPLAY_SP_TAG_ * first,
+    MERGEREPLAY_SP_TAG_ * last,
+    MERGEREPLAY_SP_TAG_ tag
+  ) {
+    if (tag->Previous)
+      tag->Previous->Next = tag->Next;
+      else
+      *first = tag->Next;
+    if (tag->Next)
+      tag->Next->Previous = tag->Previous;
+      else
+      *last = tag->Previous;
+  }
+
+/**
+ * Replay the trace.
+ *
+ * @v run               The settings, with the results filled in.
+ */
+static void MergeReplayRun_(MERGEREPLAY_SP_RUN_ run) {
+    MERGEREPLAY_SP_TAG_ tags, first = NULL, last = NULL, tag, walker;
+    MERGEREPLAY_SP_FRAME_ frames;
+    HOST_SP_TRACE_REQ req;
+    MERGEREPLAY_SP_TAG_ queued[AOE_M_MERGE_SCAN];
+    AOE_S_MERGE_IO ios[AOE_M_MERGE_SCAN], frame;
+    unsigned int picks[AOE_M_MERGE_MAX];
+    unsigned long next_req = 0, tag_count = 0, tag_max = 0, i;
+    unsigned int in_flight = 0, scanned, picked, j;
+    long long now = 0, next, hold_until;
+
+    for (i = 0; i < HostTraceCount; i++) {
+        tag_max += (HostTrace[i].Sectors + run->MaxSectors - 1) /
+          run->MaxSectors;
+      }
+    tags = calloc(tag_max, sizeof *tags);
+    frames = calloc(run->Window, sizeof *frames);
+    if (tags == NULL || frames == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+      }
+
+    run->Packets = 0;
+    run->Sectors = 0;
+    run->Tags = 0;
+    run->QueueDelay = 0;
+    while (next_req < HostTraceCount || first || in_flight) {
+        /* Replies. */
+        for (j = 0; j < in_flight; ) {
+            if (frames[j].Done <= now)
+              frames[j] = frames[--in_flight];
+              else
+              j++;
+          }
+
+        /* Requests, split into tags as AoeDiskIo_ does. */
+        while (
+            next_req < HostTraceCount &&
+            (req = HostTrace + next_req)->Time * MERGEREPLAY_M_US_ <= now
+          ) {
+            for (i = 0; i < req->Sectors; i += run->MaxSectors) {
+                tag = tags + tag_count++;
+                tag->Io.Lba = req->Lba + i;
+                tag->Io.Sectors = req->Sectors - i < run->MaxSectors ?
+                  req->Sectors - i :
+                  run->MaxSectors;
+                tag->Io.Kind = req->Kind;
+                tag->QueueTime = now;
+                tag->FrameSectors = tag->Io.Sectors;
+                tag->FrameCount = 1;
+                tag->Previous = last;
+                if (last)
+                  last->Next = tag;
+                  else
+                  first = tag;
+                last = tag;
+              }
+            next_req++;
+          }
+
+        /* Sends, as AoeThreadSend_ does. */
+        hold_until = 0;
+        while ((tag = first) != NULL && in_flight < run->Window) {
+            frame = tag->Io;
+            frame.Sectors = tag->FrameSectors;
+            if (run->MergeWindow >= 0) {
+                for (
+                    walker = tag->Next, scanned = 0;
+                    walker != NULL && scanned < AOE_M_MERGE_SCAN;
+                    walker = walker->Next, scanned++
+                  ) {
+                    queued[scanned] = walker;
+                    ios[scanned] = walker->Io;
+                  }
+                picked = AoeMergePick(
+                    &frame,
+                    tag->FrameCount,
+                    ios,
+                    scanned,
+                    run->MaxSectors,
+                    picks
+                  );
+                for (j = 0; j < picked; j++) {
+                    walker = queued[picks[j]];
+                    MergeReplayRemove_(&first, &last, walker);
+                    run->QueueDelay += now - walker->QueueTime;
+                  }
+                tag->FrameSectors = frame.Sectors;
+                tag->FrameCount += picked;
+                if (
+                    AoeMergeHold(
+                        &frame,
+                        run->MaxSectors,
+                        in_flight,
+                        now,
+                        tag->QueueTime + run->MergeWindow
+                      )
+                  ) {
+                    hold_until = tag->QueueTime + run->MergeWindow;
+                    break;
+                  }
+              }
+            MergeReplayRemove_(&first, &last, tag);
+            run->QueueDelay += now - tag->QueueTime;
+            run->Packets++;
+            run->Sectors += frame.Sectors;
+            run->Tags += tag->FrameCount;
+            frames[in_flight++].Done = now + run->Rtt +
+              frame.Sectors * MERGEREPLAY_M_SECTOR_TIME_;
+          }
+
+        /* Move the clock to whatever happens next. */
+        next = -1;
+        if (next_req < HostTraceCount)
+          next = HostTrace[next_req].Time * MERGEREPLAY_M_US_;
+        for (j = 0; j < in_flight; j++) {
+            if (next < 0 || frames[j].Done < next)
+              next = frames[j].Done;
+          }
+        if (hold_until && (next < 0 || hold_until < next))
+          next = hold_until;
+        if (next < 0)
+          break;
+        now = next;
+      }
+
+    HOST_CHECK(first == NULL);
+    HOST_CHECK(run->Tags == tag_count);
+    free(frames);
+    free(tags);
+  }
+
+/** Print a replay's results. */
+static void MergeReplayPrint_(MERGEREPLAY_SP_RUN_ run) {
+    double mb = run->Sectors * 512.0 / (1024 * 1024);
+    char window[32];
+
+    if (run->MergeWindow < 0)
+      strcpy(window, "off");
+      else
+      sprintf(window, "%lld us", run->MergeWindow / MERGEREPLAY_M_US_);
+    printf(
+        "%10s %10lu %12.1f %12.2f %12.1f\n",
+        window,
+        run->Packets,
+        mb > 0 ? run->Packets / mb : 0.0,
+        run->Packets ? (double) run->Sectors / run->Packets : 0.0,
+        run->Tags ?
+          (double) run->QueueDelay / run->Tags / MERGEREPLAY_M_US_ :
+          0.0
+      );
+  }
+
+int main(int argc, char ** argv) {
+    /* Merge windows, in microseconds, or -1 for no merging. */
+    static const long long windows[] = { -1, 0, 25, 100, 250, 1000 };
+    MERGEREPLAY_S_RUN_ run;
+    long long window = -2;
+    unsigned long long sectors = 0;
+    unsigned long i;
+    int opt;
+
+    memset(&run, 0, sizeof run);
+    run.MaxSectors = 17;
+    run.Window = 16;
+    run.Rtt = 100 * MERGEREPLAY_M_US_;
+    for (opt = 1; opt < argc - 1 && argv[opt][0] == '-'; opt += 2) {
+        switch (argv[opt][1]) {
+            case 'm':
+              run.MaxSectors = strtoul(argv[opt + 1], NULL, 0);
+              break;
+            case 'q':
+              run.Window = strtoul(argv[opt + 1], NULL, 0);
+              break;
+            case 'r':
+              run.Rtt = strtoll(argv[opt + 1], NULL, 0) * MERGEREPLAY_M_US_;
+              break;
+            case 'w':
+              window = strtoll(argv[opt + 1], NULL, 0) * MERGEREPLAY_M_US_;
+              break;
+            default:
+              fprintf(stderr, "Unknown option %s\n", argv[opt]);
+              return 2;
+          }
+      }
+    if (!run.MaxSectors || run.MaxSectors > 255 || !run.Window) {
+        fprintf(stderr, "Bad sectors per packet or frames in flight\n");
+        return 2;
+      }
+    if (opt < argc) {
+        if (!HostTraceLoad(argv[opt]))
+          return 1;
+      } else {
+        MergeReplaySynthesize_();
+      }
+    for (i = 0; i < HostTraceCount; i++)
+      sectors += HostTrace[i].Sectors;
+
+    printf(
+        "%lu requests, %.1f MiB, %u sectors per packet, %u in flight, "
+          "RTT %lld us\n",
+        HostTraceCount,
+        sectors * 512.0 / (1024 * 1024),
+        run.MaxSectors,
+        run.Window,
+        run.Rtt / MERGEREPLAY_M_US_
+      );
+    printf(
+        "%10s %10s %12s %12s %12s\n",
+        "merge",
+        "packets",
+        "packets/MiB",
+        "sectors/pkt",
+        "queued us"
+      );
+    if (window >= 0) {
+        run.MergeWindow = -1;
+        MergeReplayRun_(&run);
+        MergeReplayPrint_(&run);
+        run.MergeWindow = window;
+        MergeReplayRun_(&run);
+        MergeReplayPrint_(&run);
+      } else {
+        for (i = 0; i < sizeof windows / sizeof *windows; i++) {
+            run.MergeWindow = windows[i] < 0 ?
+              -1 :
+              windows[i] * MERGEREPLAY_M_US_;
+            MergeReplayRun_(&run);
+            MergeReplayPrint_(&run);
+            HOST_CHECK(run.Sectors == sectors);
+          }
+      }
+    HostTraceFree();
+    return HostDone("mergereplay");
+  }
@@ -0,0 +1,304 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * File-backed disk queue depth benchmark.
+ *
+ * A filedisk sends up to its queue depth of requests to the file
+ * system at once, with the file opened without the file system's
+ * cache.  This measures what that is worth on the host: a scratch file
+ * is read and written without the page cache (O_DIRECT), with 1, 8
+ * and 32 requests in flight, and the throughput and IOPS of each are
+ * reported.  Each request in flight is a thread doing pread or pwrite,
+ * as the file system would see several IRPs.  Every block read is
+ * checked.
+ *
+ * Usage: qdbench [-s MiB] [-t seconds] [directory]
+ *
+ *   -s   The size of the scratch file.  Default 256.
+ *   -t   How long to run each case.  Default 1.
+ *
+ * The scratch file is made in the directory, /var/tmp by default, and
+ * removed afterwards.  On file systems without O_DIRECT, such as tmpfs,
+ * the page cache is used and the results say so.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "host.h"
+
+/* The unit the file is stamped and checked in. */
+#define QDBENCH_M_BLOCK_ 4096
+
+/* The most requests in flight. */
+#define QDBENCH_M_QD_MAX_ 32
+
+/** A benchmark case. */
+typedef struct QDBENCH_CASE_ {
+    const char * Name;
+    unsigned int Size;
+    int Write;
+    int Sequential;
+  } QDBENCH_S_CASE_, * QDBENCH_SP_CASE_;
+
+/** A run of a case, shared by its threads. */
+typedef struct QDBENCH_RUN_ {
+    QDBENCH_SP_CASE_ Case;
+    int File;
+    unsigned long long Blocks;
+    double Deadline;
+    pthread_mutex_t Lock;
+    /* The next offset, for sequential cases. */
+    unsigned long long Next;
+    /* Results. */
+    unsigned long long Ios;
+    unsigned long Errors;
+  } QDBENCH_S_RUN_, * QDBENCH_SP_RUN_;
+
+/** Stamp a buffer with the index of each block it holds. */
+static void QdBenchStamp_(
+    unsigned char * buf,
+    unsigned long long offset,
+    unsigned int size
+  ) {
+    unsigned int i;
+    unsigned long long index;
+
+    for (i = 0; i < size; i += QDBENCH_M_BLOCK_) {
+        index = offset / QDBENCH_M_BLOCK_ + i / QDBENCH_M_BLOCK_;
+        memcpy(buf + i, &index, sizeof index);
+      }
+  }
+
+/** Check a buffer's stamps. */
+static int QdBenchCheck_(
+    const unsigned char * buf,
+    unsigned long long offset,
+    unsigned int size
+  ) {
+    unsigned int i;
+    unsigned long long index;
+
+    for (i = 0; i < size; i += QDBENCH_M_BLOCK_) {
+        memcpy(&index, buf + i, sizeof index);
+        if (index != offset / QDBENCH_M_BLOCK_ + i / QDBENCH_M_BLOCK_)
+          return 0;
+      }
+    return 1;
+  }
+
+/** Keep one request in flight until the deadline. */
+static void * QdBenchThread_(void * arg) {
+    QDBENCH_SP_RUN_ run = arg;
+    unsigned int size = run->Case->Size;
+    unsigned long long slots = run->Blocks * QDBENCH_M_BLOCK_ / size;
+    unsigned long long offset, ios = 0;
+    unsigned long errors = 0;
+    unsigned int seed;
+    void * buf;
+    ssize_t done;
+
+    if (posix_memalign(&buf, QDBENCH_M_BLOCK_, size))
+      return NULL;
+    pthread_mutex_lock(&run->Lock);
+    seed = HostRand();
+    pthread_mutex_unlock(&run->Lock);
+    while (HostNow() < run->Deadline) {
+        if (run->Case->Sequential) {
+            pthread_mutex_lock(&run->Lock);
+            offset = run->Next;
+            run->Next = (run->Next + size) % (slots * size);
+            pthread_mutex_unlock(&run->Lock);
+          } else {
+            seed = seed * 1103515245 + 12345;
+            offset = (unsigned long long) (seed >> 4) % slots * size;
+          }
+        if (run->Case->Write) {
+            QdBenchStamp_(buf, offset, size);
+            done = pwrite(run->File, buf, size, (off_t) offset);
+          } else {
+            done = pread(run->File, buf, size, (off_t) offset);
+            if (done == (ssize_t) size && !QdBenchCheck_(buf, offset, size))
+              done = -1;
+          }
+        if (done != (ssize_t) size)
+          errors++;
+        ios++;
+      }
+    free(buf);
+    pthread_mutex_lock(&run->Lock);
+    run->Ios += ios;
+    run->Errors += errors;
+    pthread_mutex_unlock(&run->Lock);
+    return NULL;
+  }
+
+/** Run a case at a queue depth, and print the results. */
+static void QdBenchRun_(
+    QDBENCH_SP_CASE_ bench_case,
+    int file,
+    unsigned long long blocks,
+    unsigned int depth,
+    double seconds
+  ) {
+    pthread_t threads[QDBENCH_M_QD_MAX_];
+    QDBENCH_S_RUN_ run;
+    unsigned int i, started;
+    double start;
+
+    memset(&run, 0, sizeof run);
+    run.Case = bench_case;
+    run.File = file;
+    run.Blocks = blocks;
+    pthread_mutex_init(&run.Lock, NULL);
+    start = HostNow();
+    run.Deadline = start + seconds;
+    for (started = 0; started < depth; started++) {
+        if (pthread_create(threads + started, NULL, QdBenchThread_, &run))
+          break;
+      }
+    for (i = 0; i < started; i++)
+      pthread_join(threads[i], NULL);
+    seconds = HostNow() - start;
+    pthread_mutex_destroy(&run.Lock);
+
+    HOST_CHECK(started == depth);
+    HOST_CHECK(run.Ios > 0);
+    HOST_CHECK(run.Errors == 0);
+    printf(
+        "%-14s %4u %10.1f %10.0f\n",
+        bench_case->Name,
+        depth,
+        run.Ios * (double) bench_case->Size / (1024 * 1024) / seconds,
+        run.Ios / seconds
+      );
+  }
+
+/** Fill the scratch file with stamped blocks. */
+static int QdBenchFill_(int file, unsigned long long blocks) {
+    enum { chunk = 256 * QDBENCH_M_BLOCK_ };
+    unsigned long long offset;
+    void * buf;
+    int ok = 1;
+
+    if (posix_memalign(&buf, QDBENCH_M_BLOCK_, chunk))
+      return 0;
+    for (
+        offset = 0;
+        ok && offset < blocks * QDBENCH_M_BLOCK_;
+        offset += chunk
+      ) {
+        QdBenchStamp_(buf, offset, chunk);
+        ok = pwrite(file, buf, chunk, (off_t) offset) == chunk;
+      }
+    free(buf);
+    return ok && !fsync(file);
+  }
+
+int main(int argc, char ** argv) {
+    static QDBENCH_S_CASE_ cases[] = {
+        { "rand-read-4k", 4096, 0, 0 },
+        { "rand-write-4k", 4096, 1, 0 },
+        { "seq-read-64k", 65536, 0, 1 },
+      };
+    static const unsigned int depths[] = { 1, 8, QDBENCH_M_QD_MAX_ };
+    const char * dir = "/var/tmp";
+    char path[4096];
+    unsigned long mib = 256;
+    double seconds = 1;
+    unsigned int i, j;
+    int opt, file, direct = 1;
+
+    for (opt = 1; opt < argc - 1 && argv[opt][0] == '-'; opt += 2) {
+        switch (argv[opt][1]) {
+            case 's':
+              mib = strtoul(argv[opt + 1], NULL, 0);
+              break;
+            case 't':
+              seconds = strtod(argv[opt + 1], NULL);
+              break;
+            default:
+              fprintf(stderr, "Unknown option %s\n", argv[opt]);
+              return 2;
+          }
+      }
+    if (opt < argc)
+      dir = argv[opt];
+    if (!mib || seconds <= 0) {
+        fprintf(stderr, "Bad size or time\n");
+        return 2;
+      }
+
+    snprintf(path, sizeof path, "%s/qdbench.XXXXXX", dir);
+    file = mkstemp(path);
+    if (file < 0) {
+        perror(path);
+        return 1;
+      }
+    close(file);
+    file = open(path, O_RDWR | O_DIRECT);
+    if (file < 0 && errno == EINVAL) {
+        direct = 0;
+        file = open(path, O_RDWR);
+      }
+    if (file < 0) {
+        perror(path);
+        unlink(path);
+        return 1;
+      }
+    if (!QdBenchFill_(file, mib * 1024 * 1024 / QDBENCH_M_BLOCK_)) {
+        perror(path);
+        close(file);
+        unlink(path);
+        return 1;
+      }
+
+    printf(
+        "%s: %lu MiB, %s\n",
+        path,
+        mib,
+        direct ? "unbuffered" : "through the page cache (no O_DIRECT)"
+      );
+    printf("%-14s %4s %10s %10s\n", "case", "qd", "MiB/s", "IOPS");
+    for (i = 0; i < sizeof cases / sizeof *cases; i++) {
+        for (j = 0; j < sizeof depths / sizeof *depths; j++) {
+            QdBenchRun_(
+                cases + i,
+                file,
+                mib * 1024 * 1024 / QDBENCH_M_BLOCK_,
+                depths[j],
+                seconds
+              );
+          }
+      }
+
+    close(file);
+    unlink(path);
+    return HostDone("qdbench");
+  }
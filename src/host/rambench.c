@@ -0,0 +1,401 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * RAM disk mapping benchmark.
+ *
+ * A GRUB4DOS or MEMDISK RAM disk is memory which the driver must map
+ * before copying to or from it.  This compares the ways ramdisk.c has
+ * done that, with the RAM disk's memory in a shared memory file:
+ *
+ *   per-io        Map the request's pages, copy, and unmap them again,
+ *                 as WvRamdiskIo_ used to with MmMapIoSpace.
+ *   chunks        Map 4 MiB chunks as they're first used and keep the
+ *                 mappings, as WvRamdiskIo_ does now on 64-bit.
+ *   lru-256m      The same, but with at most 256 MiB mapped, and the
+ *                 least recently used chunk unmapped to make room, as
+ *                 WvRamdiskIo_ first did on 32-bit.
+ *   chunks-256m   At most 256 MiB mapped, as on 32-bit now: once that
+ *                 many chunks are mapped, an unmapped chunk's requests
+ *                 are mapped just for themselves, as per-io, until the
+ *                 chunk has seen a quarter of its size in I/O.  Only
+ *                 then is the least recently used chunk unmapped.
+ *
+ * The old mappings were uncached, too, which a user-mode mapping can't
+ * be, so per-io understates what the old code cost.  Every block read
+ * is checked.
+ *
+ * Usage: rambench [-s MiB] [-t seconds]
+ *
+ *   -s   The size of the RAM disk.  Default 512.
+ *   -t   How long to run each case.  Default 1.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "host.h"
+
+/* The unit the disk is stamped and checked in. */
+#define RAMBENCH_M_BLOCK_ 4096
+
+/* The size of each chunk, as WV_M_RAMDISK_CHUNK_SIZE. */
+#define RAMBENCH_M_CHUNK_ (4 * 1024 * 1024)
+
+/* The most chunks mapped on 32-bit, as WV_M_RAMDISK_CHUNKS_MAPPED. */
+#define RAMBENCH_M_CHUNKS_32_ 64
+
+/* I/O which an unmapped chunk must see, as WV_M_RAMDISK_CHUNK_ADMIT. */
+#define RAMBENCH_M_ADMIT_ (RAMBENCH_M_CHUNK_ / 4)
+
+/** A mapped chunk. */
+typedef struct RAMBENCH_CHUNK_ {
+    unsigned char * Map;
+    unsigned int LastUse;
+    unsigned int Missed;
+  } RAMBENCH_S_CHUNK_, * RAMBENCH_SP_CHUNK_;
+
+/** A RAM disk. */
+typedef struct RAMBENCH_DISK_ {
+    int File;
+    unsigned long long Size;
+    /* Chunk mappings, for the chunk methods. */
+    RAMBENCH_SP_CHUNK_ Chunks;
+    unsigned int ChunkCount;
+    unsigned int ChunksMapped;
+    unsigned int ChunksMax;
+    /* Once ChunksMax are mapped, RAMBENCH_M_ADMIT_ or 0. */
+    unsigned int Admit;
+    unsigned int Clock;
+  } RAMBENCH_S_DISK_, * RAMBENCH_SP_DISK_;
+
+/** A benchmark case. */
+typedef struct RAMBENCH_CASE_ {
+    const char * Name;
+    unsigned int Size;
+    int Write;
+    int Sequential;
+  } RAMBENCH_S_CASE_, * RAMBENCH_SP_CASE_;
+
+typedef int RAMBENCH_F_IO_(
+    RAMBENCH_SP_DISK_,
+    unsigned char *,
+    unsigned long long,
+    unsigned int,
+    int
+  );
+
+/** Stamp a buffer with the index of each block it holds. */
+static void RamBenchStamp_(
+    unsigned char * buf,
+    unsigned long long offset,
+    unsigned int size
+  ) {
+    unsigned int i;
+    unsigned long long index;
+
+    for (i = 0; i < size; i += RAMBENCH_M_BLOCK_) {
+        index = offset / RAMBENCH_M_BLOCK_ + i / RAMBENCH_M_BLOCK_;
+        memcpy(buf + i, &index, sizeof index);
+      }
+  }
+
+/** Check a buffer's stamps. */
+static int RamBenchCheck_(
+    const unsigned char * buf,
+    unsigned long long offset,
+    unsigned int size
+  ) {
+    unsigned int i;
+    unsigned long long index;
+
+    for (i = 0; i < size; i += RAMBENCH_M_BLOCK_) {
+        memcpy(&index, buf + i, sizeof index);
+        if (index != offset / RAMBENCH_M_BLOCK_ + i / RAMBENCH_M_BLOCK_)
+          return 0;
+      }
+    return 1;
+  }
+
+/** Copy to or from the disk, mapping its pages for just this request. */
+static int RamBenchPerIo_(
+    RAMBENCH_SP_DISK_ disk,
+    unsigned char * buf,
+    unsigned long long offset,
+    unsigned int size,
+    int write
+  ) {
+    unsigned char * map;
+
+    map = mmap(
+        NULL,
+        size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        disk->File,
+        (off_t) offset
+      );
+    if (map == MAP_FAILED)
+      return 0;
+    if (write)
+      memcpy(map, buf, size);
+      else
+      memcpy(buf, map, size);
+    munmap(map, size);
+    return 1;
+  }
+
+/** Get a chunk mapped, or 0 if it should be mapped per request. */
+static unsigned char * RamBenchChunk_(
+    RAMBENCH_SP_DISK_ disk,
+    unsigned int index,
+    unsigned int len
+  ) {
+    RAMBENCH_SP_CHUNK_ chunk = disk->Chunks + index, victim;
+    unsigned int i;
+
+    if (!chunk->Map) {
+        if (disk->ChunksMapped >= disk->ChunksMax) {
+            chunk->Missed += len;
+            if (chunk->Missed < disk->Admit)
+              return NULL;
+            victim = NULL;
+            for (i = 0; i < disk->ChunkCount; i++) {
+                if (
+                    disk->Chunks[i].Map &&
+                    (!victim || disk->Chunks[i].LastUse < victim->LastUse)
+                  )
+                  victim = disk->Chunks + i;
+              }
+            munmap(victim->Map, RAMBENCH_M_CHUNK_);
+            victim->Map = NULL;
+            disk->ChunksMapped--;
+          }
+        chunk->Map = mmap(
+            NULL,
+            RAMBENCH_M_CHUNK_,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            disk->File,
+            (off_t) index * RAMBENCH_M_CHUNK_
+          );
+        if (chunk->Map == MAP_FAILED) {
+            chunk->Map = NULL;
+            return NULL;
+          }
+        chunk->Missed = 0;
+        disk->ChunksMapped++;
+      }
+    chunk->LastUse = ++disk->Clock;
+    return chunk->Map;
+  }
+
+/** Copy to or from the disk through its chunk mappings. */
+static int RamBenchChunks_(
+    RAMBENCH_SP_DISK_ disk,
+    unsigned char * buf,
+    unsigned long long offset,
+    unsigned int size,
+    int write
+  ) {
+    unsigned int chunk_offset, len;
+    unsigned char * map;
+
+    while (size) {
+        chunk_offset = (unsigned int) (offset % RAMBENCH_M_CHUNK_);
+        len = RAMBENCH_M_CHUNK_ - chunk_offset;
+        if (len > size)
+          len = size;
+        map = RamBenchChunk_(
+            disk,
+            (unsigned int) (offset / RAMBENCH_M_CHUNK_),
+            len
+          );
+        if (map) {
+            if (write)
+              memcpy(map + chunk_offset, buf, len);
+              else
+              memcpy(buf, map + chunk_offset, len);
+          } else if (!RamBenchPerIo_(disk, buf, offset, len, write)) {
+            return 0;
+          }
+        offset += len;
+        buf += len;
+        size -= len;
+      }
+    return 1;
+  }
+
+/** Unmap every chunk. */
+static void RamBenchUnmap_(RAMBENCH_SP_DISK_ disk) {
+    unsigned int i;
+
+    for (i = 0; i < disk->ChunkCount; i++) {
+        if (disk->Chunks[i].Map)
+          munmap(disk->Chunks[i].Map, RAMBENCH_M_CHUNK_);
+        disk->Chunks[i].Map = NULL;
+        disk->Chunks[i].Missed = 0;
+      }
+    disk->ChunksMapped = 0;
+  }
+
+/** Run a case with a method, and print the results. */
+static void RamBenchRun_(
+    RAMBENCH_SP_DISK_ disk,
+    RAMBENCH_SP_CASE_ bench_case,
+    const char * method,
+    RAMBENCH_F_IO_ * io,
+    double seconds
+  ) {
+    unsigned int size = bench_case->Size;
+    unsigned long long slots = disk->Size / size;
+    unsigned long long offset, next = 0, ios = 0;
+    unsigned long errors = 0;
+    unsigned char * buf;
+    double start, deadline;
+    int ok;
+
+    buf = malloc(size);
+    if (!HOST_CHECK(buf != NULL))
+      return;
+    start = HostNow();
+    deadline = start + seconds;
+    while (HostNow() < deadline) {
+        if (bench_case->Sequential) {
+            offset = next;
+            next = (next + size) % (slots * size);
+          } else {
+            offset = HostRand() % slots * size;
+          }
+        if (bench_case->Write) {
+            RamBenchStamp_(buf, offset, size);
+            ok = io(disk, buf, offset, size, 1);
+          } else {
+            ok = io(disk, buf, offset, size, 0) &&
+              RamBenchCheck_(buf, offset, size);
+          }
+        if (!ok)
+          errors++;
+        ios++;
+      }
+    seconds = HostNow() - start;
+    RamBenchUnmap_(disk);
+    free(buf);
+
+    HOST_CHECK(ios > 0);
+    HOST_CHECK(errors == 0);
+    printf(
+        "%-14s %-12s %10.1f %10.0f\n",
+        bench_case->Name,
+        method,
+        ios * (double) size / (1024 * 1024) / seconds,
+        ios / seconds
+      );
+  }
+
+int main(int argc, char ** argv) {
+    static RAMBENCH_S_CASE_ cases[] = {
+        { "rand-read-4k", 4096, 0, 0 },
+        { "rand-write-4k", 4096, 1, 0 },
+        { "seq-read-64k", 65536, 0, 1 },
+        { "seq-read-1m", 1024 * 1024, 0, 1 },
+      };
+    RAMBENCH_S_DISK_ disk;
+    unsigned char * map;
+    unsigned long mib = 512;
+    double seconds = 1;
+    unsigned int i;
+    int opt;
+
+    for (opt = 1; opt < argc - 1 && argv[opt][0] == '-'; opt += 2) {
+        switch (argv[opt][1]) {
+            case 's':
+              mib = strtoul(argv[opt + 1], NULL, 0);
+              break;
+            case 't':
+              seconds = strtod(argv[opt + 1], NULL);
+              break;
+            default:
+              fprintf(stderr, "Unknown option %s\n", argv[opt]);
+              return 2;
+          }
+      }
+    if (opt < argc || !mib || mib % 4 || seconds <= 0) {
+        fprintf(stderr, "Usage: rambench [-s MiB] [-t seconds]\n");
+        return 2;
+      }
+
+    memset(&disk, 0, sizeof disk);
+    disk.Size = (unsigned long long) mib * 1024 * 1024;
+    disk.ChunkCount = (unsigned int) (disk.Size / RAMBENCH_M_CHUNK_);
+    disk.Chunks = calloc(disk.ChunkCount, sizeof *disk.Chunks);
+    disk.File = memfd_create("rambench", 0);
+    if (
+        !disk.Chunks ||
+        disk.File < 0 ||
+        ftruncate(disk.File, (off_t) disk.Size)
+      ) {
+        perror("rambench");
+        return 1;
+      }
+    map = mmap(
+        NULL,
+        disk.Size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED,
+        disk.File,
+        0
+      );
+    if (map == MAP_FAILED) {
+        perror("rambench");
+        return 1;
+      }
+    RamBenchStamp_(map, 0, (unsigned int) disk.Size);
+    munmap(map, disk.Size);
+
+    printf("%lu MiB RAM disk, %u KiB chunks\n", mib, RAMBENCH_M_CHUNK_ / 1024);
+    printf("%-14s %-12s %10s %10s\n", "case", "method", "MiB/s", "IOPS");
+    for (i = 0; i < sizeof cases / sizeof *cases; i++) {
+        RamBenchRun_(&disk, cases + i, "per-io", RamBenchPerIo_, seconds);
+        disk.ChunksMax = disk.ChunkCount;
+        disk.Admit = 0;
+        RamBenchRun_(&disk, cases + i, "chunks", RamBenchChunks_, seconds);
+        disk.ChunksMax = RAMBENCH_M_CHUNKS_32_;
+        RamBenchRun_(&disk, cases + i, "lru-256m", RamBenchChunks_, seconds);
+        disk.Admit = RAMBENCH_M_ADMIT_;
+        RamBenchRun_(
+            &disk,
+            cases + i,
+            "chunks-256m",
+            RamBenchChunks_,
+            seconds
+          );
+      }
+
+    close(disk.File);
+    free(disk.Chunks);
+    return HostDone("rambench");
+  }
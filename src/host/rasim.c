@@ -0,0 +1,442 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Read-ahead simulation.
+ *
+ * Replays the reads of a block I/O trace through the read-ahead stream
+ * detector and a model of the block cache it reads ahead into, with the
+ * cache's CLOCK replacement and its handling of blocks read ahead.  It
+ * reports the share of reads the cache answered, how much was read
+ * ahead and used, and how many bytes were read ahead and thrown away,
+ * with read-ahead off and on.
+ *
+ * Usage: rasim [-a KiB] [-b KiB] [-c MiB] [-f KiB] [trace]
+ *
+ *   -a   The most to read ahead of a stream, as the READAHEAD loader
+ *        option gives.  Default 1024.
+ *   -b   The cache block size.  Default 32.
+ *   -c   The cache size.  Default 4, the ReadAheadBuffer default.
+ *   -f   What the disk can have in flight.  Read-ahead takes at most
+ *        half of it.  Default 4096.
+ *
+ * The trace is in mergereplay's format; writes are skipped.  Each read
+ * completes before the next is issued, so reads ahead are never still
+ * in flight when they are needed.  Without a trace, a few synthetic
+ * workloads are run and checked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wv_stdlib.h"
+#include "readahead.h"
+#include "host.h"
+
+/* Block flags, as in the cache. */
+#define RASIM_M_VALID_ 0x01
+#define RASIM_M_REF_ 0x02
+#define RASIM_M_AHEAD_ 0x10
+
+/* The sector size. */
+#define RASIM_M_SECTOR_ 512
+
+/* The number of requests in each synthetic workload. */
+#define RASIM_M_SYNTHETIC_ 200000
+
+/** A cache block. */
+typedef struct RASIM_BLOCK_ {
+    struct RASIM_BLOCK_ * Next;
+    unsigned long long Index;
+    unsigned char Flags;
+  } RASIM_S_BLOCK_, * RASIM_SP_BLOCK_;
+
+/** A simulation's settings, cache and results. */
+typedef struct RASIM_RUN_ {
+    /* Settings. */
+    unsigned int AheadMax;
+    unsigned int BlockSectors;
+    unsigned int BlockCount;
+    /* The cache. */
+    RASIM_SP_BLOCK_ Blocks;
+    RASIM_SP_BLOCK_ * Buckets;
+    unsigned int BucketMask;
+    unsigned int Hand;
+    WVL_SP_DISK_READAHEAD ReadAhead;
+    /* Results. */
+    int ReadAheadOn;
+    unsigned long Reads;
+    unsigned long Hits;
+    unsigned long long ReadBytes;
+    unsigned long long DiskBytes;
+    unsigned long AheadBlocks;
+    unsigned long AheadHits;
+    unsigned long AheadWasted;
+  } RASIM_S_RUN_, * RASIM_SP_RUN_;
+
+static RASIM_SP_BLOCK_ RaSimFind_(
+    RASIM_SP_RUN_ run,
+    unsigned long long index
+  ) {
+    RASIM_SP_BLOCK_ block = run->Buckets[index & run->BucketMask];
+
+    while (block && block->Index != index)
+      block = block->Next;
+    return block;
+  }
+
+/** Find a block to replace, as WvlDiskCacheVictim_ does. */
+static RASIM_SP_BLOCK_ RaSimVictim_(RASIM_SP_RUN_ run) {
+    RASIM_SP_BLOCK_ block, * link;
+
+    for (;;) {
+        block = run->Blocks + run->Hand;
+        if (++run->Hand == run->BlockCount)
+          run->Hand = 0;
+
+        if (!(block->Flags & RASIM_M_VALID_))
+          return block;
+        if (block->Flags & RASIM_M_REF_) {
+            block->Flags &= ~RASIM_M_REF_;
+            continue;
+          }
+        if (block->Flags & RASIM_M_AHEAD_) {
+            run->AheadWasted++;
+            if (run->ReadAhead)
+              WvlDiskReadAheadWaste(run->ReadAhead);
+          }
+        link = run->Buckets + (block->Index & run->BucketMask);
+        while (*link != block)
+          link = &(*link)->Next;
+        *link = block->Next;
+        block->Flags = 0;
+        return block;
+      }
+  }
+
+/** Read a block from the disk into the cache. */
+static void RaSimFill_(
+    RASIM_SP_RUN_ run,
+    unsigned long long index,
+    unsigned char flags
+  ) {
+    RASIM_SP_BLOCK_ block = RaSimVictim_(run), * link;
+
+    link = run->Buckets + (index & run->BucketMask);
+    block->Index = index;
+    block->Flags = flags;
+    block->Next = *link;
+    *link = block;
+    run->DiskBytes += run->BlockSectors * RASIM_M_SECTOR_;
+  }
+
+/** Read ahead, as WvlDiskCacheReadAhead_ does. */
+static void RaSimAhead_(
+    RASIM_SP_RUN_ run,
+    unsigned long long start,
+    unsigned int count
+  ) {
+    unsigned long long first, end;
+
+    first = (start + run->BlockSectors - 1) / run->BlockSectors;
+    end = (start + count + run->BlockSectors - 1) / run->BlockSectors;
+    while (first < end && RaSimFind_(run, first))
+      first++;
+    while (end > first && RaSimFind_(run, end - 1))
+      end--;
+    for (; first < end; first++) {
+        if (RaSimFind_(run, first))
+          continue;
+        /* As with any newly read block, the clock passes it once. */
+        RaSimFill_(
+            run,
+            first,
+            RASIM_M_VALID_ | RASIM_M_REF_ | RASIM_M_AHEAD_
+          );
+        run->AheadBlocks++;
+      }
+  }
+
+/** A read, as WvlDiskCacheIo does it. */
+static void RaSimRead_(
+    RASIM_SP_RUN_ run,
+    unsigned long long lba,
+    unsigned int sectors
+  ) {
+    RASIM_SP_BLOCK_ block;
+    unsigned long long index, first, last, ahead_start;
+    unsigned int ahead_count;
+    int ahead;
+
+    ahead = run->ReadAhead && WvlDiskReadAheadNote(
+        run->ReadAhead,
+        lba,
+        sectors,
+        run->AheadMax,
+        &ahead_start,
+        &ahead_count
+      );
+    first = lba / run->BlockSectors;
+    last = (lba + sectors - 1) / run->BlockSectors;
+    for (index = first; index <= last; index++) {
+        if (!RaSimFind_(run, index))
+          break;
+      }
+    if (index <= last) {
+        /* A miss reads the request's blocks, which are kept. */
+        for (index = first; index <= last; index++) {
+            if (!RaSimFind_(run, index))
+              RaSimFill_(run, index, RASIM_M_VALID_ | RASIM_M_REF_);
+          }
+      } else {
+        for (index = first; index <= last; index++) {
+            block = RaSimFind_(run, index);
+            if (block->Flags & RASIM_M_AHEAD_) {
+                block->Flags &= ~RASIM_M_AHEAD_;
+                run->AheadHits++;
+              }
+            block->Flags |= RASIM_M_REF_;
+          }
+        run->Hits++;
+      }
+    run->Reads++;
+    run->ReadBytes += (unsigned long long) sectors * RASIM_M_SECTOR_;
+    if (ahead)
+      RaSimAhead_(run, ahead_start, ahead_count);
+  }
+
+/** Replay the trace's reads, with read-ahead on or off. */
+static int RaSimRun_(RASIM_SP_RUN_ run, int read_ahead) {
+    unsigned long i;
+    unsigned int buckets;
+
+    for (buckets = 1; buckets < run->BlockCount; buckets <<= 1)
+      ;
+    run->BucketMask = buckets - 1;
+    run->Blocks = calloc(run->BlockCount, sizeof *run->Blocks);
+    run->Buckets = calloc(buckets, sizeof *run->Buckets);
+    run->ReadAhead = read_ahead ? WvlDiskReadAheadCreate() : NULL;
+    if (!run->Blocks || !run->Buckets || (read_ahead && !run->ReadAhead)) {
+        fprintf(stderr, "Out of memory\n");
+        return 0;
+      }
+    run->Hand = 0;
+    run->Reads = run->Hits = 0;
+    run->ReadBytes = run->DiskBytes = 0;
+    run->AheadBlocks = run->AheadHits = run->AheadWasted = 0;
+
+    for (i = 0; i < HostTraceCount; i++) {
+        if (!HostTrace[i].Kind)
+          RaSimRead_(run, HostTrace[i].Lba, HostTrace[i].Sectors);
+      }
+
+    run->ReadAheadOn = read_ahead;
+    WvlDiskReadAheadFree(run->ReadAhead);
+    run->ReadAhead = NULL;
+    free(run->Buckets);
+    free(run->Blocks);
+    return 1;
+  }
+
+static void RaSimPrint_(const char * name, RASIM_SP_RUN_ run) {
+    double block = run->BlockSectors * (double) RASIM_M_SECTOR_;
+
+    printf(
+        "%-12s %-4s %7.2f%% %9.2f %9lu %7.2f%% %12.1f\n",
+        name,
+        run->ReadAheadOn ? "on" : "off",
+        run->Reads ? 100.0 * run->Hits / run->Reads : 0.0,
+        run->ReadBytes ? (double) run->DiskBytes / run->ReadBytes : 0.0,
+        run->AheadBlocks,
+        run->AheadBlocks ? 100.0 * run->AheadHits / run->AheadBlocks : 0.0,
+        run->AheadWasted * block / (1024 * 1024)
+      );
+  }
+
+/**
+ * Replay the trace with read-ahead off and then on.
+ *
+ * @v name              What the trace is, to print.
+ * @v settings          The settings to use.
+ * @v off               Filled with the results without read-ahead.
+ * @v on                Filled with the results with read-ahead.
+ * @ret int             1 on success, else 0.
+ */
+static int RaSimCompare_(
+    const char * name,
+    RASIM_SP_RUN_ settings,
+    RASIM_SP_RUN_ off,
+    RASIM_SP_RUN_ on
+  ) {
+    *off = *on = *settings;
+    if (!RaSimRun_(off, 0) || !RaSimRun_(on, 1))
+      return 0;
+    RaSimPrint_(name, off);
+    RaSimPrint_(name, on);
+    return 1;
+  }
+
+/** Make up a workload of reads. */
+static void RaSimSynthesize_(const char * name) {
+    enum { streams = 4 };
+    long long next[streams], lba = 0;
+    unsigned long i;
+    unsigned int pick;
+
+    HostTraceFree();
+    HostSeed(1);
+    for (pick = 0; pick < streams; pick++)
+      next[pick] = 100000 + pick * 1000000LL;
+    for (i = 0; i < RASIM_M_SYNTHETIC_; i++) {
+        switch (name[0]) {
+            case 's':
+              /* One file, read in 64 KiB requests. */
+              HostTraceAdd(i, 0, lba, 128);
+              lba += 128;
+              break;
+
+            case 'i':
+              /* Files read side by side, in 4 KiB requests. */
+              pick = HostRand() % streams;
+              HostTraceAdd(i, 0, next[pick], 8);
+              next[pick] += 8;
+              break;
+
+            case 'r':
+              /* 4 KiB reads anywhere on a 32 GiB disk. */
+              HostTraceAdd(i, 0, (HostRand() % 8000000) * 8LL, 8);
+              break;
+
+            default:
+              /* Boot-like: mostly files, some random reads. */
+              pick = HostRand() % 20;
+              if (pick < 14) {
+                  pick %= streams;
+                  HostTraceAdd(i, 0, next[pick], 8);
+                  next[pick] += 8;
+                  if (HostRand() % 256 == 0)
+                    next[pick] = HostRand() % 4000000;
+                } else {
+                  HostTraceAdd(i, 0, (HostRand() % 1000000) * 8LL, 8);
+                }
+          }
+      }
+  }
+
+int main(int argc, char ** argv) {
+    static const char * workloads[] = {
+        "sequential",
+        "interleaved",
+        "random",
+        "boot",
+      };
+    RASIM_S_RUN_ settings, off, on;
+    unsigned long ahead_kib = 1024, block_kib = 32, cache_mib = 4;
+    unsigned long flight_kib = 4096;
+    unsigned int i;
+    int opt;
+
+    for (opt = 1; opt < argc - 1 && argv[opt][0] == '-'; opt += 2) {
+        switch (argv[opt][1]) {
+            case 'a':
+              ahead_kib = strtoul(argv[opt + 1], NULL, 0);
+              break;
+            case 'b':
+              block_kib = strtoul(argv[opt + 1], NULL, 0);
+              break;
+            case 'c':
+              cache_mib = strtoul(argv[opt + 1], NULL, 0);
+              break;
+            case 'f':
+              flight_kib = strtoul(argv[opt + 1], NULL, 0);
+              break;
+            default:
+              fprintf(stderr, "Unknown option %s\n", argv[opt]);
+              return 2;
+          }
+      }
+    if (!block_kib || !cache_mib || cache_mib * 1024 < block_kib) {
+        fprintf(stderr, "Bad block or cache size\n");
+        return 2;
+      }
+
+    /* As WvlDiskCacheAheadMax_ and WvlDiskCacheCreate work them out. */
+    memset(&settings, 0, sizeof settings);
+    if (ahead_kib > flight_kib / 2)
+      ahead_kib = flight_kib / 2;
+    settings.AheadMax = ahead_kib * 1024 / RASIM_M_SECTOR_;
+    settings.BlockSectors = block_kib * 1024 / RASIM_M_SECTOR_;
+    settings.BlockCount = cache_mib * 1024 / block_kib;
+    i = settings.BlockCount * settings.BlockSectors /
+      (2 * WVL_M_DISK_READAHEAD_STREAMS);
+    if (settings.AheadMax > i)
+      settings.AheadMax = i;
+    ahead_kib = settings.AheadMax * RASIM_M_SECTOR_ / 1024;
+
+    printf(
+        "%lu KiB blocks, %u blocks, reading ahead up to %lu KiB\n",
+        block_kib,
+        settings.BlockCount,
+        ahead_kib
+      );
+    printf(
+        "%-12s %-4s %8s %9s %9s %8s %12s\n",
+        "trace",
+        "ra",
+        "hits",
+        "disk/read",
+        "ahead",
+        "used",
+        "wasted MiB"
+      );
+    if (opt < argc) {
+        if (!HostTraceLoad(argv[opt]))
+          return 1;
+        if (!RaSimCompare_(argv[opt], &settings, &off, &on))
+          return 1;
+        HostTraceFree();
+        return 0;
+      }
+
+    for (i = 0; i < sizeof workloads / sizeof *workloads; i++) {
+        RaSimSynthesize_(workloads[i]);
+        if (!RaSimCompare_(workloads[i], &settings, &off, &on))
+          return 1;
+        /* Read-ahead must never lose hits. */
+        HOST_CHECK(on.Hits >= off.Hits);
+        switch (workloads[i][0]) {
+            case 's':
+            case 'i':
+              /* Nearly every read is read ahead, and nearly all used. */
+              HOST_CHECK(on.Hits > on.Reads * 0.95);
+              HOST_CHECK(on.AheadHits > on.AheadBlocks * 0.95);
+              break;
+
+            case 'r':
+              /* Random reads mustn't set off much reading ahead. */
+              HOST_CHECK(on.DiskBytes < off.DiskBytes * 1.01);
+              break;
+          }
+      }
+    HostTraceFree();
+    return HostDone("rasim");
+  }
@@ -0,0 +1,422 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * AoE retransmit timing tests.
+ *
+ * The estimator and the timer heap are checked directly, then driven
+ * the way the AoE worker drives them against a simulated link and a
+ * simulated clock, so that every run sees exactly the same times.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rexmit.h"
+#include "host.h"
+
+/* Times, in 100 ns units. */
+#define REXMIT_M_MS_ 10000LL
+
+/* The initial retransmit timeout the driver uses. */
+#define REXMIT_M_RTO_INIT_ (20 * REXMIT_M_MS_)
+
+/* The number of tags the simulation keeps in flight. */
+#define REXMIT_M_WINDOW_ 64
+
+/** A simulated tag. */
+typedef struct REXMIT_TAG_ {
+    AOE_S_TIMER Timer;
+    long long FirstSend;
+    long long Rto;
+    int Resent;
+    /* When the reply arrives, or -1 if the last send was lost. */
+    long long ReplyAt;
+  } REXMIT_S_TAG_, * REXMIT_SP_TAG_;
+
+/** A simulated link. */
+typedef struct REXMIT_LINK_ {
+    /* The round-trip time, and what it changes to at Rtt2From. */
+    long long Rtt;
+    long long Rtt2;
+    long long Rtt2From;
+    /* Every this many sends is lost, or 0 for none. */
+    unsigned int LossEvery;
+    unsigned int Sends;
+  } REXMIT_S_LINK_, * REXMIT_SP_LINK_;
+
+/** A simulated disk, with its link and clock. */
+typedef struct REXMIT_SIM_ {
+    REXMIT_S_LINK_ Link;
+    AOE_S_RTT Rtt;
+    REXMIT_S_TAG_ Tags[REXMIT_M_WINDOW_];
+    AOE_SP_TIMER Slots[REXMIT_M_WINDOW_];
+    AOE_S_TIMER_HEAP Heap;
+    long long Now;
+    /* What was seen. */
+    unsigned long Replies;
+    unsigned long Samples;
+    unsigned long Resends;
+    /* Resends whose last send wasn't lost. */
+    unsigned long Spurious;
+    /* Deadlines which passed before the clock reached them. */
+    unsigned long Late;
+  } REXMIT_S_SIM_, * REXMIT_SP_SIM_;
+
+/** Check that a heap is in order and its timers know their places. */
+static void RexmitHeapCheck_(AOE_SP_TIMER_HEAP heap) {
+    unsigned int i;
+
+    for (i = 0; i < heap->Count; i++) {
+        if (!HOST_CHECK(heap->Timers[i]->HeapIndex == i))
+          return;
+        if (
+            i > 0 &&
+            !HOST_CHECK(
+                heap->Timers[(i - 1) / 2]->Deadline <=
+                heap->Timers[i]->Deadline
+              )
+          )
+          return;
+      }
+  }
+
+static void RexmitTestEstimator_(void) {
+    AOE_S_RTT rtt;
+    long long sample;
+    int i;
+
+    AoeRttInit(&rtt, REXMIT_M_RTO_INIT_);
+    HOST_CHECK(rtt.Rto == REXMIT_M_RTO_INIT_);
+
+    /* The first sample sets the mean and half of it as the deviation. */
+    HOST_CHECK(AoeRttSample(&rtt, 0, 2 * REXMIT_M_MS_));
+    HOST_CHECK(rtt.Srtt == 2 * REXMIT_M_MS_);
+    HOST_CHECK(rtt.RttVar == REXMIT_M_MS_);
+    HOST_CHECK(rtt.Rto == 6 * REXMIT_M_MS_);
+
+    /* Then the gains are 1/8 and 1/4. */
+    HOST_CHECK(AoeRttSample(&rtt, 0, 10 * REXMIT_M_MS_));
+    HOST_CHECK(rtt.Srtt == 3 * REXMIT_M_MS_);
+    HOST_CHECK(rtt.RttVar == REXMIT_M_MS_ + (8 - 1) * REXMIT_M_MS_ / 4);
+    HOST_CHECK(rtt.Rto == rtt.Srtt + 4 * rtt.RttVar);
+
+    /* Karn's rule: a resent tag's reply changes nothing. */
+    sample = rtt.Rto;
+    HOST_CHECK(!AoeRttSample(&rtt, 1, 500 * REXMIT_M_MS_));
+    HOST_CHECK(rtt.Srtt == 3 * REXMIT_M_MS_);
+    HOST_CHECK(rtt.Rto == sample);
+
+    /*
+     * A steady RTT converges, with the timeout just above it.  The gains
+     * are integer divisions, so the mean stops within 8 of the RTT.
+     */
+    for (i = 0; i < 200; i++)
+      AoeRttSample(&rtt, 0, 5 * REXMIT_M_MS_);
+    HOST_CHECK(rtt.Srtt > 5 * REXMIT_M_MS_ - 8);
+    HOST_CHECK(rtt.Srtt <= 5 * REXMIT_M_MS_);
+    HOST_CHECK(rtt.Rto >= 5 * REXMIT_M_MS_);
+    HOST_CHECK(rtt.Rto < 5 * REXMIT_M_MS_ + REXMIT_M_MS_ / 10);
+
+    /* The timeout is bounded. */
+    AoeRttInit(&rtt, REXMIT_M_RTO_INIT_);
+    AoeRttSample(&rtt, 0, 1);
+    HOST_CHECK(rtt.Rto == AOE_M_RTO_MIN);
+    AoeRttInit(&rtt, REXMIT_M_RTO_INIT_);
+    AoeRttSample(&rtt, 0, AOE_M_RTO_MAX);
+    HOST_CHECK(rtt.Rto == AOE_M_RTO_MAX);
+    AoeRttInit(&rtt, REXMIT_M_RTO_INIT_);
+    AoeRttSample(&rtt, 0, -5);
+    HOST_CHECK(rtt.Srtt == 0 && rtt.Rto == AOE_M_RTO_MIN);
+  }
+
+static void RexmitTestBackoff_(void) {
+    AOE_S_RTT rtt;
+    long long rto = AOE_M_RTO_MIN;
+    int i;
+
+    AoeRttInit(&rtt, AOE_M_RTO_MIN);
+    for (i = 1; i <= 10; i++) {
+        rto = AoeRttBackoff(&rtt, rto);
+        HOST_CHECK(rto == AOE_M_RTO_MIN << i);
+        /* New tags start from the backed-off timeout, too. */
+        HOST_CHECK(rtt.Rto == rto);
+      }
+    for (i = 0; i < 10; i++)
+      rto = AoeRttBackoff(&rtt, rto);
+    HOST_CHECK(rto == AOE_M_RTO_MAX);
+    HOST_CHECK(rtt.Rto == AOE_M_RTO_MAX);
+
+    /* A tag backing off from below the disk's timeout doesn't lower it. */
+    AoeRttInit(&rtt, 50 * REXMIT_M_MS_);
+    HOST_CHECK(AoeRttBackoff(&rtt, REXMIT_M_MS_) == 2 * REXMIT_M_MS_);
+    HOST_CHECK(rtt.Rto == 50 * REXMIT_M_MS_);
+
+    /* A sample replaces the backed-off timeout. */
+    AoeRttSample(&rtt, 0, REXMIT_M_MS_);
+    HOST_CHECK(rtt.Rto == 3 * REXMIT_M_MS_);
+  }
+
+static void RexmitTestHeap_(void) {
+    enum { count = 1000 };
+    static AOE_S_TIMER timers[count];
+    static AOE_SP_TIMER slots[count];
+    AOE_S_TIMER_HEAP heap = { slots, 0, count };
+    AOE_SP_TIMER timer;
+    long long last;
+    unsigned int i, removed = 0;
+
+    HOST_CHECK(AoeTimerHeapFirst(&heap) == NULL);
+    HostSeed(3);
+    for (i = 0; i < count; i++) {
+        /* Plenty of equal deadlines, too. */
+        timers[i].Deadline = HostRand() % 500;
+        AoeTimerHeapPush(&heap, timers + i);
+      }
+    RexmitHeapCheck_(&heap);
+    HOST_CHECK(heap.Count == count);
+
+    /* Remove from the middle, as replies do. */
+    for (i = 0; i < count; i += 3) {
+        AoeTimerHeapRemove(&heap, timers + i);
+        removed++;
+      }
+    RexmitHeapCheck_(&heap);
+    HOST_CHECK(heap.Count == count - removed);
+
+    /* Move deadlines both ways, as resends do. */
+    for (i = 1; i < count; i += 3) {
+        timers[i].Deadline = HostRand() % 1000;
+        AoeTimerHeapChanged(&heap, timers + i);
+      }
+    RexmitHeapCheck_(&heap);
+
+    /* Pull many deadlines in at once, as a dead path does. */
+    for (i = 2; i < count; i += 3)
+      timers[i].Deadline = 7;
+    AoeTimerHeapRebuild(&heap);
+    RexmitHeapCheck_(&heap);
+
+    /* Everything comes out in deadline order. */
+    last = -1;
+    while ((timer = AoeTimerHeapFirst(&heap)) != NULL) {
+        HOST_CHECK(timer->Deadline >= last);
+        last = timer->Deadline;
+        AoeTimerHeapRemove(&heap, timer);
+        removed++;
+      }
+    HOST_CHECK(removed == count);
+    RexmitHeapCheck_(&heap);
+  }
+
+/** Send a simulated tag, or resend it. */
+static void RexmitSend_(REXMIT_SP_SIM_ sim, REXMIT_SP_TAG_ tag) {
+    REXMIT_SP_LINK_ link = &sim->Link;
+    long long rtt = sim->Now >= link->Rtt2From ? link->Rtt2 : link->Rtt;
+
+    link->Sends++;
+    if (link->LossEvery && link->Sends % link->LossEvery == 0)
+      return;
+    /* A reply to an earlier send might already be on its way. */
+    if (tag->ReplyAt < 0 || sim->Now + rtt < tag->ReplyAt)
+      tag->ReplyAt = sim->Now + rtt;
+  }
+
+/** Send a new simulated tag, as AoeThreadSend_ does. */
+static void RexmitSendNew_(REXMIT_SP_SIM_ sim, REXMIT_SP_TAG_ tag) {
+    tag->FirstSend = sim->Now;
+    tag->Rto = sim->Rtt.Rto;
+    tag->Resent = 0;
+    tag->ReplyAt = -1;
+    RexmitSend_(sim, tag);
+    tag->Timer.Deadline = sim->Now + tag->Rto;
+    AoeTimerHeapPush(&sim->Heap, &tag->Timer);
+  }
+
+/**
+ * Start a simulated disk, with a full window of tags in flight.
+ *
+ * @v sim               The simulation, with its link filled in.
+ */
+static void RexmitStart_(REXMIT_SP_SIM_ sim) {
+    unsigned int i;
+
+    AoeRttInit(&sim->Rtt, REXMIT_M_RTO_INIT_);
+    sim->Heap.Timers = sim->Slots;
+    sim->Heap.Count = 0;
+    sim->Heap.Capacity = REXMIT_M_WINDOW_;
+    for (i = 0; i < REXMIT_M_WINDOW_; i++)
+      RexmitSendNew_(sim, sim->Tags + i);
+  }
+
+/**
+ * Run a simulated disk.
+ *
+ * @v sim               The simulation.
+ * @v replies           How many more replies to run for.
+ *
+ * This keeps the window full the way AoeThreadSend_, AoeThreadResend_
+ * and AoeTagAcceptReply_ do, with the clock moving straight to
+ * whichever of the next reply or the next deadline is due.
+ */
+static void RexmitRun_(REXMIT_SP_SIM_ sim, unsigned long replies) {
+    AOE_SP_TIMER first;
+    REXMIT_SP_TAG_ tag, next;
+    unsigned int i;
+
+    replies += sim->Replies;
+    while (sim->Replies < replies) {
+        /* The next reply, if any is coming. */
+        next = NULL;
+        for (i = 0; i < REXMIT_M_WINDOW_; i++) {
+            tag = sim->Tags + i;
+            if (tag->ReplyAt >= 0 && (!next || tag->ReplyAt < next->ReplyAt))
+              next = tag;
+          }
+        first = AoeTimerHeapFirst(&sim->Heap);
+
+        if (next && next->ReplyAt < first->Deadline) {
+            /* The reply arrives before any deadline. */
+            sim->Now = next->ReplyAt;
+            AoeTimerHeapRemove(&sim->Heap, &next->Timer);
+            if (
+                AoeRttSample(
+                    &sim->Rtt,
+                    next->Resent,
+                    sim->Now - next->FirstSend
+                  )
+              )
+              sim->Samples++;
+            sim->Replies++;
+            /* Send another tag in its place. */
+            RexmitSendNew_(sim, next);
+            continue;
+          }
+
+        /* The soonest deadline passes first.  Timer is the tag's first. */
+        tag = (REXMIT_SP_TAG_) first;
+        if (sim->Now > first->Deadline)
+          sim->Late++;
+        sim->Now = first->Deadline;
+        if (tag->ReplyAt >= 0)
+          sim->Spurious++;
+        sim->Resends++;
+        tag->Rto = AoeRttBackoff(&sim->Rtt, tag->Rto);
+        tag->Timer.Deadline = sim->Now + tag->Rto;
+        AoeTimerHeapChanged(&sim->Heap, &tag->Timer);
+        RexmitSend_(sim, tag);
+        tag->Resent = 1;
+        RexmitHeapCheck_(&sim->Heap);
+      }
+  }
+
+static void RexmitTestSteady_(void) {
+    static REXMIT_S_SIM_ sim;
+
+    sim.Link.Rtt = sim.Link.Rtt2 = 5 * REXMIT_M_MS_;
+    RexmitStart_(&sim);
+    RexmitRun_(&sim, 20000);
+    HOST_CHECK(sim.Resends == 0);
+    HOST_CHECK(sim.Samples == sim.Replies);
+    HOST_CHECK(sim.Rtt.Srtt == sim.Link.Rtt);
+    HOST_CHECK(sim.Rtt.Rto >= sim.Link.Rtt);
+    HOST_CHECK(sim.Rtt.Rto < sim.Link.Rtt + REXMIT_M_MS_ / 10);
+    printf(
+        "steady: %lu replies, %lu resends, RTO %lld us\n",
+        sim.Replies,
+        sim.Resends,
+        sim.Rtt.Rto / 10
+      );
+  }
+
+static void RexmitTestLoss_(void) {
+    static REXMIT_S_SIM_ sim;
+
+    sim.Link.Rtt = sim.Link.Rtt2 = 2 * REXMIT_M_MS_;
+    sim.Link.LossEvery = 50;
+    RexmitStart_(&sim);
+    RexmitRun_(&sim, 20000);
+    /* Every lost send is resent, on time, and only those. */
+    HOST_CHECK(
+        sim.Resends + REXMIT_M_WINDOW_ >=
+        sim.Link.Sends / sim.Link.LossEvery
+      );
+    HOST_CHECK(sim.Late == 0);
+    HOST_CHECK(sim.Spurious == 0);
+    /* Replies to resent tags aren't sampled. */
+    HOST_CHECK(sim.Samples < sim.Replies);
+    HOST_CHECK(sim.Samples + sim.Resends >= sim.Replies);
+    HOST_CHECK(sim.Rtt.Srtt == sim.Link.Rtt);
+    printf(
+        "loss:   %lu replies, %lu resends, %lu samples, RTO %lld us\n",
+        sim.Replies,
+        sim.Resends,
+        sim.Samples,
+        sim.Rtt.Rto / 10
+      );
+  }
+
+static void RexmitTestStep_(void) {
+    static REXMIT_S_SIM_ sim;
+    unsigned long resends;
+
+    /* Settle on a 1 ms link. */
+    sim.Link.Rtt = REXMIT_M_MS_;
+    sim.Link.Rtt2 = 30 * REXMIT_M_MS_;
+    sim.Link.Rtt2From = AOE_M_RTO_MAX * 1000;
+    RexmitStart_(&sim);
+    RexmitRun_(&sim, 20000);
+    HOST_CHECK(sim.Resends == 0);
+    HOST_CHECK(sim.Rtt.Srtt == sim.Link.Rtt);
+
+    /*
+     * Then the link slows to 30 ms.  The tags in flight all time out,
+     * but the timeout backs off until replies come back to tags sent
+     * once, and the estimate follows.
+     */
+    sim.Link.Rtt2From = sim.Now;
+    RexmitRun_(&sim, 20000);
+    resends = sim.Resends;
+    HOST_CHECK(resends > 0);
+    HOST_CHECK(resends <= 8 * REXMIT_M_WINDOW_);
+    HOST_CHECK(sim.Rtt.Srtt > sim.Link.Rtt2 - 8);
+    HOST_CHECK(sim.Rtt.Srtt <= sim.Link.Rtt2);
+    HOST_CHECK(sim.Rtt.Rto >= sim.Link.Rtt2);
+
+    /* Once it has, nothing more is resent. */
+    RexmitRun_(&sim, 20000);
+    HOST_CHECK(sim.Resends == resends);
+    printf(
+        "step:   %lu resends after the step, RTO %lld us\n",
+        resends,
+        sim.Rtt.Rto / 10
+      );
+  }
+
+int main(void) {
+    RexmitTestEstimator_();
+    RexmitTestBackoff_();
+    RexmitTestHeap_();
+    RexmitTestSteady_();
+    RexmitTestLoss_();
+    RexmitTestStep_();
+    return HostDone("rexmittest");
+  }
@@ -0,0 +1,193 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * AoE tag lookup benchmark.
+ *
+ * Replays a synthetic stream of AoE replies against the tag table: a
+ * number of tags are in flight to several targets, replies come back
+ * in random order, and each answered tag is looked up, removed and
+ * replaced by a newly-sent one, as the AoE worker does.  Some replies
+ * are late duplicates of tags already answered, which must not be
+ * found.  The same stream is replayed against a linear search of the
+ * in-flight tags, which is what the driver did before the tag table.
+ *
+ * Usage: tagbench [lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tagtable.h"
+#include "host.h"
+
+/* The number of AoE targets the tags are spread over. */
+#define TAGBENCH_M_TARGETS_ 8
+
+/* One reply in this many is a late duplicate. */
+#define TAGBENCH_M_STRAY_ 16
+
+/* The most tag comparisons the linear search may make per run. */
+#define TAGBENCH_M_LINEAR_WORK_ 400000000.0
+
+static unsigned int TagBenchNextId_ = 1;
+
+/** Assign a fresh tag ID and target to an entry. */
+static void TagBenchSend_(AOE_SP_TAG_ENTRY entry) {
+    unsigned int target = HostRand() % TAGBENCH_M_TARGETS_;
+
+    entry->Id = TagBenchNextId_++;
+    if (!TagBenchNextId_)
+      TagBenchNextId_++;
+    entry->Major = (unsigned short) (0x100 + target / 4);
+    entry->Minor = (unsigned char) (target % 4);
+  }
+
+/** Search the in-flight tags one by one. */
+static AOE_SP_TAG_ENTRY TagBenchLinearFind_(
+    AOE_SP_TAG_ENTRY entries,
+    unsigned int count,
+    unsigned int id,
+    unsigned short major,
+    unsigned char minor
+  ) {
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        if (
+            entries[i].Id == id &&
+            entries[i].Major == major &&
+            entries[i].Minor == minor
+          )
+          return entries + i;
+      }
+    return NULL;
+  }
+
+/**
+ * Replay one reply stream.
+ *
+ * @v inflight          The number of tags in flight.
+ * @v lookups           The number of replies to look up.
+ * @v linear            Search linearly instead of with the tag table.
+ * @ret double          Lookups per second.
+ */
+static double TagBenchRun_(
+    unsigned int inflight,
+    unsigned long lookups,
+    int linear
+  ) {
+    static AOE_S_TAG_TABLE table;
+    AOE_SP_TAG_ENTRY entries, found;
+    AOE_S_TAG_ENTRY stray;
+    unsigned long i;
+    unsigned int pick;
+    double start, elapsed;
+
+    entries = calloc(inflight, sizeof *entries);
+    if (entries == NULL) {
+        HOST_CHECK(entries != NULL);
+        return 0;
+      }
+    HostSeed(inflight);
+    TagBenchNextId_ = 1;
+    AoeTagTableInit(&table);
+    for (pick = 0; pick < inflight; pick++) {
+        TagBenchSend_(entries + pick);
+        AoeTagTableInsert(&table, entries + pick);
+      }
+    /* No reply has been answered yet, so ID 0 stands in. */
+    stray = entries[0];
+    stray.Id = 0;
+
+    start = HostNow();
+    for (i = 0; i < lookups; i++) {
+        pick = HostRand() % inflight;
+        if (i % TAGBENCH_M_STRAY_ == 0) {
+            /* Another reply to the last tag answered. */
+            found = linear ?
+              TagBenchLinearFind_(
+                  entries,
+                  inflight,
+                  stray.Id,
+                  stray.Major,
+                  stray.Minor
+                ) :
+              AoeTagTableFind(&table, stray.Id, stray.Major, stray.Minor);
+            if (found != NULL) {
+                HOST_CHECK(found == NULL);
+                break;
+              }
+            continue;
+          }
+        found = linear ?
+          TagBenchLinearFind_(
+              entries,
+              inflight,
+              entries[pick].Id,
+              entries[pick].Major,
+              entries[pick].Minor
+            ) :
+          AoeTagTableFind(
+              &table,
+              entries[pick].Id,
+              entries[pick].Major,
+              entries[pick].Minor
+            );
+        if (found != entries + pick) {
+            HOST_CHECK(found == entries + pick);
+            break;
+          }
+        AoeTagTableRemove(&table, found);
+        stray = *found;
+        TagBenchSend_(found);
+        AoeTagTableInsert(&table, found);
+      }
+    elapsed = HostNow() - start;
+
+    free(entries);
+    return elapsed > 0 ? lookups / elapsed : 0;
+  }
+
+int main(int argc, char ** argv) {
+    static const unsigned int inflight[] = { 16, 256, 1024, 4096, 16384 };
+    unsigned long lookups = 4000000, linear_lookups;
+    unsigned int i;
+    double table, linear;
+
+    if (argc > 1)
+      lookups = strtoul(argv[1], NULL, 0);
+    printf(
+        "%10s %16s %16s\n",
+        "in flight",
+        "table lookups/s",
+        "linear lookups/s"
+      );
+    for (i = 0; i < sizeof inflight / sizeof *inflight; i++) {
+        linear_lookups = lookups;
+        if (linear_lookups * (double) inflight[i] > TAGBENCH_M_LINEAR_WORK_)
+          linear_lookups = TAGBENCH_M_LINEAR_WORK_ / inflight[i];
+        table = TagBenchRun_(inflight[i], lookups, 0);
+        linear = TagBenchRun_(inflight[i], linear_lookups, 1);
+        printf("%10u %16.0f %16.0f\n", inflight[i], table, linear);
+      }
+    return HostDone("tagbench");
+  }
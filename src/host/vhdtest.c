@@ -0,0 +1,409 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * .VHD block mapping tests.
+ *
+ * Builds fixed, dynamic and differencing images in memory, then checks
+ * random reads and writes against a plain copy of the disk, that the
+ * writes are still there after loading the images again, and that bad
+ * images and requests are refused.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wv_stdlib.h"
+#include "vhdmap.h"
+#include "host.h"
+
+#define VHD_TEST_SECTOR WV_M_VHDMAP_SECTOR
+/* Small blocks, so that requests often cross them. */
+#define VHD_TEST_BLOCK_SECTORS 16
+#define VHD_TEST_BLOCKS 21
+/* Not a whole number of blocks. */
+#define VHD_TEST_SECTORS (VHD_TEST_BLOCK_SECTORS * (VHD_TEST_BLOCKS - 1) + 5)
+#define VHD_TEST_ROUNDS 2000
+
+/** An image file in memory. */
+typedef struct VHD_TEST_FILE {
+    unsigned char * Data;
+    unsigned long long Size;
+    /* Writes left before they start failing, or -1 for no limit. */
+    long WritesLeft;
+  } VHD_S_TEST_FILE, * VHD_SP_TEST_FILE;
+
+/* The error VhdTestRw_ reports, which isn't one of the mapping's. */
+#define VHD_TEST_E_IO (-100)
+
+static long VhdTestRw_(
+    void * file,
+    int write,
+    unsigned long long offset,
+    unsigned int length,
+    void * buffer
+  ) {
+    VHD_SP_TEST_FILE test_file = file;
+    unsigned char * data;
+
+    if (!write) {
+        if (offset > test_file->Size || length > test_file->Size - offset)
+          return VHD_TEST_E_IO;
+        memcpy(buffer, test_file->Data + offset, length);
+        return 0;
+      }
+    if (!test_file->WritesLeft)
+      return VHD_TEST_E_IO;
+    if (test_file->WritesLeft > 0)
+      test_file->WritesLeft--;
+    if (offset + length > test_file->Size) {
+        data = realloc(test_file->Data, offset + length);
+        if (!data)
+          return VHD_TEST_E_IO;
+        memset(data + test_file->Size, 0, offset + length - test_file->Size);
+        test_file->Data = data;
+        test_file->Size = offset + length;
+      }
+    memcpy(test_file->Data + offset, buffer, length);
+    return 0;
+  }
+
+static void VhdTestPut32_(unsigned char * bytes, unsigned int val) {
+    bytes[0] = (unsigned char) (val >> 24);
+    bytes[1] = (unsigned char) (val >> 16);
+    bytes[2] = (unsigned char) (val >> 8);
+    bytes[3] = (unsigned char) val;
+  }
+
+static void VhdTestPut64_(unsigned char * bytes, unsigned long long val) {
+    VhdTestPut32_(bytes, (unsigned int) (val >> 32));
+    VhdTestPut32_(bytes + 4, (unsigned int) val);
+  }
+
+/* Fill in a footer.  Offsets are as in msvhd.h. */
+static void VhdTestFooter_(
+    unsigned char * footer,
+    unsigned int type,
+    unsigned long long sectors,
+    unsigned long long data_offset,
+    unsigned char uid
+  ) {
+    memset(footer, 0, 512);
+    memcpy(footer, "conectix", 8);
+    VhdTestPut64_(footer + 16, data_offset);
+    VhdTestPut64_(footer + 40, sectors * VHD_TEST_SECTOR);
+    VhdTestPut64_(footer + 48, sectors * VHD_TEST_SECTOR);
+    VhdTestPut32_(footer + 60, type);
+    memset(footer + 68, uid, 16);
+  }
+
+/* Build a fixed .VHD holding data. */
+static void VhdTestFixed_(
+    VHD_SP_TEST_FILE file,
+    const unsigned char * data,
+    unsigned long long sectors
+  ) {
+    file->Size = sectors * VHD_TEST_SECTOR + 512;
+    file->Data = malloc(file->Size);
+    file->WritesLeft = -1;
+    memcpy(file->Data, data, sectors * VHD_TEST_SECTOR);
+    VhdTestFooter_(
+        file->Data + sectors * VHD_TEST_SECTOR,
+        2,
+        sectors,
+        ~0ULL,
+        0x11
+      );
+  }
+
+/*
+ * Build an empty dynamic .VHD, or a differencing one if parent_uid
+ * isn't zero, with a parent locator.
+ */
+static void VhdTestDynamic_(
+    VHD_SP_TEST_FILE file,
+    unsigned int bat_entries,
+    unsigned char uid,
+    unsigned char parent_uid
+  ) {
+    unsigned int bat_size = (bat_entries * 4 + 511) & ~511;
+    unsigned char * header;
+
+    /* Footer copy, header, locator data, BAT, footer. */
+    file->Size = 512 + 1024 + 512 + bat_size + 512;
+    file->Data = malloc(file->Size);
+    file->WritesLeft = -1;
+    VhdTestFooter_(
+        file->Data,
+        parent_uid ? 4 : 3,
+        VHD_TEST_SECTORS,
+        512,
+        uid
+      );
+    memcpy(file->Data + file->Size - 512, file->Data, 512);
+
+    header = file->Data + 512;
+    memset(header, 0, 1024);
+    memcpy(header, "cxsparse", 8);
+    VhdTestPut64_(header + 8, ~0ULL);
+    VhdTestPut64_(header + 16, 2048);
+    VhdTestPut32_(header + 28, bat_entries);
+    VhdTestPut32_(header + 32, VHD_TEST_BLOCK_SECTORS * VHD_TEST_SECTOR);
+    memset(header + 40, parent_uid, 16);
+    if (parent_uid) {
+        /* A W2ru locator, in the second slot. */
+        VhdTestPut32_(header + 576 + 24, 0x57327275);
+        VhdTestPut32_(header + 576 + 24 + 4, 1);
+        VhdTestPut32_(header + 576 + 24 + 8, 12);
+        VhdTestPut64_(header + 576 + 24 + 16, 1536);
+      }
+    memset(file->Data + 1536, 0, 512);
+    memcpy(file->Data + 1536, "p\0a\0r\0e\0n\0t\0", 12);
+    memset(file->Data + 2048, 0xFF, bat_size);
+  }
+
+static WV_SP_VHDMAP VhdTestLoad_(VHD_SP_TEST_FILE file) {
+    WV_SP_VHDMAP map;
+
+    HOST_CHECK(!WvVhdMapLoad(VhdTestRw_, file, file->Size, &map) && map);
+    return map;
+  }
+
+/* Check the whole disk against a copy. */
+static void VhdTestCompare_(WV_SP_VHDMAP map, const unsigned char * shadow) {
+    static unsigned char buf[VHD_TEST_SECTORS * VHD_TEST_SECTOR];
+
+    HOST_CHECK(!WvVhdMapRead(map, 0, VHD_TEST_SECTORS, buf));
+    HOST_CHECK(!memcmp(buf, shadow, sizeof buf));
+  }
+
+/* Do random reads and writes, keeping a copy of the disk. */
+static void VhdTestRandom_(WV_SP_VHDMAP map, unsigned char * shadow) {
+    static unsigned char buf[3 * VHD_TEST_BLOCK_SECTORS * VHD_TEST_SECTOR];
+    unsigned long long sector;
+    unsigned int i, j, count, bad = 0;
+
+    for (i = 0; i < VHD_TEST_ROUNDS; i++) {
+        count = 1 + HostRand() % (3 * VHD_TEST_BLOCK_SECTORS);
+        sector = HostRand() % (VHD_TEST_SECTORS - count + 1);
+        if (HostRand() % 2) {
+            for (j = 0; j < count * VHD_TEST_SECTOR; j++)
+              buf[j] = (unsigned char) HostRand();
+            bad += !!WvVhdMapWrite(map, sector, count, buf);
+            memcpy(shadow + sector * VHD_TEST_SECTOR, buf, j);
+          } else {
+            bad += !!WvVhdMapRead(map, sector, count, buf);
+            bad += !!memcmp(
+                buf,
+                shadow + sector * VHD_TEST_SECTOR,
+                count * VHD_TEST_SECTOR
+              );
+          }
+      }
+    HOST_CHECK(!bad);
+  }
+
+/** Fixed .VHDs are read as they are, and not written by the mapping. */
+static void VhdTestFixedImage_(void) {
+    enum { sectors = 37 };
+    static unsigned char data[sectors * VHD_TEST_SECTOR];
+    unsigned char buf[3 * VHD_TEST_SECTOR];
+    VHD_S_TEST_FILE file;
+    WV_SP_VHDMAP map;
+    unsigned int i;
+
+    for (i = 0; i < sizeof data; i++)
+      data[i] = (unsigned char) HostRand();
+    VhdTestFixed_(&file, data, sectors);
+    map = VhdTestLoad_(&file);
+    HOST_CHECK(map->Sectors == sectors);
+    HOST_CHECK(!WvVhdMapRead(map, sectors - 3, 3, buf));
+    HOST_CHECK(!memcmp(buf, data + (sectors - 3) * VHD_TEST_SECTOR, 3 * 512));
+    HOST_CHECK(WvVhdMapRead(map, sectors - 2, 3, buf) == WV_M_VHDMAP_E_RANGE);
+    HOST_CHECK(WvVhdMapWrite(map, 0, 1, buf) == WV_M_VHDMAP_E_TYPE);
+    HOST_CHECK(!WvVhdMapLocator(map, 0, &i, &i, NULL));
+    WvVhdMapFree(map);
+    free(file.Data);
+  }
+
+/** A dynamic .VHD keeps what's written to it, and is zeroes elsewhere. */
+static void VhdTestDynamicImage_(void) {
+    static unsigned char shadow[VHD_TEST_SECTORS * VHD_TEST_SECTOR];
+    unsigned char buf[VHD_TEST_SECTOR];
+    VHD_S_TEST_FILE file;
+    WV_SP_VHDMAP map;
+    unsigned long long size;
+    unsigned int i;
+
+    VhdTestDynamic_(&file, VHD_TEST_BLOCKS, 0x22, 0);
+    map = VhdTestLoad_(&file);
+    HOST_CHECK(map->Sectors == VHD_TEST_SECTORS);
+    HOST_CHECK(map->BlockSectors == VHD_TEST_BLOCK_SECTORS);
+    HOST_CHECK(map->BitmapSize == VHD_TEST_SECTOR);
+    memset(shadow, 0, sizeof shadow);
+    VhdTestCompare_(map, shadow);
+    HOST_CHECK(
+        WvVhdMapRead(map, VHD_TEST_SECTORS, 1, buf) == WV_M_VHDMAP_E_RANGE
+      );
+    HOST_CHECK(
+        WvVhdMapWrite(map, VHD_TEST_SECTORS - 1, 2, buf) ==
+        WV_M_VHDMAP_E_RANGE
+      );
+
+    /* A failed allocation leaves the block unused, at each step. */
+    for (i = 0; i < 3; i++) {
+        size = file.Size;
+        file.WritesLeft = i;
+        memset(buf, 0xA5, sizeof buf);
+        HOST_CHECK(
+            WvVhdMapWrite(map, 3 * VHD_TEST_BLOCK_SECTORS, 1, buf) ==
+            VHD_TEST_E_IO
+          );
+        HOST_CHECK(map->Bat[3] == 0xFFFFFFFF);
+        HOST_CHECK(i || file.Size == size);
+      }
+    file.WritesLeft = -1;
+    VhdTestCompare_(map, shadow);
+
+    VhdTestRandom_(map, shadow);
+    VhdTestCompare_(map, shadow);
+    /* The footer was moved to the end of the file. */
+    HOST_CHECK(map->FooterOffset == file.Size - 512);
+    HOST_CHECK(!memcmp(file.Data + file.Size - 512, file.Data, 512));
+    WvVhdMapFree(map);
+
+    /* Load it again. */
+    map = VhdTestLoad_(&file);
+    VhdTestCompare_(map, shadow);
+
+    WvVhdMapFree(map);
+    free(file.Data);
+  }
+
+/** A differencing .VHD reads through to its parent, and never writes it. */
+static void VhdTestDiffImage_(void) {
+    static unsigned char shadow[VHD_TEST_SECTORS * VHD_TEST_SECTOR];
+    static unsigned char parent_data[sizeof shadow];
+    VHD_S_TEST_FILE parent_file, file, other_file;
+    WV_SP_VHDMAP parent, map, other;
+    unsigned int code, length;
+    unsigned long long offset;
+
+    /* A dynamic parent with some data. */
+    VhdTestDynamic_(&parent_file, VHD_TEST_BLOCKS, 0x33, 0);
+    parent = VhdTestLoad_(&parent_file);
+    memset(parent_data, 0, sizeof parent_data);
+    VhdTestRandom_(parent, parent_data);
+    WvVhdMapFree(parent);
+
+    VhdTestDynamic_(&file, VHD_TEST_BLOCKS, 0x44, 0x33);
+    map = VhdTestLoad_(&file);
+    HOST_CHECK(WvVhdMapLocator(map, 0, &code, &length, &offset) && !code);
+    HOST_CHECK(WvVhdMapLocator(map, 1, &code, &length, &offset));
+    HOST_CHECK(code == 0x57327275 && length == 12 && offset == 1536);
+    HOST_CHECK(!WvVhdMapLocator(map, 8, &code, &length, &offset));
+
+    /* Not the parent it was made from. */
+    VhdTestDynamic_(&other_file, VHD_TEST_BLOCKS, 0x55, 0);
+    other = VhdTestLoad_(&other_file);
+    HOST_CHECK(WvVhdMapSetParent(map, other) == WV_M_VHDMAP_E_FORMAT);
+    WvVhdMapFree(other);
+    free(other_file.Data);
+
+    parent = VhdTestLoad_(&parent_file);
+    HOST_CHECK(!WvVhdMapSetParent(map, parent));
+    VhdTestCompare_(map, parent_data);
+    memcpy(shadow, parent_data, sizeof shadow);
+    VhdTestRandom_(map, shadow);
+    VhdTestCompare_(map, shadow);
+    VhdTestCompare_(parent, parent_data);
+    WvVhdMapFree(map);
+
+    /* Load both again. */
+    map = VhdTestLoad_(&file);
+    parent = VhdTestLoad_(&parent_file);
+    HOST_CHECK(!WvVhdMapSetParent(map, parent));
+    VhdTestCompare_(map, shadow);
+    VhdTestCompare_(parent, parent_data);
+    WvVhdMapFree(map);
+    free(file.Data);
+    free(parent_file.Data);
+  }
+
+/** Files which aren't .VHDs, and .VHDs which are broken. */
+static void VhdTestBadImage_(void) {
+    VHD_S_TEST_FILE file;
+    WV_SP_VHDMAP map = NULL;
+
+    /* Too small to have a footer. */
+    file.Data = calloc(1, 511);
+    file.Size = 511;
+    HOST_CHECK(!WvVhdMapLoad(VhdTestRw_, &file, file.Size, &map) && !map);
+    free(file.Data);
+
+    /* No footer cookie. */
+    VhdTestDynamic_(&file, VHD_TEST_BLOCKS, 0x66, 0);
+    file.Data[file.Size - 512] = 'C';
+    HOST_CHECK(!WvVhdMapLoad(VhdTestRw_, &file, file.Size, &map) && !map);
+    free(file.Data);
+
+    /* No dynamic header cookie. */
+    VhdTestDynamic_(&file, VHD_TEST_BLOCKS, 0x66, 0);
+    file.Data[512] = 'C';
+    HOST_CHECK(
+        WvVhdMapLoad(VhdTestRw_, &file, file.Size, &map) ==
+        WV_M_VHDMAP_E_FORMAT
+      );
+    free(file.Data);
+
+    /* Too few BAT entries for the disk. */
+    VhdTestDynamic_(&file, VHD_TEST_BLOCKS - 1, 0x66, 0);
+    HOST_CHECK(
+        WvVhdMapLoad(VhdTestRw_, &file, file.Size, &map) ==
+        WV_M_VHDMAP_E_FORMAT
+      );
+    free(file.Data);
+
+    /* An unknown type. */
+    VhdTestDynamic_(&file, VHD_TEST_BLOCKS, 0x66, 0);
+    VhdTestPut32_(file.Data + file.Size - 512 + 60, 5);
+    HOST_CHECK(
+        WvVhdMapLoad(VhdTestRw_, &file, file.Size, &map) ==
+        WV_M_VHDMAP_E_TYPE
+      );
+    free(file.Data);
+
+    /* A BAT past the end of the file. */
+    VhdTestDynamic_(&file, VHD_TEST_BLOCKS, 0x66, 0);
+    VhdTestPut64_(file.Data + 512 + 16, file.Size);
+    HOST_CHECK(
+        WvVhdMapLoad(VhdTestRw_, &file, file.Size, &map) == VHD_TEST_E_IO
+      );
+    free(file.Data);
+  }
+
+int main(void) {
+    VhdTestFixedImage_();
+    VhdTestDynamicImage_();
+    VhdTestDiffImage_();
+    VhdTestBadImage_();
+    return HostDone("vhdtest");
+  }
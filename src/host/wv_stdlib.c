@@ -0,0 +1,51 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * The wv_stdlib work-alikes, for the host harness.
+ *
+ * The host has only one pool, so the paged and non-paged allocators
+ * are the same.
+ */
+
+#include <stdlib.h>
+
+#include "wv_stdlib.h"
+
+void * wv_malloc(wv_size_t size) {
+    return malloc(size);
+  }
+
+void * wv_palloc(wv_size_t size) {
+    return malloc(size);
+  }
+
+void * wv_mallocz(wv_size_t size) {
+    return calloc(1, size);
+  }
+
+void * wv_pallocz(wv_size_t size) {
+    return calloc(1, size);
+  }
+
+void wv_free(void * ptr) {
+    free(ptr);
+  }
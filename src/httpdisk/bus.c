@@ -45,6 +45,12 @@ extern NTSTATUS STDCALL HttpdiskCreateDevice(
 extern NTSTATUS HttpDiskConnect(IN PDEVICE_OBJECT, IN PIRP);
 extern PDEVICE_OBJECT HttpDiskDeleteDevice(IN PDEVICE_OBJECT);
 
+/** From cache.c */
+extern VOID STDCALL HttpdiskCacheStats(
+    IN HTTPDISK_SP_DEV,
+    OUT PHTTP_DISK_CACHE_STATS
+  );
+
 /** Exports. */
 NTSTATUS STDCALL HttpdiskBusEstablish(void);
 VOID HttpdiskBusCleanup(void);
@@ -58,6 +64,7 @@ static VOID HttpdiskBusDeleteFdo_(void);
 static NTSTATUS STDCALL HttpdiskBusDevCtl_(IN PIRP);
 static NTSTATUS STDCALL HttpdiskBusAdd_(IN PIRP);
 static NTSTATUS STDCALL HttpdiskBusRemove_(IN PIRP);
+static NTSTATUS STDCALL HttpdiskBusCacheStats_(IN PIRP);
 
 /* The HTTPDisk bus. */
 static WVL_S_BUS_T HttpdiskBus_ = {0};
@@ -298,6 +305,9 @@ static NTSTATUS STDCALL HttpdiskBusDevCtl_(IN PIRP irp) {
 
         case IOCTL_HTTP_DISK_DISCONNECT:
           return HttpdiskBusRemove_(irp);
+
+        case IOCTL_HTTP_DISK_CACHE_STATS:
+          return HttpdiskBusCacheStats_(irp);
       }
     return WvlIrpComplete(irp, 0, STATUS_NOT_SUPPORTED);
   }
@@ -415,3 +425,43 @@ static NTSTATUS STDCALL HttpdiskBusRemove_(IN PIRP irp) {
 
     return WvlIrpComplete(irp, 0, status);
   }
+
+static NTSTATUS STDCALL HttpdiskBusCacheStats_(IN PIRP irp) {
+    PIO_STACK_LOCATION io_stack_loc = IoGetCurrentIrpStackLocation(irp);
+    UINT32 unit_num;
+    PHTTP_DISK_CACHE_STATS stats;
+    WVL_SP_BUS_NODE walker;
+    PDEVICE_OBJECT pdo = NULL;
+
+    /* Validate buffer sizes. */
+    if (
+        (io_stack_loc->Parameters.DeviceIoControl.InputBufferLength <
+          sizeof unit_num) ||
+        (io_stack_loc->Parameters.DeviceIoControl.OutputBufferLength <
+          sizeof *stats)
+      ) {
+        DBG("Buffer too small.\n");
+        return WvlIrpComplete(irp, 0, STATUS_INVALID_PARAMETER);
+      }
+    /* The output overwrites the input. */
+    unit_num = *(PUINT32) irp->AssociatedIrp.SystemBuffer;
+    stats = irp->AssociatedIrp.SystemBuffer;
+
+    walker = NULL;
+    /* For each node on the bus... */
+    WvlBusLock(&HttpdiskBus_);
+    while (walker = WvlBusGetNextNode(&HttpdiskBus_, walker)) {
+        /* If the unit number matches... */
+        if (WvlBusGetNodeNum(walker) == unit_num) {
+            pdo = WvlBusGetNodePdo(walker);
+            HttpdiskCacheStats(pdo->DeviceExtension, stats);
+            break;
+          }
+      }
+    WvlBusUnlock(&HttpdiskBus_);
+    if (!pdo) {
+        DBG("Unit %d not found.\n", unit_num);
+        return WvlIrpComplete(irp, 0, STATUS_INVALID_PARAMETER);
+      }
+    return WvlIrpComplete(irp, sizeof *stats, STATUS_SUCCESS);
+  }
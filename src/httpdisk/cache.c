@@ -0,0 +1,489 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk local cache files.
+ *
+ * When the CacheDirectory registry value names a directory on a local
+ * volume, each disk keeps a read-through cache of its image there.  See
+ * cachemap.c for what's in the file.  The file is sparse, so that it
+ * only takes the space of the blocks cached, and writing a block far
+ * into it doesn't first fill the file with zeroes up to there.  The
+ * bitmap is written back by the disk's thread when it's idle.
+ */
+
+#include <ntifs.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "debug.h"
+#include "bus.h"
+#include "disk.h"
+#include "httpdisk.h"
+
+/* From httpdisk.c */
+extern PVOID HttpDiskMalloc(SIZE_T);
+extern NTSTATUS STDCALL HttpdiskFetch(
+    IN HTTPDISK_SP_DEV,
+    IN PLARGE_INTEGER,
+    IN ULONG,
+    OUT PIO_STATUS_BLOCK,
+    OUT PVOID
+  );
+
+/** Macros. */
+
+/* How often the bitmap can be written back, in 100 ns. */
+#define HTTPDISK_M_CACHE_FLUSH_ (5 * 10000000LL)
+
+/** Object types. */
+
+struct HTTPDISK_CACHE {
+    HTTPDISK_SP_DEV Dev;
+    HANDLE File;
+    HTTPDISK_S_CACHE_MAP Map;
+    LARGE_INTEGER LastFlush;
+  };
+
+/** Private function declarations. */
+static NTSTATUS STDCALL HttpdiskCacheFile_(
+    IN HTTPDISK_SP_DEV,
+    OUT PHANDLE
+  );
+static HTTPDISK_F_CACHE_RW HttpdiskCacheRw_;
+static HTTPDISK_F_CACHE_SYNC HttpdiskCacheSync_;
+static HTTPDISK_F_CACHE_TRUNCATE HttpdiskCacheTruncate_;
+static HTTPDISK_F_CACHE_FETCH HttpdiskCacheFetch_;
+
+/** Public objects. */
+
+/* Where cache files go.  Empty for no caching.  Set from the registry. */
+UNICODE_STRING HttpdiskCacheDir = { 0 };
+
+/** Public function definitions. */
+
+/**
+ * Open a disk's cache file, if there's a cache directory.
+ *
+ * @v dev               The disk, with its file size known.
+ * @v validator         The server's ETag or Last-Modified, or "".
+ *
+ * Not having a cache isn't an error; the disk just reads from the
+ * server.  Called at PASSIVE_LEVEL.
+ */
+VOID STDCALL HttpdiskCacheOpen(
+    IN HTTPDISK_SP_DEV dev,
+    IN const char * validator
+  ) {
+    HTTPDISK_SP_CACHE cache;
+    HTTPDISK_SP_CACHE_MAP map;
+    HTTPDISK_SP_CACHE_HEADER header, expected;
+    NTSTATUS status;
+    long kept;
+
+    dev->cache = NULL;
+    if (!HttpdiskCacheDir.Length)
+      return;
+
+    cache = HttpDiskMalloc(sizeof *cache);
+    if (!cache) {
+        DBG("Couldn't allocate cache!\n");
+        goto err_cache;
+      }
+    RtlZeroMemory(cache, sizeof *cache);
+    cache->Dev = dev;
+    map = &cache->Map;
+    HttpdiskCacheMapInit(
+        map,
+        dev->file_size.QuadPart,
+        dev->conns.count,
+        cache,
+        HttpdiskCacheRw_,
+        HttpdiskCacheSync_,
+        HttpdiskCacheTruncate_,
+        HttpdiskCacheFetch_
+      );
+
+    map->Bitmap = HttpDiskMalloc(map->BitmapSize);
+    map->Bounce = HttpDiskMalloc(map->BounceBlocks * map->BlockSize);
+    header = HttpDiskMalloc(HTTPDISK_M_CACHE_PAGE);
+    expected = HttpDiskMalloc(HTTPDISK_M_CACHE_PAGE);
+    if (!map->Bitmap || !map->Bounce || !header || !expected) {
+        DBG("Couldn't allocate cache buffers!\n");
+        goto err_bufs;
+      }
+
+    status = HttpdiskCacheFile_(dev, &cache->File);
+    if (!NT_SUCCESS(status))
+      goto err_file;
+
+    /* Keep what's cached if the header matches, else start over. */
+    HttpdiskCacheMapHeader(
+        map,
+        validator,
+        (const char *) dev->host_name,
+        (const char *) dev->file_name,
+        expected
+      );
+    kept = HttpdiskCacheMapLoad(map, expected, header);
+    if (kept < 0) {
+        DBG("Couldn't start cache over: %08x\n", kept);
+        goto err_load;
+      }
+    if (kept) {
+        DBG(
+            "Cache has %I64u of %I64u blocks\n",
+            map->BlocksCached,
+            map->Blocks
+          );
+      } else {
+        DBG("Cache doesn't match the image; started over\n");
+      }
+
+    ExFreePool(expected);
+    ExFreePool(header);
+    KeQuerySystemTime(&cache->LastFlush);
+    dev->cache = cache;
+    return;
+
+    err_load:
+
+    ZwClose(cache->File);
+    err_file:
+
+    err_bufs:
+    if (expected)
+      ExFreePool(expected);
+    if (header)
+      ExFreePool(header);
+    if (map->Bounce)
+      ExFreePool(map->Bounce);
+    if (map->Bitmap)
+      ExFreePool(map->Bitmap);
+    ExFreePool(cache);
+    err_cache:
+
+    return;
+  }
+
+/**
+ * Read from a disk through its cache.
+ *
+ * @v dev               The disk.
+ * @v offset            Where to read from, in bytes.
+ * @v length            How many bytes to read.
+ * @v io_status         Receives the status and the bytes read.
+ * @v buffer            Where to put the data.
+ * @ret NTSTATUS        The status of the read.
+ *
+ * See HttpdiskCacheMapRead.  Called from the disk's thread.
+ */
+NTSTATUS STDCALL HttpdiskCacheRead(
+    IN HTTPDISK_SP_DEV dev,
+    IN PLARGE_INTEGER offset,
+    IN ULONG length,
+    OUT PIO_STATUS_BLOCK io_status,
+    OUT PVOID buffer
+  ) {
+    NTSTATUS status;
+
+    /* The server will refuse this, but it's not for the cache to say. */
+    if (offset->QuadPart + length > dev->file_size.QuadPart)
+      return HttpdiskFetch(dev, offset, length, io_status, buffer);
+
+    status = HttpdiskCacheMapRead(
+        &dev->cache->Map,
+        offset->QuadPart,
+        length,
+        buffer
+      );
+    io_status->Status = status;
+    io_status->Information = NT_SUCCESS(status) ? length : 0;
+    return status;
+  }
+
+/**
+ * Write back a disk's cache bitmap.
+ *
+ * @v dev               The disk.
+ * @v force             Write back even if it was written back recently.
+ *
+ * Called from the disk's thread.
+ */
+VOID STDCALL HttpdiskCacheFlush(IN HTTPDISK_SP_DEV dev, IN BOOLEAN force) {
+    HTTPDISK_SP_CACHE cache = dev->cache;
+    LARGE_INTEGER now;
+    NTSTATUS status;
+
+    if (!cache || cache->Map.DirtyStart >= cache->Map.DirtyEnd)
+      return;
+    KeQuerySystemTime(&now);
+    if (
+        !force &&
+        now.QuadPart - cache->LastFlush.QuadPart < HTTPDISK_M_CACHE_FLUSH_
+      )
+      return;
+    cache->LastFlush = now;
+
+    status = HttpdiskCacheMapFlush(&cache->Map);
+    if (!NT_SUCCESS(status))
+      DBG("Couldn't write back cache bitmap: %08x\n", status);
+  }
+
+/**
+ * Close a disk's cache file.
+ *
+ * @v dev               The disk.
+ */
+VOID STDCALL HttpdiskCacheClose(IN HTTPDISK_SP_DEV dev) {
+    HTTPDISK_SP_CACHE cache = dev->cache;
+    IO_STATUS_BLOCK io_status;
+
+    if (!cache)
+      return;
+    HttpdiskCacheFlush(dev, TRUE);
+    ZwFlushBuffersFile(cache->File, &io_status);
+    ZwClose(cache->File);
+    ExFreePool(cache->Map.Bounce);
+    ExFreePool(cache->Map.Bitmap);
+    ExFreePool(cache);
+    dev->cache = NULL;
+  }
+
+/**
+ * Report on a disk's cache.
+ *
+ * @v dev               The disk.
+ * @v stats             Receives the statistics.
+ */
+VOID STDCALL HttpdiskCacheStats(
+    IN HTTPDISK_SP_DEV dev,
+    OUT PHTTP_DISK_CACHE_STATS stats
+  ) {
+    HTTPDISK_SP_CACHE cache = dev->cache;
+
+    RtlZeroMemory(stats, sizeof *stats);
+    if (!cache)
+      return;
+    stats->Enabled = TRUE;
+    stats->BlockSize = cache->Map.BlockSize;
+    stats->Blocks = cache->Map.Blocks;
+    stats->BlocksCached = cache->Map.BlocksCached;
+    stats->Hits = cache->Map.Hits;
+    stats->Misses = cache->Map.Misses;
+    stats->BytesSaved = cache->Map.BytesSaved;
+    stats->BytesFetched = cache->Map.BytesFetched;
+  }
+
+/** Private function definitions. */
+
+/* Open or create a disk's sparse cache file, named for its host and file. */
+static NTSTATUS STDCALL HttpdiskCacheFile_(
+    IN HTTPDISK_SP_DEV dev,
+    OUT PHANDLE file
+  ) {
+    static const WCHAR hex[] = L"0123456789ABCDEF";
+    static const WCHAR suffix[] = L".cache";
+    ULONGLONG hash;
+    PUCHAR name;
+    UNICODE_STRING path;
+    OBJECT_ATTRIBUTES obj_attrs;
+    IO_STATUS_BLOCK io_status;
+    PWCHAR pos;
+    int i;
+    NTSTATUS status;
+
+    /* FNV-1a, over the host and then the file name. */
+    hash = 0xCBF29CE484222325ULL;
+    for (name = dev->host_name; *name; name++)
+      hash = (hash ^ *name) * 0x100000001B3ULL;
+    for (name = dev->file_name; *name; name++)
+      hash = (hash ^ *name) * 0x100000001B3ULL;
+
+    path.MaximumLength = HttpdiskCacheDir.Length +
+      sizeof (WCHAR) * (1 + 16) + sizeof suffix;
+    path.Buffer = HttpDiskMalloc(path.MaximumLength);
+    if (!path.Buffer) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_path;
+      }
+    RtlCopyMemory(
+        path.Buffer,
+        HttpdiskCacheDir.Buffer,
+        HttpdiskCacheDir.Length
+      );
+    pos = path.Buffer + HttpdiskCacheDir.Length / sizeof (WCHAR);
+    *pos++ = L'\\';
+    for (i = 60; i >= 0; i -= 4)
+      *pos++ = hex[(hash >> i) & 0xF];
+    RtlCopyMemory(pos, suffix, sizeof suffix);
+    path.Length = path.MaximumLength - sizeof (WCHAR);
+
+    InitializeObjectAttributes(
+        &obj_attrs,
+        &path,
+        OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+        NULL,
+        NULL
+      );
+    status = ZwCreateFile(
+        file,
+        GENERIC_READ | GENERIC_WRITE,
+        &obj_attrs,
+        &io_status,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ,
+        FILE_OPEN_IF,
+        FILE_NON_DIRECTORY_FILE |
+          FILE_RANDOM_ACCESS |
+          FILE_SYNCHRONOUS_IO_NONALERT,
+        NULL,
+        0
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't open cache file %wZ: %08x\n", &path, status);
+        goto err_open;
+      }
+
+    /*
+     * This is a no-op for a file which is already sparse.  A file system
+     * without sparse files, such as FAT, fills the gaps with zeroes.
+     */
+    status = ZwFsControlFile(
+        *file,
+        NULL,
+        NULL,
+        NULL,
+        &io_status,
+        FSCTL_SET_SPARSE,
+        NULL,
+        0,
+        NULL,
+        0
+      );
+    if (!NT_SUCCESS(status))
+      DBG("Couldn't make cache file %wZ sparse: %08x\n", &path, status);
+    status = STATUS_SUCCESS;
+
+    err_open:
+
+    ExFreePool(path.Buffer);
+    err_path:
+
+    return status;
+  }
+
+/* Read or write part of a cache file.  See HTTPDISK_F_CACHE_RW. */
+static long HttpdiskCacheRw_(
+    IN void * context,
+    IN int write,
+    IN long long offset,
+    IN unsigned int length,
+    IN OUT void * buffer
+  ) {
+    HTTPDISK_SP_CACHE cache = context;
+    IO_STATUS_BLOCK io_status;
+    LARGE_INTEGER file_offset;
+    NTSTATUS status;
+
+    file_offset.QuadPart = offset;
+    if (write) {
+        status = ZwWriteFile(
+            cache->File,
+            NULL,
+            NULL,
+            NULL,
+            &io_status,
+            buffer,
+            length,
+            &file_offset,
+            NULL
+          );
+      } else {
+        status = ZwReadFile(
+            cache->File,
+            NULL,
+            NULL,
+            NULL,
+            &io_status,
+            buffer,
+            length,
+            &file_offset,
+            NULL
+          );
+      }
+    if (NT_SUCCESS(status) && io_status.Information != length)
+      status = STATUS_END_OF_FILE;
+    if (!NT_SUCCESS(status)) {
+        DBG(
+            "Couldn't %s cache: %08x\n",
+            write ? "write" : "read",
+            status
+          );
+      }
+    return status;
+  }
+
+/* Flush a cache file's writes.  See HTTPDISK_F_CACHE_SYNC. */
+static long HttpdiskCacheSync_(IN void * context) {
+    HTTPDISK_SP_CACHE cache = context;
+    IO_STATUS_BLOCK io_status;
+
+    return ZwFlushBuffersFile(cache->File, &io_status);
+  }
+
+/* Set a cache file's size.  See HTTPDISK_F_CACHE_TRUNCATE. */
+static long HttpdiskCacheTruncate_(IN void * context, IN long long size) {
+    HTTPDISK_SP_CACHE cache = context;
+    FILE_END_OF_FILE_INFORMATION eof;
+    IO_STATUS_BLOCK io_status;
+
+    eof.EndOfFile.QuadPart = size;
+    return ZwSetInformationFile(
+        cache->File,
+        &io_status,
+        &eof,
+        sizeof eof,
+        FileEndOfFileInformation
+      );
+  }
+
+/* Read part of a disk's image from its server.  See HTTPDISK_F_CACHE_FETCH. */
+static long HttpdiskCacheFetch_(
+    IN void * context,
+    IN long long offset,
+    IN unsigned int length,
+    OUT void * buffer
+  ) {
+    HTTPDISK_SP_CACHE cache = context;
+    IO_STATUS_BLOCK io_status;
+    LARGE_INTEGER fetch_offset;
+
+    fetch_offset.QuadPart = offset;
+    return HttpdiskFetch(
+        cache->Dev,
+        &fetch_offset,
+        length,
+        &io_status,
+        buffer
+      );
+  }
@@ -0,0 +1,369 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk cache file layout and reads through it.
+ *
+ * The file starts with a header page, then a bitmap of which blocks
+ * are cached, then the blocks at their places in the image.  Blocks
+ * which are cached are read from the file and only the rest are fetched
+ * from the server, and then kept.
+ *
+ * The header records the server's ETag (or Last-Modified) for the
+ * image.  If the image has changed, or the server gives neither, the
+ * cache starts empty.  The bitmap is only written back after the blocks
+ * it covers are made durable, so a crash can lose blocks but the bitmap
+ * never covers blocks which weren't written.
+ */
+
+#include <string.h>
+
+#include "cachemap.h"
+
+/** Private function declarations. */
+static void HttpdiskCacheMapMark_(
+    HTTPDISK_SP_CACHE_MAP,
+    unsigned long long,
+    unsigned long long
+  );
+
+/** Public function definitions. */
+
+/**
+ * Initialize a cache map, and work out the file's layout.
+ *
+ * @v map               The map.
+ * @v file_size         The size of the image, in bytes.
+ * @v bounce_blocks     The most blocks to fetch at once.  At least 1.
+ * @v context           Passed to the routines.
+ * @v rw                Reads and writes the cache file.
+ * @v sync              Makes the cache file's writes durable.
+ * @v truncate          Cuts the cache file short.
+ * @v fetch             Reads from the server.
+ *
+ * The owner then gives the map a Bitmap of BitmapSize bytes and a
+ * Bounce of BounceBlocks * BlockSize bytes, and calls
+ * HttpdiskCacheMapLoad.
+ */
+void HttpdiskCacheMapInit(
+    HTTPDISK_SP_CACHE_MAP map,
+    long long file_size,
+    unsigned int bounce_blocks,
+    void * context,
+    HTTPDISK_FP_CACHE_RW rw,
+    HTTPDISK_FP_CACHE_SYNC sync,
+    HTTPDISK_FP_CACHE_TRUNCATE truncate,
+    HTTPDISK_FP_CACHE_FETCH fetch
+  ) {
+    memset(map, 0, sizeof *map);
+    map->Context = context;
+    map->Rw = rw;
+    map->Sync = sync;
+    map->Truncate = truncate;
+    map->Fetch = fetch;
+    map->FileSize = file_size;
+    map->BlockSize = HTTPDISK_M_CACHE_BLOCK;
+    map->Blocks = (file_size + map->BlockSize - 1) / map->BlockSize;
+    map->BitmapSize = (unsigned int) ((map->Blocks + 7) / 8);
+    map->BitmapSize = (map->BitmapSize + HTTPDISK_M_CACHE_PAGE - 1) &
+      ~(HTTPDISK_M_CACHE_PAGE - 1);
+    map->DataOffset = HTTPDISK_M_CACHE_PAGE + map->BitmapSize;
+    map->DirtyStart = map->BitmapSize;
+    map->DirtyEnd = 0;
+    map->BounceBlocks = bounce_blocks;
+  }
+
+/**
+ * Fill in the header page which a disk's cache file should have.
+ *
+ * @v map               The map.
+ * @v validator         The server's ETag or Last-Modified, or "".
+ * @v host              The disk's host name.
+ * @v file              The disk's file name.
+ * @v header            Receives the header.  HTTPDISK_M_CACHE_PAGE bytes.
+ */
+void HttpdiskCacheMapHeader(
+    HTTPDISK_SP_CACHE_MAP map,
+    const char * validator,
+    const char * host,
+    const char * file,
+    HTTPDISK_SP_CACHE_HEADER header
+  ) {
+    size_t len;
+
+    memset(header, 0, HTTPDISK_M_CACHE_PAGE);
+    memcpy(header->Magic, "HDCACHE", sizeof header->Magic);
+    header->Version = HTTPDISK_M_CACHE_VERSION;
+    header->BlockSize = map->BlockSize;
+    header->FileSize = map->FileSize;
+
+    len = strlen(validator);
+    if (len > sizeof header->Validator)
+      len = sizeof header->Validator;
+    header->ValidatorLen = (unsigned int) len;
+    memcpy(header->Validator, validator, len);
+
+    /* Names are checked too, in case two disks' file names collide. */
+    len = strlen(host);
+    if (len > sizeof header->Name)
+      len = sizeof header->Name;
+    memcpy(header->Name, host, len);
+    header->NameLen = (unsigned int) len;
+    len = strlen(file);
+    if (len > sizeof header->Name - header->NameLen)
+      len = sizeof header->Name - header->NameLen;
+    memcpy(header->Name + header->NameLen, file, len);
+    header->NameLen += (unsigned int) len;
+  }
+
+/**
+ * Load a cache file's bitmap, or start the file over.
+ *
+ * @v map               The map, with its Bitmap.
+ * @v expected          The header from HttpdiskCacheMapHeader.
+ * @v header            Scratch for the file's header.
+ *                      HTTPDISK_M_CACHE_PAGE bytes.
+ * @ret long            1 if what was cached is kept, 0 if the file was
+ *                      started over, else the failure from a routine.
+ *
+ * The file is started over unless its header matches and has a
+ * validator.  The cleared bitmap is made durable before the old blocks
+ * are released, and the header goes last, so a torn start-over leaves
+ * an empty cache, or one which is started over next time.
+ */
+long HttpdiskCacheMapLoad(
+    HTTPDISK_SP_CACHE_MAP map,
+    HTTPDISK_SP_CACHE_HEADER expected,
+    HTTPDISK_SP_CACHE_HEADER header
+  ) {
+    unsigned long long block;
+    long status;
+
+    map->BlocksCached = 0;
+    status = map->Rw(map->Context, 0, 0, HTTPDISK_M_CACHE_PAGE, header);
+    if (
+        status >= 0 &&
+        expected->ValidatorLen &&
+        !memcmp(header, expected, HTTPDISK_M_CACHE_PAGE)
+      ) {
+        status = map->Rw(
+            map->Context,
+            0,
+            HTTPDISK_M_CACHE_PAGE,
+            map->BitmapSize,
+            map->Bitmap
+          );
+        if (status >= 0) {
+            for (block = 0; block < map->Blocks; block++) {
+                if (map->Bitmap[block / 8] & (1 << (block % 8)))
+                  map->BlocksCached++;
+              }
+            return 1;
+          }
+      }
+
+    /* Start over. */
+    memset(map->Bitmap, 0, map->BitmapSize);
+    status = map->Rw(
+        map->Context,
+        1,
+        HTTPDISK_M_CACHE_PAGE,
+        map->BitmapSize,
+        map->Bitmap
+      );
+    if (status >= 0)
+      status = map->Sync(map->Context);
+    /* Release the old blocks, now that the bitmap doesn't cover them. */
+    if (status >= 0)
+      status = map->Truncate(map->Context, map->DataOffset);
+    if (status >= 0) {
+        status = map->Rw(
+            map->Context,
+            1,
+            0,
+            HTTPDISK_M_CACHE_PAGE,
+            expected
+          );
+      }
+    return (status >= 0) ? 0 : status;
+  }
+
+/**
+ * Read from an image through its cache.
+ *
+ * @v map               The map.
+ * @v offset            Where to read from, in bytes.
+ * @v length            How many bytes to read.  The range must be
+ *                      within the image.
+ * @v buffer            Where to put the data.
+ * @ret long            The failure from the fetch routine, else 0.
+ *
+ * The read is taken in runs of blocks which are all cached or all not.
+ * Cached runs come from the file, or are fetched if the file can't be
+ * read.  Runs which aren't cached are fetched whole, up to BounceBlocks
+ * at a time, and kept.  They're fetched straight into the buffer unless
+ * the read only covers part of them.
+ */
+long HttpdiskCacheMapRead(
+    HTTPDISK_SP_CACHE_MAP map,
+    long long offset,
+    unsigned int length,
+    void * buffer
+  ) {
+    long long pos, end, run_start, run_end, part_end;
+    unsigned long long first, last;
+    unsigned char * dest;
+    int hit;
+    long status;
+
+    pos = offset;
+    end = pos + length;
+    while (pos < end) {
+        /* Find the run. */
+        first = pos / map->BlockSize;
+        hit = (map->Bitmap[first / 8] & (1 << (first % 8))) ? 1 : 0;
+        for (
+            last = first + 1;
+            last * map->BlockSize < (unsigned long long) end;
+          ) {
+            if (!hit && last - first >= map->BounceBlocks)
+              break;
+            if (hit != ((map->Bitmap[last / 8] & (1 << (last % 8))) ? 1 : 0))
+              break;
+            last++;
+          }
+        run_start = first * map->BlockSize;
+        run_end = last * map->BlockSize;
+        if (run_end > map->FileSize)
+          run_end = map->FileSize;
+        part_end = (run_end < end) ? run_end : end;
+        dest = (unsigned char *) buffer + (pos - offset);
+
+        if (hit) {
+            status = map->Rw(
+                map->Context,
+                0,
+                map->DataOffset + pos,
+                (unsigned int) (part_end - pos),
+                dest
+              );
+            if (status >= 0) {
+                map->Hits += last - first;
+                map->BytesSaved += part_end - pos;
+                pos = part_end;
+                continue;
+              }
+            /* Fetch it instead, below. */
+          }
+
+        /* Fetch whole blocks, so they can be kept. */
+        if (run_start < offset || run_end > end)
+          dest = map->Bounce;
+        else
+          dest = (unsigned char *) buffer + (run_start - offset);
+        status = map->Fetch(
+            map->Context,
+            run_start,
+            (unsigned int) (run_end - run_start),
+            dest
+          );
+        if (status < 0)
+          return status;
+        map->Misses += last - first;
+        map->BytesFetched += run_end - run_start;
+
+        if (!hit) {
+            status = map->Rw(
+                map->Context,
+                1,
+                map->DataOffset + run_start,
+                (unsigned int) (run_end - run_start),
+                dest
+              );
+            /* Only blocks which were written are marked. */
+            if (status >= 0)
+              HttpdiskCacheMapMark_(map, first, last);
+          }
+
+        if (dest == map->Bounce) {
+            memcpy(
+                (unsigned char *) buffer + (pos - offset),
+                dest + (pos - run_start),
+                (size_t) (part_end - pos)
+              );
+          }
+        pos = part_end;
+      }
+    return 0;
+  }
+
+/**
+ * Write back a cache file's bitmap.
+ *
+ * @v map               The map.
+ * @ret long            The failure from a routine, else 0.
+ *
+ * The blocks are made durable first, so that the bitmap in the file
+ * only ever covers blocks which are there.
+ */
+long HttpdiskCacheMapFlush(HTTPDISK_SP_CACHE_MAP map) {
+    long status;
+
+    if (map->DirtyStart >= map->DirtyEnd)
+      return 0;
+    status = map->Sync(map->Context);
+    if (status >= 0) {
+        status = map->Rw(
+            map->Context,
+            1,
+            HTTPDISK_M_CACHE_PAGE + map->DirtyStart,
+            map->DirtyEnd - map->DirtyStart,
+            map->Bitmap + map->DirtyStart
+          );
+      }
+    if (status < 0)
+      return status;
+    map->DirtyStart = map->BitmapSize;
+    map->DirtyEnd = 0;
+    return 0;
+  }
+
+/** Private function definitions. */
+
+/* Note blocks as cached, for the next write-back. */
+static void HttpdiskCacheMapMark_(
+    HTTPDISK_SP_CACHE_MAP map,
+    unsigned long long first,
+    unsigned long long last
+  ) {
+    unsigned long long block;
+
+    for (block = first; block < last; block++) {
+        if (map->Bitmap[block / 8] & (1 << (block % 8)))
+          continue;
+        map->Bitmap[block / 8] |= 1 << (block % 8);
+        map->BlocksCached++;
+      }
+    if (first / 8 < map->DirtyStart)
+      map->DirtyStart = (unsigned int) (first / 8);
+    if ((last + 7) / 8 > map->DirtyEnd)
+      map->DirtyEnd = (unsigned int) ((last + 7) / 8);
+  }
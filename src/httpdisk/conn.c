@@ -0,0 +1,251 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk keep-alive connections.
+ *
+ * Each disk keeps a few persistent HTTP/1.1 connections to its server,
+ * in a pool (see connpool.c) which this file gives the disk's sockets
+ * and clock.  Idle connections are probed with a HEAD request, which
+ * also stops the server from timing them out.
+ */
+
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "debug.h"
+#include "bus.h"
+#include "disk.h"
+#include "httpdisk.h"
+#include "ksocket.h"
+
+/* From httpdisk.c */
+extern int __cdecl _snprintf(char *, size_t, const char *, ...);
+
+/** Macros. */
+
+/* The most of a response header to receive at once, in bytes. */
+#define HTTPDISK_M_CONN_PIECE_ 1024
+
+/** Public objects. */
+
+/* How many connections each disk keeps.  Set from the registry. */
+ULONG HttpdiskConnections = HTTPDISK_M_CONNS_DEFAULT;
+
+/** Private function declarations. */
+static HTTPDISK_F_CONN_OPEN HttpdiskConnOpen_;
+static HTTPDISK_F_CONN_PROBE HttpdiskConnProbe_;
+static HTTPDISK_F_CONN_CLOSE HttpdiskConnClose_;
+
+/** Public function definitions. */
+
+/**
+ * Initialize a disk's connections.  None is connected until it's used.
+ *
+ * @v dev               The disk.
+ */
+VOID STDCALL HttpdiskConnInit(IN HTTPDISK_SP_DEV dev) {
+    HttpdiskConnPoolInit(
+        &dev->conns,
+        HttpdiskConnections,
+        dev,
+        HttpdiskConnOpen_,
+        HttpdiskConnProbe_,
+        HttpdiskConnClose_
+      );
+  }
+
+/**
+ * Take the next live connections for requests.
+ *
+ * @v dev               The disk.
+ * @v conns             Receives the connections.
+ * @v max               The most connections to take.
+ * @v fresh             Points to where to note that a connection is new.
+ * @ret ULONG           The number of connections taken.
+ *
+ * See HttpdiskConnPoolTake.  Called from the disk's thread.
+ */
+ULONG STDCALL HttpdiskConnTake(
+    IN HTTPDISK_SP_DEV dev,
+    OUT HTTPDISK_SP_CONN * conns,
+    IN ULONG max,
+    OUT PBOOLEAN fresh
+  ) {
+    LARGE_INTEGER now;
+    ULONG count;
+    int is_fresh;
+
+    KeQuerySystemTime(&now);
+    count = HttpdiskConnPoolTake(
+        &dev->conns,
+        now.QuadPart,
+        conns,
+        max,
+        &is_fresh
+      );
+    *fresh = is_fresh ? TRUE : FALSE;
+    return count;
+  }
+
+/**
+ * Receive a response header.
+ *
+ * @v sock              The connection's socket.
+ * @v buf               Where to put the header.
+ * @v len               The size of the buffer.
+ * @v header_len        Points to where to put the length of the header.
+ * @ret int             The number of bytes received, or a negative error.
+ *
+ * A header might arrive in pieces, so this receives until it has the
+ * blank line which ends it.  The start of the body might follow it in
+ * the buffer, but it's received in small pieces so that most of the
+ * body is left for the caller to receive where it belongs.
+ */
+int STDCALL HttpdiskConnRecvHeader(
+    IN int sock,
+    OUT char * buf,
+    IN int len,
+    OUT int * header_len
+  ) {
+    int got, n, i;
+
+    got = 0;
+    while (got < len) {
+        n = len - got;
+        if (n > HTTPDISK_M_CONN_PIECE_)
+          n = HTTPDISK_M_CONN_PIECE_;
+        n = recv(sock, buf + got, n, 0);
+        if (n < 0)
+          return n;
+        if (n == 0)
+          break;
+        /* The blank line might straddle the pieces. */
+        i = (got > 3) ? got - 3 : 0;
+        got += n;
+        for (; i + 4 <= got; i++) {
+            if (RtlCompareMemory(buf + i, "\r\n\r\n", 4) == 4) {
+                *header_len = i + 4;
+                return got;
+              }
+          }
+      }
+    DBG("Incomplete HTTP response header\n");
+    return -1;
+  }
+
+/**
+ * Look after a disk's connections between requests.
+ *
+ * @v dev               The disk.
+ *
+ * Called from the disk's thread while it has nothing else to do.
+ */
+VOID STDCALL HttpdiskConnMaintain(IN HTTPDISK_SP_DEV dev) {
+    LARGE_INTEGER now;
+
+    KeQuerySystemTime(&now);
+    HttpdiskConnPoolMaintain(&dev->conns, now.QuadPart);
+  }
+
+/**
+ * Close all of a disk's connections.
+ *
+ * @v dev               The disk.
+ */
+VOID STDCALL HttpdiskConnCloseAll(IN HTTPDISK_SP_DEV dev) {
+    HttpdiskConnPoolCloseAll(&dev->conns);
+  }
+
+/** Private function definitions. */
+
+/* Connect a new socket to a disk's server.  Returns -1 on failure. */
+static int HttpdiskConnOpen_(IN PVOID context) {
+    HTTPDISK_SP_DEV dev = context;
+    struct sockaddr_in to_addr;
+    int sock, status;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        DBG("socket() error: %#x\n", sock);
+        return -1;
+      }
+
+    to_addr.sin_family = AF_INET;
+    to_addr.sin_port = dev->port;
+    to_addr.sin_addr.s_addr = dev->address;
+    status = connect(sock, (struct sockaddr *) &to_addr, sizeof to_addr);
+    if (status < 0) {
+        DBG("connect() error: %#x\n", status);
+        close(sock);
+        return -1;
+      }
+    return sock;
+  }
+
+/* Check that an idle connection still works, with a HEAD request. */
+static int HttpdiskConnProbe_(IN PVOID context, IN int sock) {
+    HTTPDISK_SP_DEV dev = context;
+    char * buf = dev->scratch;
+    HTTPDISK_S_RESPONSE response;
+    int len, header_len;
+    BOOLEAN ok;
+
+    ok = FALSE;
+    len = _snprintf(
+        buf,
+        HTTPDISK_M_SCRATCH_SIZE,
+        "HEAD %s HTTP/1.1\r\nHost: %s\r\nAccept: */*\r\n"
+          "User-Agent: HttpDisk/1.2\r\nConnection: keep-alive\r\n\r\n",
+        dev->file_name,
+        dev->host_name
+      );
+    if (len < 0 || send(sock, buf, len, 0) != len)
+      goto out;
+
+    len = HttpdiskConnRecvHeader(
+        sock,
+        buf,
+        HTTPDISK_M_SCRATCH_SIZE,
+        &header_len
+      );
+    /* A HEAD response has no body, so nothing should follow. */
+    if (len < 0 || len != header_len)
+      goto out;
+    if (
+        !HttpdiskHttpParse(buf, header_len, &response) ||
+        response.status != 200
+      )
+      goto out;
+    ok = response.keep_alive ? TRUE : FALSE;
+
+    out:
+    if (!ok)
+      DBG("Socket %d failed its probe\n", sock);
+    return ok;
+  }
+
+/* Close a connection's socket. */
+static VOID HttpdiskConnClose_(IN PVOID context, IN int sock) {
+    (VOID) context;
+    close(sock);
+  }
@@ -0,0 +1,202 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk keep-alive connection pool.
+ *
+ * Requests take a disk's connections in turn, with at most one request
+ * in flight on each.  Between requests, the disk's thread probes idle
+ * connections and connects broken ones again, so that a request only
+ * waits for a TCP handshake when no connection is left.
+ *
+ * A connect to a server which is down can take as long as TCP's own
+ * retries, on the thread which serves the disk's requests.  So once a
+ * connect fails, none is tried again until a wait has passed, whether
+ * for a request or between them, and the wait doubles each time until
+ * a connect works.  Meanwhile, requests which find no connection fail
+ * at once.
+ */
+
+#include "connpool.h"
+
+/** Private function declarations. */
+static int HttpdiskConnPoolOpen_(
+    HTTPDISK_SP_CONN_POOL,
+    HTTPDISK_SP_CONN,
+    long long
+  );
+
+/** Public function definitions. */
+
+/**
+ * Initialize a connection pool.  None is connected until it's used.
+ *
+ * @v pool              The pool.
+ * @v count             How many connections to keep, from 1 to
+ *                      HTTPDISK_M_CONNS.
+ * @v context           Passed to the routines.
+ * @v open              Connects a new socket.
+ * @v probe             Checks an idle socket.
+ * @v close             Closes a socket.
+ */
+void HttpdiskConnPoolInit(
+    HTTPDISK_SP_CONN_POOL pool,
+    unsigned int count,
+    void * context,
+    HTTPDISK_FP_CONN_OPEN open,
+    HTTPDISK_FP_CONN_PROBE probe,
+    HTTPDISK_FP_CONN_CLOSE close
+  ) {
+    unsigned int i;
+
+    pool->context = context;
+    pool->open = open;
+    pool->probe = probe;
+    pool->close = close;
+    for (i = 0; i < HTTPDISK_M_CONNS; i++) {
+        pool->conns[i].socket = -1;
+        pool->conns[i].last_used = 0;
+      }
+    if (count < 1)
+      count = 1;
+    if (count > HTTPDISK_M_CONNS)
+      count = HTTPDISK_M_CONNS;
+    pool->count = count;
+    pool->next = 0;
+    pool->retry_at = 0;
+    pool->retry_wait = HTTPDISK_M_CONN_RETRY_MIN;
+  }
+
+/**
+ * Take the next live connections for requests.
+ *
+ * @v pool              The pool.
+ * @v now               The time, in 100 ns.
+ * @v conns             Receives the connections.
+ * @v max               The most connections to take.
+ * @v fresh             Set to non-zero if the connection is new.
+ * @ret unsigned int    The number of connections taken.
+ *
+ * Connections are taken in turn, skipping broken ones, and no
+ * connection is taken twice.  Only when they're all broken do we
+ * connect one for the caller, if a connect may be tried yet.  None is
+ * taken if that fails.
+ */
+unsigned int HttpdiskConnPoolTake(
+    HTTPDISK_SP_CONN_POOL pool,
+    long long now,
+    HTTPDISK_SP_CONN * conns,
+    unsigned int max,
+    int * fresh
+  ) {
+    HTTPDISK_SP_CONN conn;
+    unsigned int count, i;
+
+    *fresh = 0;
+    count = 0;
+    conn = pool->conns + pool->next;
+    for (i = 0; i < pool->count && count < max; i++) {
+        conn = pool->conns + pool->next;
+        pool->next = (pool->next + 1) % pool->count;
+        if (conn->socket < 0)
+          continue;
+        conn->last_used = now;
+        conns[count++] = conn;
+      }
+    if (count || !max)
+      return count;
+
+    /* None is live, so the request has to wait for a connection. */
+    if (!HttpdiskConnPoolOpen_(pool, conn, now))
+      return 0;
+    *fresh = 1;
+    conns[0] = conn;
+    return 1;
+  }
+
+/**
+ * Look after a pool's connections between requests.
+ *
+ * @v pool              The pool.
+ * @v now               The time, in 100 ns.
+ *
+ * Idle connections are probed, and broken ones are connected again.
+ */
+void HttpdiskConnPoolMaintain(HTTPDISK_SP_CONN_POOL pool, long long now) {
+    HTTPDISK_SP_CONN conn;
+    unsigned int i;
+
+    for (i = 0; i < pool->count; i++) {
+        conn = pool->conns + i;
+        if (conn->socket >= 0) {
+            if (now - conn->last_used < HTTPDISK_M_CONN_IDLE)
+              continue;
+            if (pool->probe(pool->context, conn->socket)) {
+                conn->last_used = now;
+                continue;
+              }
+            pool->close(pool->context, conn->socket);
+            conn->socket = -1;
+          }
+        /* If the server is unreachable, this waits its turn. */
+        HttpdiskConnPoolOpen_(pool, conn, now);
+      }
+  }
+
+/**
+ * Close all of a pool's connections.
+ *
+ * @v pool              The pool.
+ */
+void HttpdiskConnPoolCloseAll(HTTPDISK_SP_CONN_POOL pool) {
+    unsigned int i;
+
+    for (i = 0; i < HTTPDISK_M_CONNS; i++) {
+        if (pool->conns[i].socket < 0)
+          continue;
+        pool->close(pool->context, pool->conns[i].socket);
+        pool->conns[i].socket = -1;
+      }
+  }
+
+/** Private function definitions. */
+
+/* Connect a broken connection, unless a connect failed too lately. */
+static int HttpdiskConnPoolOpen_(
+    HTTPDISK_SP_CONN_POOL pool,
+    HTTPDISK_SP_CONN conn,
+    long long now
+  ) {
+    if (now < pool->retry_at)
+      return 0;
+    conn->socket = pool->open(pool->context);
+    if (conn->socket < 0) {
+        conn->socket = -1;
+        pool->retry_at = now + pool->retry_wait;
+        pool->retry_wait *= 2;
+        if (pool->retry_wait > HTTPDISK_M_CONN_RETRY_MAX)
+          pool->retry_wait = HTTPDISK_M_CONN_RETRY_MAX;
+        return 0;
+      }
+    conn->last_used = now;
+    pool->retry_wait = HTTPDISK_M_CONN_RETRY_MIN;
+    return 1;
+  }
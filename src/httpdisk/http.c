@@ -0,0 +1,204 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * HTTPDisk response header parsing.
+ *
+ * Nothing here touches the network or the C library, and the header
+ * isn't assumed to be NUL-terminated, since the body can follow it
+ * in the same buffer.
+ */
+
+#include <stddef.h>
+
+#include "httpparse.h"
+
+/** Private function declarations. */
+static int HttpdiskHttpIs_(const char *, const char *, const char *);
+static const char * HttpdiskHttpSkip_(const char *, const char *);
+static const char * HttpdiskHttpNum_(
+    const char *,
+    const char *,
+    long long *
+  );
+static int HttpdiskHttpValueLen_(const char *, const char *);
+
+/** Public function definitions. */
+
+/**
+ * Parse a response header.
+ *
+ * @v header            The response header.
+ * @v len               The length of the header, up to its blank line.
+ * @v response          Receives what was found.
+ * @ret int             0 if the status line is malformed, else 1.
+ *
+ * Values which the header doesn't have are -1, or NULL for strings.
+ * A Content-Range of "bytes 0-511/1024" sets range_start to 0,
+ * range_end to 511 and total to 1024.  The ETag and Last-Modified
+ * strings point into the header, and aren't NUL-terminated.
+ */
+int HttpdiskHttpParse(
+    const char * header,
+    int len,
+    HTTPDISK_SP_RESPONSE response
+  ) {
+    const char * end = header + len;
+    const char * line;
+    const char * value;
+    long long num;
+
+    response->status = -1;
+    response->content_length = -1;
+    response->range_start = -1;
+    response->range_end = -1;
+    response->total = -1;
+    response->keep_alive = 0;
+    response->etag = NULL;
+    response->etag_len = 0;
+    response->modified = NULL;
+    response->modified_len = 0;
+
+    /* "HTTP/1.1 206 Partial Content" */
+    if (len < 9 || !HttpdiskHttpIs_(header, end, "HTTP/1."))
+      return 0;
+    value = HttpdiskHttpSkip_(header + 9, end);
+    /* A status code is three digits. */
+    if (!HttpdiskHttpNum_(value, end, &num) || num > 999)
+      return 0;
+    response->status = (int) num;
+    /* HTTP/1.0 servers close unless told otherwise, and we don't. */
+    response->keep_alive = header[7] == '1';
+
+    for (line = header; line < end; line++) {
+        if (*line != '\n')
+          continue;
+        line++;
+        if (HttpdiskHttpIs_(line, end, "Content-Length:")) {
+            value = HttpdiskHttpSkip_(line + 15, end);
+            if (HttpdiskHttpNum_(value, end, &num))
+              response->content_length = num;
+            continue;
+          }
+        if (HttpdiskHttpIs_(line, end, "Content-Range:")) {
+            value = HttpdiskHttpSkip_(line + 14, end);
+            if (!HttpdiskHttpIs_(value, end, "bytes"))
+              continue;
+            value = HttpdiskHttpSkip_(value + 5, end);
+            value = HttpdiskHttpNum_(value, end, &response->range_start);
+            if (!value || value >= end || *value != '-')
+              continue;
+            value = HttpdiskHttpNum_(value + 1, end, &response->range_end);
+            if (!value || value >= end || *value != '/')
+              continue;
+            HttpdiskHttpNum_(value + 1, end, &response->total);
+            continue;
+          }
+        if (HttpdiskHttpIs_(line, end, "ETag:")) {
+            response->etag = HttpdiskHttpSkip_(line + 5, end);
+            response->etag_len = HttpdiskHttpValueLen_(response->etag, end);
+            continue;
+          }
+        if (HttpdiskHttpIs_(line, end, "Last-Modified:")) {
+            response->modified = HttpdiskHttpSkip_(line + 14, end);
+            response->modified_len = HttpdiskHttpValueLen_(
+                response->modified,
+                end
+              );
+            continue;
+          }
+        if (HttpdiskHttpIs_(line, end, "Connection:")) {
+            value = HttpdiskHttpSkip_(line + 11, end);
+            if (HttpdiskHttpIs_(value, end, "close"))
+              response->keep_alive = 0;
+            else if (HttpdiskHttpIs_(value, end, "keep-alive"))
+              response->keep_alive = 1;
+            continue;
+          }
+      }
+    return 1;
+  }
+
+/** Private function definitions. */
+
+/* Check whether text starts with a name, ignoring case. */
+static int HttpdiskHttpIs_(
+    const char * text,
+    const char * end,
+    const char * name
+  ) {
+    char c, n;
+
+    for (; *name; text++, name++) {
+        if (text >= end)
+          return 0;
+        c = *text;
+        n = *name;
+        if (c >= 'A' && c <= 'Z')
+          c += 'a' - 'A';
+        if (n >= 'A' && n <= 'Z')
+          n += 'a' - 'A';
+        if (c != n)
+          return 0;
+      }
+    return 1;
+  }
+
+/* Skip spaces and tabs. */
+static const char * HttpdiskHttpSkip_(
+    const char * text,
+    const char * end
+  ) {
+    while (text < end && (*text == ' ' || *text == '\t'))
+      text++;
+    return text;
+  }
+
+/* Parse a decimal number.  Returns what follows it, or NULL. */
+static const char * HttpdiskHttpNum_(
+    const char * text,
+    const char * end,
+    long long * num
+  ) {
+    const char * start = text;
+    long long value = 0;
+
+    while (text < end && *text >= '0' && *text <= '9') {
+        /* Too big for a disk. */
+        if (value > 0x7FFFFFFFFFFFFFFFLL / 10 - 1)
+          return NULL;
+        value = value * 10 + (*text - '0');
+        text++;
+      }
+    if (text == start)
+      return NULL;
+    *num = value;
+    return text;
+  }
+
+/* The length of a header value, up to the end of its line. */
+static int HttpdiskHttpValueLen_(const char * text, const char * end) {
+    const char * value = text;
+
+    while (text < end && *text != '\r' && *text != '\n')
+      text++;
+    return (int) (text - value);
+  }
@@ -113,6 +113,7 @@ MmGetSystemAddressForMdlPrettySafe (
 #include "httpdisk.h"
 #include "debug.h"
 #include "irp.h"
+#include "copy.h"
 
 /* From bus.c */
 extern NTSTATUS STDCALL HttpdiskBusEstablish(void);
@@ -120,11 +121,46 @@ extern VOID HttpdiskBusCleanup(void);
 extern DRIVER_ADD_DEVICE HttpdiskBusAttach;
 extern DRIVER_DISPATCH HttpdiskBusIrp;
 
+/* From conn.c */
+extern ULONG HttpdiskConnections;
+extern VOID STDCALL HttpdiskConnInit(IN HTTPDISK_SP_DEV);
+extern ULONG STDCALL HttpdiskConnTake(
+    IN HTTPDISK_SP_DEV,
+    OUT HTTPDISK_SP_CONN *,
+    IN ULONG,
+    OUT PBOOLEAN
+  );
+extern int STDCALL HttpdiskConnRecvHeader(
+    IN int,
+    OUT char *,
+    IN int,
+    OUT int *
+  );
+extern VOID STDCALL HttpdiskConnMaintain(IN HTTPDISK_SP_DEV);
+extern VOID STDCALL HttpdiskConnCloseAll(IN HTTPDISK_SP_DEV);
+
+/* From cache.c */
+extern UNICODE_STRING HttpdiskCacheDir;
+extern VOID STDCALL HttpdiskCacheOpen(IN HTTPDISK_SP_DEV, IN const char *);
+extern NTSTATUS STDCALL HttpdiskCacheRead(
+    IN HTTPDISK_SP_DEV,
+    IN PLARGE_INTEGER,
+    IN ULONG,
+    OUT PIO_STATUS_BLOCK,
+    OUT PVOID
+  );
+extern VOID STDCALL HttpdiskCacheFlush(IN HTTPDISK_SP_DEV, IN BOOLEAN);
+extern VOID STDCALL HttpdiskCacheClose(IN HTTPDISK_SP_DEV);
+
 /* For this file. */
 #define PARAMETER_KEY           L"\\Parameters"
 
 #define NUMBEROFDEVICES_VALUE   L"NumberOfDevices"
 
+#define CONNECTIONS_VALUE       L"Connections"
+
+#define CACHEDIRECTORY_VALUE    L"CacheDirectory"
+
 #define DEFAULT_NUMBEROFDEVICES 4
 
 #define SECTOR_SIZE             512
@@ -133,12 +169,34 @@ extern DRIVER_DISPATCH HttpdiskBusIrp;
 
 #define BUFFER_SIZE             (4096 * 4)
 
+/* How often an idle disk thread looks after its connections, in 100 ns. */
+#define CONN_CHECK_INTERVAL     (2 * 10000000LL)
+
+/* Reads are split into range requests of at most this many bytes. */
+#define CHUNK_SIZE              (64 * 1024)
+
 PDRIVER_OBJECT HttpdiskDriverObj = NULL;
 
 typedef struct _HTTP_HEADER {
     LARGE_INTEGER ContentLength;
+    CHAR Validator[HTTPDISK_M_VALIDATOR_SIZE];
 } HTTP_HEADER, *PHTTP_HEADER;
 
+//
+// The rest of a block's body, after its header.  The bodies of the
+// blocks which are in flight are received at the same time.
+//
+typedef struct _HTTP_BODY {
+    int *Socket;
+    PUCHAR Buffer;
+    ULONG Length;
+    ULONG Received;
+    BOOLEAN KeepAlive;
+    // What the last recv_async() got, once Event is set.
+    int Result;
+    KEVENT Event;
+} HTTP_BODY, *PHTTP_BODY;
+
 NTSTATUS
 DriverEntry (
     IN PDRIVER_OBJECT   DriverObject,
@@ -191,6 +249,22 @@ static WVL_F_DISK_IO HttpdiskIo_;
 
 static WVL_F_DISK_UNIT_NUM HttpdiskUnitNum_;
 
+static NTSTATUS STDCALL HttpdiskRead_(
+    IN HTTPDISK_SP_DEV,
+    IN PLARGE_INTEGER,
+    IN ULONG,
+    OUT PIO_STATUS_BLOCK,
+    OUT PVOID
+  );
+
+NTSTATUS STDCALL HttpdiskFetch(
+    IN HTTPDISK_SP_DEV,
+    IN PLARGE_INTEGER,
+    IN ULONG,
+    OUT PIO_STATUS_BLOCK,
+    OUT PVOID
+  );
+
 VOID
 HttpDiskThread (
     IN PVOID            Context
@@ -219,18 +293,35 @@ HttpDiskGetHeader (
 );
 
 NTSTATUS
-HttpDiskGetBlock (
+HttpDiskRequestBlock (
     IN int                  *Socket,
-    IN ULONG                Address,
-    IN USHORT               Port,
+    IN PCHAR                Scratch,
     IN PUCHAR               HostName,
     IN PUCHAR               FileName,
     IN PLARGE_INTEGER       Offset,
     IN ULONG                Length,
+    OUT PIO_STATUS_BLOCK    IoStatus
+);
+
+NTSTATUS
+HttpDiskReceiveBlock (
+    IN int                  *Socket,
+    IN PCHAR                Scratch,
+    IN PLARGE_INTEGER       Offset,
+    IN ULONG                Length,
     OUT PIO_STATUS_BLOCK    IoStatus,
-    OUT PVOID               SystemBuffer
+    OUT PVOID               SystemBuffer,
+    OUT PHTTP_BODY          Body
 );
 
+NTSTATUS
+HttpDiskFinishBlock (
+    IN PHTTP_BODY           Body,
+    OUT PIO_STATUS_BLOCK    IoStatus
+);
+
+static VOID HttpdiskBodyReceived_(IN PVOID, IN int);
+
 __int64 __cdecl _atoi64(const char *);
 int __cdecl _snprintf(char *, size_t, const char *, ...);
 int __cdecl swprintf(wchar_t *, const wchar_t *, ...);
@@ -258,7 +349,7 @@ DriverEntry (
     )
 {
     UNICODE_STRING              parameter_path;
-    RTL_QUERY_REGISTRY_TABLE    query_table[2];
+    RTL_QUERY_REGISTRY_TABLE    query_table[4];
     ULONG                       n_devices;
     NTSTATUS                    status;
     ULONG                       n;
@@ -284,9 +375,19 @@ DriverEntry (
 
     RtlZeroMemory(&query_table[0], sizeof(query_table));
 
-    query_table[0].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_REQUIRED;
-    query_table[0].Name = NUMBEROFDEVICES_VALUE;
-    query_table[0].EntryContext = &n_devices;
+    /* Optional, so it comes before the required value. */
+    query_table[0].Flags = RTL_QUERY_REGISTRY_DIRECT;
+    query_table[0].Name = CONNECTIONS_VALUE;
+    query_table[0].EntryContext = &HttpdiskConnections;
+
+    /* A UNICODE_STRING with no buffer gets one allocated. */
+    query_table[1].Flags = RTL_QUERY_REGISTRY_DIRECT;
+    query_table[1].Name = CACHEDIRECTORY_VALUE;
+    query_table[1].EntryContext = &HttpdiskCacheDir;
+
+    query_table[2].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_REQUIRED;
+    query_table[2].Name = NUMBEROFDEVICES_VALUE;
+    query_table[2].EntryContext = &n_devices;
 
     status = RtlQueryRegistryValues(
         RTL_REGISTRY_ABSOLUTE,
@@ -362,7 +463,11 @@ NTSTATUS STDCALL HttpdiskCreateDevice(
 
     device_extension->file_name = NULL;
 
-    device_extension->socket = -1;
+    device_extension->scratch = NULL;
+
+    device_extension->cache = NULL;
+
+    HttpdiskConnInit(device_extension);
 
     device_object->Characteristics |= FILE_READ_ONLY_DEVICE;
 
@@ -389,6 +494,7 @@ NTSTATUS STDCALL HttpdiskCreateDevice(
     device_extension->Disk->disk_ops.PnpQueryId = HttpdiskPnpQueryId_;
     device_extension->Disk->disk_ops.Io = HttpdiskIo_;
     device_extension->Disk->disk_ops.UnitNum = HttpdiskUnitNum_;
+    device_extension->Disk->ReadAhead = TRUE;
 
     status = PsCreateSystemThread(
         &thread_handle,
@@ -453,6 +559,8 @@ HttpDiskUnload (
     {
         device_object = HttpDiskDeleteDevice(device_object);
     }
+
+    RtlFreeUnicodeString(&HttpdiskCacheDir);
     return;
 }
 
@@ -939,7 +1047,6 @@ static NTSTATUS STDCALL HttpdiskIo_(
     IN PUCHAR buffer,
     IN PIRP irp
   ) {
-    UCHAR tries;
     HTTPDISK_SP_DEV dev = CONTAINING_RECORD(disk, HTTPDISK_S_DEV, Disk[0]);
     LARGE_INTEGER offset;
 
@@ -947,27 +1054,154 @@ static NTSTATUS STDCALL HttpdiskIo_(
       return WvlIrpComplete(irp, 0, STATUS_MEDIA_WRITE_PROTECTED);
 
     offset.QuadPart = start_sector * disk->SectorSize;
-    tries = 2;
-    while (tries--) {
-        HttpDiskGetBlock(
-            &dev->socket,
-            dev->address,
-            dev->port,
-            dev->host_name,
-            dev->file_name,
-            &offset,
-            sector_count * disk->SectorSize,
-            &irp->IoStatus,
-            buffer
-          );
-        if (NT_SUCCESS(irp->IoStatus.Status))
-          return WvlIrpComplete(
-              irp,
-              sector_count * disk->SectorSize,
-              STATUS_SUCCESS
-            );
+    HttpdiskRead_(
+        dev,
+        &offset,
+        sector_count * disk->SectorSize,
+        &irp->IoStatus,
+        buffer
+      );
+    if (!NT_SUCCESS(irp->IoStatus.Status))
+      return WvlIrpComplete(irp, 0, irp->IoStatus.Status);
+    return WvlIrpComplete(
+        irp,
+        sector_count * disk->SectorSize,
+        STATUS_SUCCESS
+      );
+  }
+
+/**
+ * Read from a disk, through its cache if it has one.
+ *
+ * @v dev               The disk.
+ * @v offset            Where to read from, in bytes.
+ * @v length            How many bytes to read.
+ * @v io_status         Receives the status and the bytes read.
+ * @v buffer            Where to put the data.
+ * @ret NTSTATUS        The status of the read.
+ */
+static NTSTATUS STDCALL HttpdiskRead_(
+    IN HTTPDISK_SP_DEV dev,
+    IN PLARGE_INTEGER offset,
+    IN ULONG length,
+    OUT PIO_STATUS_BLOCK io_status,
+    OUT PVOID buffer
+  ) {
+    if (dev->cache)
+      return HttpdiskCacheRead(dev, offset, length, io_status, buffer);
+    return HttpdiskFetch(dev, offset, length, io_status, buffer);
+  }
+
+/**
+ * Read from a disk's server.
+ *
+ * @v dev               The disk.
+ * @v offset            Where to read from, in bytes.
+ * @v length            How many bytes to read.
+ * @v io_status         Receives the status and the bytes read.
+ * @v buffer            Where to put the data.
+ * @ret NTSTATUS        The status of the read.
+ *
+ * The read is split into chunks, which are requested in rounds with
+ * one chunk in flight on each live connection.  Each response body is
+ * received straight into its place in the buffer.  A kept connection
+ * might have been closed by the server since its last use, so the read
+ * goes on from the first chunk which failed, on the connections which
+ * are left.  A read which fails on a new connection isn't retried.
+ */
+NTSTATUS STDCALL HttpdiskFetch(
+    IN HTTPDISK_SP_DEV dev,
+    IN PLARGE_INTEGER offset,
+    IN ULONG length,
+    OUT PIO_STATUS_BLOCK io_status,
+    OUT PVOID buffer
+  ) {
+    HTTPDISK_SP_CONN conns[HTTPDISK_M_CONNS];
+    HTTP_BODY bodies[HTTPDISK_M_CONNS];
+    NTSTATUS statuses[HTTPDISK_M_CONNS];
+    IO_STATUS_BLOCK chunk_status;
+    LARGE_INTEGER chunk_offset;
+    ULONG done, chunks, count, ok, tries, i, len;
+    BOOLEAN fresh;
+
+    io_status->Status = STATUS_SUCCESS;
+    io_status->Information = 0;
+    done = 0;
+    tries = 0;
+    while (done < length) {
+        chunks = (length - done + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        count = HttpdiskConnTake(dev, conns, chunks, &fresh);
+        if (!count) {
+            io_status->Status = STATUS_DEVICE_NOT_CONNECTED;
+            break;
+          }
+
+        /* Put a chunk in flight on each connection... */
+        for (i = 0; i < count; i++) {
+            chunk_offset.QuadPart = offset->QuadPart + done + i * CHUNK_SIZE;
+            len = length - done - i * CHUNK_SIZE;
+            if (len > CHUNK_SIZE)
+              len = CHUNK_SIZE;
+            HttpDiskRequestBlock(
+                &conns[i]->socket,
+                dev->scratch,
+                dev->host_name,
+                dev->file_name,
+                &chunk_offset,
+                len,
+                &chunk_status
+              );
+          }
+
+        /* ...then take their headers, in the order they were sent... */
+        for (i = 0; i < count; i++) {
+            chunk_offset.QuadPart = offset->QuadPart + done + i * CHUNK_SIZE;
+            len = length - done - i * CHUNK_SIZE;
+            if (len > CHUNK_SIZE)
+              len = CHUNK_SIZE;
+            HttpDiskReceiveBlock(
+                &conns[i]->socket,
+                dev->scratch,
+                &chunk_offset,
+                len,
+                &chunk_status,
+                (PUCHAR) buffer + done + i * CHUNK_SIZE,
+                bodies + i
+              );
+            statuses[i] = chunk_status.Status;
+          }
+
+        /*
+         * ...while their bodies come in together.  Every body which was
+         * started is waited for, as it's received into the buffer.
+         */
+        ok = count;
+        for (i = 0; i < count; i++) {
+            if (NT_SUCCESS(statuses[i])) {
+                HttpDiskFinishBlock(bodies + i, &chunk_status);
+                statuses[i] = chunk_status.Status;
+              }
+            if (!NT_SUCCESS(statuses[i]) && ok == count) {
+                ok = i;
+                io_status->Status = statuses[i];
+              }
+          }
+
+        /* Go on from the first chunk which failed. */
+        if (ok == count) {
+            done += length - done < count * CHUNK_SIZE ?
+              length - done :
+              count * CHUNK_SIZE;
+            continue;
+          }
+        done += ok * CHUNK_SIZE;
+        if (fresh || ++tries > dev->conns.count)
+          break;
+        io_status->Status = STATUS_SUCCESS;
       }
-    return WvlIrpComplete(irp, 0, irp->IoStatus.Status);
+    if (NT_SUCCESS(io_status->Status))
+      io_status->Information = done;
+    return io_status->Status;
   }
 
 static UCHAR STDCALL HttpdiskUnitNum_(IN WVL_SP_DISK_T disk) {
@@ -993,6 +1227,7 @@ HttpDiskThread (
     PLIST_ENTRY         request;
     PIRP                irp;
     PIO_STACK_LOCATION  io_stack;
+    LARGE_INTEGER       timeout;
 
     ASSERT(Context != NULL);
 
@@ -1002,6 +1237,8 @@ HttpDiskThread (
 
     KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
 
+    timeout.QuadPart = -CONN_CHECK_INTERVAL;
+
     for (;;)
     {
         KeWaitForSingleObject(
@@ -1009,7 +1246,7 @@ HttpDiskThread (
             Executive,
             KernelMode,
             FALSE,
-            NULL
+            &timeout
             );
 
         if (device_extension->terminate_thread)
@@ -1035,31 +1272,13 @@ HttpDiskThread (
             switch (io_stack->MajorFunction)
             {
             case IRP_MJ_READ:
-                HttpDiskGetBlock(
-                    &device_extension->socket,
-                    device_extension->address,
-                    device_extension->port,
-                    device_extension->host_name,
-                    device_extension->file_name,
+                HttpdiskRead_(
+                    device_extension,
                     &io_stack->Parameters.Read.ByteOffset,
                     io_stack->Parameters.Read.Length,
                     &irp->IoStatus,
                     MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority)
                     );
-                if (!NT_SUCCESS(irp->IoStatus.Status))
-                {
-                    HttpDiskGetBlock(
-                        &device_extension->socket,
-                        device_extension->address,
-                        device_extension->port,
-                        device_extension->host_name,
-                        device_extension->file_name,
-                        &io_stack->Parameters.Read.ByteOffset,
-                        io_stack->Parameters.Read.Length,
-                        &irp->IoStatus,
-                        MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority)
-                        );
-                }
                 break;
 
             case IRP_MJ_WRITE:
@@ -1089,6 +1308,13 @@ HttpDiskThread (
                 IO_DISK_INCREMENT : IO_NO_INCREMENT)
                 );
         }
+
+        /* Between requests, look after the connections and the cache. */
+        if (device_extension->media_in_device)
+        {
+            HttpdiskConnMaintain(device_extension);
+            HttpdiskCacheFlush(device_extension, FALSE);
+        }
     }
 }
 
@@ -1155,6 +1381,20 @@ HttpDiskConnect (
 
     device_extension->file_name[http_disk_information->FileNameLength] = '\0';
 
+    device_extension->scratch = HttpDiskMalloc(HTTPDISK_M_SCRATCH_SIZE + 1);
+
+    if (device_extension->scratch == NULL)
+    {
+        ExFreePool(device_extension->host_name);
+        device_extension->host_name = NULL;
+
+        ExFreePool(device_extension->file_name);
+        device_extension->file_name = NULL;
+
+        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+        return Irp->IoStatus.Status;
+    }
+
     HttpDiskGetHeader(
         device_extension->address,
         device_extension->port,
@@ -1190,11 +1430,16 @@ HttpDiskConnect (
             device_extension->file_name = NULL;
         }
 
+        ExFreePool(device_extension->scratch);
+        device_extension->scratch = NULL;
+
         return Irp->IoStatus.Status;
     }
 
     device_extension->file_size.QuadPart = http_header.ContentLength.QuadPart;
 
+    HttpdiskCacheOpen(device_extension, http_header.Validator);
+
     device_extension->media_in_device = TRUE;
 
     return Irp->IoStatus.Status;
@@ -1227,10 +1472,14 @@ HttpDiskDisconnect (
         device_extension->file_name = NULL;
     }
 
-    if (device_extension->socket > 0)
+    HttpdiskConnCloseAll(device_extension);
+
+    HttpdiskCacheClose(device_extension);
+
+    if (device_extension->scratch != NULL)
     {
-        close(device_extension->socket);
-        device_extension->socket = -1;
+        ExFreePool(device_extension->scratch);
+        device_extension->scratch = NULL;
     }
 
     Irp->IoStatus.Status = STATUS_SUCCESS;
@@ -1251,8 +1500,11 @@ HttpDiskGetHeader (
 {
     int                 kSocket;
     struct sockaddr_in  toAddr;
-    int                 status, nSent, nRecv;
-    char                *buffer, *pStr;
+    int                 status, nSent, nRecv, headerLen;
+    char                *buffer;
+    const char          *validator;
+    int                 validatorLen;
+    HTTPDISK_S_RESPONSE response;
 
     ASSERT(HostName != NULL);
     ASSERT(FileName != NULL);
@@ -1323,7 +1575,7 @@ HttpDiskGetHeader (
         return IoStatus->Status;
     }
 
-    nRecv = recv(kSocket, buffer, BUFFER_SIZE, 0);
+    nRecv = HttpdiskConnRecvHeader(kSocket, buffer, BUFFER_SIZE - 1, &headerLen);
 
     if (nRecv < 0)
     {
@@ -1336,9 +1588,11 @@ HttpDiskGetHeader (
 
     close(kSocket);
 
-    buffer[BUFFER_SIZE - 1] = '\0';
+    buffer[headerLen] = '\0';
 
-    if (_strnicmp(buffer, "HTTP/1.1 200 OK", 15))
+    if (!HttpdiskHttpParse(buffer, headerLen, &response) ||
+        response.status != 200 ||
+        response.content_length <= 0)
     {
         DbgPrint("HttpDisk: Invalid HTTP response:\n%s", buffer);
         ExFreePool(buffer);
@@ -1346,26 +1600,26 @@ HttpDiskGetHeader (
         return IoStatus->Status;
     }
 
-    pStr = strstr(buffer, "Content-Length:");
+    HttpHeader->ContentLength.QuadPart = response.content_length;
+
+    // The cache is only kept for an image which the server can tell
+    // apart from its other versions.
 
-    if (pStr == NULL || pStr + 16 >= buffer + BUFFER_SIZE)
+    validator = response.etag ? response.etag : response.modified;
+    validatorLen = response.etag ? response.etag_len : response.modified_len;
+
+    if (validatorLen >= HTTPDISK_M_VALIDATOR_SIZE)
     {
-        DbgPrint("HttpDisk: Invalid HTTP response:\n%s", buffer);
-        ExFreePool(buffer);
-        IoStatus->Status = STATUS_NO_SUCH_FILE;
-        return IoStatus->Status;
+        validatorLen = 0;
     }
 
-    HttpHeader->ContentLength.QuadPart = _atoi64(pStr + 16);
-
-    if (HttpHeader->ContentLength.QuadPart == 0)
+    if (validatorLen > 0)
     {
-        DbgPrint("HttpDisk: Invalid HTTP response:\n%s", buffer);
-        ExFreePool(buffer);
-        IoStatus->Status = STATUS_NO_SUCH_FILE;
-        return IoStatus->Status;
+        RtlCopyMemory(HttpHeader->Validator, validator, validatorLen);
     }
 
+    HttpHeader->Validator[validatorLen] = '\0';
+
     ExFreePool(buffer);
 
     IoStatus->Status = STATUS_SUCCESS;
@@ -1375,228 +1629,149 @@ HttpDiskGetHeader (
 }
 
 NTSTATUS
-HttpDiskGetBlock (
+HttpDiskRequestBlock (
     IN int                  *Socket,
-    IN ULONG                Address,
-    IN USHORT               Port,
+    IN PCHAR                Scratch,
     IN PUCHAR               HostName,
     IN PUCHAR               FileName,
     IN PLARGE_INTEGER       Offset,
     IN ULONG                Length,
-    OUT PIO_STATUS_BLOCK    IoStatus,
-    OUT PVOID               SystemBuffer
+    OUT PIO_STATUS_BLOCK    IoStatus
     )
 {
-    struct sockaddr_in  toAddr;
-    int                 status, nSent, nRecv;
-    unsigned int        dataLen;
-    char                *buffer, *pData;
+    int                 nSent, len;
 
     ASSERT(Socket != NULL);
+    ASSERT(Scratch != NULL);
     ASSERT(HostName != NULL);
     ASSERT(FileName != NULL);
     ASSERT(Offset != NULL);
     ASSERT(IoStatus != NULL);
-    ASSERT(SystemBuffer != NULL);
 
     IoStatus->Information = 0;
 
-    buffer = HttpDiskPalloc(BUFFER_SIZE + 1);
-
-    if (buffer == NULL)
-    {
-        IoStatus->Status = STATUS_INSUFFICIENT_RESOURCES;
-        return IoStatus->Status;
-    }
-
     // Example request:
     //  GET 'FileName' HTTP/1.1
     //  Host: 'HostName'
     //  Range: bytes='Offset'-'Offset + Length - 1'
     //  Accept: */*
     //  User-Agent: HttpDisk/1.2
+    //  Connection: keep-alive
     //
     // Interesting lines in answer:
     //  HTTP/1.1 206 Partial content
     //  Content-Length: 'requested size'
     //  Content-Range: bytes 'start'-'end'/'total file size'
+    //  Connection: close (if the server won't keep the connection)
     //  Data follows after '\r\n\r\n'
 
-    _snprintf(
-        buffer,
-        BUFFER_SIZE,
-        "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%I64u-%I64u\r\nAccept: */*\r\nUser-Agent: HttpDisk/1.2\r\n\r\n",
+    len = _snprintf(
+        Scratch,
+        HTTPDISK_M_SCRATCH_SIZE,
+        "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%I64u-%I64u\r\nAccept: */*\r\nUser-Agent: HttpDisk/1.2\r\nConnection: keep-alive\r\n\r\n",
         FileName,
         HostName,
         Offset->QuadPart,
         Offset->QuadPart + Length - 1
         );
 
-    if (*Socket < 0)
+    if (len < 0)
     {
-        *Socket = socket(AF_INET, SOCK_STREAM, 0);
-
-        if (*Socket < 0)
-        {
-            ExFreePool(buffer);
-            *Socket = -1;
-            IoStatus->Status = STATUS_INSUFFICIENT_RESOURCES;
-            return IoStatus->Status;
-        }
-
-        toAddr.sin_family = AF_INET;
-        toAddr.sin_port = Port;
-        toAddr.sin_addr.s_addr = Address;
-
-        status = connect(*Socket, (struct sockaddr*) &toAddr, sizeof(toAddr));
-
-        if (status < 0)
-        {
-            DbgPrint("HttpDisk: connect() error: %#x\n", status);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = status;
-            return IoStatus->Status;
-        }
+        IoStatus->Status = STATUS_NAME_TOO_LONG;
+        return IoStatus->Status;
     }
 
-    nSent = send(*Socket, buffer, strlen(buffer), 0);
-
-    if (nSent < 0)
+    if (*Socket < 0)
     {
-        KdPrint(("HttpDisk: send() error: %#x\n", nSent));
-
-        close(*Socket);
-
-        *Socket = socket(AF_INET, SOCK_STREAM, 0);
-
-        if (*Socket < 0)
-        {
-            ExFreePool(buffer);
-            *Socket = -1;
-            IoStatus->Status = STATUS_INSUFFICIENT_RESOURCES;
-            return IoStatus->Status;
-        }
-
-        toAddr.sin_family = AF_INET;
-        toAddr.sin_port = Port;
-        toAddr.sin_addr.s_addr = Address;
-
-        status = connect(*Socket, (struct sockaddr*) &toAddr, sizeof(toAddr));
-
-        if (status < 0)
-        {
-            DbgPrint("HttpDisk: connect() error: %#x\n", status);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = status;
-            return IoStatus->Status;
-        }
-
-        nSent = send(*Socket, buffer, strlen(buffer), 0);
-
-        if (nSent < 0)
-        {
-            DbgPrint("HttpDisk: send() error: %#x\n", nSent);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = nSent;
-            return IoStatus->Status;
-        }
+        IoStatus->Status = STATUS_DEVICE_NOT_CONNECTED;
+        return IoStatus->Status;
     }
 
-    nRecv = recv(*Socket, buffer, BUFFER_SIZE, 0);
+    nSent = send(*Socket, Scratch, len, 0);
 
-    if (nRecv < 0)
+    if (nSent < 0)
     {
-        KdPrint(("HttpDisk: recv() error: %#x\n", nRecv));
-
+        DbgPrint("HttpDisk: send() error: %#x\n", nSent);
         close(*Socket);
+        *Socket = -1;
+        IoStatus->Status = nSent;
+        return IoStatus->Status;
+    }
 
-        *Socket = socket(AF_INET, SOCK_STREAM, 0);
-
-        if (*Socket < 0)
-        {
-            ExFreePool(buffer);
-            *Socket = -1;
-            IoStatus->Status = STATUS_INSUFFICIENT_RESOURCES;
-            return IoStatus->Status;
-        }
-
-        toAddr.sin_family = AF_INET;
-        toAddr.sin_port = Port;
-        toAddr.sin_addr.s_addr = Address;
-
-        status = connect(*Socket, (struct sockaddr*) &toAddr, sizeof(toAddr));
-
-        if (status < 0)
-        {
-            DbgPrint("HttpDisk: connect() error: %#x\n", status);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = status;
-            return IoStatus->Status;
-        }
+    IoStatus->Status = STATUS_SUCCESS;
+    return IoStatus->Status;
+}
 
-        nSent = send(*Socket, buffer, strlen(buffer), 0);
+NTSTATUS
+HttpDiskReceiveBlock (
+    IN int                  *Socket,
+    IN PCHAR                Scratch,
+    IN PLARGE_INTEGER       Offset,
+    IN ULONG                Length,
+    OUT PIO_STATUS_BLOCK    IoStatus,
+    OUT PVOID               SystemBuffer,
+    OUT PHTTP_BODY          Body
+    )
+{
+    HTTPDISK_S_RESPONSE response;
+    int                 nRecv, headerLen;
+    ULONG               dataLen;
 
-        if (nSent < 0)
-        {
-            DbgPrint("HttpDisk: send() error: %#x\n", nSent);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = nSent;
-            return IoStatus->Status;
-        }
+    ASSERT(Socket != NULL);
+    ASSERT(Scratch != NULL);
+    ASSERT(Offset != NULL);
+    ASSERT(IoStatus != NULL);
+    ASSERT(SystemBuffer != NULL);
+    ASSERT(Body != NULL);
 
-        nRecv = recv(*Socket, buffer, BUFFER_SIZE, 0);
+    IoStatus->Information = 0;
 
-        if (nRecv < 0)
-        {
-            DbgPrint("HttpDisk: recv() error: %#x\n", nRecv);
-            ExFreePool(buffer);
-            close(*Socket);
-            *Socket = -1;
-            IoStatus->Status = nRecv;
-            return IoStatus->Status;
-        }
+    // The request failed to go out.
+    if (*Socket < 0)
+    {
+        IoStatus->Status = STATUS_DEVICE_NOT_CONNECTED;
+        return IoStatus->Status;
     }
 
-    buffer[BUFFER_SIZE] = '\0';
+    //
+    // Only the header goes to the scratch buffer.  It's received in
+    // small pieces, so at most the start of the body comes with it.
+    //
+    nRecv = HttpdiskConnRecvHeader(
+        *Socket,
+        Scratch,
+        HTTPDISK_M_SCRATCH_SIZE,
+        &headerLen
+        );
 
-    if (_strnicmp(buffer, "HTTP/1.1 206 Partial Content", 28))
+    if (nRecv < 0)
     {
-        DbgPrint("HttpDisk: Invalid HTTP response:\n%s", buffer);
-        ExFreePool(buffer);
+        DbgPrint("HttpDisk: recv() error: %#x\n", nRecv);
         close(*Socket);
         *Socket = -1;
-        IoStatus->Status = STATUS_UNSUCCESSFUL;
+        IoStatus->Status = nRecv;
         return IoStatus->Status;
     }
 
-    pData = strstr(buffer, "\r\n\r\n") + 4;
-
-    if (pData == NULL || pData < buffer || pData >= buffer + BUFFER_SIZE)
+    if (!HttpdiskHttpParse(Scratch, headerLen, &response) ||
+        response.status != 206 ||
+        response.content_length != Length ||
+        (response.range_start >= 0 &&
+         response.range_start != Offset->QuadPart))
     {
-        DbgPrint("HttpDisk: Invalid HTTP response:\n%s", buffer);
-        ExFreePool(buffer);
+        Scratch[headerLen] = '\0';
+        DbgPrint("HttpDisk: Invalid HTTP response:\n%s", Scratch);
         close(*Socket);
         *Socket = -1;
         IoStatus->Status = STATUS_UNSUCCESSFUL;
         return IoStatus->Status;
     }
 
-    dataLen = nRecv - (pData - buffer);
+    dataLen = nRecv - headerLen;
 
-    if (dataLen > Length || pData + dataLen > buffer + BUFFER_SIZE)
+    if (dataLen > Length)
     {
-        DbgPrint("HttpDisk: Invalid data length %u in HTTP response:\n%s", dataLen, buffer);
-        ExFreePool(buffer);
+        DbgPrint("HttpDisk: Invalid data length %u\n", dataLen);
         close(*Socket);
         *Socket = -1;
         IoStatus->Status = STATUS_UNSUCCESSFUL;
@@ -1605,45 +1780,115 @@ HttpDiskGetBlock (
 
     if (dataLen > 0)
     {
-        RtlCopyMemory(
+        WvlCopyMemory(
             SystemBuffer,
-            pData,
+            Scratch + headerLen,
             dataLen
             );
     }
 
-    while (dataLen < Length)
+    //
+    // The rest of the body goes straight where it belongs, while the
+    // caller takes the other blocks' headers.  HttpDiskFinishBlock()
+    // waits for it.
+    //
+    Body->Socket = Socket;
+    Body->Buffer = SystemBuffer;
+    Body->Length = Length;
+    Body->Received = dataLen;
+    Body->KeepAlive = response.keep_alive;
+    KeInitializeEvent(&Body->Event, SynchronizationEvent, FALSE);
+
+    if (dataLen < Length)
     {
-        nRecv = recv(*Socket, buffer, BUFFER_SIZE, 0);
-        if (nRecv < 0)
+        nRecv = recv_async(
+            *Socket,
+            (char *) SystemBuffer + dataLen,
+            Length - dataLen,
+            0,
+            HttpdiskBodyReceived_,
+            Body
+            );
+        if (nRecv != 0)
         {
-            DbgPrint("HttpDisk: recv() error: %#x\n", nRecv);
+            DbgPrint("HttpDisk: recv_async() error: %#x\n", nRecv);
             close(*Socket);
             *Socket = -1;
-            break;
+            IoStatus->Status = STATUS_UNSUCCESSFUL;
+            return IoStatus->Status;
         }
-        if (nRecv < 1 || dataLen + nRecv > Length || nRecv > BUFFER_SIZE)
+    }
+
+    IoStatus->Status = STATUS_SUCCESS;
+    return IoStatus->Status;
+}
+
+NTSTATUS
+HttpDiskFinishBlock (
+    IN PHTTP_BODY           Body,
+    OUT PIO_STATUS_BLOCK    IoStatus
+    )
+{
+    int                 nRecv;
+
+    ASSERT(Body != NULL);
+    ASSERT(IoStatus != NULL);
+
+    IoStatus->Information = 0;
+
+    while (Body->Received < Body->Length)
+    {
+        KeWaitForSingleObject(&Body->Event, Executive, KernelMode, FALSE, NULL);
+
+        nRecv = Body->Result;
+
+        if (nRecv >= 1)
         {
-            DbgPrint("HttpDisk: Invalid data length %u+%u\n", dataLen, nRecv);
-            close(*Socket);
-            *Socket = -1;
-            break;
+            Body->Received += nRecv;
+
+            if (Body->Received >= Body->Length)
+            {
+                break;
+            }
+
+            nRecv = recv_async(
+                *Body->Socket,
+                (char *) Body->Buffer + Body->Received,
+                Body->Length - Body->Received,
+                0,
+                HttpdiskBodyReceived_,
+                Body
+                );
+
+            if (nRecv == 0)
+            {
+                continue;
+            }
         }
-        RtlCopyMemory(
-            (PVOID)((PUCHAR) SystemBuffer + dataLen),
-            buffer,
-            nRecv
-        );
-        dataLen += nRecv;
+
+        DbgPrint("HttpDisk: recv() error: %#x\n", nRecv);
+        DbgPrint("HttpDisk: received data length: %u, expected data length: %u\n", Body->Received, Body->Length);
+        close(*Body->Socket);
+        *Body->Socket = -1;
+        IoStatus->Status = STATUS_UNSUCCESSFUL;
+        return IoStatus->Status;
     }
 
-    if (dataLen != Length)
+    if (!Body->KeepAlive)
     {
-        DbgPrint("HttpDisk: received data length: %u, expected data length: %u\n", dataLen, Length);
+        close(*Body->Socket);
+        *Body->Socket = -1;
     }
 
-    ExFreePool(buffer);
     IoStatus->Status = STATUS_SUCCESS;
-    IoStatus->Information = dataLen;
+    IoStatus->Information = Body->Received;
     return IoStatus->Status;
 }
+
+/* Note what a body's recv_async() got.  Can run at DISPATCH_LEVEL. */
+static VOID HttpdiskBodyReceived_(IN PVOID context, IN int result) {
+    PHTTP_BODY body = context;
+
+    body->Result = result;
+    KeSetEvent(&body->Event, 0, FALSE);
+  }
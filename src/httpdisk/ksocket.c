@@ -42,6 +42,15 @@ typedef struct _SOCKET {
     struct sockaddr     peer;
 } SOCKET, *PSOCKET;
 
+// What send_async() and recv_async() pass to the TDI layer's callback.
+typedef struct _SOCKET_ASYNC {
+    sock_callback       callback;
+    void                *context;
+} SOCKET_ASYNC, *PSOCKET_ASYNC;
+
+static PSOCKET_ASYNC socket_async_alloc(sock_callback callback, void *context);
+static void socket_async_complete(PVOID context, NTSTATUS result);
+
 NTSTATUS event_disconnect(PVOID TdiEventContext, CONNECTION_CONTEXT ConnectionContext, LONG DisconnectDataLength,
                           PVOID DisconnectData, LONG DisconnectInformationLength, PVOID DisconnectInformation,
                           ULONG DisconnectFlags)
@@ -358,6 +367,48 @@ int __cdecl recv(int socket, char *buf, int len, int flags)
     }
 }
 
+//
+// Start receiving on a connected stream socket.  Returns 0 once started,
+// and the callback gets what recv() would have returned.  Returns -1 or
+// a negative status if it couldn't be started, and then the callback
+// isn't called.
+//
+int __cdecl recv_async(int socket, char *buf, int len, int flags, sock_callback callback, void *context)
+{
+    PSOCKET s = (PSOCKET) -socket;
+    PSOCKET_ASYNC async;
+    NTSTATUS status;
+
+    if (s->type != SOCK_STREAM || !s->isConnected)
+    {
+        return -1;
+    }
+
+    async = socket_async_alloc(callback, context);
+
+    if (async == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = tdi_recv_stream_async(
+        s->streamSocket->connectionFileObject,
+        buf,
+        len,
+        flags == MSG_OOB ? TDI_RECEIVE_EXPEDITED : TDI_RECEIVE_NORMAL,
+        socket_async_complete,
+        async
+        );
+
+    if (status != STATUS_PENDING)
+    {
+        ExFreePool(async);
+        return status;
+    }
+
+    return 0;
+}
+
 int __cdecl recvfrom(int socket, char *buf, int len, int flags, struct sockaddr *addr, int *addrlen)
 {
     PSOCKET s = (PSOCKET) -socket;
@@ -432,6 +483,45 @@ int __cdecl send(int socket, const char *buf, int len, int flags)
     }
 }
 
+//
+// Start sending on a connected stream socket, like recv_async().
+//
+int __cdecl send_async(int socket, const char *buf, int len, int flags, sock_callback callback, void *context)
+{
+    PSOCKET s = (PSOCKET) -socket;
+    PSOCKET_ASYNC async;
+    NTSTATUS status;
+
+    if (s->type != SOCK_STREAM || !s->isConnected)
+    {
+        return -1;
+    }
+
+    async = socket_async_alloc(callback, context);
+
+    if (async == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = tdi_send_stream_async(
+        s->streamSocket->connectionFileObject,
+        buf,
+        len,
+        flags == MSG_OOB ? TDI_SEND_EXPEDITED : 0,
+        socket_async_complete,
+        async
+        );
+
+    if (status != STATUS_PENDING)
+    {
+        ExFreePool(async);
+        return status;
+    }
+
+    return 0;
+}
+
 int __cdecl sendto(int socket, const char *buf, int len, int flags, const struct sockaddr *addr, int addrlen)
 {
     PSOCKET s = (PSOCKET) -socket;
@@ -531,3 +621,31 @@ int __cdecl socket(int af, int type, int protocol)
 
     return -(int)s;
 }
+
+static PSOCKET_ASYNC socket_async_alloc(sock_callback callback, void *context)
+{
+    PSOCKET_ASYNC async = HttpDiskMalloc(sizeof *async);
+
+    if (async != NULL)
+    {
+        async->callback = callback;
+        async->context = context;
+    }
+
+    return async;
+}
+
+//
+// Pass what the TDI layer reports on to the socket's caller, as recv()
+// or send() would have returned it.
+//
+static void socket_async_complete(PVOID context, NTSTATUS result)
+{
+    PSOCKET_ASYNC async = (PSOCKET_ASYNC) context;
+    sock_callback callback = async->callback;
+    void *callbackContext = async->context;
+
+    ExFreePool(async);
+
+    callback(callbackContext, (int) result);
+}
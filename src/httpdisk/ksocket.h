@@ -108,6 +108,11 @@ struct timeval {
     long tv_usec;
 };
 
+// Called once send_async() or recv_async() is done, with what send() or
+// recv() would have returned.  Can be called at DISPATCH_LEVEL, and
+// before the call which started it has returned.
+typedef void (*sock_callback)(void *context, int result);
+
 int __cdecl accept(int socket, struct sockaddr *addr, int *addrlen);
 int __cdecl bind(int socket, const struct sockaddr *addr, int addrlen);
 int __cdecl close(int socket);
@@ -131,9 +136,11 @@ int __cdecl listen(int socket, int backlog);
 u_long __cdecl ntohl(u_long netlong);
 u_short __cdecl ntohs(u_short netshort);
 int __cdecl recv(int socket, char *buf, int len, int flags);
+int __cdecl recv_async(int socket, char *buf, int len, int flags, sock_callback callback, void *context);
 int __cdecl recvfrom(int socket, char *buf, int len, int flags, struct sockaddr *addr, int *addrlen);
 int __cdecl select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const struct timeval *timeout);
 int __cdecl send(int socket, const char *buf, int len, int flags);
+int __cdecl send_async(int socket, const char *buf, int len, int flags, sock_callback callback, void *context);
 int __cdecl sendto(int socket, const char *buf, int len, int flags, const struct sockaddr *addr, int addrlen);
 int __cdecl setsockopt(int socket, int level, int optname, const char *optval, int optlen);
 int __cdecl shutdown(int socket, int how);
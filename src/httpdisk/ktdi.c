@@ -22,6 +22,15 @@
 extern PVOID HttpDiskMalloc(SIZE_T);
 extern PVOID HttpDiskPalloc(SIZE_T);
 
+typedef struct _TDI_ASYNC {
+    PFILE_OBJECT    connectionFileObject;
+    tdi_callback    callback;
+    PVOID           context;
+} TDI_ASYNC, *PTDI_ASYNC;
+
+static NTSTATUS tdi_stream_async(UCHAR minorFunction, PFILE_OBJECT connectionFileObject, char *buf, int len, ULONG flags, tdi_callback callback, PVOID context);
+static NTSTATUS tdi_async_complete(PDEVICE_OBJECT devObj, PIRP irp, PVOID context);
+
 NTSTATUS tdi_open_transport_address(PUNICODE_STRING devName, ULONG addr, USHORT port, BOOLEAN shared, PHANDLE addressHandle, PFILE_OBJECT *addressFileObject)
 {
     OBJECT_ATTRIBUTES           attr;
@@ -779,3 +788,129 @@ NTSTATUS tdi_query_address(PFILE_OBJECT addressFileObject, PULONG addr, PUSHORT
 
     return status;
 }
+
+//
+// The asynchronous versions use an IRP of our own rather than one built
+// by TdiBuildInternalDeviceControlIrp, since the I/O manager would
+// otherwise complete it by signalling an event in the caller's frame.
+// They return STATUS_PENDING once the operation is started, after which
+// the callback is called exactly once, or an error if it couldn't be
+// started, in which case the callback isn't called.  The buffer has to
+// stay valid until then.  The connection's file object is referenced
+// meanwhile, so a socket which is closed early just fails what it has
+// outstanding.
+//
+
+NTSTATUS tdi_send_stream_async(PFILE_OBJECT connectionFileObject, const char *buf, int len, ULONG flags, tdi_callback callback, PVOID context)
+{
+    return tdi_stream_async(TDI_SEND, connectionFileObject, (char *) buf, len, flags, callback, context);
+}
+
+NTSTATUS tdi_recv_stream_async(PFILE_OBJECT connectionFileObject, char *buf, int len, ULONG flags, tdi_callback callback, PVOID context)
+{
+    return tdi_stream_async(TDI_RECEIVE, connectionFileObject, buf, len, flags, callback, context);
+}
+
+static NTSTATUS tdi_stream_async(UCHAR minorFunction, PFILE_OBJECT connectionFileObject, char *buf, int len, ULONG flags, tdi_callback callback, PVOID context)
+{
+    PDEVICE_OBJECT  devObj;
+    PTDI_ASYNC      async;
+    PIRP            irp;
+    PMDL            mdl;
+    NTSTATUS        status;
+
+    devObj = IoGetRelatedDeviceObject(connectionFileObject);
+
+    async = HttpDiskMalloc(sizeof *async);
+
+    if (async == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    async->connectionFileObject = connectionFileObject;
+    async->callback = callback;
+    async->context = context;
+
+    irp = IoAllocateIrp(devObj->StackSize, FALSE);
+
+    if (irp == NULL)
+    {
+        ExFreePool(async);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    mdl = NULL;
+
+    if (len)
+    {
+        mdl = IoAllocateMdl((void*) buf, len, FALSE, FALSE, NULL);
+
+        if (mdl == NULL)
+        {
+            IoFreeIrp(irp);
+            ExFreePool(async);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        __try
+        {
+            MmProbeAndLockPages(mdl, KernelMode, minorFunction == TDI_SEND ? IoReadAccess : IoWriteAccess);
+            status = STATUS_SUCCESS;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            IoFreeMdl(mdl);
+            IoFreeIrp(irp);
+            ExFreePool(async);
+            status = STATUS_INVALID_USER_BUFFER;
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    if (minorFunction == TDI_SEND)
+    {
+        TdiBuildSend(irp, devObj, connectionFileObject, tdi_async_complete, async, mdl, flags, len);
+    }
+    else
+    {
+        TdiBuildReceive(irp, devObj, connectionFileObject, tdi_async_complete, async, mdl, flags, len);
+    }
+
+    ObReferenceObject(connectionFileObject);
+
+    // The completion routine sees to everything, whatever this returns.
+    IoCallDriver(devObj, irp);
+
+    return STATUS_PENDING;
+}
+
+static NTSTATUS tdi_async_complete(PDEVICE_OBJECT devObj, PIRP irp, PVOID context)
+{
+    PTDI_ASYNC  async = (PTDI_ASYNC) context;
+    NTSTATUS    status;
+
+    status = NT_SUCCESS(irp->IoStatus.Status) ? irp->IoStatus.Information : irp->IoStatus.Status;
+
+    if (irp->MdlAddress != NULL)
+    {
+        MmUnlockPages(irp->MdlAddress);
+        IoFreeMdl(irp->MdlAddress);
+        irp->MdlAddress = NULL;
+    }
+
+    IoFreeIrp(irp);
+
+    ObDereferenceObject(async->connectionFileObject);
+
+    async->callback(async->context, status);
+
+    ExFreePool(async);
+
+    // The IRP is ours and it's gone, so the I/O manager mustn't touch it.
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
@@ -14,6 +14,11 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+// Called once an asynchronous operation is done, with what the blocking
+// version would have returned.  Can be called at DISPATCH_LEVEL, and
+// before the call which started the operation has returned.
+typedef void (*tdi_callback)(PVOID context, NTSTATUS result);
+
 NTSTATUS tdi_open_transport_address(PUNICODE_STRING devName, ULONG addr, USHORT port, BOOLEAN shared, PHANDLE addressHandle, PFILE_OBJECT *addressFileObject);
 NTSTATUS tdi_open_connection_endpoint(PUNICODE_STRING devName, PVOID connectionContext, BOOLEAN shared, PHANDLE connectionHandle, PFILE_OBJECT *connectionFileObject);
 NTSTATUS tdi_set_event_handler(PFILE_OBJECT addressFileObject, LONG eventType, PVOID eventHandler, PVOID eventContext);
@@ -27,3 +32,5 @@ NTSTATUS tdi_recv_dgram(PFILE_OBJECT addressFileObject, PULONG addr, PUSHORT por
 NTSTATUS tdi_send_stream(PFILE_OBJECT connectionFileObject, const char *buf, int len, ULONG flags);
 NTSTATUS tdi_recv_stream(PFILE_OBJECT connectionFileObject, char *buf, int len, ULONG flags);
 NTSTATUS tdi_query_address(PFILE_OBJECT addressFileObject, PULONG addr, PUSHORT port);
+NTSTATUS tdi_send_stream_async(PFILE_OBJECT connectionFileObject, const char *buf, int len, ULONG flags, tdi_callback callback, PVOID context);
+NTSTATUS tdi_recv_stream_async(PFILE_OBJECT connectionFileObject, char *buf, int len, ULONG flags, tdi_callback callback, PVOID context);
@@ -1,6 +1,6 @@
 @echo off
 
-set c=ksocket.c ktdi.c httpdisk.c bus.c httpdisk.rc
+set c=ksocket.c ktdi.c httpdisk.c bus.c conn.c connpool.c http.c cachemap.c cache.c httpdisk.rc
 
 set name=WvHTTP%bits%
 
@@ -29,6 +29,7 @@ int HttpDiskSyntax(void)
     fprintf(stderr, "syntax:\n");
     fprintf(stderr, "httpdisk /mount  <url> [/cd]\n");
     fprintf(stderr, "httpdisk /umount <unit_num>\n");
+    fprintf(stderr, "httpdisk /stats  <unit_num>\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "example:\n");
     fprintf(stderr, "httpdisk /mount  http://server.domain.com/path/diskimage.img\n");
@@ -36,6 +37,7 @@ int HttpDiskSyntax(void)
     fprintf(stderr, "...\n");
     fprintf(stderr, "httpdisk /umount 0\n");
     fprintf(stderr, "httpdisk /umount 1\n");
+    fprintf(stderr, "httpdisk /stats  0\n");
 
     return -1;
 }
@@ -147,6 +149,70 @@ int HttpDiskUmount(int DeviceNumber)
     return 0;
 }
 
+int HttpDiskStats(int DeviceNumber)
+{
+    HANDLE                  Device;
+    DWORD                   BytesReturned;
+    HTTP_DISK_CACHE_STATS   Stats;
+    ULONGLONG               Reads;
+
+    Device = CreateFile(
+        HTTPDiskBus,
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_NO_BUFFERING,
+        NULL
+        );
+
+    if (Device == INVALID_HANDLE_VALUE)
+    {
+        PrintLastError("CreateFile()");
+        return -1;
+    }
+
+    // The unit number goes in, and the statistics come back over it.
+
+    *(int *) &Stats = DeviceNumber;
+
+    if (!DeviceIoControl(
+        Device,
+        IOCTL_HTTP_DISK_CACHE_STATS,
+        &Stats,
+        sizeof DeviceNumber,
+        &Stats,
+        sizeof Stats,
+        &BytesReturned,
+        NULL
+        ))
+    {
+        PrintLastError("HttpDisk");
+        CloseHandle(Device);
+        return -1;
+    }
+
+    CloseHandle(Device);
+
+    if (!Stats.Enabled)
+    {
+        printf("Unit %d has no cache.\n", DeviceNumber);
+        return 0;
+    }
+
+    Reads = Stats.Hits + Stats.Misses;
+
+    printf("Block size:    %lu bytes\n", Stats.BlockSize);
+    printf("Blocks cached: %I64u of %I64u\n", Stats.BlocksCached, Stats.Blocks);
+    printf("Block hits:    %I64u\n", Stats.Hits);
+    printf("Block misses:  %I64u\n", Stats.Misses);
+    printf("Hit ratio:     %.1f%%\n", Reads ? 100.0 * Stats.Hits / Reads : 0.0);
+    printf("Bytes saved:   %I64u\n", Stats.BytesSaved);
+    printf("Bytes fetched: %I64u\n", Stats.BytesFetched);
+
+    return 0;
+}
+
 int __cdecl main(int argc, char* argv[])
 {
     char*                   Command;
@@ -286,6 +352,11 @@ int __cdecl main(int argc, char* argv[])
         DeviceNumber = atoi(argv[2]);
         return HttpDiskUmount(DeviceNumber);
     }
+    else if (argc == 3 && !strcmp(Command, "/stats"))
+    {
+        DeviceNumber = atoi(argv[2]);
+        return HttpDiskStats(DeviceNumber);
+    }
     else
     {
         return HttpDiskSyntax();
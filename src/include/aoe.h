@@ -27,6 +27,8 @@
  * AoE specifics.
  */
 
+#  include "rexmit.h"
+
 #  define htons(x) \
   (UINT16)((((x) << 8) & 0xff00) | (((x) >> 8) & 0xff))
 #  define ntohs(x) \
@@ -60,6 +62,13 @@ CTL_CODE(                               \
     METHOD_BUFFERED,                    \
     FILE_READ_DATA | FILE_WRITE_DATA    \
   )
+#  define IOCTL_AOE_STATS               \
+CTL_CODE(                               \
+    FILE_DEVICE_CONTROLLER,             \
+    0x807,                              \
+    METHOD_BUFFERED,                    \
+    FILE_READ_DATA | FILE_WRITE_DATA    \
+  )
 
 typedef enum AOE_SEARCH_STATE {
     AoeSearchStateSearchNic,
@@ -67,14 +76,46 @@ typedef enum AOE_SEARCH_STATE {
     AoeSearchStateGettingSize,
     AoeSearchStateGetGeometry,
     AoeSearchStateGettingGeometry,
-    AoeSearchStateGetMaxSectsPerPacket,
-    AoeSearchStateGettingMaxSectsPerPacket,
+    AoeSearchStateGetConfig,
+    AoeSearchStateGettingConfig,
     AoeSearchStateDone,
     AoeSearchStates
   } AOE_E_SEARCH_STATE, * AOE_EP_SEARCH_STATE;
 
 /*** Object types */
 typedef struct S_AOE_DEV_ S_AOE_DEV, * SP_AOE_DEV;
+/* Private to aoe/driver.c */
+struct AOE_WORK_TAG_;
+struct AOE_POOL_;
+
+/* The most (client NIC, server MAC) paths a disk uses. */
+#define AOE_M_PATHS 8
+
+/** A path to an AoE target. */
+typedef struct AOE_PATH {
+    UCHAR ClientMac[6];
+    UCHAR ServerMac[6];
+    /* The client NIC's MTU.  Below the disk's, the path isn't used. */
+    UINT32 MTU;
+    /* Smoothed round-trip time, in 100 ns units, or zero if unmeasured. */
+    LONGLONG Srtt;
+    /* Tags last sent on the path and awaiting a reply. */
+    UINT32 InFlight;
+    /* Timeouts since the path's last reply. */
+    UINT32 Timeouts;
+    /* When the path was found dead, or zero while it's live. */
+    LARGE_INTEGER DeadTime;
+  } AOE_S_PATH, * AOE_SP_PATH;
+
+/** Object pool statistics. */
+typedef struct AOE_POOL_STATS {
+    /* Allocations satisfied from the pool, and those which weren't. */
+    UINT32 Hits;
+    UINT32 Misses;
+    /* Objects currently allocated, and the most ever at once. */
+    UINT32 InUse;
+    UINT32 HighWater;
+  } AOE_S_POOL_STATS, * AOE_SP_POOL_STATS;
 
 /*** Structure/union definitions */
 struct S_AOE_DEV_ {
@@ -94,7 +135,11 @@ typedef struct AOE_DISK {
     UINT32 Major;
     UINT32 Minor;
     UINT32 MaxSectorsPerPacket;
-    UINT32 Timeout;
+    /* The target's limits, from its Query Config reply. */
+    UINT32 ConfigSectors;
+    UINT32 ConfigBuffers;
+    /* Round-trip time estimate and retransmit timeout, in 100 ns units. */
+    AOE_S_RTT Rtt;
     KEVENT SearchEvent;
     BOOLEAN Boot;
     AOE_E_SEARCH_STATE search_state;
@@ -102,6 +147,32 @@ typedef struct AOE_DISK {
     WV_E_DEV_STATE State;
     /* Previous state of the device. */
     WV_E_DEV_STATE OldState;
+    /* Unsent tags, oldest first. */
+    struct AOE_WORK_TAG_ * TagQueueFirst;
+    struct AOE_WORK_TAG_ * TagQueueLast;
+    /* The next disk with unsent tags, if we're queued. */
+    struct AOE_DISK * NextQueued;
+    BOOLEAN Queued;
+    /* Tags sent and awaiting a reply. */
+    UINT32 InFlight;
+    /* Congestion window, in tags. */
+    UINT32 Window;
+    /* Window size at which growth slows from exponential to linear. */
+    UINT32 WindowThreshold;
+    /* Upper bound for the window. */
+    UINT32 WindowMax;
+    /* Timely replies since the window last grew, above the threshold. */
+    UINT32 WindowAcks;
+    /* When the window was last cut. */
+    LARGE_INTEGER WindowCutTime;
+    /* Tags with their frame headers, and I/O requests. */
+    struct AOE_POOL_ * TagPool;
+    struct AOE_POOL_ * RequestPool;
+    /* Paths to the target, once it's found.  Tags are striped over them. */
+    AOE_S_PATH Paths[AOE_M_PATHS];
+    UINT32 PathCount;
+    /* When to next look for new or revived paths. */
+    LARGE_INTEGER PathScanTime;
   } AOE_S_DISK, * AOE_SP_DISK;
 
 typedef struct AOE_MOUNT_TARGET {
@@ -125,13 +196,50 @@ typedef struct AOE_MOUNT_DISK {
     UINT32 Major;
     UINT32 Minor;
     LONGLONG LBASize;
+    UINT32 InFlight;
+    UINT32 Window;
+    AOE_S_POOL_STATS TagPool;
+    AOE_S_POOL_STATS RequestPool;
+    UINT32 Paths;
+    UINT32 LivePaths;
   } AOE_S_MOUNT_DISK, * AOE_SP_MOUNT_DISK;
 
 typedef struct AOE_MOUNT_DISKS {
     UINT32 Count;
+    /* Tags in flight for all disks. */
+    UINT32 InFlight;
     AOE_S_MOUNT_DISK Disk[];
   } AOE_S_MOUNT_DISKS, * AOE_SP_MOUNT_DISKS;
 
+/** AoE worker thread statistics, from IOCTL_AOE_STATS. */
+typedef struct AOE_STATS {
+    /* Tags waiting to be sent. */
+    UINT32 QueueDepth;
+    /* Tags sent and awaiting a reply. */
+    UINT32 InFlight;
+    /* Worker thread wakeups, and those which found nothing due. */
+    UINT32 Wakeups;
+    UINT32 IdleWakeups;
+    /* Sends, resends and probes done by all wakeups, and by the busiest. */
+    UINT32 Work;
+    UINT32 MaxWork;
+    UINT32 Sends;
+    UINT32 SendFails;
+    UINT32 Resends;
+    UINT32 ResendFails;
+    /* Resends put off because NDIS hadn't finished the last send. */
+    UINT32 ResendsDeferred;
+    UINT32 Probes;
+    /* Wakeups and work during the last whole second. */
+    UINT32 WakeupsPerSec;
+    UINT32 WorkPerSec;
+    /* Tags sent in another tag's frame, rather than in their own. */
+    UINT32 Merges;
+    /* Sectors carried by sends, not counting resends. */
+    UINT32 SentSectors;
+  } AOE_S_STATS, * AOE_SP_STATS;
+
 extern VOID aoe__reset_probe(void);
+extern VOID STDCALL aoe__mtu_changed(IN PUCHAR, IN UINT32);
 
 #endif  /* AOE_M_AOE_H_ */
@@ -0,0 +1,166 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HTTPDISK_M_CACHEMAP_H_
+#  define HTTPDISK_M_CACHEMAP_H_
+
+/**
+ * @file
+ *
+ * HTTPDisk cache file layout and reads through it.
+ *
+ * The file and the server are only used through the owner's routines.
+ * Which file to use, and when to write the bitmap back, is the owner's
+ * business.
+ */
+
+/* The most of an ETag or Last-Modified validator we keep. */
+#  define HTTPDISK_M_VALIDATOR_SIZE 128
+
+/* The size of a cached block, in bytes.  A range request each. */
+#  define HTTPDISK_M_CACHE_BLOCK (64 * 1024)
+
+/* The size of the header page, and what the bitmap is rounded up to. */
+#  define HTTPDISK_M_CACHE_PAGE 4096
+
+/* Change this when the layout changes, so old files are started over. */
+#  define HTTPDISK_M_CACHE_VERSION 1
+
+/* The most of the disk's host and file name which is kept. */
+#  define HTTPDISK_M_CACHE_NAME 2048
+
+/* The header page of a cache file. */
+typedef struct HTTPDISK_CACHE_HEADER {
+    char Magic[8];
+    unsigned int Version;
+    unsigned int BlockSize;
+    long long FileSize;
+    unsigned int ValidatorLen;
+    char Validator[HTTPDISK_M_VALIDATOR_SIZE];
+    unsigned int NameLen;
+    char Name[HTTPDISK_M_CACHE_NAME];
+  } HTTPDISK_S_CACHE_HEADER, * HTTPDISK_SP_CACHE_HEADER;
+
+/**
+ * Read or write part of the cache file.
+ *
+ * @v context           The map's owner.
+ * @v write             Non-zero to write, else read.
+ * @v offset            The byte offset into the file.
+ * @v length            The number of bytes.
+ * @v buffer            The data.
+ * @ret long            Negative upon failure.  Short reads are failures.
+ */
+typedef long HTTPDISK_F_CACHE_RW(
+    void *,
+    int,
+    long long,
+    unsigned int,
+    void *
+  );
+typedef HTTPDISK_F_CACHE_RW * HTTPDISK_FP_CACHE_RW;
+
+/**
+ * Make what has been written to the cache file durable.
+ *
+ * @v context           The map's owner.
+ * @ret long            Negative upon failure.
+ */
+typedef long HTTPDISK_F_CACHE_SYNC(void *);
+typedef HTTPDISK_F_CACHE_SYNC * HTTPDISK_FP_CACHE_SYNC;
+
+/**
+ * Cut the cache file short.
+ *
+ * @v context           The map's owner.
+ * @v size              The file's new size, in bytes.
+ * @ret long            Negative upon failure.
+ */
+typedef long HTTPDISK_F_CACHE_TRUNCATE(void *, long long);
+typedef HTTPDISK_F_CACHE_TRUNCATE * HTTPDISK_FP_CACHE_TRUNCATE;
+
+/**
+ * Read part of the image from the server.
+ *
+ * @v context           The map's owner.
+ * @v offset            The byte offset into the image.
+ * @v length            The number of bytes.
+ * @v buffer            Receives the data.
+ * @ret long            Negative upon failure.
+ */
+typedef long HTTPDISK_F_CACHE_FETCH(void *, long long, unsigned int, void *);
+typedef HTTPDISK_F_CACHE_FETCH * HTTPDISK_FP_CACHE_FETCH;
+
+/** A disk's cache file, as the disk sees it. */
+typedef struct HTTPDISK_CACHE_MAP {
+    void * Context;
+    HTTPDISK_FP_CACHE_RW Rw;
+    HTTPDISK_FP_CACHE_SYNC Sync;
+    HTTPDISK_FP_CACHE_TRUNCATE Truncate;
+    HTTPDISK_FP_CACHE_FETCH Fetch;
+    long long FileSize;
+    unsigned int BlockSize;
+    unsigned long long Blocks;
+    unsigned int BitmapSize;
+    long long DataOffset;
+    /* Which blocks are cached.  BitmapSize bytes, from the owner. */
+    unsigned char * Bitmap;
+    /* The range of the bitmap which isn't written back yet. */
+    unsigned int DirtyStart;
+    unsigned int DirtyEnd;
+    /* For blocks which are only partly read.  From the owner. */
+    unsigned char * Bounce;
+    unsigned int BounceBlocks;
+    unsigned long long BlocksCached;
+    unsigned long long Hits;
+    unsigned long long Misses;
+    unsigned long long BytesSaved;
+    unsigned long long BytesFetched;
+  } HTTPDISK_S_CACHE_MAP, * HTTPDISK_SP_CACHE_MAP;
+
+extern void HttpdiskCacheMapInit(
+    HTTPDISK_SP_CACHE_MAP,
+    long long,
+    unsigned int,
+    void *,
+    HTTPDISK_FP_CACHE_RW,
+    HTTPDISK_FP_CACHE_SYNC,
+    HTTPDISK_FP_CACHE_TRUNCATE,
+    HTTPDISK_FP_CACHE_FETCH
+  );
+extern void HttpdiskCacheMapHeader(
+    HTTPDISK_SP_CACHE_MAP,
+    const char *,
+    const char *,
+    const char *,
+    HTTPDISK_SP_CACHE_HEADER
+  );
+extern long HttpdiskCacheMapLoad(
+    HTTPDISK_SP_CACHE_MAP,
+    HTTPDISK_SP_CACHE_HEADER,
+    HTTPDISK_SP_CACHE_HEADER
+  );
+extern long HttpdiskCacheMapRead(
+    HTTPDISK_SP_CACHE_MAP,
+    long long,
+    unsigned int,
+    void *
+  );
+extern long HttpdiskCacheMapFlush(HTTPDISK_SP_CACHE_MAP);
+
+#endif  /* HTTPDISK_M_CACHEMAP_H_ */
@@ -0,0 +1,114 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HTTPDISK_M_CONNPOOL_H_
+#  define HTTPDISK_M_CONNPOOL_H_
+
+/**
+ * @file
+ *
+ * HTTPDisk keep-alive connection pool.
+ *
+ * The pool decides which connections requests use, when idle ones are
+ * probed, and when broken ones are connected again.  Sockets are only
+ * touched through its owner's routines, and times are given by its
+ * owner.
+ */
+
+/* The most keep-alive connections a disk can have to its server. */
+#  define HTTPDISK_M_CONNS 16
+
+/* How long a connection can sit idle before it's probed, in 100 ns. */
+#  define HTTPDISK_M_CONN_IDLE (4 * 10000000LL)
+
+/*
+ * How long to wait after a connect fails before trying another, in
+ * 100 ns.  The wait doubles with each failure, up to the most.
+ */
+#  define HTTPDISK_M_CONN_RETRY_MIN (1 * 10000000LL)
+#  define HTTPDISK_M_CONN_RETRY_MAX (64 * 10000000LL)
+
+typedef struct HTTPDISK_CONN {
+    int socket;
+    /* When the connection was last used or probed, in 100 ns. */
+    long long last_used;
+  } HTTPDISK_S_CONN, * HTTPDISK_SP_CONN;
+
+/**
+ * Connect a new socket to the server.
+ *
+ * @v context           The pool's owner.
+ * @ret int             The socket, or a negative value upon failure.
+ */
+typedef int HTTPDISK_F_CONN_OPEN(void *);
+typedef HTTPDISK_F_CONN_OPEN * HTTPDISK_FP_CONN_OPEN;
+
+/**
+ * Check that an idle connection still works.
+ *
+ * @v context           The pool's owner.
+ * @v socket            The connection's socket.
+ * @ret int             Non-zero if it works.
+ */
+typedef int HTTPDISK_F_CONN_PROBE(void *, int);
+typedef HTTPDISK_F_CONN_PROBE * HTTPDISK_FP_CONN_PROBE;
+
+/**
+ * Close a connection's socket.
+ *
+ * @v context           The pool's owner.
+ * @v socket            The socket.
+ */
+typedef void HTTPDISK_F_CONN_CLOSE(void *, int);
+typedef HTTPDISK_F_CONN_CLOSE * HTTPDISK_FP_CONN_CLOSE;
+
+typedef struct HTTPDISK_CONN_POOL {
+    void * context;
+    HTTPDISK_FP_CONN_OPEN open;
+    HTTPDISK_FP_CONN_PROBE probe;
+    HTTPDISK_FP_CONN_CLOSE close;
+    HTTPDISK_S_CONN conns[HTTPDISK_M_CONNS];
+    /* How many of the connections are used. */
+    unsigned int count;
+    /* The connection the next request starts with. */
+    unsigned int next;
+    /* No connect is tried before this time. */
+    long long retry_at;
+    /* How far off the next failed connect puts retry_at. */
+    long long retry_wait;
+  } HTTPDISK_S_CONN_POOL, * HTTPDISK_SP_CONN_POOL;
+
+extern void HttpdiskConnPoolInit(
+    HTTPDISK_SP_CONN_POOL,
+    unsigned int,
+    void *,
+    HTTPDISK_FP_CONN_OPEN,
+    HTTPDISK_FP_CONN_PROBE,
+    HTTPDISK_FP_CONN_CLOSE
+  );
+extern unsigned int HttpdiskConnPoolTake(
+    HTTPDISK_SP_CONN_POOL,
+    long long,
+    HTTPDISK_SP_CONN *,
+    unsigned int,
+    int *
+  );
+extern void HttpdiskConnPoolMaintain(HTTPDISK_SP_CONN_POOL, long long);
+extern void HttpdiskConnPoolCloseAll(HTTPDISK_SP_CONN_POOL);
+
+#endif  /* HTTPDISK_M_CONNPOOL_H_ */
@@ -0,0 +1,70 @@
+/**
+ * Copyright (C) 2009-2011, Shao Miller <shao.miller@yrdsb.edu.on.ca>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef M_COPY_H_
+
+/****
+ * @file
+ *
+ * WinVBlock bulk copy library.
+ */
+
+/*** Macros */
+#define M_COPY_H_
+
+/**
+ * Transfers at least this large are copied with non-temporal stores,
+ * when the CPU supports SSE2, so that they don't evict the cache.
+ */
+#define WVL_M_COPY_STREAM_MIN (256 * 1024)
+
+/*** Function declarations */
+
+/**
+ * Copy a block of memory, choosing the fastest method for this CPU.
+ *
+ * @v Dest              Points to the destination.
+ * @v Src               Points to the source.
+ * @v Length            The number of bytes to copy.
+ *
+ * The source and destination must not overlap.  Every byte is copied,
+ * regardless of the alignment of the pointers or the length.
+ * Must be called at IRQL <= DISPATCH_LEVEL.
+ */
+extern WVL_M_LIB VOID STDCALL WvlCopyMemory(
+    OUT PVOID Dest,
+    IN const VOID * Src,
+    IN SIZE_T Length
+  );
+
+/**
+ * Copy a block of memory using portable C, only.
+ *
+ * @v Dest              Points to the destination.
+ * @v Src               Points to the source.
+ * @v Length            The number of bytes to copy.
+ *
+ * This is the reference that the CPU-specific methods must match.
+ */
+extern WVL_M_LIB VOID STDCALL WvlCopyMemoryReference(
+    OUT PVOID Dest,
+    IN const VOID * Src,
+    IN SIZE_T Length
+  );
+
+#endif  /* M_COPY_H_ */
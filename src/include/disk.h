@@ -54,8 +54,10 @@ typedef enum WVL_DISK_IO_MODE {
     WvlDiskIoModes
   } WVL_E_DISK_IO_MODE, * WVL_EP_DISK_IO_MODE;
 
-/* Forward declaration. */
+/* Forward declarations. */
 typedef struct WVL_DISK_T WVL_S_DISK_T, * WVL_SP_DISK_T;
+typedef struct WVL_DISK_OVERLAY WVL_S_DISK_OVERLAY, * WVL_SP_DISK_OVERLAY;
+typedef struct WVL_DISK_CACHE WVL_S_DISK_CACHE, * WVL_SP_DISK_CACHE;
 
 typedef NTSTATUS STDCALL WVL_F_DISK_SCSI(
     IN PDEVICE_OBJECT dev_obj,
@@ -111,6 +113,14 @@ typedef UINT32 WVL_F_DISK_MAX_XFER_LEN(IN WVL_SP_DISK_T);
 typedef WVL_F_DISK_MAX_XFER_LEN * WVL_FP_DISK_MAX_XFER_LEN;
 extern WVL_M_LIB WVL_F_DISK_MAX_XFER_LEN WvlDiskMaxXferLen;
 
+/**
+ * How much a disk can have in flight at once, in bytes.  The disk's
+ * MaxInFlightLen operation has the same prototype as MaxXferLen, and
+ * can change its answer over time.  Without one, this is the maximum
+ * transfer length.
+ */
+extern WVL_M_LIB WVL_F_DISK_MAX_XFER_LEN WvlDiskMaxInFlightLen;
+
 /**
  * Disk close routine.
  *
@@ -129,6 +139,27 @@ typedef UCHAR STDCALL WVL_F_DISK_UNIT_NUM(IN WVL_SP_DISK_T);
 typedef WVL_F_DISK_UNIT_NUM * WVL_FP_DISK_UNIT_NUM;
 extern WVL_M_LIB WVL_F_DISK_UNIT_NUM WvlDiskUnitNum;
 
+/**
+ * Disk unmap routine.
+ *
+ * @v disk              The disk with sectors no longer in use.
+ * @v start_sector      First sector no longer in use.
+ * @v sector_count      Number of sectors no longer in use.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The disk may release whatever backs the sectors.  Unmapped sectors
+ * read back as zeroes.  Called at IRQL <= DISPATCH_LEVEL, from whatever
+ * context the disk passes a SCSI UNMAP or WRITE SAME to WvlDiskScsi in
+ * (see WvlDiskScsiUnmaps), or at PASSIVE_LEVEL for a TRIM IOCTL.
+ */
+typedef NTSTATUS STDCALL WVL_F_DISK_UNMAP(
+    IN WVL_SP_DISK_T,
+    IN LONGLONG,
+    IN ULONGLONG
+  );
+typedef WVL_F_DISK_UNMAP * WVL_FP_DISK_UNMAP;
+extern WVL_M_LIB WVL_F_DISK_UNMAP WvlDiskUnmap;
+
 typedef struct WVL_DISK_OPS {
     WVL_FP_DISK_IO Io;
     WVL_FP_DISK_MAX_XFER_LEN MaxXferLen;
@@ -136,6 +167,8 @@ typedef struct WVL_DISK_OPS {
     WVL_FP_DISK_UNIT_NUM UnitNum;
     WVL_FP_DISK_PNP PnpQueryId;
     WVL_FP_DISK_PNP PnpQueryDevText;
+    WVL_FP_DISK_UNMAP Unmap;
+    WVL_FP_DISK_MAX_XFER_LEN MaxInFlightLen;
   } WVL_S_DISK_OPS, * WVL_SP_DISK_OPS;
 
 struct WVL_DISK_T {
@@ -154,8 +187,76 @@ struct WVL_DISK_T {
     WVL_E_DISK_STATE State;
     /* Do we allow page files? */
     BOOLEAN DenyPageFile;
+    /* Copy-on-write overlay, if writes are kept in RAM. */
+    WVL_SP_DISK_OVERLAY Overlay;
+    /* Block cache, if the disk is cached. */
+    WVL_SP_DISK_CACHE Cache;
+    /* Never cache the disk; it's in RAM already. */
+    BOOLEAN NoCache;
+    /* Read ahead of sequential reads; each read is a round trip. */
+    BOOLEAN ReadAhead;
   };
 
+/**
+ * Give a disk a copy-on-write overlay in RAM.
+ *
+ * @v Disk              The disk.  Its size and sector size must be known.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Writes to the disk are then kept in RAM and never reach the disk's
+ * I/O routine.  Call this before the disk is added to a bus.
+ */
+extern WVL_M_LIB NTSTATUS STDCALL WvlDiskOverlayCreate(
+    IN OUT WVL_SP_DISK_T
+  );
+
+/**
+ * Release a disk's copy-on-write overlay, and everything written to it.
+ *
+ * @v Disk              The disk, which must have no I/O in progress.
+ */
+extern WVL_M_LIB VOID STDCALL WvlDiskOverlayFree(IN OUT WVL_SP_DISK_T);
+
+/* Block cache settings, for disks started from now on. */
+extern WVL_M_LIB UINT32 WvlDiskCacheSize;
+extern WVL_M_LIB UINT32 WvlDiskCacheBlockSize;
+extern WVL_M_LIB BOOLEAN WvlDiskCacheWriteBack;
+/* Read-ahead settings, for disks started from now on. */
+extern WVL_M_LIB UINT32 WvlDiskReadAheadMax;
+extern WVL_M_LIB UINT32 WvlDiskReadAheadBuffer;
+
+/**
+ * Give a disk a block cache, if caching is enabled.
+ *
+ * @v Disk              The disk.  Its size and sector size must be known.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Called when the disk is started.  A disk which reads ahead is given a
+ * cache of WvlDiskReadAheadBuffer megabytes, if caching is otherwise
+ * disabled.
+ */
+extern WVL_M_LIB NTSTATUS STDCALL WvlDiskCacheCreate(IN OUT WVL_SP_DISK_T);
+
+/**
+ * Write a disk's dirty cache blocks to the disk.
+ *
+ * @v Disk              The disk.
+ * @v Irp               Optional.  A SCSI IRP to complete when done.
+ * @ret NTSTATUS        STATUS_PENDING if the IRP will be completed,
+ *                      else the status of the operation.
+ */
+extern WVL_M_LIB NTSTATUS STDCALL WvlDiskCacheFlush(
+    IN WVL_SP_DISK_T,
+    IN PIRP
+  );
+
+/**
+ * Write a disk's dirty cache blocks, then release its cache.
+ *
+ * @v Disk              The disk.  Called at PASSIVE_LEVEL.
+ */
+extern WVL_M_LIB VOID STDCALL WvlDiskCacheFree(IN OUT WVL_SP_DISK_T);
+
 /* An MBR C/H/S address and ways to access its components. */
 typedef UCHAR chs[3];
 
@@ -207,6 +308,7 @@ extern WVL_M_LIB NTSTATUS STDCALL WvlDiskDevCtl(
   );
 /* IRP_MJ_SCSI dispatcher from libdisk/scsi.c */
 extern WVL_M_LIB WVL_F_DISK_SCSI WvlDiskScsi;
+extern WVL_M_LIB BOOLEAN STDCALL WvlDiskScsiUnmaps(IN PIRP);
 /* IRP_MJ_PNP dispatcher from libdisk/pnp.c */
 extern WVL_M_LIB WVL_F_DISK_PNP WvlDiskPnp;
 
@@ -222,6 +324,7 @@ extern WVL_M_LIB VOID WvlDiskGuessGeometry(
     IN OUT WVL_SP_DISK_T
   );
 extern WVL_M_LIB VOID STDCALL WvlDiskInit(IN OUT WVL_SP_DISK_T);
+extern WVL_M_LIB BOOLEAN STDCALL WvlDiskIsZero(IN PVOID, IN UINT32);
 /* Objects. */
 extern WVL_M_LIB BOOLEAN WvlDiskIsRemovable[WvlDiskMediaTypes];
 extern WVL_M_LIB PWCHAR WvlDiskCompatIds[WvlDiskMediaTypes];
@@ -103,6 +103,16 @@ extern NTSTATUS STDCALL WvDriverGetDevCapabilities(
 /* From driver.c */
 extern DRIVER_INITIALIZE DriverEntry;
 
+/**
+ * Check if boot-time disks should keep their writes in RAM
+ *
+ * @retval TRUE
+ *   The loader options include /WINVBLOCK=OVERLAY=1
+ * @retval FALSE
+ *   Writes should reach boot-time disks
+ */
+extern WVL_M_LIB BOOLEAN STDCALL WvlBootOverlayWanted(void);
+
 /* From mainbus/mainbus.c */
 
 /**
@@ -0,0 +1,68 @@
+/**
+ * Copyright (C) 2009-2011, Shao Miller <shao.miller@yrdsb.edu.on.ca>.
+ *
+ * This file is part of WinVBlock, derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WV_M_EXTENT_H_
+#  define WV_M_EXTENT_H_
+
+/**
+ * @file
+ *
+ * RAM extents.
+ *
+ * Sparse RAM disks and disk overlays keep their data in extents of RAM,
+ * allocated as they're first written.  Extents are physical pages, and
+ * are only mapped into system address space while I/O uses them.  All
+ * extents together may only use half of physical memory.
+ */
+
+/* The size of an extent. */
+#  define WV_M_EXTENT_SIZE (64 * 1024)
+
+/* The most extents mapped at once. */
+#  ifdef _WIN64
+#    define WV_M_EXTENTS_MAPPED ((UINT32) -1)
+#  else
+/* System PTEs are scarce on 32-bit: 64 MB. */
+#    define WV_M_EXTENTS_MAPPED 1024
+#  endif
+
+/*
+ * The most extents from the non-paged pool, for writes which arrive
+ * above APC_LEVEL, where pages can't be allocated: 16 MB.
+ */
+#  define WV_M_EXTENTS_POOL 256
+
+/** An extent. */
+typedef struct WV_EXTENT {
+    /* The extent's pages, or NULL if it's from the non-paged pool. */
+    PMDL Mdl;
+    /* Where the extent is mapped, or NULL. */
+    PUCHAR Data;
+    /* I/O using the mapping. */
+    LONG Users;
+    /* On the list of idle mappings, while mapped and unused. */
+    LIST_ENTRY Idle;
+  } WV_S_EXTENT, * WV_SP_EXTENT;
+
+extern VOID WvExtentsInit(void);
+extern WV_SP_EXTENT WvExtentAlloc(void);
+extern VOID WvExtentFree(IN PVOID);
+extern PUCHAR WvExtentMap(IN WV_SP_EXTENT);
+extern VOID WvExtentUnmap(IN WV_SP_EXTENT);
+
+#endif  /* WV_M_EXTENT_H_ */
@@ -0,0 +1,60 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WV_M_EXTMAP_H_
+#  define WV_M_EXTMAP_H_
+
+/**
+ * @file
+ *
+ * Extent maps.
+ *
+ * An extent map finds the memory for each extent of a sparse disk.  It
+ * is two levels deep: a table of tables, allocated up-front, and the
+ * tables of extents, allocated when an extent in them is first used.
+ * The map doesn't know how extents are allocated; it only keeps them.
+ */
+
+/* The number of extents described by each table in the map. */
+#  define WV_M_EXTMAP_TABLE_EXTENTS 512
+
+/* The most extents a map can describe. */
+#  define WV_M_EXTMAP_MAX_EXTENTS (1U << 24)
+
+/** An extent map. */
+typedef struct WV_EXTMAP {
+    void *** Tables;
+    unsigned int TableCount;
+    unsigned int ExtentCount;
+    /* The number of extents in the map. */
+    unsigned int ExtentsUsed;
+  } WV_S_EXTMAP, * WV_SP_EXTMAP;
+
+/* Frees an extent, when a map is emptied. */
+typedef void WV_F_EXTMAP_FREE(void *);
+typedef WV_F_EXTMAP_FREE * WV_FP_EXTMAP_FREE;
+
+extern int WvExtMapInit(WV_SP_EXTMAP, unsigned int);
+extern void WvExtMapFree(WV_SP_EXTMAP, WV_FP_EXTMAP_FREE);
+extern void ** WvExtMapTableAlloc(void);
+extern void * WvExtMapGet(WV_SP_EXTMAP, unsigned int);
+extern int WvExtMapHasTable(WV_SP_EXTMAP, unsigned int);
+extern void * WvExtMapInsert(WV_SP_EXTMAP, unsigned int, void ***, void **);
+extern void * WvExtMapRemove(WV_SP_EXTMAP, unsigned int);
+
+#endif  /* WV_M_EXTMAP_H_ */
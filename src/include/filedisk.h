@@ -25,21 +25,76 @@
  * File-backed disk specifics.
  */
 
+/* A dynamic or differencing .VHD's mapping.  See vhdmap.h */
+typedef struct WV_VHDMAP WV_S_FILEDISK_VHD, * WV_SP_FILEDISK_VHD;
+
 typedef struct WV_FILEDISK_T {
     WV_S_DEV_EXT DevExt;
     WV_S_DEV_T Dev[1];
     WVL_S_DISK_T disk[1];
     HANDLE file;
+    /* The file's object, referenced.  Swapped with file under IrpsLock. */
+    PFILE_OBJECT FileObj;
     UINT32 hash;
     LARGE_INTEGER offset;
-    WVL_S_THREAD Thread[1];
     LIST_ENTRY Irps[1];
     KSPIN_LOCK IrpsLock[1];
     PVOID impersonation;
+    /* Requests to keep in flight to the file at once. */
+    UINT32 QueueDepth;
+    /* Requests in flight to the file.  Protected by IrpsLock. */
+    UINT32 InFlight;
+    /* The pool worker which runs our work items and usually our I/O. */
+    UINT32 Worker;
+    /* On a worker's ready queue or being served.  Protected by IrpsLock. */
+    BOOLEAN Scheduled;
+    LIST_ENTRY ReadyLink[1];
+    /* Set by WvFilediskPoolLeave.  Protected by IrpsLock. */
+    BOOLEAN Leaving;
+    /* Signalled when a leaving filedisk has nothing in the pool. */
+    KEVENT Idle;
+    /* For a dynamic or differencing .VHD file, its mapping.  Else NULL. */
+    WV_SP_FILEDISK_VHD Vhd;
+    /* For a sparse file, an event for releasing ranges.  Else NULL. */
+    HANDLE ZeroEvent;
+    /* Held while a range is released with ZeroEvent. */
+    KMUTEX ZeroLock;
   } WV_S_FILEDISK_T, * WV_SP_FILEDISK_T;
 
 extern NTSTATUS STDCALL WvFilediskAttach(IN PIRP);
 extern WV_SP_FILEDISK_T STDCALL WvFilediskCreatePdo(IN WVL_E_DISK_MEDIA_TYPE);
 extern VOID STDCALL WvFilediskHotSwap(IN WV_SP_FILEDISK_T, IN PCHAR);
+extern NTSTATUS STDCALL WvFilediskSetFile(
+    IN WV_SP_FILEDISK_T,
+    IN HANDLE,
+    IN PLARGE_INTEGER
+  );
+
+/* From filedisk/pool.c */
+extern NTSTATUS STDCALL WvFilediskPoolJoin(IN WV_SP_FILEDISK_T);
+extern VOID STDCALL WvFilediskPoolLeave(IN WV_SP_FILEDISK_T);
+extern BOOLEAN STDCALL WvFilediskPoolAddItem(
+    IN WV_SP_FILEDISK_T,
+    IN WVL_SP_THREAD_ITEM
+  );
+extern VOID STDCALL WvFilediskPoolQueue(IN WV_SP_FILEDISK_T, IN PIRP);
+extern VOID STDCALL WvFilediskPoolDone(IN WV_SP_FILEDISK_T);
+extern NTSTATUS STDCALL WvFilediskPoolStats(IN PIRP);
+extern VOID STDCALL WvFilediskPoolStop(void);
+
+/* From filedisk/vhd.c */
+extern NTSTATUS STDCALL WvFilediskVhdOpen(
+    IN WV_SP_FILEDISK_T,
+    IN HANDLE,
+    IN PUNICODE_STRING
+  );
+extern NTSTATUS STDCALL WvFilediskVhdIo(
+    IN WV_SP_FILEDISK_T,
+    IN WVL_E_DISK_IO_MODE,
+    IN LONGLONG,
+    IN UINT32,
+    IN PUCHAR
+  );
+extern VOID STDCALL WvFilediskVhdClose(IN WV_SP_FILEDISK_T);
 
 #endif  /* WV_M_FILEDISK_H_ */
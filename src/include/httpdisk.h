@@ -34,6 +34,7 @@
 
 #define IOCTL_HTTP_DISK_CONNECT     CTL_CODE(FILE_DEVICE_HTTP_DISK, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
 #define IOCTL_HTTP_DISK_DISCONNECT  CTL_CODE(FILE_DEVICE_HTTP_DISK, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define IOCTL_HTTP_DISK_CACHE_STATS CTL_CODE(FILE_DEVICE_HTTP_DISK, 0x802, METHOD_BUFFERED, FILE_READ_ACCESS)
 
 typedef struct _HTTP_DISK_INFORMATION {
     BOOLEAN Optical;
@@ -45,6 +46,40 @@ typedef struct _HTTP_DISK_INFORMATION {
     UCHAR   FileName[1];
 } HTTP_DISK_INFORMATION, *PHTTP_DISK_INFORMATION;
 
+/*
+ * What IOCTL_HTTP_DISK_CACHE_STATS returns for a unit number.  Hits
+ * and misses count blocks.  BytesSaved is what was read from the local
+ * cache file instead of the server.
+ */
+typedef struct _HTTP_DISK_CACHE_STATS {
+    BOOLEAN     Enabled;
+    ULONG       BlockSize;
+    ULONGLONG   Blocks;
+    ULONGLONG   BlocksCached;
+    ULONGLONG   Hits;
+    ULONGLONG   Misses;
+    ULONGLONG   BytesSaved;
+    ULONGLONG   BytesFetched;
+} HTTP_DISK_CACHE_STATS, *PHTTP_DISK_CACHE_STATS;
+
+/* A disk's local cache file's layout, and the most of a validator kept. */
+#include "cachemap.h"
+
+/* A disk's local cache file.  Only cache.c knows what's in it. */
+typedef struct HTTPDISK_CACHE HTTPDISK_S_CACHE, * HTTPDISK_SP_CACHE;
+
+/* A disk's keep-alive connections to its server. */
+#include "connpool.h"
+
+/* How many connections a disk has unless the registry says otherwise. */
+#define HTTPDISK_M_CONNS_DEFAULT    4
+
+/* The size of a disk's buffer for requests and response headers. */
+#define HTTPDISK_M_SCRATCH_SIZE     (4096 * 4)
+
+/* What matters to us in an HTTP response header. */
+#include "httpparse.h"
+
 typedef struct HTTPDISK_DEV {
     BOOLEAN         media_in_device;
     ULONG           address;
@@ -52,7 +87,9 @@ typedef struct HTTPDISK_DEV {
     PUCHAR          host_name;
     PUCHAR          file_name;
     LARGE_INTEGER   file_size;
-    int             socket;
+    PCHAR           scratch;
+    HTTPDISK_SP_CACHE cache;
+    HTTPDISK_S_CONN_POOL conns;
     LIST_ENTRY      list_head;
     KSPIN_LOCK      list_lock;
     KEVENT          request_event;
@@ -0,0 +1,46 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HTTPDISK_M_HTTPPARSE_H_
+#  define HTTPDISK_M_HTTPPARSE_H_
+
+/**
+ * @file
+ *
+ * HTTPDisk response header parsing.
+ */
+
+/* What matters to us in an HTTP response header.  -1 means absent. */
+typedef struct HTTPDISK_RESPONSE {
+    int status;
+    /* Non-zero if the server will keep the connection open. */
+    int keep_alive;
+    long long content_length;
+    long long range_start;
+    long long range_end;
+    long long total;
+    /* These point into the header, and aren't NUL-terminated. */
+    const char * etag;
+    int etag_len;
+    const char * modified;
+    int modified_len;
+  } HTTPDISK_S_RESPONSE, * HTTPDISK_SP_RESPONSE;
+
+extern int HttpdiskHttpParse(const char *, int, HTTPDISK_SP_RESPONSE);
+
+#endif  /* HTTPDISK_M_HTTPPARSE_H_ */
@@ -0,0 +1,65 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef AOE_M_MERGE_H_
+#  define AOE_M_MERGE_H_
+
+/**
+ * @file
+ *
+ * AoE frame merging.
+ *
+ * Unsent I/O whose sectors follow on from the I/O at the front of a
+ * disk's queue can share its frame.
+ */
+
+/* The most I/Os whose sectors can share one frame. */
+#  define AOE_M_MERGE_MAX 16
+
+/* How far into a disk's unsent queue to look for I/O to merge. */
+#  define AOE_M_MERGE_SCAN 64
+
+/* The kind of I/O which never merges. */
+#  define AOE_M_MERGE_NONE (-1)
+
+/** Unsent I/O, as far as merging is concerned. */
+typedef struct AOE_MERGE_IO {
+    /* The first sector. */
+    long long Lba;
+    unsigned int Sectors;
+    /* Only I/O of the same kind merges, and never AOE_M_MERGE_NONE. */
+    int Kind;
+  } AOE_S_MERGE_IO, * AOE_SP_MERGE_IO;
+
+extern unsigned int AoeMergePick(
+    AOE_SP_MERGE_IO,
+    unsigned int,
+    const AOE_S_MERGE_IO *,
+    unsigned int,
+    unsigned int,
+    unsigned int *
+  );
+extern int AoeMergeHold(
+    const AOE_S_MERGE_IO *,
+    unsigned int,
+    unsigned int,
+    long long,
+    long long
+  );
+
+#endif  /* AOE_M_MERGE_H_ */
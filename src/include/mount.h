@@ -47,6 +47,82 @@ typedef struct WV_MOUNT_DISK {
     int cylinders;
     int heads;
     int sectors;
+    /* For a file-backed disk, requests in flight at once.  0 for default. */
+    int queue_depth;
   } WV_S_MOUNT_DISK, * WV_SP_MOUNT_DISK;
 
+/* Create a sparse RAM disk.  Takes a WV_S_MOUNT_RAMDISK. */
+#  define IOCTL_RAM_ATTACH              \
+  CTL_CODE(                             \
+    FILE_DEVICE_CONTROLLER,             \
+    0x808,                              \
+    METHOD_BUFFERED,                    \
+    FILE_READ_DATA | FILE_WRITE_DATA    \
+    )
+
+typedef struct WV_MOUNT_RAMDISK {
+    WV_S_MOUNT_DISK disk;
+    /* The size of the disk, in bytes. */
+    ULONGLONG size;
+  } WV_S_MOUNT_RAMDISK, * WV_SP_MOUNT_RAMDISK;
+
+/* Fetch a disk's block cache counters.  Returns a WV_S_CACHE_STATS. */
+#  define IOCTL_WV_CACHE_STATS          \
+  CTL_CODE(                             \
+    FILE_DEVICE_CONTROLLER,             \
+    0x809,                              \
+    METHOD_BUFFERED,                    \
+    FILE_READ_DATA                      \
+    )
+
+typedef struct WV_CACHE_STATS {
+    /* Reads served from the cache, and reads which weren't. */
+    ULONGLONG Hits;
+    ULONGLONG Misses;
+    /* Blocks replaced by others. */
+    ULONGLONG Evictions;
+    /* Dirty blocks written to the disk. */
+    ULONGLONG Flushes;
+    /* Blocks read ahead, those later used, and those replaced unused. */
+    ULONGLONG AheadBlocks;
+    ULONGLONG AheadHits;
+    ULONGLONG AheadWasted;
+    UINT32 BlockSize;
+    UINT32 BlockCount;
+    /* Blocks with memory allocated. */
+    UINT32 BlocksUsed;
+    UINT32 DirtyCount;
+    /* Zero if the cache is write-through, or the disk isn't cached. */
+    UINT32 WriteBack;
+  } WV_S_CACHE_STATS, * WV_SP_CACHE_STATS;
+
+/* Fetch the filedisk worker pool's counters.  Returns WV_S_FILE_POOL_STATS. */
+#  define IOCTL_FILE_POOL_STATS         \
+  CTL_CODE(                             \
+    FILE_DEVICE_CONTROLLER,             \
+    0x80A,                              \
+    METHOD_BUFFERED,                    \
+    FILE_READ_DATA                      \
+    )
+
+typedef struct WV_FILE_WORKER_STATS {
+    /* Filedisks waiting for the worker, now and at most. */
+    UINT32 QueueDepth;
+    UINT32 MaxQueueDepth;
+    /* Filedisks with this as their home worker. */
+    UINT32 Disks;
+    /* Times the worker served a filedisk, and the requests it sent. */
+    ULONGLONG Runs;
+    ULONGLONG Irps;
+    /* Filedisks taken from other workers' queues, and taken from ours. */
+    ULONGLONG Steals;
+    ULONGLONG Stolen;
+  } WV_S_FILE_WORKER_STATS, * WV_SP_FILE_WORKER_STATS;
+
+typedef struct WV_FILE_POOL_STATS {
+    /* Workers in the pool.  Only those which fit are returned. */
+    UINT32 Count;
+    WV_S_FILE_WORKER_STATS Worker[];
+  } WV_S_FILE_POOL_STATS, * WV_SP_FILE_POOL_STATS;
+
 #endif  /* WV_M_MOUNT_H_ */
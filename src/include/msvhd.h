@@ -31,6 +31,18 @@
  *
  */
 
+/* .VHD disk types */
+#define WV_M_MSVHD_TYPE_FIXED 2
+#define WV_M_MSVHD_TYPE_DYNAMIC 3
+#define WV_M_MSVHD_TYPE_DIFF 4
+
+/* A block allocation table entry for a block which isn't in the file */
+#define WV_M_MSVHD_BAT_UNUSED 0xFFFFFFFF
+
+/* Parent locator platform codes: absolute and relative Unicode paths */
+#define WV_M_MSVHD_LOCATOR_W2KU 0x57326B75
+#define WV_M_MSVHD_LOCATOR_W2RU 0x57327275
+
 /* The .VHD disk image footer format */
 #ifdef _MSC_VER
 #  pragma pack(1)
@@ -79,4 +91,70 @@ msvhd__footer_swap_endian (
   byte__rev_array_union ( footer_ptr->checksum );
 }
 
+/* A .VHD parent locator entry */
+#ifdef _MSC_VER
+#  pragma pack(1)
+#endif
+struct WV_MSVHD_LOCATOR {
+    byte__array_union(UINT32, code);
+    byte__array_union(UINT32, data_space);
+    byte__array_union(UINT32, data_len);
+    UINT32 reserved;
+    byte__array_union(ULONGLONG, data_offset);
+  } __attribute__((__packed__));
+typedef struct WV_MSVHD_LOCATOR WV_S_MSVHD_LOCATOR, * WV_SP_MSVHD_LOCATOR;
+#ifdef _MSC_VER
+#  pragma pack()
+#endif
+
+/* The dynamic and differencing .VHD disk image header format */
+#ifdef _MSC_VER
+#  pragma pack(1)
+#endif
+struct WV_MSVHD_DYN_HEADER {
+    char cookie[8];
+    byte__array_union(ULONGLONG, data_offset);
+    byte__array_union(ULONGLONG, table_offset);
+    byte__array_union(UINT32, header_ver);
+    byte__array_union(UINT32, max_table_entries);
+    byte__array_union(UINT32, block_size);
+    byte__array_union(UINT32, checksum);
+    char parent_uid[16];
+    byte__array_union(UINT32, parent_timestamp);
+    UINT32 reserved1;
+    /* Big-endian UTF-16 */
+    char parent_name[512];
+    WV_S_MSVHD_LOCATOR locators[8];
+    char reserved2[256];
+  } __attribute__((__packed__));
+typedef struct WV_MSVHD_DYN_HEADER
+  WV_S_MSVHD_DYN_HEADER, * WV_SP_MSVHD_DYN_HEADER;
+#ifdef _MSC_VER
+#  pragma pack()
+#endif
+
+/* Function body in header so user-land utility links without WinVBlock */
+static VOID STDCALL
+msvhd__dyn_header_swap_endian (
+  WV_SP_MSVHD_DYN_HEADER header_ptr
+ )
+{
+  int i;
+
+  byte__rev_array_union ( header_ptr->data_offset );
+  byte__rev_array_union ( header_ptr->table_offset );
+  byte__rev_array_union ( header_ptr->header_ver );
+  byte__rev_array_union ( header_ptr->max_table_entries );
+  byte__rev_array_union ( header_ptr->block_size );
+  byte__rev_array_union ( header_ptr->checksum );
+  byte__rev_array_union ( header_ptr->parent_timestamp );
+  for ( i = 0; i < 8; i++ )
+    {
+      byte__rev_array_union ( header_ptr->locators[i].code );
+      byte__rev_array_union ( header_ptr->locators[i].data_space );
+      byte__rev_array_union ( header_ptr->locators[i].data_len );
+      byte__rev_array_union ( header_ptr->locators[i].data_offset );
+    }
+}
+
 #endif  /* WV_M_MSVHD_H_ */
@@ -34,6 +34,16 @@ extern BOOLEAN STDCALL Protocol_SearchNIC (
 extern UINT32 STDCALL Protocol_GetMTU (
   IN PUCHAR Mac
  );
+/* The headroom which Protocol_SendFrame needs before the data. */
+#  define PROTOCOL_M_HEADER_SIZE 14
+
+/* A piece of data which Protocol_SendFrame sends after the header. */
+typedef struct PROTOCOL_PAYLOAD
+{
+  PUCHAR Data;
+  UINT32 Size;
+} PROTOCOL_S_PAYLOAD, *PROTOCOL_SP_PAYLOAD;
+
 extern BOOLEAN STDCALL Protocol_Send (
   IN PUCHAR SourceMac,
   IN PUCHAR DestinationMac,
@@ -41,6 +51,15 @@ extern BOOLEAN STDCALL Protocol_Send (
   IN UINT32 DataSize,
   IN PVOID PacketContext
  );
+extern BOOLEAN STDCALL Protocol_SendFrame (
+  IN PUCHAR SourceMac,
+  IN PUCHAR DestinationMac,
+  IN PUCHAR Data,
+  IN UINT32 DataSize,
+  IN PROTOCOL_SP_PAYLOAD Payload,
+  IN UINT32 PayloadCount,
+  IN PVOID PacketContext
+ );
 extern NTSTATUS Protocol_Start(void);
 extern VOID Protocol_Stop(void);
 
@@ -25,6 +25,35 @@
  * RAM disk specifics.
  */
 
+/* The size of each mapping of a RAM disk's memory. */
+#  define WV_M_RAMDISK_CHUNK_SIZE (4 * 1024 * 1024)
+
+/* The most chunks a RAM disk keeps mapped at once. */
+#  ifdef _WIN64
+#    define WV_M_RAMDISK_CHUNKS_MAPPED ((UINT32) -1)
+#  else
+/* Kernel address space is scarce on 32-bit: 256 MB. */
+#    define WV_M_RAMDISK_CHUNKS_MAPPED 64
+#  endif
+
+/*
+ * Once the most chunks are mapped, how much I/O an unmapped chunk
+ * must see, mapped just for each request, before it's mapped itself.
+ */
+#  define WV_M_RAMDISK_CHUNK_ADMIT (WV_M_RAMDISK_CHUNK_SIZE / 4)
+
+/** A mapping of part of a RAM disk's memory. */
+typedef struct WV_RAMDISK_CHUNK {
+    /* Where the chunk is mapped, or NULL. */
+    PUCHAR Map;
+    /* I/O in progress using the mapping. */
+    LONG Users;
+    /* When the chunk was last used, for choosing one to unmap. */
+    UINT32 LastUse;
+    /* Bytes of I/O while unmapped, towards WV_M_RAMDISK_CHUNK_ADMIT. */
+    UINT32 Missed;
+  } WV_S_RAMDISK_CHUNK, * WV_SP_RAMDISK_CHUNK;
+
 typedef struct WV_RAMDISK_T {
     WV_S_DEV_EXT DevExt;
     WV_S_DEV_T Dev[1];
@@ -32,6 +61,12 @@ typedef struct WV_RAMDISK_T {
     UINT32 DiskBuf;
     UINT32 DiskSize;
     WV_FP_DEV_FREE prev_free;
+    /* Cached mappings of the memory, kept for the life of the device. */
+    KSPIN_LOCK ChunkLock;
+    WV_SP_RAMDISK_CHUNK Chunks;
+    UINT32 ChunkCount;
+    UINT32 ChunksMapped;
+    UINT32 ChunkClock;
   } WV_S_RAMDISK_T, * WV_SP_RAMDISK_T;
 
 extern WV_SP_RAMDISK_T WvRamdiskCreatePdo(IN WVL_E_DISK_MEDIA_TYPE);
@@ -0,0 +1,66 @@
+/**
+ * Copyright (C) 2009-2011, Shao Miller <shao.miller@yrdsb.edu.on.ca>.
+ * Copyright 2006-2008, V.
+ * For WinAoE contact information, see http://winaoe.org/
+ *
+ * This file is part of WinVBlock, derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WVL_M_READAHEAD_H_
+#  define WVL_M_READAHEAD_H_
+
+/**
+ * @file
+ *
+ * Sequential read detection, for read-ahead.
+ */
+
+/* The number of streams tracked for each disk. */
+#  define WVL_M_DISK_READAHEAD_STREAMS 8
+
+/** A stream of sequential reads. */
+typedef struct WVL_DISK_READAHEAD_STREAM {
+    /* Where the stream's next read is expected. */
+    unsigned long long Next;
+    /* Where reading ahead for the stream has reached. */
+    unsigned long long Ahead;
+    /* The next read-ahead size, in sectors. */
+    unsigned int Window;
+    /* Reads in a row.  Zero if the stream is unused. */
+    unsigned int Run;
+    /* When the stream was last read from. */
+    unsigned int Used;
+  } WVL_S_DISK_READAHEAD_STREAM, * WVL_SP_DISK_READAHEAD_STREAM;
+
+/** A disk's stream detector. */
+typedef struct WVL_DISK_READAHEAD {
+    unsigned int Clock;
+    WVL_S_DISK_READAHEAD_STREAM Streams[WVL_M_DISK_READAHEAD_STREAMS];
+  } WVL_S_DISK_READAHEAD, * WVL_SP_DISK_READAHEAD;
+
+extern WVL_SP_DISK_READAHEAD WvlDiskReadAheadCreate(void);
+extern void WvlDiskReadAheadFree(WVL_SP_DISK_READAHEAD);
+extern int WvlDiskReadAheadNote(
+    WVL_SP_DISK_READAHEAD,
+    unsigned long long,
+    unsigned int,
+    unsigned int,
+    unsigned long long *,
+    unsigned int *
+  );
+extern void WvlDiskReadAheadWaste(WVL_SP_DISK_READAHEAD);
+
+#endif  /* WVL_M_READAHEAD_H_ */
@@ -0,0 +1,71 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef AOE_M_REXMIT_H_
+#  define AOE_M_REXMIT_H_
+
+/**
+ * @file
+ *
+ * AoE retransmit timing.
+ *
+ * Each disk's retransmit timeout comes from its round-trip times, and
+ * sent tags wait for their replies in a min-heap ordered by when they
+ * are next due for a resend.  Times are in 100 ns units, but nothing
+ * here reads a clock: the caller passes the times in.
+ */
+
+/* Retransmit timeout bounds: 1 ms and 10 s. */
+#  define AOE_M_RTO_MIN 10000LL
+#  define AOE_M_RTO_MAX 100000000LL
+
+/** A round-trip time estimate. */
+typedef struct AOE_RTT {
+    /* The smoothed round-trip time and its mean deviation. */
+    long long Srtt;
+    long long RttVar;
+    /* The retransmit timeout for newly-sent tags. */
+    long long Rto;
+  } AOE_S_RTT, * AOE_SP_RTT;
+
+/** A retransmit timer, kept inside whatever it times. */
+typedef struct AOE_TIMER {
+    /* When the timer is due. */
+    long long Deadline;
+    /* The timer's position in its heap. */
+    unsigned int HeapIndex;
+  } AOE_S_TIMER, * AOE_SP_TIMER;
+
+/** A min-heap of retransmit timers by deadline. */
+typedef struct AOE_TIMER_HEAP {
+    /* Room for Capacity timers, which the owner allocates. */
+    AOE_SP_TIMER * Timers;
+    unsigned int Count;
+    unsigned int Capacity;
+  } AOE_S_TIMER_HEAP, * AOE_SP_TIMER_HEAP;
+
+extern void AoeRttInit(AOE_SP_RTT, long long);
+extern int AoeRttSample(AOE_SP_RTT, int, long long);
+extern long long AoeRttBackoff(AOE_SP_RTT, long long);
+extern void AoeTimerHeapPush(AOE_SP_TIMER_HEAP, AOE_SP_TIMER);
+extern void AoeTimerHeapRemove(AOE_SP_TIMER_HEAP, AOE_SP_TIMER);
+extern void AoeTimerHeapChanged(AOE_SP_TIMER_HEAP, AOE_SP_TIMER);
+extern void AoeTimerHeapRebuild(AOE_SP_TIMER_HEAP);
+extern AOE_SP_TIMER AoeTimerHeapFirst(AOE_SP_TIMER_HEAP);
+
+#endif  /* AOE_M_REXMIT_H_ */
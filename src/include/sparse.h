@@ -0,0 +1,49 @@
+/**
+ * Copyright (C) 2009-2011, Shao Miller <shao.miller@yrdsb.edu.on.ca>.
+ *
+ * This file is part of WinVBlock, derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WV_M_SPARSE_H_
+#  define WV_M_SPARSE_H_
+
+/**
+ * @file
+ *
+ * Sparse RAM disk specifics.
+ */
+
+#  include "extmap.h"
+#  include "extent.h"
+
+/* Memory is allocated to a sparse RAM disk in extents of this size. */
+#  define WV_M_SPARSE_EXTENT_SIZE WV_M_EXTENT_SIZE
+
+typedef struct WV_SPARSE_T {
+    WV_S_DEV_EXT DevExt;
+    WV_S_DEV_T Dev[1];
+    WVL_S_DISK_T disk[1];
+    /* Distinguishes this disk from other sparse RAM disks. */
+    UINT32 Id;
+    /* Protects the extent map and the extents' contents. */
+    KSPIN_LOCK Lock;
+    /* The extent map.  Each extent is a WV_S_EXTENT. */
+    WV_S_EXTMAP Map;
+  } WV_S_SPARSE_T, * WV_SP_SPARSE_T;
+
+extern NTSTATUS STDCALL WvSparseAttach(IN PIRP);
+extern WV_SP_SPARSE_T STDCALL WvSparseCreatePdo(IN WVL_E_DISK_MEDIA_TYPE);
+
+#endif  /* WV_M_SPARSE_H_ */
@@ -0,0 +1,62 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef AOE_M_TAGTABLE_H_
+#  define AOE_M_TAGTABLE_H_
+
+/**
+ * @file
+ *
+ * AoE tag table.
+ *
+ * Sent tags awaiting a reply are found by the tag ID and target address
+ * of each reply.
+ */
+
+/* The number of tag table buckets.  Must be a power of two. */
+#  define AOE_M_TAG_TABLE_SIZE 1024
+
+/* The tag table bucket for a tag ID. */
+#  define AOE_M_TAG_BUCKET(Id_) ((Id_) & (AOE_M_TAG_TABLE_SIZE - 1))
+
+/** A tag table entry, kept inside whatever it finds. */
+typedef struct AOE_TAG_ENTRY {
+    unsigned int Id;
+    /* The target's major address, in network order. */
+    unsigned short Major;
+    unsigned char Minor;
+    /* The next entry in the same bucket. */
+    struct AOE_TAG_ENTRY * HashNext;
+  } AOE_S_TAG_ENTRY, * AOE_SP_TAG_ENTRY;
+
+/** A tag table. */
+typedef struct AOE_TAG_TABLE {
+    AOE_SP_TAG_ENTRY Buckets[AOE_M_TAG_TABLE_SIZE];
+  } AOE_S_TAG_TABLE, * AOE_SP_TAG_TABLE;
+
+extern void AoeTagTableInit(AOE_SP_TAG_TABLE);
+extern void AoeTagTableInsert(AOE_SP_TAG_TABLE, AOE_SP_TAG_ENTRY);
+extern AOE_SP_TAG_ENTRY AoeTagTableFind(
+    AOE_SP_TAG_TABLE,
+    unsigned int,
+    unsigned short,
+    unsigned char
+  );
+extern int AoeTagTableRemove(AOE_SP_TAG_TABLE, AOE_SP_TAG_ENTRY);
+
+#endif  /* AOE_M_TAGTABLE_H_ */
@@ -0,0 +1,120 @@
+/**
+ * Copyright (C) 2009-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WV_M_VHDMAP_H_
+#  define WV_M_VHDMAP_H_
+
+/**
+ * @file
+ *
+ * Dynamic and differencing .VHD block mapping.
+ *
+ * The mapping reads and writes the .VHD file only through the caller's
+ * I/O routine.  Finding and opening a differencing .VHD's parent is the
+ * caller's job.
+ */
+
+/* .VHD sectors are always 512 bytes. */
+#  define WV_M_VHDMAP_SECTOR 512
+
+/*
+ * Errors of the mapping's own.  Errors from the I/O routine are passed
+ * back as they are, and must be negative, but not one of these.
+ */
+#  define WV_M_VHDMAP_E_NOMEM (-1)
+#  define WV_M_VHDMAP_E_FORMAT (-2)
+#  define WV_M_VHDMAP_E_RANGE (-3)
+#  define WV_M_VHDMAP_E_TYPE (-4)
+
+/**
+ * Read from or write to a .VHD file.
+ *
+ * @v file              The file, as given to WvVhdMapLoad.
+ * @v write             Non-zero to write, else read.
+ * @v offset            The byte offset into the file.
+ * @v length            The number of bytes.
+ * @v buffer            The data.
+ * @ret long            Negative upon failure.  Short reads are failures.
+ *
+ * Writing past the end of the file extends it, with zeroes before the
+ * data written.
+ */
+typedef long WV_F_VHDMAP_RW(
+    void *,
+    int,
+    unsigned long long,
+    unsigned int,
+    void *
+  );
+typedef WV_F_VHDMAP_RW * WV_FP_VHDMAP_RW;
+
+/** A .VHD's mapping. */
+typedef struct WV_VHDMAP {
+    void * File;
+    WV_FP_VHDMAP_RW Rw;
+    unsigned int Type;
+    unsigned char Uid[16];
+    /* The size of the disk, in .VHD sectors. */
+    unsigned long long Sectors;
+    /* Where the footer is in the file, and the footer itself, as-is. */
+    unsigned long long FooterOffset;
+    unsigned char * Footer;
+    /* The rest are only for dynamic and differencing .VHDs. */
+    unsigned char * Header;
+    unsigned int BlockSectors;
+    /* Bytes before each block's data, rounded up to a sector. */
+    unsigned int BitmapSize;
+    unsigned int BatEntries;
+    /* The BAT, in host byte order, padded to a whole sector. */
+    unsigned long long BatOffset;
+    unsigned int BatSectors;
+    unsigned int * Bat;
+    /* For a differencing .VHD, each block's bitmap, once read. */
+    unsigned char ** Bitmaps;
+    struct WV_VHDMAP * Parent;
+  } WV_S_VHDMAP, * WV_SP_VHDMAP;
+
+extern long WvVhdMapLoad(
+    WV_FP_VHDMAP_RW,
+    void *,
+    unsigned long long,
+    WV_SP_VHDMAP *
+  );
+extern void WvVhdMapFree(WV_SP_VHDMAP);
+extern int WvVhdMapLocator(
+    WV_SP_VHDMAP,
+    unsigned int,
+    unsigned int *,
+    unsigned int *,
+    unsigned long long *
+  );
+extern long WvVhdMapSetParent(WV_SP_VHDMAP, WV_SP_VHDMAP);
+extern long WvVhdMapRead(
+    WV_SP_VHDMAP,
+    unsigned long long,
+    unsigned int,
+    unsigned char *
+  );
+extern long WvVhdMapWrite(
+    WV_SP_VHDMAP,
+    unsigned long long,
+    unsigned int,
+    const unsigned char *
+  );
+
+#endif  /* WV_M_VHDMAP_H_ */
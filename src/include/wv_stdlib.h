@@ -22,18 +22,18 @@
 #include "wv_stddef.h"
 
 /* Allocate memory from non-paged memory pool. */
-PVOID wv_malloc(wv_size_t size);
+void * wv_malloc(wv_size_t size);
 
 /* Allocate memory from paged memory pool. */
-PVOID wv_palloc(wv_size_t size);
+void * wv_palloc(wv_size_t size);
 
 /* Allocate memory from non-paged memory pool and fill with zero bits. */
-PVOID wv_mallocz(wv_size_t size);
+void * wv_mallocz(wv_size_t size);
 
 /* Allocate memory from paged memory pool and fill with zero bits. */
-PVOID wv_pallocz(wv_size_t size);
+void * wv_pallocz(wv_size_t size);
 
 /* Free allocated memory. */
-VOID wv_free(PVOID ptr);
+void wv_free(void * ptr);
 
 #endif  /* WV_M_STDLIB_H_ */
@@ -92,6 +92,10 @@ static WVU_S_OPTION opt_uri = {
     "U", NULL, 1
   };
 
+static WVU_S_OPTION opt_size = {
+    "SIZE", NULL, 1
+  };
+
 static WVU_S_OPTION opt_mac = {
     "MAC", NULL, 1
   };
@@ -104,6 +108,10 @@ static WVU_S_OPTION opt_regsvr = {
     "REGSERVER", NULL, 0
   };
 
+static WVU_S_OPTION opt_depth = {
+    "DEPTH", NULL, 1
+  };
+
 static WVU_SP_OPTION options[] = {
     &opt_h1,
     &opt_h2,
@@ -115,8 +123,10 @@ static WVU_SP_OPTION options[] = {
     &opt_media,
     &opt_uri,
     &opt_mac,
+    &opt_size,
     &opt_service,
     &opt_regsvr,
+    &opt_depth,
   };
 
 static char present[] = "";
@@ -219,24 +229,31 @@ WinVBlock user-land utility for disk control. (C) 2006-2008 V.,\n\
 Usage:\n\
   winvblk -cmd <command> [-d <disk number>] [-m <media>] [-u <uri or path>]\n\
     [-mac <client mac address>] [-c <cyls>] [-h <heads>] [-s <sects per track>]\n\
-    [-service <service>]\n\
+    [-size <megabytes>] [-service <service>] [-depth <queue depth>]\n\
   winvblk -?\n\
 \n\
 Parameters:\n\
   <command> is one of:\n\
     scan    - Shows the reachable AoE targets.\n\
     show    - Shows the mounted AoE targets.\n\
+    stats   - Shows AoE worker thread statistics.\n\
+    cache   - Shows block cache statistics for a disk.  Requires -d,\n\
+              the PhysicalDrive number of the disk.\n\
+    pool    - Shows file-backed disk worker pool statistics.\n\
     mount   - Mounts an AoE target.  Requires -mac and -u\n\
     umount  - Unmounts an AoE disk.  Requires -d\n\
     attach  - Attaches <filepath> disk image file.  Requires -u and -m.\n\
-              -c, -h, -s are optional.\n\
-    detach  - Detaches file-backed disk.  Requires -d\n\
+              -c, -h, -s are optional.  -depth sets how many requests\n\
+              can be in flight to the file at once (default 8).\n\
+    ramdisk - Creates a sparse RAM disk.  Requires -size and -m.\n\
+              -c, -h, -s are optional.  Memory is only used once written.\n\
+    detach  - Detaches file-backed disk or RAM disk.  Requires -d\n\
     install - Install a service.  Requires -service\n\
     start   - Start the WinVBlock service.\n\
   <uri or path> is something like:\n\
     aoe:eX.Y        - Where X is the \"major\" (shelf) and Y is\n\
                       the \"minor\" (slot)\n\
-    c:\\my_disk.hdd - The path to a disk image file or .ISO\n\
+    c:\\my_disk.hdd - The path to a disk image file, .VHD or .ISO\n\
   <media> is one of 'c' for CD/DVD, 'f' for floppy, 'h' for hard disk drive\n\
   <service> is one of:\n\
     'wvblk32', 'wvblk64', 'aoe32', 'aoe64', 'wvhttp32', 'wvhttp64'\n\
@@ -355,7 +372,10 @@ static int STDCALL cmd_show(void) {
         printf("No AoE disks mounted.\n");
         goto err_no_disks;
       }
-    printf("Disk  Client NIC         Server MAC         Target      Size\n");
+    printf(
+        "Disk  Client NIC         Server MAC         Target      Size"
+          "      In flight/Window\n"
+      );
     for (i = 0; i < mounted_disks->Count && i < 10; i++) {
         sprintf(
             string,
@@ -366,7 +386,7 @@ static int STDCALL cmd_show(void) {
         string[10] = 0;
         printf(
             " %-4lu %02x:%02x:%02x:%02x:%02x:%02x  "
-              "%02x:%02x:%02x:%02x:%02x:%02x  %s  %I64uM\n",
+              "%02x:%02x:%02x:%02x:%02x:%02x  %s  %-8I64uM %lu/%lu\n",
             mounted_disks->Disk[i].Disk,
             mounted_disks->Disk[i].ClientMac[0],
             mounted_disks->Disk[i].ClientMac[1],
@@ -381,9 +401,31 @@ static int STDCALL cmd_show(void) {
             mounted_disks->Disk[i].ServerMac[4],
             mounted_disks->Disk[i].ServerMac[5],
             string,
-            mounted_disks->Disk[i].LBASize / 2048
+            mounted_disks->Disk[i].LBASize / 2048,
+            mounted_disks->Disk[i].InFlight,
+            mounted_disks->Disk[i].Window
+          );
+        printf(
+            "      Paths: %lu (%lu live)\n",
+            mounted_disks->Disk[i].Paths,
+            mounted_disks->Disk[i].LivePaths
+          );
+        printf(
+            "      Tag pool: %lu hits, %lu misses, %lu in use, %lu peak\n",
+            mounted_disks->Disk[i].TagPool.Hits,
+            mounted_disks->Disk[i].TagPool.Misses,
+            mounted_disks->Disk[i].TagPool.InUse,
+            mounted_disks->Disk[i].TagPool.HighWater
+          );
+        printf(
+            "      Request pool: %lu hits, %lu misses, %lu in use, %lu peak\n",
+            mounted_disks->Disk[i].RequestPool.Hits,
+            mounted_disks->Disk[i].RequestPool.Misses,
+            mounted_disks->Disk[i].RequestPool.InUse,
+            mounted_disks->Disk[i].RequestPool.HighWater
           );
       }
+    printf("Tags in flight for all disks: %lu\n", mounted_disks->InFlight);
 
     err_no_disks:
 
@@ -395,6 +437,187 @@ static int STDCALL cmd_show(void) {
     return status;
   }
 
+static int STDCALL cmd_stats(void) {
+    AOE_S_STATS stats;
+    ULONGLONG frames_per_mb;
+    DWORD bytes_returned;
+
+    if (!DeviceIoControl(
+        boot_bus,
+        IOCTL_AOE_STATS,
+        NULL,
+        0,
+        &stats,
+        sizeof stats,
+        &bytes_returned,
+        (LPOVERLAPPED) NULL
+      )) {
+        WvuShowLastErr();
+        return 2;
+      }
+
+    printf("Queue depth:       %lu\n", stats.QueueDepth);
+    printf("In flight:         %lu\n", stats.InFlight);
+    printf(
+        "Wakeups:           %lu (%lu idle)\n",
+        stats.Wakeups,
+        stats.IdleWakeups
+      );
+    printf(
+        "Work per wakeup:   %lu.%02lu (at most %lu)\n",
+        stats.Wakeups ? stats.Work / stats.Wakeups : 0,
+        stats.Wakeups ? stats.Work * 100 / stats.Wakeups % 100 : 0,
+        stats.MaxWork
+      );
+    printf("Wakeups/second:    %lu\n", stats.WakeupsPerSec);
+    printf("Work/second:       %lu\n", stats.WorkPerSec);
+    printf(
+        "Sends:             %lu (%lu failed)\n",
+        stats.Sends,
+        stats.SendFails
+      );
+    printf(
+        "Resends:           %lu (%lu failed, %lu put off)\n",
+        stats.Resends,
+        stats.ResendFails,
+        stats.ResendsDeferred
+      );
+    printf("Probes:            %lu\n", stats.Probes);
+    printf("Merged tags:       %lu\n", stats.Merges);
+    /* AoE sectors are 512 bytes, so there are 2048 to the megabyte. */
+    frames_per_mb = stats.SentSectors ?
+      (ULONGLONG) stats.Sends * 204800 / stats.SentSectors :
+      0;
+    printf(
+        "Frames per MB:     %lu.%02lu\n",
+        (UINT32) (frames_per_mb / 100),
+        (UINT32) (frames_per_mb % 100)
+      );
+    return 0;
+  }
+
+static int STDCALL cmd_cache(void) {
+    WV_S_CACHE_STATS stats;
+    DWORD bytes_returned;
+    ULONGLONG reads;
+
+    if (!DeviceIoControl(
+        boot_bus,
+        IOCTL_WV_CACHE_STATS,
+        NULL,
+        0,
+        &stats,
+        sizeof stats,
+        &bytes_returned,
+        (LPOVERLAPPED) NULL
+      )) {
+        WvuShowLastErr();
+        return 2;
+      }
+    if (!stats.BlockCount) {
+        printf("The disk isn't cached.\n");
+        return 0;
+      }
+
+    reads = stats.Hits + stats.Misses;
+    printf(
+        "Blocks:            %lu of %lu used, %lu bytes each\n",
+        stats.BlocksUsed,
+        stats.BlockCount,
+        stats.BlockSize
+      );
+    printf(
+        "Mode:              write-%s\n",
+        stats.WriteBack ? "back" : "through"
+      );
+    printf("Hits:              %I64u\n", stats.Hits);
+    printf("Misses:            %I64u\n", stats.Misses);
+    printf(
+        "Hit rate:          %lu%%\n",
+        reads ? (UINT32) (stats.Hits * 100 / reads) : 0
+      );
+    printf("Evictions:         %I64u\n", stats.Evictions);
+    printf(
+        "Flushed blocks:    %I64u (%lu dirty)\n",
+        stats.Flushes,
+        stats.DirtyCount
+      );
+    if (stats.AheadBlocks) {
+        printf(
+            "Read ahead:        %I64u blocks, %I64u used (%lu%%)\n",
+            stats.AheadBlocks,
+            stats.AheadHits,
+            (UINT32) (stats.AheadHits * 100 / stats.AheadBlocks)
+          );
+        printf(
+            "Read-ahead waste:  %I64u bytes\n",
+            stats.AheadWasted * stats.BlockSize
+          );
+      }
+    return 0;
+  }
+
+static int STDCALL cmd_pool(void) {
+    WV_SP_FILE_POOL_STATS stats;
+    DWORD bytes_returned;
+    UINT32 i;
+    int status = 2;
+
+    stats = malloc(
+        sizeof (WV_S_FILE_POOL_STATS) +
+        (64 * sizeof (WV_S_FILE_WORKER_STATS))
+      );
+    if (stats == NULL) {
+        printf("Out of memory\n");
+        goto err_alloc;
+      }
+
+    if (!DeviceIoControl(
+        boot_bus,
+        IOCTL_FILE_POOL_STATS,
+        NULL,
+        0,
+        stats,
+        sizeof (WV_S_FILE_POOL_STATS) + (64 * sizeof (WV_S_FILE_WORKER_STATS)),
+        &bytes_returned,
+        (LPOVERLAPPED) NULL
+      )) {
+        WvuShowLastErr();
+        goto err_ioctl;
+      }
+    if (stats->Count == 0) {
+        printf("No file-backed disk workers are running.\n");
+        status = 0;
+        goto err_no_workers;
+      }
+    printf(
+        "Worker  Queue (max)  Disks  Runs        IRPs        Steals  Stolen\n"
+      );
+    for (i = 0; i < stats->Count && i < 64; i++) {
+        printf(
+            "%-6lu  %5lu (%3lu)  %5lu  %-10I64u  %-10I64u  %6I64u  %6I64u\n",
+            i,
+            stats->Worker[i].QueueDepth,
+            stats->Worker[i].MaxQueueDepth,
+            stats->Worker[i].Disks,
+            stats->Worker[i].Runs,
+            stats->Worker[i].Irps,
+            stats->Worker[i].Steals,
+            stats->Worker[i].Stolen
+          );
+      }
+    status = 0;
+
+    err_no_workers:
+
+    err_ioctl:
+
+    free(stats);
+    err_alloc:
+
+    return status;
+  }
+
 static int STDCALL cmd_mount(void) {
     UCHAR mac_addr[6];
     UINT32 ver_major, ver_minor;
@@ -489,6 +712,7 @@ static int STDCALL cmd_attach(void) {
         printf("-u and -m options required.  See -? for help.\n");
         return 1;
       }
+    memset(&filedisk, 0, sizeof filedisk);
     filedisk.type = opt_media.value[0];
     if (opt_cyls.value != NULL)
       sscanf(opt_cyls.value, "%d", (int *) &filedisk.cylinders);
@@ -496,6 +720,8 @@ static int STDCALL cmd_attach(void) {
       sscanf(opt_heads.value, "%d", (int *) &filedisk.heads);
     if (opt_spt.value != NULL)
       sscanf(opt_spt.value, "%d", (int *) &filedisk.sectors);
+    if (opt_depth.value != NULL)
+      sscanf(opt_depth.value, "%d", &filedisk.queue_depth);
     memcpy(in_buf, &filedisk, sizeof (WV_S_MOUNT_DISK));
     memcpy(
         in_buf + sizeof (WV_S_MOUNT_DISK),
@@ -523,6 +749,44 @@ static int STDCALL cmd_attach(void) {
     return 0;
   }
 
+static int STDCALL cmd_ramdisk(void) {
+    WV_S_MOUNT_RAMDISK ramdisk;
+    unsigned int size_mb;
+    DWORD bytes_returned;
+
+    if (opt_size.value == NULL || opt_media.value == NULL) {
+        printf("-size and -m options required.  See -? for help.\n");
+        return 1;
+      }
+    if (sscanf(opt_size.value, "%u", &size_mb) != 1 || !size_mb) {
+        printf("Invalid size: %s\n", opt_size.value);
+        return 1;
+      }
+    memset(&ramdisk, 0, sizeof ramdisk);
+    ramdisk.disk.type = opt_media.value[0];
+    if (opt_cyls.value != NULL)
+      sscanf(opt_cyls.value, "%d", (int *) &ramdisk.disk.cylinders);
+    if (opt_heads.value != NULL)
+      sscanf(opt_heads.value, "%d", (int *) &ramdisk.disk.heads);
+    if (opt_spt.value != NULL)
+      sscanf(opt_spt.value, "%d", (int *) &ramdisk.disk.sectors);
+    ramdisk.size = (ULONGLONG) size_mb * 1024 * 1024;
+    if (!DeviceIoControl(
+        boot_bus,
+        IOCTL_RAM_ATTACH,
+        &ramdisk,
+        sizeof ramdisk,
+        NULL,
+        0,
+        &bytes_returned,
+        (LPOVERLAPPED) NULL
+      )) {
+        WvuShowLastErr();
+        return 2;
+      }
+    return 0;
+  }
+
 static int STDCALL cmd_detach(void) {
     UINT32 disk_num;
     UCHAR in_buf[sizeof (WV_S_MOUNT_DISK) + 1024];
@@ -660,6 +924,7 @@ int main(int argc, char **argv, char **envp) {
     int status = 1;
     char winvblock[] = "\\\\.\\" WVL_M_LIT;
     char aoe[] = "\\\\.\\AoE";
+    char drive[64];
     char * bus_name;
 
     cmdline_options(argc, argv);
@@ -687,6 +952,23 @@ int main(int argc, char **argv, char **envp) {
         cmd = cmd_show;
         bus_name = aoe;
       }
+    if (strcmp(opt_cmd.value, "stats") == 0) {
+        cmd = cmd_stats;
+        bus_name = aoe;
+      }
+    if (strcmp(opt_cmd.value, "cache") == 0) {
+        if (opt_disknum.value == NULL) {
+            printf("-d option required.  See -? for help.\n");
+            goto err_bad_cmd;
+          }
+        sprintf(drive, "\\\\.\\PhysicalDrive%d", atoi(opt_disknum.value));
+        cmd = cmd_cache;
+        bus_name = drive;
+      }
+    if (strcmp(opt_cmd.value, "pool") == 0) {
+        cmd = cmd_pool;
+        bus_name = winvblock;
+      }
     if (strcmp(opt_cmd.value, "mount" ) == 0) {
         cmd = cmd_mount;
         bus_name = aoe;
@@ -699,6 +981,10 @@ int main(int argc, char **argv, char **envp) {
         cmd = cmd_attach;
         bus_name = winvblock;
       }
+    if (strcmp(opt_cmd.value, "ramdisk") == 0) {
+        cmd = cmd_ramdisk;
+        bus_name = winvblock;
+      }
     if (strcmp(opt_cmd.value, "detach") == 0) {
         cmd = cmd_detach;
         bus_name = winvblock;
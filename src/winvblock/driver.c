@@ -42,6 +42,7 @@
 #include "mount.h"
 #include "filedisk.h"
 #include "ramdisk.h"
+#include "extent.h"
 #include "debug.h"
 
 /* From mainbus/mainbus.c */
@@ -76,6 +77,7 @@ static KEVENT WvMiniDriversDeregistered;
 
 /* Private function declarations */
 static VOID WvDriverCheckCddb(IN UNICODE_STRING * RegistryPath);
+static VOID WvDriverFetchCacheOpts(IN UNICODE_STRING * RegistryPath);
 static DRIVER_DISPATCH WvIrpNotSupported;
 static
   __drv_dispatchType(IRP_MJ_POWER)
@@ -175,6 +177,26 @@ static LPWSTR STDCALL WvGetOpt(IN LPWSTR opt_name) {
     return the_opt;
   }
 
+/* Fetch a decimal /WINVBLOCK= option, or the default if it's missing */
+static UINT32 STDCALL WvGetOptNum(IN LPWSTR opt_name, IN UINT32 def) {
+    LPWSTR value;
+    UINT32 num;
+
+    value = WvGetOpt(opt_name);
+    if (!value || *value < L'0' || *value > L'9')
+      return def;
+    for (num = 0; *value >= L'0' && *value <= L'9'; value++)
+      num = num * 10 + (*value - L'0');
+    return num;
+  }
+
+WVL_M_LIB BOOLEAN STDCALL WvlBootOverlayWanted(void) {
+    LPWSTR value;
+
+    value = WvGetOpt(L"OVERLAY");
+    return value && *value == L'1';
+  }
+
 static VOID STDCALL WvDriverReinitialize(
     IN PDRIVER_OBJECT driver_obj,
     IN PVOID context,
@@ -265,6 +287,9 @@ NTSTATUS STDCALL DriverEntry(
     /* Check if CDDB associations have been produced by the .INF file */
     WvDriverCheckCddb(reg_path);
 
+    /* Check how disks should be cached */
+    WvDriverFetchCacheOpts(reg_path);
+
     /* AoE doesn't support sleeping */
     WvDriverStateHandle = PoRegisterSystemState(NULL, ES_CONTINUOUS);
     if (!WvDriverStateHandle)
@@ -272,6 +297,9 @@ NTSTATUS STDCALL DriverEntry(
 
     KeInitializeSpinLock(&WvFindDiskLock);
 
+    /* For sparse RAM disks and overlays */
+    WvExtentsInit();
+
     /*
      * Set up IRP MajorFunction function table for devices
      * this driver handles
@@ -423,6 +451,7 @@ static VOID STDCALL WvUnload(IN DRIVER_OBJECT * drv_obj) {
     DBG("Unloading...\n");
 
     WvDeregisterMiniDrivers();
+    WvFilediskPoolStop();
 
     if (WvDriverStateHandle != NULL)
       PoUnregisterSystemState(WvDriverStateHandle);
@@ -472,6 +501,66 @@ static VOID WvDriverCheckCddb(IN UNICODE_STRING * reg_path) {
     WvlRegCloseKey(reg_key);
   }
 
+/**
+ * Fetch the disk block cache settings
+ *
+ * @param RegistryPath
+ *   The Registry path for the driver, provided by Windows
+ *
+ * The CacheSize (megabytes per disk), CacheBlockSize (kilobytes) and
+ * CacheWriteBack values may be overridden by the CACHESIZE, BLOCKSIZE
+ * and WRITEBACK /WINVBLOCK= loader options.  So may ReadAhead (the most
+ * to read ahead of a sequential stream, in kilobytes), by READAHEAD.
+ * ReadAheadBuffer is the cache, in megabytes, for disks which read ahead
+ * while caching is otherwise disabled
+ */
+static VOID WvDriverFetchCacheOpts(IN UNICODE_STRING * reg_path) {
+    HANDLE reg_key;
+    UINT32 value;
+    NTSTATUS status;
+
+    ASSERT(reg_path);
+    status = WvlRegOpenKey(reg_path->Buffer, &reg_key);
+    if (NT_SUCCESS(status)) {
+        status = WvlRegFetchDword(reg_key, L"CacheSize", &value);
+        if (NT_SUCCESS(status))
+          WvlDiskCacheSize = value;
+        status = WvlRegFetchDword(reg_key, L"CacheBlockSize", &value);
+        if (NT_SUCCESS(status))
+          WvlDiskCacheBlockSize = value * 1024;
+        status = WvlRegFetchDword(reg_key, L"CacheWriteBack", &value);
+        if (NT_SUCCESS(status))
+          WvlDiskCacheWriteBack = !!value;
+        status = WvlRegFetchDword(reg_key, L"ReadAhead", &value);
+        if (NT_SUCCESS(status))
+          WvlDiskReadAheadMax = value;
+        status = WvlRegFetchDword(reg_key, L"ReadAheadBuffer", &value);
+        if (NT_SUCCESS(status))
+          WvlDiskReadAheadBuffer = value;
+        WvlRegCloseKey(reg_key);
+      } else {
+        DBG("Couldn't open Registry path!\n");
+      }
+
+    WvlDiskCacheSize = WvGetOptNum(L"CACHESIZE", WvlDiskCacheSize);
+    WvlDiskCacheBlockSize = WvGetOptNum(
+        L"BLOCKSIZE",
+        WvlDiskCacheBlockSize / 1024
+      ) * 1024;
+    WvlDiskCacheWriteBack = !!WvGetOptNum(
+        L"WRITEBACK",
+        WvlDiskCacheWriteBack
+      );
+    WvlDiskReadAheadMax = WvGetOptNum(L"READAHEAD", WvlDiskReadAheadMax);
+    DBG(
+        "Disk cache: %u MB, %u-byte blocks, write-%s, read-ahead %u KB\n",
+        WvlDiskCacheSize,
+        WvlDiskCacheBlockSize,
+        WvlDiskCacheWriteBack ? "back" : "through",
+        WvlDiskReadAheadMax
+      );
+  }
+
 NTSTATUS STDCALL WvDriverGetDevCapabilities(
     IN PDEVICE_OBJECT DevObj,
     IN PDEVICE_CAPABILITIES DevCapabilities
@@ -41,6 +41,37 @@
 #include "filedisk.h"
 #include "debug.h"
 
+/** Macros. */
+
+/* Requests in flight to a file at once, by default and at most. */
+#define WV_M_FILEDISK_QUEUE_DEPTH_ 8
+#define WV_M_FILEDISK_QUEUE_DEPTH_MAX_ 64
+
+/*
+ * How a filedisk's file is opened, whether at attach time or by a
+ * hot-swap.  It's opened for asynchronous I/O, so that the file system
+ * can have several of our reads and writes in flight, and without the
+ * file system's cache, since the disk's user has its own.
+ */
+#define WV_M_FILEDISK_OPEN_OPTIONS_ \
+  (FILE_NON_DIRECTORY_FILE |        \
+    FILE_RANDOM_ACCESS |            \
+    FILE_NO_INTERMEDIATE_BUFFERING)
+
+/** Object types. */
+
+/* A request in flight to a filedisk's file. */
+typedef struct WV_FILEDISK_IO_ {
+    WV_SP_FILEDISK_T filedisk;
+    /* The request. */
+    PIRP irp;
+    PFILE_OBJECT file_obj;
+    WVL_E_DISK_IO_MODE mode;
+    LONGLONG start_sector;
+    UINT32 sector_count;
+    PUCHAR buffer;
+  } WV_S_FILEDISK_IO_, * WV_SP_FILEDISK_IO_;
+
 /* From ../mainbus/mainbus.c */
 extern NTSTATUS STDCALL WvBusRemoveDev(IN WV_SP_DEV_T);
 
@@ -50,8 +81,19 @@ extern VOID WvFilediskStopImpersonating(void);
 extern NTSTATUS STDCALL WvFilediskCreateClientSecurity(OUT PVOID *);
 extern VOID STDCALL WvFilediskDeleteClientSecurity(IN OUT PVOID *);
 
+/* From filedisk/zero.c */
+extern BOOLEAN STDCALL WvFilediskCanZero(IN HANDLE, OUT PHANDLE);
+extern NTSTATUS STDCALL WvFilediskZero(
+    IN HANDLE,
+    IN HANDLE,
+    IN LONGLONG,
+    IN LONGLONG
+  );
+
 /** Private function declarations. */
 static WVL_F_DISK_IO WvFilediskIo_;
+static IO_COMPLETION_ROUTINE WvFilediskIoDone_;
+static WVL_F_DISK_UNMAP WvFilediskUnmap_;
 static NTSTATUS STDCALL WvFilediskPnpQueryId_(
     IN PDEVICE_OBJECT,
     IN PIRP,
@@ -60,7 +102,6 @@ static NTSTATUS STDCALL WvFilediskPnpQueryId_(
 static WVL_F_THREAD_ITEM WvFilediskOpenInThread_;
 static NTSTATUS STDCALL WvFilediskOpen_(IN WV_SP_FILEDISK_T, IN PANSI_STRING);
 static WVL_F_DISK_UNIT_NUM WvFilediskUnitNum_;
-static WVL_F_THREAD_ITEM WvFilediskThread_;
 static WV_F_DEV_FREE WvFilediskFree_;
 static BOOLEAN STDCALL WvFilediskHotSwap_(
     IN WV_SP_FILEDISK_T,
@@ -112,11 +153,17 @@ NTSTATUS STDCALL WvFilediskAttach(IN PIRP irp) {
     filedisk->disk->Cylinders = params->cylinders;
     filedisk->disk->Heads = params->heads;
     filedisk->disk->Sectors = params->sectors;
+    if (params->queue_depth > 0) {
+        filedisk->QueueDepth = params->queue_depth;
+        if (filedisk->QueueDepth > WV_M_FILEDISK_QUEUE_DEPTH_MAX_)
+          filedisk->QueueDepth = WV_M_FILEDISK_QUEUE_DEPTH_MAX_;
+      }
+    DBG("Queue depth: %u\n", filedisk->QueueDepth);
 
     /* Populate the file path into a counted ANSI string. */
     RtlInitAnsiString(&ansi_path, buf + sizeof *params);
 
-    /* Attempt to open the file from within the filedisk's thread. */
+    /* Attempt to open the file from within a pool worker. */
     status = WvFilediskOpen_(filedisk, &ansi_path);
     if (!NT_SUCCESS(status))
       goto err_file_open;
@@ -133,7 +180,7 @@ NTSTATUS STDCALL WvFilediskAttach(IN PIRP irp) {
     WvBusRemoveDev(filedisk->Dev);
     err_add_child:
 
-    /* Any open file handle will be closed upon thread exit. */
+    /* Any open file handle will be closed when the filedisk is freed. */
     err_file_open:
 
     WvFilediskFree_(filedisk->Dev);
@@ -155,6 +202,12 @@ static NTSTATUS WvFilediskIrpDispatch(
     filedisk = dev_obj->DeviceExtension;
     switch (io_stack_loc->MajorFunction) {
         case IRP_MJ_SCSI:
+          /* Unmapping uses the file system, so is done by a pool worker. */
+          if (WvlDiskScsiUnmaps(irp)) {
+              IoMarkIrpPending(irp);
+              WvFilediskPoolQueue(filedisk, irp);
+              return STATUS_PENDING;
+            }
           return WvlDiskScsi(dev_obj, irp, filedisk->disk);
 
         case IRP_MJ_PNP:
@@ -166,6 +219,7 @@ static NTSTATUS WvFilediskIrpDispatch(
               if (!filedisk->Dev->BusNode.Linked) {
                   /* Unlinked _and_ deleted */
                   DBG("Deleting filedisk PDO: %p", dev_obj);
+                  WvlDiskOverlayFree(filedisk->disk);
                   IoDeleteDevice(dev_obj);
                 }
             }
@@ -238,14 +292,15 @@ WV_SP_FILEDISK_T STDCALL WvFilediskCreatePdo(
     filedisk->disk->ext = filedisk;
     filedisk->disk->DriverObj = WvDriverObj;
     filedisk->disk->DenyPageFile = TRUE;
+    filedisk->QueueDepth = WV_M_FILEDISK_QUEUE_DEPTH_;
     InitializeListHead(filedisk->Irps);
     KeInitializeSpinLock(filedisk->IrpsLock);
+    KeInitializeMutex(&filedisk->ZeroLock, 0);
 
-    /* Start the thread. */
-    filedisk->Thread->Main.Func = WvFilediskThread_;
-    status = WvlThreadStart(filedisk->Thread);
+    /* Join the worker pool. */
+    status = WvFilediskPoolJoin(filedisk);
     if (!NT_SUCCESS(status)) {
-        DBG("Couldn't create thread!\n");
+        DBG("Couldn't join worker pool!\n");
         goto err_thread;
       }
 
@@ -261,7 +316,6 @@ WV_SP_FILEDISK_T STDCALL WvFilediskCreatePdo(
     DBG("New PDO: %p\n", pdo);
     return filedisk;
 
-    WvlThreadSendStopAndWait(filedisk->Thread);
     err_thread:
 
     IoDeleteDevice(pdo);
@@ -332,9 +386,76 @@ VOID STDCALL WvFilediskHotSwap(IN WV_SP_FILEDISK_T filedisk, IN PCHAR file) {
     return;
   }
 
+/**
+ * Make a file a filedisk's backing file, in place of any it had.
+ *
+ * @v filedisk          The filedisk.
+ * @v file              The file.  The filedisk closes it, if this
+ *                      succeeds.
+ * @v offset            Where the disk starts in the file, or NULL to keep
+ *                      the filedisk's offset.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Requests hold the file object they were sent with, so the old file is
+ * only closed once no new requests can pick it up.
+ */
+NTSTATUS STDCALL WvFilediskSetFile(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN HANDLE file,
+    IN PLARGE_INTEGER offset
+  ) {
+    PFILE_OBJECT file_obj, old_obj;
+    HANDLE old;
+    NTSTATUS status;
+    KIRQL irql;
+
+    status = ObReferenceObjectByHandle(
+        file,
+        0,
+        *IoFileObjectType,
+        KernelMode,
+        &file_obj,
+        NULL
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't reference file object!\n");
+        return status;
+      }
+
+    /* Ranges are released through the handle, while holding ZeroLock. */
+    KeWaitForSingleObject(
+        &filedisk->ZeroLock,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL
+      );
+    KeAcquireSpinLock(filedisk->IrpsLock, &irql);
+    old = filedisk->file;
+    old_obj = filedisk->FileObj;
+    filedisk->file = file;
+    filedisk->FileObj = file_obj;
+    if (offset)
+      filedisk->offset = *offset;
+    KeReleaseSpinLock(filedisk->IrpsLock, irql);
+    KeReleaseMutex(&filedisk->ZeroLock, FALSE);
+
+    if (old_obj)
+      ObDereferenceObject(old_obj);
+    if (old)
+      ZwClose(old);
+    return STATUS_SUCCESS;
+  }
+
 /** Private function definitions. */
 
-/* Filedisk I/O routine. */
+/**
+ * Filedisk I/O routine.
+ *
+ * Requests are first queued for the worker pool.  From there, they
+ * are sent to the file system asynchronously, with up to the filedisk's
+ * queue depth of them in flight at once.
+ */
 static NTSTATUS STDCALL WvFilediskIo_(
     IN WVL_SP_DISK_T disk_ptr,
     IN WVL_E_DISK_IO_MODE mode,
@@ -344,9 +465,13 @@ static NTSTATUS STDCALL WvFilediskIo_(
     IN PIRP irp
   ) {
     WV_SP_FILEDISK_T filedisk_ptr;
+    WV_SP_FILEDISK_IO_ io;
+    PDEVICE_OBJECT fs_dev;
+    PIRP fs_irp;
+    PIO_STACK_LOCATION io_stack_loc;
     LARGE_INTEGER offset;
     NTSTATUS status;
-    IO_STATUS_BLOCK io_status;
+    KIRQL irql;
 
     if (sector_count < 1) {
         /* A silly request. */
@@ -358,55 +483,199 @@ static NTSTATUS STDCALL WvFilediskIo_(
     filedisk_ptr = CONTAINING_RECORD(disk_ptr, WV_S_FILEDISK_T, disk);
 
     /*
-     * These SCSI read/write IRPs should be completed in the thread context.
+     * These SCSI read/write IRPs should be completed in a pool worker.
      * Check if the IRP was already marked pending.
      */
     if (!(IoGetCurrentIrpStackLocation(irp)->Control & SL_PENDING_RETURNED)) {
         /* Enqueue and signal work. */
         IoMarkIrpPending(irp);
-        ExInterlockedInsertTailList(
-            filedisk_ptr->Irps,
-            &irp->Tail.Overlay.ListEntry,
-            filedisk_ptr->IrpsLock
-          );
-        KeSetEvent(&filedisk_ptr->Thread->Signal, 0, FALSE);
+        WvFilediskPoolQueue(filedisk_ptr, irp);
         return STATUS_PENDING;
       }
 
+    /* Dynamic and differencing .VHDs are mapped through their BAT. */
+    if (filedisk_ptr->Vhd) {
+        status = WvFilediskVhdIo(
+            filedisk_ptr,
+            mode,
+            start_sector,
+            sector_count,
+            buffer
+          );
+        if (NT_SUCCESS(status) && mode == WvlDiskIoModeRead && !start_sector)
+          WvlDiskGuessGeometry((WVL_AP_DISK_BOOT_SECT) buffer, disk_ptr);
+        return WvlIrpComplete(
+            irp,
+            NT_SUCCESS(status) ? sector_count * disk_ptr->SectorSize : 0,
+            status
+          );
+      }
+
+    /* Zeroes are written by releasing that range of a sparse file. */
+    if (
+        mode == WvlDiskIoModeWrite &&
+        disk_ptr->disk_ops.Unmap &&
+        WvlDiskIsZero(buffer, sector_count * disk_ptr->SectorSize)
+      ) {
+        status = WvFilediskUnmap_(disk_ptr, start_sector, sector_count);
+        if (NT_SUCCESS(status)) {
+            return WvlIrpComplete(
+                irp,
+                sector_count * disk_ptr->SectorSize,
+                status
+              );
+          }
+        /* Else write them. */
+      }
+
+    io = wv_malloc(sizeof *io);
+    if (!io) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_io;
+      }
+    io->filedisk = filedisk_ptr;
+    io->irp = irp;
+    io->mode = mode;
+    io->start_sector = start_sector;
+    io->sector_count = sector_count;
+    io->buffer = buffer;
+
+    /*
+     * Hold the file object, in case of a hot-swap while in flight.  The
+     * offset goes with it.
+     */
+    KeAcquireSpinLock(filedisk_ptr->IrpsLock, &irql);
+    io->file_obj = filedisk_ptr->FileObj;
+    ObReferenceObject(io->file_obj);
+    offset.QuadPart = filedisk_ptr->offset.QuadPart;
+    KeReleaseSpinLock(filedisk_ptr->IrpsLock, irql);
+    fs_dev = IoGetRelatedDeviceObject(io->file_obj);
+
     /* Calculate the offset. */
-    offset.QuadPart = start_sector * disk_ptr->SectorSize;
-    offset.QuadPart += filedisk_ptr->offset.QuadPart;
+    offset.QuadPart += start_sector * disk_ptr->SectorSize;
 
-    /* Perform the read/write. */
+    /* Build a read/write for the file system.  These take the buffer as-is. */
+    fs_irp = IoAllocateIrp(fs_dev->StackSize, FALSE);
+    if (!fs_irp) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_fs_irp;
+      }
+    fs_irp->UserBuffer = buffer;
+    fs_irp->RequestorMode = KernelMode;
+    fs_irp->Tail.Overlay.Thread = PsGetCurrentThread();
+    fs_irp->Tail.Overlay.OriginalFileObject = io->file_obj;
+    if (io->file_obj->Flags & FO_NO_INTERMEDIATE_BUFFERING)
+      fs_irp->Flags |= IRP_NOCACHE;
+    io_stack_loc = IoGetNextIrpStackLocation(fs_irp);
+    io_stack_loc->FileObject = io->file_obj;
     if (mode == WvlDiskIoModeWrite) {
-        status = ZwWriteFile(
-            filedisk_ptr->file,
-            NULL,
-            NULL,
-            NULL,
-            &io_status,
-            buffer,
-            sector_count * disk_ptr->SectorSize,
-            &offset,
-            NULL
-          );
+        fs_irp->Flags |= IRP_WRITE_OPERATION;
+        io_stack_loc->MajorFunction = IRP_MJ_WRITE;
+        io_stack_loc->Parameters.Write.Length =
+          sector_count * disk_ptr->SectorSize;
+        io_stack_loc->Parameters.Write.ByteOffset = offset;
       } else {
-        status = ZwReadFile(
-            filedisk_ptr->file,
-            NULL,
-            NULL,
-            NULL,
-            &io_status,
-            buffer,
-            sector_count * disk_ptr->SectorSize,
-            &offset,
-            NULL
+        fs_irp->Flags |= IRP_READ_OPERATION;
+        io_stack_loc->MajorFunction = IRP_MJ_READ;
+        io_stack_loc->Parameters.Read.Length =
+          sector_count * disk_ptr->SectorSize;
+        io_stack_loc->Parameters.Read.ByteOffset = offset;
+      }
+    IoSetCompletionRoutine(fs_irp, WvFilediskIoDone_, io, TRUE, TRUE, TRUE);
+
+    /* Perform the read/write.  WvFilediskIoDone_() completes the request. */
+    KeAcquireSpinLock(filedisk_ptr->IrpsLock, &irql);
+    filedisk_ptr->InFlight++;
+    KeReleaseSpinLock(filedisk_ptr->IrpsLock, irql);
+    IoCallDriver(fs_dev, fs_irp);
+    return STATUS_PENDING;
+
+    err_fs_irp:
+
+    ObDereferenceObject(io->file_obj);
+    wv_free(io);
+    err_io:
+
+    return WvlIrpComplete(irp, 0, status);
+  }
+
+/* Finish a filedisk read/write, once the file system is done with it. */
+static NTSTATUS STDCALL WvFilediskIoDone_(
+    IN PDEVICE_OBJECT dev_obj,
+    IN PIRP fs_irp,
+    IN PVOID context
+  ) {
+    WV_SP_FILEDISK_IO_ io = context;
+    WV_SP_FILEDISK_T filedisk = io->filedisk;
+    NTSTATUS status = fs_irp->IoStatus.Status;
+    PMDL mdl;
+
+    /* Release anything the file system locked for us. */
+    while (mdl = fs_irp->MdlAddress) {
+        fs_irp->MdlAddress = mdl->Next;
+        MmUnlockPages(mdl);
+        IoFreeMdl(mdl);
+      }
+    IoFreeIrp(fs_irp);
+    ObDereferenceObject(io->file_obj);
+
+    /* When the MBR is read, re-determine the disk geometry. */
+    if (
+        NT_SUCCESS(status) &&
+        io->mode == WvlDiskIoModeRead &&
+        !io->start_sector
+      ) {
+        WvlDiskGuessGeometry(
+            (WVL_AP_DISK_BOOT_SECT) io->buffer,
+            filedisk->disk
           );
-        /* When the MBR is read, re-determine the disk geometry. */
-        if (!start_sector)
-          WvlDiskGuessGeometry((WVL_AP_DISK_BOOT_SECT) buffer, disk_ptr);
       }
-    return WvlIrpComplete(irp, sector_count * disk_ptr->SectorSize, status);
+    WvlIrpComplete(
+        io->irp,
+        NT_SUCCESS(status) ? io->sector_count * filedisk->disk->SectorSize : 0,
+        status
+      );
+    wv_free(io);
+
+    /* Let the pool send another.  Don't touch the filedisk after this. */
+    WvFilediskPoolDone(filedisk);
+    /* The IRP is gone. */
+    return STATUS_MORE_PROCESSING_REQUIRED;
+  }
+
+/**
+ * Filedisk unmap routine.
+ *
+ * The range of the file is zeroed, and released by the file system.
+ * Only set for sparse files.
+ */
+static NTSTATUS STDCALL WvFilediskUnmap_(
+    IN WVL_SP_DISK_T disk_ptr,
+    IN LONGLONG start_sector,
+    IN ULONGLONG sector_count
+  ) {
+    WV_SP_FILEDISK_T filedisk_ptr;
+    NTSTATUS status;
+
+    filedisk_ptr = CONTAINING_RECORD(disk_ptr, WV_S_FILEDISK_T, disk);
+    /* The file system can only be asked at PASSIVE_LEVEL. */
+    if (KeGetCurrentIrql() != PASSIVE_LEVEL)
+      return STATUS_NOT_SUPPORTED;
+    KeWaitForSingleObject(
+        &filedisk_ptr->ZeroLock,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL
+      );
+    status = WvFilediskZero(
+        filedisk_ptr->file,
+        filedisk_ptr->ZeroEvent,
+        filedisk_ptr->offset.QuadPart + start_sector * disk_ptr->SectorSize,
+        sector_count * disk_ptr->SectorSize
+      );
+    KeReleaseMutex(&filedisk_ptr->ZeroLock, FALSE);
+    return status;
   }
 
 /* Filedisk PnP ID query-response routine. */
@@ -507,7 +776,7 @@ static VOID STDCALL WvFilediskOpenInThread_(IN OUT WVL_SP_THREAD_ITEM item) {
         NULL,
         NULL
       );
-    /* Open the file.  The handle is closed when the thread finishes. */
+    /* Open the file.  The handle is closed when the filedisk is freed. */
     opener->status = ZwCreateFile(
         &file,
         GENERIC_READ | GENERIC_WRITE,
@@ -517,10 +786,7 @@ static VOID STDCALL WvFilediskOpenInThread_(IN OUT WVL_SP_THREAD_ITEM item) {
         FILE_ATTRIBUTE_NORMAL,
         FILE_SHARE_READ | FILE_SHARE_DELETE | FILE_SHARE_WRITE,
         FILE_OPEN,
-        FILE_NON_DIRECTORY_FILE |
-          FILE_RANDOM_ACCESS |
-          FILE_NO_INTERMEDIATE_BUFFERING |
-          FILE_SYNCHRONOUS_IO_NONALERT,
+        WV_M_FILEDISK_OPEN_OPTIONS_,
         NULL,
         0
       );
@@ -544,6 +810,24 @@ static VOID STDCALL WvFilediskOpenInThread_(IN OUT WVL_SP_THREAD_ITEM item) {
     opener->filedisk->disk->LBADiskSize =
       file_info.EndOfFile.QuadPart / opener->filedisk->disk->SectorSize;
 
+    /* A .VHD has its own size, and might need mapping. */
+    opener->status = WvFilediskVhdOpen(
+        opener->filedisk,
+        file,
+        opener->file_path
+      );
+    if (!NT_SUCCESS(opener->status)) {
+        DBG("Couldn't open .VHD!\n");
+        goto err_vhd;
+      }
+
+    /* Unmapped and zeroed sectors can be released from a sparse file. */
+    if (
+        !opener->filedisk->Vhd &&
+        WvFilediskCanZero(file, &opener->filedisk->ZeroEvent)
+      )
+      opener->filedisk->disk->disk_ops.Unmap = WvFilediskUnmap_;
+
     /*
      * A really stupid "hash".  RtlHashUnicodeString() would have been
      * good, but is only available >= Windows XP.
@@ -556,9 +840,15 @@ static VOID STDCALL WvFilediskOpenInThread_(IN OUT WVL_SP_THREAD_ITEM item) {
       }
 
     /* Opened. */
-    opener->filedisk->file = file;
+    opener->status = WvFilediskSetFile(opener->filedisk, file, NULL);
+    if (!NT_SUCCESS(opener->status)) {
+        WvFilediskVhdClose(opener->filedisk);
+        goto err_vhd;
+      }
     goto out;
 
+    err_vhd:
+
     err_query_info:
 
     ZwClose(file);
@@ -603,9 +893,9 @@ static NTSTATUS STDCALL WvFilediskOpen_(
     opener.filedisk = filedisk;
     KeInitializeEvent(opener.completion, SynchronizationEvent, FALSE);
 
-    /* Attempt to open the file from within the filedisk's thread. */
-    if (!(WvlThreadAddItem(filedisk->Thread, opener.item))) {
-        DBG("Filedisk thread not active!\n");
+    /* Attempt to open the file from within a pool worker. */
+    if (!WvFilediskPoolAddItem(filedisk, opener.item)) {
+        DBG("Filedisk worker not active!\n");
         goto err_add_item;
       }
     KeWaitForSingleObject(
@@ -639,66 +929,6 @@ static UCHAR STDCALL WvFilediskUnitNum_(IN WVL_SP_DISK_T disk) {
     return (UCHAR) WvlBusGetNodeNum(&filedisk->Dev->BusNode);
   }
 
-/* A filedisk's thread routine. */
-static VOID STDCALL WvFilediskThread_(IN OUT WVL_SP_THREAD_ITEM item) {
-    WV_SP_FILEDISK_T filedisk = CONTAINING_RECORD(
-        item,
-        WV_S_FILEDISK_T,
-        Thread[0].Main
-      );
-    LARGE_INTEGER timeout;
-    WVL_SP_THREAD_ITEM work_item;
-    PLIST_ENTRY irp_item;
-
-    /* Wake up at least every 30 seconds. */
-    timeout.QuadPart = -300000000LL;
-
-    while (
-        (filedisk->Thread->State == WvlThreadStateStarted) ||
-        (filedisk->Thread->State == WvlThreadStateStopping)
-      ) {
-        /* Wait for the work signal or the timeout. */
-        KeWaitForSingleObject(
-            &filedisk->Thread->Signal,
-            Executive,
-            KernelMode,
-            FALSE,
-            &timeout
-          );
-        /* Reset the work signal. */
-        KeResetEvent(&filedisk->Thread->Signal);
-
-        /* Process work items.  One of these might be a stopper. */
-        while (work_item = WvlThreadGetItem(filedisk->Thread))
-          work_item->Func(work_item);
-
-        /* Process SCSI IRPs. */
-        while (irp_item = ExInterlockedRemoveHeadList(
-            filedisk->Irps,
-            filedisk->IrpsLock
-          )) {
-            PIRP irp;
-            PIO_STACK_LOCATION io_stack_loc;
-
-            irp = CONTAINING_RECORD(irp_item, IRP, Tail.Overlay.ListEntry);
-            io_stack_loc = IoGetCurrentIrpStackLocation(irp);
-            if (io_stack_loc->MajorFunction != IRP_MJ_SCSI) {
-                DBG("Non-SCSI IRP!\n");
-                continue;
-              }
-            WvlDiskScsi(filedisk->Dev->Self, irp, filedisk->disk);
-          }
-
-        /* Are we finished? */
-        if (filedisk->Thread->State == WvlThreadStateStopping)
-          filedisk->Thread->State = WvlThreadStateStopped;
-      } /* while thread started or stopping. */
-    /* Close any open file handle. */
-    if (filedisk->file)
-      ZwClose(filedisk->file);
-    return;
-  }
-
 /**
  * Default file-backed disk deletion operation.
  *
@@ -712,9 +942,17 @@ static VOID STDCALL WvFilediskFree_(IN WV_SP_DEV_T dev) {
       );
     PDEVICE_OBJECT pdo = dev->Self;
 
-    WvlThreadSendStopAndWait(filedisk->Thread);
+    WvFilediskPoolLeave(filedisk);
+    WvFilediskVhdClose(filedisk);
+    if (filedisk->FileObj)
+      ObDereferenceObject(filedisk->FileObj);
+    if (filedisk->file)
+      ZwClose(filedisk->file);
+    if (filedisk->ZeroEvent)
+      ZwClose(filedisk->ZeroEvent);
     /* It's ok to pass this even if the field is still NULL. */
     WvFilediskDeleteClientSecurity(&filedisk->impersonation);
+    WvlDiskOverlayFree(filedisk->disk);
     IoDeleteDevice(pdo);
     DBG("Deleted PDO: %p\n", pdo);
     return;
@@ -816,7 +1054,11 @@ static BOOLEAN STDCALL WvFilediskHotSwap_(
             NULL,
             NULL
           );
-        /* Look for the file on this volume. */
+        /*
+         * Look for the file on this volume.  It must be opened as the
+         * original was, or our asynchronous requests would be sent to
+         * a synchronous file object.
+         */
         status = ZwCreateFile(
             &file,
             GENERIC_READ | GENERIC_WRITE,
@@ -826,22 +1068,20 @@ static BOOLEAN STDCALL WvFilediskHotSwap_(
             FILE_ATTRIBUTE_NORMAL,
             FILE_SHARE_READ | FILE_SHARE_DELETE | FILE_SHARE_WRITE,
             FILE_OPEN,
-            FILE_NON_DIRECTORY_FILE |
-              FILE_RANDOM_ACCESS |
-              FILE_SYNCHRONOUS_IO_NONALERT,
+            WV_M_FILEDISK_OPEN_OPTIONS_,
             NULL,
             0
           );
         if (!NT_SUCCESS(status))
           goto err_open;
         /* We could open it.  Do the hot-swap. */
-        {   HANDLE old = filedisk->file;
-  
-            filedisk->file = 0;
-            filedisk->offset.QuadPart = 0;
-            filedisk->file = file;
-            ZwClose(old);
-          } /* old scope */
+        {   LARGE_INTEGER offset;
+
+            offset.QuadPart = 0;
+            status = WvFilediskSetFile(filedisk, file, &offset);
+            if (!NT_SUCCESS(status))
+              ZwClose(file);
+          } /* offset scope */
   
         err_open:
   
@@ -375,7 +375,14 @@ static VOID STDCALL WvFilediskG4dFindBackingDisk_(
     if (!NT_SUCCESS(status))
       goto retry;
     /* Use the backing disk and report the sector-mapped disk. */
-    filedisk_ptr->file = file;
+    status = WvFilediskSetFile(filedisk_ptr, file, NULL);
+    if (!NT_SUCCESS(status)) {
+        ZwClose(file);
+        goto retry;
+      }
+    /* Keep writes in RAM, if asked to. */
+    if (WvlBootOverlayWanted())
+      WvlDiskOverlayCreate(filedisk_ptr->disk);
     if (!WvBusAddDev(filedisk_ptr->Dev))
       WvDevFree(filedisk_ptr->Dev);
 
@@ -418,7 +425,7 @@ static BOOLEAN STDCALL WvFilediskG4dFindBackingDisk(
     finder->item->Func = WvFilediskG4dFindBackingDisk_;
     finder->filedisk = filedisk;
     /* Add the hot-swapper work item. */
-    if (!WvlThreadAddItem(filedisk->Thread, finder->item)) {
+    if (!WvFilediskPoolAddItem(filedisk, finder->item)) {
         DBG("Couldn't add work item!\n");
         goto err_work_item;
       }
@@ -2,7 +2,7 @@
 
 set libname=filedisk
 
-set c=filedisk.c grub4dos.c security.c
+set c=filedisk.c grub4dos.c security.c pool.c vhd.c vhdmap.c zero.c
 
 echo !INCLUDE $(NTMAKEENV)\makefile.def	> makefile
 
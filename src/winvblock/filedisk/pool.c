@@ -0,0 +1,508 @@
+/**
+ * Copyright (C) 2009-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * The worker pool shared by all filedisks.
+ *
+ * There is one worker thread per processor.  Each filedisk has a home
+ * worker, which runs its work items and usually sends its requests.
+ * When a filedisk has requests to send and room for more in flight, it
+ * is put on its home worker's ready queue.  A worker with nothing to do
+ * steals the newest filedisk from another worker's ready queue.
+ *
+ * A filedisk is only ever on one ready queue, or being served by one
+ * worker, so its requests are sent in the order they arrived.
+ */
+
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "irp.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "mount.h"
+#include "thread.h"
+#include "filedisk.h"
+#include "debug.h"
+
+/** Macros. */
+
+/* The most workers in the pool. */
+#define WV_M_FILEDISK_POOL_MAX_ 32
+
+/** Object types. */
+
+typedef struct WV_FILEDISK_WORKER_ {
+    WVL_S_THREAD Thread[1];
+    /* Protects everything below. */
+    KSPIN_LOCK Lock;
+    /* Filedisks with requests to send, oldest first. */
+    LIST_ENTRY Ready;
+    UINT32 QueueDepth;
+    UINT32 MaxQueueDepth;
+    /* Filedisks with this as their home worker. */
+    UINT32 Disks;
+    /* Counters. */
+    ULONGLONG Runs;
+    ULONGLONG Irps;
+    ULONGLONG Steals;
+    ULONGLONG Stolen;
+  } WV_S_FILEDISK_WORKER_, * WV_SP_FILEDISK_WORKER_;
+
+/** Private function declarations. */
+static WVL_F_THREAD_ITEM WvFilediskWorker_;
+
+/** Private objects. */
+
+static WV_S_FILEDISK_WORKER_ WvFilediskWorkers_[WV_M_FILEDISK_POOL_MAX_];
+static UINT32 WvFilediskWorkerCount_;
+/* 0 if the pool isn't started, 1 while starting, 2 once started. */
+static LONG WvFilediskPoolState_;
+/* For choosing home workers in turn. */
+static LONG WvFilediskNextWorker_;
+
+/** Private function definitions. */
+
+/* Start the pool's workers, if they aren't started already. */
+static NTSTATUS STDCALL WvFilediskPoolStart_(void) {
+    LARGE_INTEGER delay;
+    KAFFINITY cpus;
+    UINT32 count, i;
+    NTSTATUS status;
+
+    if (!InterlockedCompareExchange(&WvFilediskPoolState_, 1, 0)) {
+        /* One worker per processor. */
+        count = 0;
+        for (cpus = KeQueryActiveProcessors(); cpus; cpus &= cpus - 1)
+          count++;
+        if (count > WV_M_FILEDISK_POOL_MAX_)
+          count = WV_M_FILEDISK_POOL_MAX_;
+
+        for (i = 0; i < count; i++) {
+            WV_SP_FILEDISK_WORKER_ worker = WvFilediskWorkers_ + i;
+
+            KeInitializeSpinLock(&worker->Lock);
+            InitializeListHead(&worker->Ready);
+            worker->Thread->Main.Func = WvFilediskWorker_;
+            status = WvlThreadStart(worker->Thread);
+            if (!NT_SUCCESS(status)) {
+                DBG("Couldn't start worker %u!\n", i);
+                break;
+              }
+          }
+        /* Make do with the workers we have. */
+        if (!i) {
+            InterlockedExchange(&WvFilediskPoolState_, 0);
+            return status;
+          }
+        WvFilediskWorkerCount_ = i;
+        DBG("%u filedisk workers\n", i);
+        InterlockedExchange(&WvFilediskPoolState_, 2);
+        return STATUS_SUCCESS;
+      }
+
+    /* Someone else is starting the pool. */
+    delay.QuadPart = -100000LL;
+    while (WvFilediskPoolState_ == 1)
+      KeDelayExecutionThread(KernelMode, FALSE, &delay);
+    if (WvFilediskPoolState_ != 2)
+      return STATUS_UNSUCCESSFUL;
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Check if a filedisk has nothing in the pool.
+ *
+ * @v filedisk          The filedisk.
+ * @ret BOOLEAN         TRUE if it's idle, else FALSE.
+ *
+ * The caller must hold the filedisk's IrpsLock.
+ */
+static BOOLEAN STDCALL WvFilediskPoolIdle_(IN WV_SP_FILEDISK_T filedisk) {
+    return !filedisk->Scheduled &&
+      !filedisk->InFlight &&
+      IsListEmpty(filedisk->Irps);
+  }
+
+/**
+ * Put a filedisk on its home worker's ready queue, if it should be.
+ *
+ * @v filedisk          The filedisk.
+ *
+ * The caller must hold the filedisk's IrpsLock.  If the filedisk is
+ * leaving the pool and is now idle, WvFilediskPoolLeave is woken.
+ */
+static VOID STDCALL WvFilediskPoolSchedule_(IN WV_SP_FILEDISK_T filedisk) {
+    WV_SP_FILEDISK_WORKER_ worker;
+    UINT32 depth;
+
+    if (filedisk->Leaving && WvFilediskPoolIdle_(filedisk)) {
+        KeSetEvent(&filedisk->Idle, 0, FALSE);
+        return;
+      }
+    if (
+        filedisk->Scheduled ||
+        IsListEmpty(filedisk->Irps) ||
+        filedisk->InFlight >= filedisk->QueueDepth
+      )
+      return;
+    filedisk->Scheduled = TRUE;
+
+    worker = WvFilediskWorkers_ + filedisk->Worker;
+    KeAcquireSpinLockAtDpcLevel(&worker->Lock);
+    InsertTailList(&worker->Ready, filedisk->ReadyLink);
+    depth = ++worker->QueueDepth;
+    if (depth > worker->MaxQueueDepth)
+      worker->MaxQueueDepth = depth;
+    KeReleaseSpinLockFromDpcLevel(&worker->Lock);
+
+    KeSetEvent(&worker->Thread->Signal, 0, FALSE);
+    /* With a backlog, wake the next worker to steal from it. */
+    if (depth > 1 && WvFilediskWorkerCount_ > 1) {
+        worker = WvFilediskWorkers_ +
+          (filedisk->Worker + 1) % WvFilediskWorkerCount_;
+        KeSetEvent(&worker->Thread->Signal, 0, FALSE);
+      }
+    return;
+  }
+
+/**
+ * Take the next filedisk to serve.
+ *
+ * @v worker            The worker looking for work.
+ * @ret WV_SP_FILEDISK_T        A filedisk from the worker's own ready
+ *                              queue, else one stolen from another's,
+ *                              else NULL.
+ */
+static WV_SP_FILEDISK_T STDCALL WvFilediskPoolTake_(
+    IN WV_SP_FILEDISK_WORKER_ worker
+  ) {
+    WV_SP_FILEDISK_WORKER_ victim;
+    PLIST_ENTRY link;
+    KIRQL irql;
+    UINT32 i, index;
+
+    KeAcquireSpinLock(&worker->Lock, &irql);
+    if (!IsListEmpty(&worker->Ready)) {
+        link = RemoveHeadList(&worker->Ready);
+        worker->QueueDepth--;
+        KeReleaseSpinLock(&worker->Lock, irql);
+        return CONTAINING_RECORD(link, WV_S_FILEDISK_T, ReadyLink[0]);
+      }
+    KeReleaseSpinLock(&worker->Lock, irql);
+
+    /* Steal the newest, leaving the oldest to their home worker. */
+    index = (UINT32) (worker - WvFilediskWorkers_);
+    for (i = 1; i < WvFilediskWorkerCount_; i++) {
+        victim = WvFilediskWorkers_ + (index + i) % WvFilediskWorkerCount_;
+        KeAcquireSpinLock(&victim->Lock, &irql);
+        if (IsListEmpty(&victim->Ready)) {
+            KeReleaseSpinLock(&victim->Lock, irql);
+            continue;
+          }
+        link = RemoveTailList(&victim->Ready);
+        victim->QueueDepth--;
+        victim->Stolen++;
+        KeReleaseSpinLock(&victim->Lock, irql);
+
+        KeAcquireSpinLock(&worker->Lock, &irql);
+        worker->Steals++;
+        KeReleaseSpinLock(&worker->Lock, irql);
+        return CONTAINING_RECORD(link, WV_S_FILEDISK_T, ReadyLink[0]);
+      }
+    return NULL;
+  }
+
+/**
+ * Send a filedisk's queued requests, while there's room for more in flight.
+ *
+ * @v worker            The worker serving the filedisk.
+ * @v filedisk          The filedisk, taken from a ready queue.
+ */
+static VOID STDCALL WvFilediskPoolRun_(
+    IN WV_SP_FILEDISK_WORKER_ worker,
+    IN WV_SP_FILEDISK_T filedisk
+  ) {
+    PLIST_ENTRY irp_item;
+    PIRP irp;
+    UINT32 count = 0;
+    KIRQL irql;
+
+    KeAcquireSpinLock(filedisk->IrpsLock, &irql);
+    while (
+        filedisk->InFlight < filedisk->QueueDepth &&
+        !IsListEmpty(filedisk->Irps)
+      ) {
+        irp_item = RemoveHeadList(filedisk->Irps);
+        KeReleaseSpinLock(filedisk->IrpsLock, irql);
+
+        irp = CONTAINING_RECORD(irp_item, IRP, Tail.Overlay.ListEntry);
+        if (IoGetCurrentIrpStackLocation(irp)->MajorFunction == IRP_MJ_SCSI) {
+            WvlDiskScsi(filedisk->Dev->Self, irp, filedisk->disk);
+            count++;
+          } else {
+            DBG("Non-SCSI IRP!\n");
+          }
+
+        KeAcquireSpinLock(filedisk->IrpsLock, &irql);
+      }
+    /*
+     * A completion or a new request puts the filedisk back on a ready
+     * queue.  Don't touch the filedisk after this.
+     */
+    filedisk->Scheduled = FALSE;
+    if (filedisk->Leaving && WvFilediskPoolIdle_(filedisk))
+      KeSetEvent(&filedisk->Idle, 0, FALSE);
+    KeReleaseSpinLock(filedisk->IrpsLock, irql);
+
+    KeAcquireSpinLock(&worker->Lock, &irql);
+    worker->Runs++;
+    worker->Irps += count;
+    KeReleaseSpinLock(&worker->Lock, irql);
+    return;
+  }
+
+/* A pool worker's thread routine. */
+static VOID STDCALL WvFilediskWorker_(IN OUT WVL_SP_THREAD_ITEM item) {
+    WV_SP_FILEDISK_WORKER_ worker = CONTAINING_RECORD(
+        item,
+        WV_S_FILEDISK_WORKER_,
+        Thread[0].Main
+      );
+    LARGE_INTEGER timeout;
+    WVL_SP_THREAD_ITEM work_item;
+    WV_SP_FILEDISK_T filedisk;
+
+    /* Wake up at least every 30 seconds. */
+    timeout.QuadPart = -300000000LL;
+
+    while (
+        (worker->Thread->State == WvlThreadStateStarted) ||
+        (worker->Thread->State == WvlThreadStateStopping)
+      ) {
+        /* Wait for the work signal or the timeout. */
+        KeWaitForSingleObject(
+            &worker->Thread->Signal,
+            Executive,
+            KernelMode,
+            FALSE,
+            &timeout
+          );
+        /* Reset the work signal. */
+        KeResetEvent(&worker->Thread->Signal);
+
+        /* Process work items.  One of these might be a stopper. */
+        while (work_item = WvlThreadGetItem(worker->Thread))
+          work_item->Func(work_item);
+
+        /* Serve filedisks, ours first. */
+        while (filedisk = WvFilediskPoolTake_(worker))
+          WvFilediskPoolRun_(worker, filedisk);
+
+        /* Are we finished? */
+        if (worker->Thread->State == WvlThreadStateStopping)
+          worker->Thread->State = WvlThreadStateStopped;
+      } /* while thread started or stopping. */
+    return;
+  }
+
+/** Exported function definitions. */
+
+/**
+ * Give a filedisk a home worker in the pool, starting the pool if needed.
+ *
+ * @v filedisk          The new filedisk.
+ * @ret NTSTATUS        The status of the operation.
+ */
+NTSTATUS STDCALL WvFilediskPoolJoin(IN WV_SP_FILEDISK_T filedisk) {
+    WV_SP_FILEDISK_WORKER_ worker;
+    NTSTATUS status;
+    KIRQL irql;
+
+    status = WvFilediskPoolStart_();
+    if (!NT_SUCCESS(status))
+      return status;
+
+    InitializeListHead(filedisk->ReadyLink);
+    KeInitializeEvent(&filedisk->Idle, NotificationEvent, FALSE);
+    filedisk->Worker = (UINT32) InterlockedIncrement(&WvFilediskNextWorker_) %
+      WvFilediskWorkerCount_;
+    worker = WvFilediskWorkers_ + filedisk->Worker;
+    KeAcquireSpinLock(&worker->Lock, &irql);
+    worker->Disks++;
+    KeReleaseSpinLock(&worker->Lock, irql);
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Wait for a filedisk to be idle, then take it out of the pool.
+ *
+ * @v filedisk          The filedisk, which must get no more requests.
+ */
+VOID STDCALL WvFilediskPoolLeave(IN WV_SP_FILEDISK_T filedisk) {
+    WV_SP_FILEDISK_WORKER_ worker;
+    BOOLEAN busy;
+    KIRQL irql;
+
+    /*
+     * The event is set with IrpsLock held, so taking the lock again
+     * after the wait means whoever set it is done with the filedisk.
+     */
+    do {
+        KeAcquireSpinLock(filedisk->IrpsLock, &irql);
+        busy = !WvFilediskPoolIdle_(filedisk);
+        if (busy) {
+            filedisk->Leaving = TRUE;
+            KeClearEvent(&filedisk->Idle);
+          }
+        KeReleaseSpinLock(filedisk->IrpsLock, irql);
+        if (busy) {
+            KeWaitForSingleObject(
+                &filedisk->Idle,
+                Executive,
+                KernelMode,
+                FALSE,
+                NULL
+              );
+          }
+      } while (busy);
+
+    worker = WvFilediskWorkers_ + filedisk->Worker;
+    KeAcquireSpinLock(&worker->Lock, &irql);
+    worker->Disks--;
+    KeReleaseSpinLock(&worker->Lock, irql);
+    return;
+  }
+
+/**
+ * Stop the pool's workers, when the driver is unloading.
+ *
+ * Every filedisk must have left the pool.  The pool is started again
+ * by the next WvFilediskPoolJoin.
+ */
+VOID STDCALL WvFilediskPoolStop(void) {
+    UINT32 i;
+
+    if (WvFilediskPoolState_ != 2)
+      return;
+    for (i = 0; i < WvFilediskWorkerCount_; i++)
+      WvlThreadSendStopAndWait(WvFilediskWorkers_[i].Thread);
+    WvFilediskWorkerCount_ = 0;
+    WvFilediskNextWorker_ = 0;
+    RtlZeroMemory(WvFilediskWorkers_, sizeof WvFilediskWorkers_);
+    InterlockedExchange(&WvFilediskPoolState_, 0);
+    return;
+  }
+
+/**
+ * Run a work item for a filedisk, in its home worker.
+ *
+ * @v filedisk          The filedisk.
+ * @v item              The work item.
+ * @ret BOOLEAN         FALSE for failure, TRUE for success.
+ */
+BOOLEAN STDCALL WvFilediskPoolAddItem(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN WVL_SP_THREAD_ITEM item
+  ) {
+    return WvlThreadAddItem(
+        WvFilediskWorkers_[filedisk->Worker].Thread,
+        item
+      );
+  }
+
+/**
+ * Queue a SCSI IRP for a filedisk's requests to be sent from the pool.
+ *
+ * @v filedisk          The filedisk.
+ * @v irp               The IRP, already marked pending.
+ */
+VOID STDCALL WvFilediskPoolQueue(IN WV_SP_FILEDISK_T filedisk, IN PIRP irp) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(filedisk->IrpsLock, &irql);
+    InsertTailList(filedisk->Irps, &irp->Tail.Overlay.ListEntry);
+    WvFilediskPoolSchedule_(filedisk);
+    KeReleaseSpinLock(filedisk->IrpsLock, irql);
+    return;
+  }
+
+/**
+ * Note that a filedisk request sent from the pool is done.
+ *
+ * @v filedisk          The filedisk.  Don't touch it after this.
+ */
+VOID STDCALL WvFilediskPoolDone(IN WV_SP_FILEDISK_T filedisk) {
+    KIRQL irql;
+
+    KeAcquireSpinLock(filedisk->IrpsLock, &irql);
+    filedisk->InFlight--;
+    WvFilediskPoolSchedule_(filedisk);
+    KeReleaseSpinLock(filedisk->IrpsLock, irql);
+    return;
+  }
+
+/**
+ * Respond to IOCTL_FILE_POOL_STATS.
+ *
+ * @v irp               The IRP, with a buffer for a WV_S_FILE_POOL_STATS.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * As many workers' counters as fit in the buffer are returned.
+ */
+NTSTATUS STDCALL WvFilediskPoolStats(IN PIRP irp) {
+    WV_SP_FILE_POOL_STATS stats = irp->AssociatedIrp.SystemBuffer;
+    WV_SP_FILEDISK_WORKER_ worker;
+    ULONG size;
+    UINT32 count, i;
+    KIRQL irql;
+
+    size = IoGetCurrentIrpStackLocation(irp)->
+      Parameters.DeviceIoControl.OutputBufferLength;
+    if (size < sizeof *stats) {
+        irp->IoStatus.Information = 0;
+        return STATUS_BUFFER_TOO_SMALL;
+      }
+    count = (UINT32) ((size - sizeof *stats) / sizeof stats->Worker[0]);
+    if (count > WvFilediskWorkerCount_)
+      count = WvFilediskWorkerCount_;
+
+    stats->Count = WvFilediskWorkerCount_;
+    for (i = 0; i < count; i++) {
+        worker = WvFilediskWorkers_ + i;
+        KeAcquireSpinLock(&worker->Lock, &irql);
+        stats->Worker[i].QueueDepth = worker->QueueDepth;
+        stats->Worker[i].MaxQueueDepth = worker->MaxQueueDepth;
+        stats->Worker[i].Disks = worker->Disks;
+        stats->Worker[i].Runs = worker->Runs;
+        stats->Worker[i].Irps = worker->Irps;
+        stats->Worker[i].Steals = worker->Steals;
+        stats->Worker[i].Stolen = worker->Stolen;
+        KeReleaseSpinLock(&worker->Lock, irql);
+      }
+    irp->IoStatus.Information =
+      sizeof *stats + count * sizeof stats->Worker[0];
+    return STATUS_SUCCESS;
+  }
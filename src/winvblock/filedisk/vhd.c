@@ -0,0 +1,523 @@
+/**
+ * Copyright (C) 2009-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ *
+ * Dynamic and differencing .VHD file-backed disks.
+ *
+ * The block mapping itself is in vhdmap.c.  This file gives it the
+ * filedisk's file to read and write, and finds and opens the parents of
+ * a differencing .VHD.
+ *
+ * All I/O here is synchronous, and is done by a filedisk's pool worker.
+ * Only one worker serves a filedisk at a time, so the in-memory BAT and
+ * bitmaps need no locking.
+ */
+
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "wv_string.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "thread.h"
+#include "filedisk.h"
+#include "debug.h"
+#include "byte.h"
+#include "msvhd.h"
+#include "vhdmap.h"
+
+/** Macros. */
+
+/* The most parents a differencing .VHD can have. */
+#define WV_M_FILEDISK_VHD_MAX_DEPTH_ 16
+/* The longest parent locator path we'll read, in bytes. */
+#define WV_M_FILEDISK_VHD_MAX_LOCATOR_ 4096
+
+/** Private function declarations. */
+static WV_F_VHDMAP_RW WvFilediskVhdRw_;
+static NTSTATUS STDCALL WvFilediskVhdStatus_(IN LONG);
+static NTSTATUS STDCALL WvFilediskVhdLoad_(
+    IN HANDLE,
+    IN PUNICODE_STRING,
+    IN UINT32,
+    OUT WV_SP_FILEDISK_VHD *
+  );
+static NTSTATUS STDCALL WvFilediskVhdOpenParent_(
+    IN OUT WV_SP_FILEDISK_VHD,
+    IN PUNICODE_STRING,
+    IN UINT32
+  );
+static NTSTATUS STDCALL WvFilediskVhdTryParent_(
+    IN OUT WV_SP_FILEDISK_VHD,
+    IN PUNICODE_STRING,
+    IN UINT32,
+    IN UINT32,
+    IN ULONGLONG,
+    IN UINT32
+  );
+static VOID STDCALL WvFilediskVhdFree_(IN WV_SP_FILEDISK_VHD);
+
+/** Exported function definitions. */
+
+/**
+ * Check a newly-opened filedisk's file for a .VHD footer.
+ *
+ * @v filedisk          The filedisk being attached.
+ * @v file              The filedisk's file.
+ * @v path              The path the file was opened with.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The disk's size is set to the .VHD's.  Fixed .VHDs are then read and
+ * written directly, as any other file is.  Dynamic and differencing
+ * .VHDs are mapped, and the parents of a differencing .VHD are opened.
+ * This is called in a pool worker, while impersonating the user.
+ */
+NTSTATUS STDCALL WvFilediskVhdOpen(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN HANDLE file,
+    IN PUNICODE_STRING path
+  ) {
+    WV_SP_FILEDISK_VHD vhd;
+    NTSTATUS status;
+
+    status = WvFilediskVhdLoad_(file, path, 0, &vhd);
+    if (!NT_SUCCESS(status))
+      return status;
+    /* Not a .VHD. */
+    if (!vhd)
+      return STATUS_SUCCESS;
+
+    filedisk->disk->LBADiskSize =
+      vhd->Sectors * WV_M_VHDMAP_SECTOR / filedisk->disk->SectorSize;
+    if (vhd->Type == WV_M_MSVHD_TYPE_FIXED) {
+        WvFilediskVhdFree_(vhd);
+        return STATUS_SUCCESS;
+      }
+    DBG(
+        "%s .VHD with %u blocks of %u sectors\n",
+        vhd->Parent ? "Differencing" : "Dynamic",
+        vhd->BatEntries,
+        vhd->BlockSectors
+      );
+    filedisk->Vhd = vhd;
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Read from or write to a dynamic or differencing .VHD filedisk.
+ *
+ * @v filedisk          The filedisk.
+ * @v mode              Read or write.
+ * @v start_sector      The first disk sector.
+ * @v sector_count      The number of disk sectors.
+ * @v buffer            The data.
+ * @ret NTSTATUS        The status of the operation.
+ */
+NTSTATUS STDCALL WvFilediskVhdIo(
+    IN WV_SP_FILEDISK_T filedisk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer
+  ) {
+    WV_SP_FILEDISK_VHD vhd = filedisk->Vhd;
+    UINT32 ratio = filedisk->disk->SectorSize / WV_M_VHDMAP_SECTOR;
+    ULONGLONG sector = start_sector * ratio;
+    UINT32 count = sector_count * ratio;
+
+    if (mode == WvlDiskIoModeWrite)
+      return WvFilediskVhdStatus_(WvVhdMapWrite(vhd, sector, count, buffer));
+    return WvFilediskVhdStatus_(WvVhdMapRead(vhd, sector, count, buffer));
+  }
+
+/**
+ * Release a filedisk's .VHD mapping and close any parents.
+ *
+ * @v filedisk          The filedisk, whose I/O has finished.
+ */
+VOID STDCALL WvFilediskVhdClose(IN WV_SP_FILEDISK_T filedisk) {
+    if (!filedisk->Vhd)
+      return;
+    WvFilediskVhdFree_(filedisk->Vhd);
+    filedisk->Vhd = NULL;
+    return;
+  }
+
+/** Private function definitions. */
+
+/* Synchronously read from or write to a file opened for asynchronous I/O. */
+static LONG WvFilediskVhdRw_(
+    IN PVOID file,
+    IN int write,
+    IN ULONGLONG offset,
+    IN UINT32 length,
+    IN OUT PVOID buffer
+  ) {
+    IO_STATUS_BLOCK io_status;
+    LARGE_INTEGER where;
+    NTSTATUS status;
+
+    where.QuadPart = offset;
+    if (write) {
+        status = ZwWriteFile(
+            file,
+            NULL,
+            NULL,
+            NULL,
+            &io_status,
+            buffer,
+            length,
+            &where,
+            NULL
+          );
+      } else {
+        status = ZwReadFile(
+            file,
+            NULL,
+            NULL,
+            NULL,
+            &io_status,
+            buffer,
+            length,
+            &where,
+            NULL
+          );
+      }
+    /* Without an event, the file object is signalled upon completion. */
+    if (status == STATUS_PENDING) {
+        ZwWaitForSingleObject(file, FALSE, NULL);
+        status = io_status.Status;
+      }
+    if (NT_SUCCESS(status) && io_status.Information != length)
+      status = STATUS_END_OF_FILE;
+    return status;
+  }
+
+/* Turn a result from the .VHD mapping into an NTSTATUS. */
+static NTSTATUS STDCALL WvFilediskVhdStatus_(IN LONG result) {
+    switch (result) {
+        case WV_M_VHDMAP_E_NOMEM:
+          return STATUS_INSUFFICIENT_RESOURCES;
+
+        case WV_M_VHDMAP_E_FORMAT:
+          return STATUS_INVALID_IMAGE_FORMAT;
+
+        case WV_M_VHDMAP_E_RANGE:
+          return STATUS_INVALID_PARAMETER;
+
+        case WV_M_VHDMAP_E_TYPE:
+          return STATUS_NOT_SUPPORTED;
+
+        default:
+          /* Otherwise, it's the NTSTATUS from WvFilediskVhdRw_. */
+          return result < 0 ? result : STATUS_SUCCESS;
+      }
+  }
+
+/**
+ * Read a .VHD's footer and, if it's dynamic or differencing, its BAT.
+ *
+ * @v file              The open .VHD file.
+ * @v path              The path the file was opened with.
+ * @v depth             How many children the .VHD has.
+ * @v vhd_out           Filled with the .VHD, or NULL if it isn't one.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The file is only the new .VHD's to close if it's a parent.
+ */
+static NTSTATUS STDCALL WvFilediskVhdLoad_(
+    IN HANDLE file,
+    IN PUNICODE_STRING path,
+    IN UINT32 depth,
+    OUT WV_SP_FILEDISK_VHD * vhd_out
+  ) {
+    IO_STATUS_BLOCK io_status;
+    FILE_STANDARD_INFORMATION file_info;
+    WV_SP_FILEDISK_VHD vhd;
+    NTSTATUS status;
+
+    *vhd_out = NULL;
+    status = ZwQueryInformationFile(
+        file,
+        &io_status,
+        &file_info,
+        sizeof file_info,
+        FileStandardInformation
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't query file size!\n");
+        goto err_query_info;
+      }
+
+    status = WvFilediskVhdStatus_(
+        WvVhdMapLoad(
+            WvFilediskVhdRw_,
+            file,
+            file_info.EndOfFile.QuadPart,
+            &vhd
+          )
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't load .VHD: 0x%08X\n", status);
+        goto err_load;
+      }
+    if (!vhd) {
+        /* Not a .VHD, which is fine for the top file. */
+        status = depth ? STATUS_INVALID_IMAGE_FORMAT : STATUS_SUCCESS;
+        goto err_cookie;
+      }
+
+    if (vhd->Type == WV_M_MSVHD_TYPE_DIFF) {
+        status = WvFilediskVhdOpenParent_(vhd, path, depth);
+        if (!NT_SUCCESS(status))
+          goto err_parent;
+      }
+
+    *vhd_out = vhd;
+    return STATUS_SUCCESS;
+
+    err_parent:
+
+    /* Our caller closes the file upon failure. */
+    WvFilediskVhdFree_(vhd);
+    err_cookie:
+
+    err_load:
+
+    err_query_info:
+
+    return status;
+  }
+
+/**
+ * Find and open a differencing .VHD's parent.
+ *
+ * @v vhd               The differencing .VHD.
+ * @v path              The path it was opened with.
+ * @v depth             How many children it has.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * Relative locators are tried first, so that a chain of .VHDs still
+ * works after being moved together.
+ */
+static NTSTATUS STDCALL WvFilediskVhdOpenParent_(
+    IN OUT WV_SP_FILEDISK_VHD vhd,
+    IN PUNICODE_STRING path,
+    IN UINT32 depth
+  ) {
+    static const UINT32 codes[] = {
+        WV_M_MSVHD_LOCATOR_W2RU,
+        WV_M_MSVHD_LOCATOR_W2KU
+      };
+    UINT32 i, j, code, length;
+    ULONGLONG offset;
+    NTSTATUS status = STATUS_OBJECT_NAME_NOT_FOUND;
+
+    if (depth + 1 >= WV_M_FILEDISK_VHD_MAX_DEPTH_) {
+        DBG("Too many parents!\n");
+        return STATUS_INVALID_IMAGE_FORMAT;
+      }
+    for (i = 0; i < sizeof codes / sizeof *codes; i++) {
+        for (j = 0; WvVhdMapLocator(vhd, j, &code, &length, &offset); j++) {
+            if (code != codes[i] || !length)
+              continue;
+            status = WvFilediskVhdTryParent_(
+                vhd,
+                path,
+                code,
+                length,
+                offset,
+                depth
+              );
+            if (NT_SUCCESS(status))
+              return status;
+          }
+      }
+    DBG("Couldn't open parent .VHD!\n");
+    return status;
+  }
+
+/**
+ * Try to open a differencing .VHD's parent, using one of its locators.
+ *
+ * @v vhd               The differencing .VHD.
+ * @v path              The path it was opened with.
+ * @v code              The locator's platform code.
+ * @v length            The length of the locator's path, in bytes.
+ * @v offset            Where the locator's path is in the file.
+ * @v depth             How many children the differencing .VHD has.
+ * @ret NTSTATUS        The status of the operation.
+ */
+static NTSTATUS STDCALL WvFilediskVhdTryParent_(
+    IN OUT WV_SP_FILEDISK_VHD vhd,
+    IN PUNICODE_STRING path,
+    IN UINT32 code,
+    IN UINT32 length,
+    IN ULONGLONG offset,
+    IN UINT32 depth
+  ) {
+    static const WCHAR obj_path_prefix[] = L"\\??\\";
+    UINT32 data_size;
+    PWCHAR data, name;
+    USHORT name_len, dir_len;
+    UNICODE_STRING parent_path;
+    OBJECT_ATTRIBUTES obj_attrs;
+    IO_STATUS_BLOCK io_status;
+    HANDLE file;
+    WV_SP_FILEDISK_VHD parent;
+    NTSTATUS status;
+
+    /* Read the locator's path. */
+    if (length > WV_M_FILEDISK_VHD_MAX_LOCATOR_) {
+        status = STATUS_NAME_TOO_LONG;
+        goto err_data;
+      }
+    data_size =
+      (length + WV_M_VHDMAP_SECTOR - 1) & ~(WV_M_VHDMAP_SECTOR - 1);
+    data = wv_malloc(data_size);
+    if (!data) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_data;
+      }
+    status = WvFilediskVhdRw_(vhd->File, FALSE, offset, data_size, data);
+    if (!NT_SUCCESS(status))
+      goto err_read;
+    name = data;
+    name_len = (USHORT) length;
+    while (name_len >= sizeof *name && !name[name_len / sizeof *name - 1])
+      name_len -= sizeof *name;
+
+    /* Build an object path from it. */
+    if (code == WV_M_MSVHD_LOCATOR_W2RU) {
+        /* Relative to the child's directory. */
+        if (
+            name_len >= 2 * sizeof *name &&
+            name[0] == L'.' &&
+            name[1] == L'\\'
+          ) {
+            name += 2;
+            name_len -= 2 * sizeof *name;
+          }
+        dir_len = path->Length;
+        while (dir_len && path->Buffer[dir_len / sizeof (WCHAR) - 1] != L'\\')
+          dir_len -= sizeof (WCHAR);
+      } else {
+        dir_len = 0;
+      }
+    parent_path.MaximumLength = dir_len + sizeof obj_path_prefix + name_len;
+    parent_path.Buffer = wv_malloc(parent_path.MaximumLength);
+    if (!parent_path.Buffer) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_path;
+      }
+    if (dir_len) {
+        RtlCopyMemory(parent_path.Buffer, path->Buffer, dir_len);
+        parent_path.Length = dir_len;
+      } else {
+        parent_path.Length = sizeof obj_path_prefix - sizeof (WCHAR);
+        RtlCopyMemory(parent_path.Buffer, obj_path_prefix, parent_path.Length);
+      }
+    RtlCopyMemory(
+        (PUCHAR) parent_path.Buffer + parent_path.Length,
+        name,
+        name_len
+      );
+    parent_path.Length += name_len;
+    DBG("Trying parent: %wZ\n", &parent_path);
+
+    /* Open it.  Parents are never written to. */
+    InitializeObjectAttributes(
+        &obj_attrs,
+        &parent_path,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+        NULL,
+        NULL
+      );
+    status = ZwCreateFile(
+        &file,
+        GENERIC_READ,
+        &obj_attrs,
+        &io_status,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        FILE_OPEN,
+        FILE_NON_DIRECTORY_FILE |
+          FILE_RANDOM_ACCESS |
+          FILE_NO_INTERMEDIATE_BUFFERING,
+        NULL,
+        0
+      );
+    if (!NT_SUCCESS(status))
+      goto err_open;
+
+    status = WvFilediskVhdLoad_(file, &parent_path, depth + 1, &parent);
+    if (!NT_SUCCESS(status))
+      goto err_load;
+
+    /* Check that it's the parent we were made from. */
+    if (WvVhdMapSetParent(vhd, parent) < 0) {
+        DBG("Parent doesn't match!\n");
+        status = STATUS_OBJECT_NAME_NOT_FOUND;
+        goto err_match;
+      }
+
+    wv_free(parent_path.Buffer);
+    wv_free(data);
+    return STATUS_SUCCESS;
+
+    err_match:
+
+    WvFilediskVhdFree_(parent);
+    err_load:
+
+    ZwClose(file);
+    err_open:
+
+    wv_free(parent_path.Buffer);
+    err_path:
+
+    err_read:
+
+    wv_free(data);
+    err_data:
+
+    return status;
+  }
+
+/**
+ * Free a .VHD and its parents.
+ *
+ * @v vhd               The .VHD.
+ *
+ * The parents' files are closed.  The .VHD's own file is the caller's.
+ */
+static VOID STDCALL WvFilediskVhdFree_(IN WV_SP_FILEDISK_VHD vhd) {
+    WV_SP_FILEDISK_VHD parent;
+
+    for (parent = vhd->Parent; parent; parent = parent->Parent)
+      ZwClose(parent->File);
+    WvVhdMapFree(vhd);
+    return;
+  }
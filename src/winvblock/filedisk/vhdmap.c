@@ -0,0 +1,620 @@
+/**
+ * Copyright (C) 2009-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Dynamic and differencing .VHD block mapping.
+ *
+ * A dynamic .VHD only holds the blocks of the disk which have been
+ * written, in whatever order they were first written.  Its block
+ * allocation table (BAT) gives the file offset of each block, and is
+ * kept in memory.  Each block in the file is preceded by a bitmap with
+ * a bit for each sector.  A differencing .VHD is the same, except that
+ * sectors whose bits are clear, and blocks which aren't in the file,
+ * are read from a parent .VHD instead.  Differencing bitmaps are read
+ * into memory as they're first needed.
+ *
+ * A block is added to the file when it's first written, at the end of
+ * the file, and the footer is moved after it.  The file system gives us
+ * zeroes for the block's data until it's written.
+ *
+ * Nothing here takes a lock; the caller serializes I/O to a .VHD.
+ */
+
+#include <string.h>
+
+#include "wv_stdlib.h"
+#include "vhdmap.h"
+
+/* .VHD disk types, as in msvhd.h. */
+#define WV_M_VHDMAP_TYPE_FIXED_ 2
+#define WV_M_VHDMAP_TYPE_DYNAMIC_ 3
+#define WV_M_VHDMAP_TYPE_DIFF_ 4
+
+/* A BAT entry for a block which isn't in the file. */
+#define WV_M_VHDMAP_BAT_UNUSED_ 0xFFFFFFFF
+
+/* Field offsets in the footer and dynamic header, as in msvhd.h. */
+#define WV_M_VHDMAP_FOOTER_SIZE_ 512
+#define WV_M_VHDMAP_FOOTER_DATA_OFFSET_ 16
+#define WV_M_VHDMAP_FOOTER_CUR_SIZE_ 48
+#define WV_M_VHDMAP_FOOTER_TYPE_ 60
+#define WV_M_VHDMAP_FOOTER_UID_ 68
+#define WV_M_VHDMAP_HEADER_SIZE_ 1024
+#define WV_M_VHDMAP_HEADER_TABLE_OFFSET_ 16
+#define WV_M_VHDMAP_HEADER_MAX_ENTRIES_ 28
+#define WV_M_VHDMAP_HEADER_BLOCK_SIZE_ 32
+#define WV_M_VHDMAP_HEADER_PARENT_UID_ 40
+#define WV_M_VHDMAP_HEADER_LOCATORS_ 576
+#define WV_M_VHDMAP_LOCATORS_ 8
+#define WV_M_VHDMAP_LOCATOR_SIZE_ 24
+#define WV_M_VHDMAP_LOCATOR_LEN_ 8
+#define WV_M_VHDMAP_LOCATOR_OFFSET_ 16
+
+/** Private function declarations. */
+static unsigned int WvVhdMapBe32_(const unsigned char *);
+static unsigned long long WvVhdMapBe64_(const unsigned char *);
+static int WvVhdMapTestBit_(const unsigned char *, unsigned int);
+static long WvVhdMapBitmap_(WV_SP_VHDMAP, unsigned int, unsigned char **);
+static long WvVhdMapAllocate_(WV_SP_VHDMAP, unsigned int);
+
+/** Function definitions. */
+
+/**
+ * Read a .VHD's footer and, if it's dynamic or differencing, its BAT.
+ *
+ * @v rw                The I/O routine for the file.
+ * @v file              The open .VHD file, for the I/O routine.
+ * @v file_size         The size of the file, in bytes.
+ * @v map_out           Filled with the mapping, or NULL if the file
+ *                      isn't a .VHD.
+ * @ret long            0, or an error.
+ *
+ * A differencing .VHD's parent must then be given with
+ * WvVhdMapSetParent before the mapping is used.
+ */
+long WvVhdMapLoad(
+    WV_FP_VHDMAP_RW rw,
+    void * file,
+    unsigned long long file_size,
+    WV_SP_VHDMAP * map_out
+  ) {
+    WV_SP_VHDMAP map;
+    unsigned char * header;
+    unsigned int i;
+    long status;
+
+    *map_out = NULL;
+    if (file_size < WV_M_VHDMAP_FOOTER_SIZE_)
+      return 0;
+
+    map = wv_mallocz(sizeof *map);
+    if (!map) {
+        status = WV_M_VHDMAP_E_NOMEM;
+        goto err_map;
+      }
+    map->File = file;
+    map->Rw = rw;
+
+    /* Read the footer, and keep it as-is for moving it later. */
+    map->Footer = wv_malloc(WV_M_VHDMAP_FOOTER_SIZE_);
+    if (!map->Footer) {
+        status = WV_M_VHDMAP_E_NOMEM;
+        goto err_load;
+      }
+    map->FooterOffset = file_size - WV_M_VHDMAP_FOOTER_SIZE_;
+    status = rw(
+        file,
+        0,
+        map->FooterOffset,
+        WV_M_VHDMAP_FOOTER_SIZE_,
+        map->Footer
+      );
+    if (status < 0)
+      goto err_load;
+    if (memcmp(map->Footer, "conectix", 8)) {
+        /* Not a .VHD. */
+        status = 0;
+        goto err_load;
+      }
+    map->Type = WvVhdMapBe32_(map->Footer + WV_M_VHDMAP_FOOTER_TYPE_);
+    map->Sectors = WvVhdMapBe64_(map->Footer + WV_M_VHDMAP_FOOTER_CUR_SIZE_) /
+      WV_M_VHDMAP_SECTOR;
+    memcpy(map->Uid, map->Footer + WV_M_VHDMAP_FOOTER_UID_, sizeof map->Uid);
+    if (map->Type == WV_M_VHDMAP_TYPE_FIXED_) {
+        *map_out = map;
+        return 0;
+      }
+    if (
+        map->Type != WV_M_VHDMAP_TYPE_DYNAMIC_ &&
+        map->Type != WV_M_VHDMAP_TYPE_DIFF_
+      ) {
+        status = WV_M_VHDMAP_E_TYPE;
+        goto err_load;
+      }
+
+    /* Read the dynamic header. */
+    header = map->Header = wv_malloc(WV_M_VHDMAP_HEADER_SIZE_);
+    if (!header) {
+        status = WV_M_VHDMAP_E_NOMEM;
+        goto err_load;
+      }
+    status = rw(
+        file,
+        0,
+        WvVhdMapBe64_(map->Footer + WV_M_VHDMAP_FOOTER_DATA_OFFSET_),
+        WV_M_VHDMAP_HEADER_SIZE_,
+        header
+      );
+    if (status < 0)
+      goto err_load;
+    i = WvVhdMapBe32_(header + WV_M_VHDMAP_HEADER_BLOCK_SIZE_);
+    map->BlockSectors = i / WV_M_VHDMAP_SECTOR;
+    map->BatEntries = WvVhdMapBe32_(header + WV_M_VHDMAP_HEADER_MAX_ENTRIES_);
+    if (
+        memcmp(header, "cxsparse", 8) ||
+        !map->BlockSectors ||
+        i % WV_M_VHDMAP_SECTOR ||
+        (unsigned long long) map->BatEntries * map->BlockSectors <
+          map->Sectors ||
+        map->BatEntries > (unsigned int) -1 / sizeof *map->Bat
+      ) {
+        status = WV_M_VHDMAP_E_FORMAT;
+        goto err_load;
+      }
+    map->BitmapSize =
+      (map->BlockSectors / 8 + WV_M_VHDMAP_SECTOR - 1) &
+      ~(WV_M_VHDMAP_SECTOR - 1);
+
+    /* Read the BAT. */
+    map->BatOffset = WvVhdMapBe64_(header + WV_M_VHDMAP_HEADER_TABLE_OFFSET_);
+    map->BatSectors =
+      (map->BatEntries * sizeof *map->Bat + WV_M_VHDMAP_SECTOR - 1) /
+      WV_M_VHDMAP_SECTOR;
+    map->Bat = wv_malloc(map->BatSectors * WV_M_VHDMAP_SECTOR);
+    if (!map->Bat) {
+        status = WV_M_VHDMAP_E_NOMEM;
+        goto err_load;
+      }
+    status = rw(
+        file,
+        0,
+        map->BatOffset,
+        map->BatSectors * WV_M_VHDMAP_SECTOR,
+        map->Bat
+      );
+    if (status < 0)
+      goto err_load;
+    for (i = 0; i < map->BatSectors * WV_M_VHDMAP_SECTOR / 4; i++)
+      map->Bat[i] = WvVhdMapBe32_((unsigned char *) (map->Bat + i));
+
+    if (map->Type == WV_M_VHDMAP_TYPE_DIFF_) {
+        map->Bitmaps = wv_mallocz(map->BatEntries * sizeof *map->Bitmaps);
+        if (!map->Bitmaps) {
+            status = WV_M_VHDMAP_E_NOMEM;
+            goto err_load;
+          }
+      }
+
+    *map_out = map;
+    return 0;
+
+    err_load:
+
+    WvVhdMapFree(map);
+    err_map:
+
+    return status;
+  }
+
+/**
+ * Free a .VHD's mapping, and its parents'.
+ *
+ * @v map               The mapping.  The files are the caller's to close.
+ */
+void WvVhdMapFree(WV_SP_VHDMAP map) {
+    unsigned int i;
+
+    if (map->Parent)
+      WvVhdMapFree(map->Parent);
+    if (map->Bitmaps) {
+        for (i = 0; i < map->BatEntries; i++)
+          wv_free(map->Bitmaps[i]);
+        wv_free(map->Bitmaps);
+      }
+    wv_free(map->Bat);
+    wv_free(map->Header);
+    wv_free(map->Footer);
+    wv_free(map);
+  }
+
+/**
+ * Fetch one of a differencing .VHD's parent locators.
+ *
+ * @v map               The differencing .VHD's mapping.
+ * @v index             Which locator.
+ * @v code              Filled with the locator's platform code.
+ * @v length            Filled with the length of the locator's data.
+ * @v offset            Filled with the offset of the data in the file.
+ * @ret int             1 if there's such a locator, else 0.
+ */
+int WvVhdMapLocator(
+    WV_SP_VHDMAP map,
+    unsigned int index,
+    unsigned int * code,
+    unsigned int * length,
+    unsigned long long * offset
+  ) {
+    const unsigned char * locator;
+
+    if (map->Type != WV_M_VHDMAP_TYPE_DIFF_ || index >= WV_M_VHDMAP_LOCATORS_)
+      return 0;
+    locator = map->Header +
+      WV_M_VHDMAP_HEADER_LOCATORS_ +
+      index * WV_M_VHDMAP_LOCATOR_SIZE_;
+    *code = WvVhdMapBe32_(locator);
+    *length = WvVhdMapBe32_(locator + WV_M_VHDMAP_LOCATOR_LEN_);
+    *offset = WvVhdMapBe64_(locator + WV_M_VHDMAP_LOCATOR_OFFSET_);
+    return 1;
+  }
+
+/**
+ * Give a differencing .VHD its parent.
+ *
+ * @v map               The differencing .VHD's mapping.
+ * @v parent            The parent's mapping, which map then owns.
+ * @ret long            0, or WV_M_VHDMAP_E_FORMAT if it isn't the
+ *                      parent map was made from.  Then it's not owned.
+ */
+long WvVhdMapSetParent(WV_SP_VHDMAP map, WV_SP_VHDMAP parent) {
+    if (
+        memcmp(
+            parent->Uid,
+            map->Header + WV_M_VHDMAP_HEADER_PARENT_UID_,
+            sizeof parent->Uid
+          ) ||
+        parent->Sectors < map->Sectors
+      )
+      return WV_M_VHDMAP_E_FORMAT;
+    map->Parent = parent;
+    return 0;
+  }
+
+/**
+ * Read from a .VHD, and any parents.
+ *
+ * @v map               The .VHD's mapping.
+ * @v sector            The first .VHD sector.
+ * @v count             The number of .VHD sectors.
+ * @v buffer            Filled with the data.
+ * @ret long            0, or an error.
+ */
+long WvVhdMapRead(
+    WV_SP_VHDMAP map,
+    unsigned long long sector,
+    unsigned int count,
+    unsigned char * buffer
+  ) {
+    unsigned int block, within, chunk, i, j;
+    unsigned long long data;
+    unsigned char * bitmap = NULL;
+    int present;
+    long status = 0;
+
+    if (sector > map->Sectors || count > map->Sectors - sector)
+      return WV_M_VHDMAP_E_RANGE;
+    if (map->Type == WV_M_VHDMAP_TYPE_FIXED_) {
+        status = map->Rw(
+            map->File,
+            0,
+            sector * WV_M_VHDMAP_SECTOR,
+            count * WV_M_VHDMAP_SECTOR,
+            buffer
+          );
+        return status < 0 ? status : 0;
+      }
+
+    while (count) {
+        block = (unsigned int) (sector / map->BlockSectors);
+        within = (unsigned int) (sector % map->BlockSectors);
+        chunk = map->BlockSectors - within;
+        if (chunk > count)
+          chunk = count;
+
+        if (map->Bat[block] == WV_M_VHDMAP_BAT_UNUSED_) {
+            /* Not in the file. */
+            if (map->Parent) {
+                status = WvVhdMapRead(map->Parent, sector, chunk, buffer);
+              } else {
+                memset(buffer, 0, chunk * WV_M_VHDMAP_SECTOR);
+              }
+          } else {
+            data =
+              (unsigned long long) map->Bat[block] * WV_M_VHDMAP_SECTOR +
+              map->BitmapSize;
+            if (map->Parent)
+              status = WvVhdMapBitmap_(map, block, &bitmap);
+            /* Read runs of sectors from the file or the parent. */
+            for (i = within; status >= 0 && i < within + chunk; i = j) {
+                present = !map->Parent || WvVhdMapTestBit_(bitmap, i);
+                for (j = i + 1; j < within + chunk; j++) {
+                    if (map->Parent && WvVhdMapTestBit_(bitmap, j) != present)
+                      break;
+                  }
+                if (present) {
+                    status = map->Rw(
+                        map->File,
+                        0,
+                        data + (unsigned long long) i * WV_M_VHDMAP_SECTOR,
+                        (j - i) * WV_M_VHDMAP_SECTOR,
+                        buffer + (i - within) * WV_M_VHDMAP_SECTOR
+                      );
+                  } else {
+                    status = WvVhdMapRead(
+                        map->Parent,
+                        sector + i - within,
+                        j - i,
+                        buffer + (i - within) * WV_M_VHDMAP_SECTOR
+                      );
+                  }
+              }
+          }
+        if (status < 0)
+          return status;
+
+        sector += chunk;
+        count -= chunk;
+        buffer += chunk * WV_M_VHDMAP_SECTOR;
+      }
+    return 0;
+  }
+
+/**
+ * Write to a dynamic or differencing .VHD.
+ *
+ * @v map               The .VHD's mapping.
+ * @v sector            The first .VHD sector.
+ * @v count             The number of .VHD sectors.
+ * @v buffer            The data.
+ * @ret long            0, or an error.
+ */
+long WvVhdMapWrite(
+    WV_SP_VHDMAP map,
+    unsigned long long sector,
+    unsigned int count,
+    const unsigned char * buffer
+  ) {
+    unsigned int block, within, chunk, i;
+    unsigned char * bitmap;
+    int changed;
+    long status;
+
+    if (sector > map->Sectors || count > map->Sectors - sector)
+      return WV_M_VHDMAP_E_RANGE;
+    if (map->Type == WV_M_VHDMAP_TYPE_FIXED_)
+      return WV_M_VHDMAP_E_TYPE;
+
+    while (count) {
+        block = (unsigned int) (sector / map->BlockSectors);
+        within = (unsigned int) (sector % map->BlockSectors);
+        chunk = map->BlockSectors - within;
+        if (chunk > count)
+          chunk = count;
+
+        if (map->Bat[block] == WV_M_VHDMAP_BAT_UNUSED_) {
+            status = WvVhdMapAllocate_(map, block);
+            if (status < 0)
+              return status;
+          }
+        status = map->Rw(
+            map->File,
+            1,
+            (unsigned long long) map->Bat[block] * WV_M_VHDMAP_SECTOR +
+              map->BitmapSize +
+              (unsigned long long) within * WV_M_VHDMAP_SECTOR,
+            chunk * WV_M_VHDMAP_SECTOR,
+            (void *) buffer
+          );
+        if (status < 0)
+          return status;
+
+        /* A differencing .VHD's sectors are now in the file. */
+        if (map->Parent) {
+            status = WvVhdMapBitmap_(map, block, &bitmap);
+            if (status < 0)
+              return status;
+            changed = 0;
+            for (i = within; i < within + chunk; i++) {
+                if (WvVhdMapTestBit_(bitmap, i))
+                  continue;
+                bitmap[i / 8] |= 0x80 >> (i % 8);
+                changed = 1;
+              }
+            if (changed) {
+                status = map->Rw(
+                    map->File,
+                    1,
+                    (unsigned long long) map->Bat[block] * WV_M_VHDMAP_SECTOR,
+                    map->BitmapSize,
+                    bitmap
+                  );
+                if (status < 0)
+                  return status;
+              }
+          }
+
+        sector += chunk;
+        count -= chunk;
+        buffer += chunk * WV_M_VHDMAP_SECTOR;
+      }
+    return 0;
+  }
+
+/** Private function definitions. */
+
+/* Read a big-endian 32-bit value. */
+static unsigned int WvVhdMapBe32_(const unsigned char * bytes) {
+    return
+      ((unsigned int) bytes[0] << 24) |
+      ((unsigned int) bytes[1] << 16) |
+      ((unsigned int) bytes[2] << 8) |
+      bytes[3];
+  }
+
+/* Read a big-endian 64-bit value. */
+static unsigned long long WvVhdMapBe64_(const unsigned char * bytes) {
+    return
+      ((unsigned long long) WvVhdMapBe32_(bytes) << 32) |
+      WvVhdMapBe32_(bytes + 4);
+  }
+
+/* Check whether a sector's bit is set in a block's bitmap. */
+static int WvVhdMapTestBit_(
+    const unsigned char * bitmap,
+    unsigned int sector
+  ) {
+    return (bitmap[sector / 8] & (0x80 >> (sector % 8))) ? 1 : 0;
+  }
+
+/* Fetch a differencing .VHD block's bitmap, reading it if needed. */
+static long WvVhdMapBitmap_(
+    WV_SP_VHDMAP map,
+    unsigned int block,
+    unsigned char ** bitmap
+  ) {
+    long status;
+
+    if (map->Bitmaps[block]) {
+        *bitmap = map->Bitmaps[block];
+        return 0;
+      }
+    *bitmap = wv_malloc(map->BitmapSize);
+    if (!*bitmap)
+      return WV_M_VHDMAP_E_NOMEM;
+    status = map->Rw(
+        map->File,
+        0,
+        (unsigned long long) map->Bat[block] * WV_M_VHDMAP_SECTOR,
+        map->BitmapSize,
+        *bitmap
+      );
+    if (status < 0) {
+        wv_free(*bitmap);
+        return status;
+      }
+    map->Bitmaps[block] = *bitmap;
+    return 0;
+  }
+
+/**
+ * Add a block to the end of a .VHD file.
+ *
+ * @v map               The dynamic or differencing .VHD's mapping.
+ * @v block             The block which isn't yet in the file.
+ * @ret long            0, or an error.
+ *
+ * The footer is written after the new block first, which extends the
+ * file and leaves the block's data as zeroes.  The block's bitmap
+ * replaces the old footer, then the block's BAT entry is written.
+ */
+static long WvVhdMapAllocate_(WV_SP_VHDMAP map, unsigned int block) {
+    unsigned long long offset = map->FooterOffset;
+    unsigned long long size;
+    unsigned int per_sector = WV_M_VHDMAP_SECTOR / sizeof *map->Bat;
+    unsigned int bat_sector = block / per_sector;
+    unsigned char * bitmap;
+    unsigned char * bat;
+    unsigned int i, entry;
+    long status;
+
+    /* Move the footer. */
+    size = map->BitmapSize +
+      (unsigned long long) map->BlockSectors * WV_M_VHDMAP_SECTOR;
+    status = map->Rw(
+        map->File,
+        1,
+        offset + size,
+        WV_M_VHDMAP_FOOTER_SIZE_,
+        map->Footer
+      );
+    if (status < 0)
+      goto err_footer;
+    map->FooterOffset += size;
+
+    /*
+     * Write the bitmap.  A dynamic .VHD's zeroed block is all present,
+     * but a differencing .VHD's block is all in the parent until written.
+     */
+    bitmap = wv_malloc(map->BitmapSize);
+    if (!bitmap) {
+        status = WV_M_VHDMAP_E_NOMEM;
+        goto err_bitmap;
+      }
+    memset(bitmap, map->Parent ? 0 : 0xFF, map->BitmapSize);
+    status = map->Rw(map->File, 1, offset, map->BitmapSize, bitmap);
+    if (status < 0)
+      goto err_bitmap_write;
+
+    /* Write the BAT sector with the new entry. */
+    bat = wv_malloc(WV_M_VHDMAP_SECTOR);
+    if (!bat) {
+        status = WV_M_VHDMAP_E_NOMEM;
+        goto err_bat;
+      }
+    map->Bat[block] = (unsigned int) (offset / WV_M_VHDMAP_SECTOR);
+    for (i = 0; i < per_sector; i++) {
+        entry = map->Bat[bat_sector * per_sector + i];
+        bat[i * 4] = (unsigned char) (entry >> 24);
+        bat[i * 4 + 1] = (unsigned char) (entry >> 16);
+        bat[i * 4 + 2] = (unsigned char) (entry >> 8);
+        bat[i * 4 + 3] = (unsigned char) entry;
+      }
+    status = map->Rw(
+        map->File,
+        1,
+        map->BatOffset + bat_sector * WV_M_VHDMAP_SECTOR,
+        WV_M_VHDMAP_SECTOR,
+        bat
+      );
+    wv_free(bat);
+    if (status < 0) {
+        map->Bat[block] = WV_M_VHDMAP_BAT_UNUSED_;
+        goto err_bat;
+      }
+
+    if (map->Bitmaps) {
+        map->Bitmaps[block] = bitmap;
+      } else {
+        wv_free(bitmap);
+      }
+    return 0;
+
+    err_bat:
+
+    err_bitmap_write:
+
+    wv_free(bitmap);
+    err_bitmap:
+
+    /* The space stays in the file, unused. */
+    err_footer:
+
+    return status;
+  }
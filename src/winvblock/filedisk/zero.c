@@ -0,0 +1,160 @@
+/**
+ * Copyright (C) 2009-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * File-backed disk zeroing, by releasing ranges of sparse files.
+ */
+
+#include <ntifs.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "debug.h"
+
+/** Private function declarations. */
+static NTSTATUS STDCALL WvFilediskFsctl_(
+    IN HANDLE,
+    IN HANDLE,
+    IN ULONG,
+    IN PVOID,
+    IN ULONG
+  );
+
+/** Exported function definitions. */
+
+/**
+ * Check whether a file is sparse, so zeroed ranges can be released.
+ *
+ * @v File              The file.
+ * @v Event             Filled with an event for WvFilediskZero, if the
+ *                      file is sparse.  The caller closes it.
+ * @ret BOOLEAN         TRUE if the file is sparse, else FALSE.
+ *
+ * A file which isn't sparse is left alone: it might have been made
+ * fully allocated on purpose.  Called at PASSIVE_LEVEL.
+ */
+BOOLEAN STDCALL WvFilediskCanZero(IN HANDLE File, OUT PHANDLE Event) {
+    FILE_BASIC_INFORMATION info;
+    OBJECT_ATTRIBUTES obj_attrs;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+
+    status = ZwQueryInformationFile(
+        File,
+        &io_status,
+        &info,
+        sizeof info,
+        FileBasicInformation
+      );
+    if (
+        !NT_SUCCESS(status) ||
+        !(info.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)
+      )
+      return FALSE;
+
+    /* The file is open for asynchronous I/O, so we wait on an event. */
+    InitializeObjectAttributes(
+        &obj_attrs,
+        NULL,
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        NULL
+      );
+    status = ZwCreateEvent(
+        Event,
+        EVENT_ALL_ACCESS,
+        &obj_attrs,
+        NotificationEvent,
+        FALSE
+      );
+    if (!NT_SUCCESS(status)) {
+        DBG("Couldn't create event: %08x\n", status);
+        return FALSE;
+      }
+    return TRUE;
+  }
+
+/**
+ * Zero a range of a sparse file, releasing whatever backs it.
+ *
+ * @v File              The file.
+ * @v Event             The event from WvFilediskCanZero.
+ * @v Offset            Where the range starts, in bytes.
+ * @v Length            The length of the range, in bytes.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The caller must make sure that only one range is zeroed at a time
+ * with the event.  Called at PASSIVE_LEVEL.
+ */
+NTSTATUS STDCALL WvFilediskZero(
+    IN HANDLE File,
+    IN HANDLE Event,
+    IN LONGLONG Offset,
+    IN LONGLONG Length
+  ) {
+    FILE_ZERO_DATA_INFORMATION zero;
+    NTSTATUS status;
+
+    zero.FileOffset.QuadPart = Offset;
+    zero.BeyondFinalZero.QuadPart = Offset + Length;
+    status = WvFilediskFsctl_(
+        File,
+        Event,
+        FSCTL_SET_ZERO_DATA,
+        &zero,
+        sizeof zero
+      );
+    if (!NT_SUCCESS(status))
+      DBG("Couldn't zero file range: %08x\n", status);
+    return status;
+  }
+
+/** Private function definitions. */
+
+/* Send a file system control, and wait for it. */
+static NTSTATUS STDCALL WvFilediskFsctl_(
+    IN HANDLE file,
+    IN HANDLE event,
+    IN ULONG code,
+    IN PVOID input,
+    IN ULONG input_len
+  ) {
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+
+    status = ZwFsControlFile(
+        file,
+        event,
+        NULL,
+        NULL,
+        &io_status,
+        code,
+        input,
+        input_len,
+        NULL,
+        0
+      );
+    if (status == STATUS_PENDING) {
+        ZwWaitForSingleObject(event, FALSE, NULL);
+        status = io_status.Status;
+      }
+    return status;
+  }
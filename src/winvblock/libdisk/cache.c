@@ -0,0 +1,1259 @@
+/**
+ * Copyright (C) 2009-2011, Shao Miller <shao.miller@yrdsb.edu.on.ca>.
+ * Copyright 2006-2008, V.
+ * For WinAoE contact information, see http://winaoe.org/
+ *
+ * This file is part of WinVBlock, derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Disk block cache.
+ *
+ * A cache sits between WvlDiskIo and a disk's I/O routine and keeps
+ * recently used, sector-aligned blocks of the disk in RAM.  Blocks are
+ * found by a hash of their index and replaced with the CLOCK policy:
+ * each hit sets a block's reference bit and the clock hand clears it,
+ * so a block is only replaced after a full sweep without a hit.
+ *
+ * Reads which miss are sent to the disk extended to whole blocks, so
+ * that the blocks they touch can be kept.  Writes update any cached
+ * blocks.  In write-through mode they are then sent to the disk; in
+ * write-back mode, they are kept as dirty blocks, which are written
+ * to the disk when half of the cache is dirty, when the disk is
+ * flushed and when the disk is removed.
+ *
+ * For a disk which reads ahead, sequential reads are noted with the
+ * disk's stream detector, and what it asks for is read into the cache.
+ * Blocks read ahead get one sweep of the clock hand, like any newly
+ * read block; without it, once every other block has been hit, the
+ * hand would replace them before their reader got to them.  Each block
+ * read ahead and replaced without a hit shrinks the read-ahead, and a
+ * stream may only read ahead a share of the cache.
+ */
+
+#include <ntddk.h>
+#include <scsi.h>
+#include <srb.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "irp.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "mount.h"
+#include "copy.h"
+#include "readahead.h"
+#include "debug.h"
+
+/*** Macros */
+
+/* The block holds data for its index. */
+#define WVL_M_DISK_CACHE_VALID_ 0x01
+/* The block has been used since the clock hand last passed it. */
+#define WVL_M_DISK_CACHE_REF_ 0x02
+/* The block holds data which the disk doesn't. */
+#define WVL_M_DISK_CACHE_DIRTY_ 0x04
+/* The block's data is being written to the disk. */
+#define WVL_M_DISK_CACHE_FLUSHING_ 0x08
+/* The block was read ahead, and hasn't been used yet. */
+#define WVL_M_DISK_CACHE_AHEAD_ 0x10
+
+/* Limits on the block size, in bytes. */
+#define WVL_M_DISK_CACHE_BLOCK_MIN_ (4 * 1024)
+#define WVL_M_DISK_CACHE_BLOCK_MAX_ (64 * 1024)
+/* A limit on the number of blocks in a cache. */
+#define WVL_M_DISK_CACHE_BLOCKS_MAX_ (256 * 1024)
+/* A limit on the reads ahead in progress for a disk. */
+#define WVL_M_DISK_CACHE_AHEAD_IOS_ 2
+
+/*** Object types */
+
+typedef struct WVL_DISK_CACHE_BLOCK_ WVL_S_DISK_CACHE_BLOCK_,
+  * WVL_SP_DISK_CACHE_BLOCK_;
+
+struct WVL_DISK_CACHE_BLOCK_ {
+    /* The next block in the same hash bucket. */
+    WVL_SP_DISK_CACHE_BLOCK_ Next;
+    ULONGLONG Index;
+    /* Allocated when the block is first used. */
+    PUCHAR Data;
+    UCHAR Flags;
+    /*
+     * Fills in progress which began while the block was dirty or being
+     * flushed.  Their data for it is stale, so it mustn't be replaced.
+     */
+    UINT32 Pins;
+  };
+
+struct WVL_DISK_CACHE {
+    /* Protects everything below, and the blocks' contents. */
+    KSPIN_LOCK Lock;
+    UINT32 BlockSize;
+    UINT32 BlockSectors;
+    UINT32 BlockCount;
+    BOOLEAN WriteBack;
+    WVL_SP_DISK_CACHE_BLOCK_ Blocks;
+    WVL_SP_DISK_CACHE_BLOCK_ * Buckets;
+    UINT32 BucketMask;
+    /* The clock hand. */
+    UINT32 Hand;
+    UINT32 BlocksUsed;
+    UINT32 DirtyCount;
+    /*
+     * Bumped when a write or a flush begins and ends.  Blocks read while
+     * this changes, or while writes are in progress, aren't kept.
+     */
+    UINT32 Generation;
+    UINT32 Writes;
+    /* Counters. */
+    ULONGLONG Hits;
+    ULONGLONG Misses;
+    ULONGLONG Evictions;
+    ULONGLONG Flushes;
+    ULONGLONG AheadBlocks;
+    ULONGLONG AheadHits;
+    ULONGLONG AheadWasted;
+    /* The stream detector, if the disk reads ahead. */
+    WVL_SP_DISK_READAHEAD ReadAhead;
+    /* Reads ahead in progress. */
+    UINT32 AheadIos;
+    /* Our own IRPs at the disk, plus one until the cache is freed. */
+    LONG Outstanding;
+    KEVENT Idle;
+  };
+
+typedef enum WVL_DISK_CACHE_IO_KIND_ {
+    /* A read extended to whole blocks. */
+    WvlDiskCacheIoFill_,
+    /* A write sent on to the disk. */
+    WvlDiskCacheIoWrite_,
+    /* A dirty block written to the disk. */
+    WvlDiskCacheIoFlush_
+  } WVL_E_DISK_CACHE_IO_KIND_;
+
+/* A flush of all dirty blocks. */
+typedef struct WVL_DISK_CACHE_FLUSH_ {
+    /* Flush writes in progress, plus one until they have all started. */
+    LONG Pending;
+    NTSTATUS Status;
+    /* Optional.  Completed when the flush is done. */
+    PIRP Irp;
+    /* Optional.  Signalled when the flush is done. */
+    PKEVENT Event;
+  } WVL_S_DISK_CACHE_FLUSH_, * WVL_SP_DISK_CACHE_FLUSH_;
+
+/* One of our own IRPs at the disk. */
+typedef struct WVL_DISK_CACHE_IO_ {
+    WVL_E_DISK_CACHE_IO_KIND_ Kind;
+    WVL_SP_DISK_T Disk;
+    /* For a fill or a write, the original request.  None to read ahead. */
+    PIRP Irp;
+    PUCHAR Buffer;
+    LONGLONG StartSector;
+    UINT32 SectorCount;
+    /* For a fill, the whole blocks read. */
+    PUCHAR Bounce;
+    ULONGLONG FirstBlock;
+    ULONGLONG LastBlock;
+    BOOLEAN Keep;
+    UINT32 Generation;
+    /* Blocks which were dirty or being flushed when the fill began. */
+    WVL_SP_DISK_CACHE_BLOCK_ * Pinned;
+    UINT32 PinnedCount;
+    /* For a flush, the block and the flush it's a part of. */
+    WVL_SP_DISK_CACHE_BLOCK_ Block;
+    WVL_SP_DISK_CACHE_FLUSH_ Flush;
+    SCSI_REQUEST_BLOCK Srb;
+  } WVL_S_DISK_CACHE_IO_, * WVL_SP_DISK_CACHE_IO_;
+
+/*** Function declarations */
+IO_COMPLETION_ROUTINE WvlDiskCacheIoDone;
+WVL_F_DISK_IO WvlDiskCacheIo;
+VOID STDCALL WvlDiskCacheUnmap(IN WVL_SP_DISK_T, IN LONGLONG, IN ULONGLONG);
+VOID STDCALL WvlDiskCacheStats(IN WVL_SP_DISK_T, OUT WV_SP_CACHE_STATS);
+
+/* From scsi.c */
+extern PIRP STDCALL WvlDiskScsiSubIrp(
+    IN WVL_SP_DISK_T,
+    IN WVL_E_DISK_IO_MODE,
+    IN LONGLONG,
+    IN UINT32,
+    IN PUCHAR,
+    IN PIRP,
+    IN PSCSI_REQUEST_BLOCK,
+    IN PIO_COMPLETION_ROUTINE,
+    IN PVOID
+  );
+extern VOID STDCALL WvlDiskScsiSubIrpFree(IN PIRP);
+
+/*** Exports */
+
+/* The memory for each disk's cache, in megabytes.  0 disables caching. */
+WVL_M_LIB UINT32 WvlDiskCacheSize = 0;
+/* The cache block size, in bytes. */
+WVL_M_LIB UINT32 WvlDiskCacheBlockSize = 32 * 1024;
+/* Keep writes in the cache until it's flushed? */
+WVL_M_LIB BOOLEAN WvlDiskCacheWriteBack = FALSE;
+/* The most to read ahead of each stream, in kilobytes.  0 disables. */
+WVL_M_LIB UINT32 WvlDiskReadAheadMax = 1024;
+/* The cache for disks which read ahead but aren't otherwise cached, in MB. */
+WVL_M_LIB UINT32 WvlDiskReadAheadBuffer = 4;
+
+/*** Function definitions */
+
+/* Find a cached block.  The caller must hold the cache's lock. */
+static WVL_SP_DISK_CACHE_BLOCK_ WvlDiskCacheFind_(
+    IN WVL_SP_DISK_CACHE cache,
+    IN ULONGLONG index
+  ) {
+    WVL_SP_DISK_CACHE_BLOCK_ block;
+
+    block = cache->Buckets[(UINT32) index & cache->BucketMask];
+    while (block && block->Index != index)
+      block = block->Next;
+    return block;
+  }
+
+/* Remove a block from its hash bucket.  The caller must hold the lock. */
+static VOID WvlDiskCacheUnhash_(
+    IN WVL_SP_DISK_CACHE cache,
+    IN WVL_SP_DISK_CACHE_BLOCK_ block
+  ) {
+    WVL_SP_DISK_CACHE_BLOCK_ * link;
+
+    link = cache->Buckets + ((UINT32) block->Index & cache->BucketMask);
+    while (*link != block)
+      link = &(*link)->Next;
+    *link = block->Next;
+    block->Next = NULL;
+    return;
+  }
+
+/* Add a block to its hash bucket.  The caller must hold the lock. */
+static VOID WvlDiskCacheHash_(
+    IN WVL_SP_DISK_CACHE cache,
+    IN WVL_SP_DISK_CACHE_BLOCK_ block,
+    IN ULONGLONG index
+  ) {
+    WVL_SP_DISK_CACHE_BLOCK_ * link;
+
+    link = cache->Buckets + ((UINT32) index & cache->BucketMask);
+    block->Index = index;
+    block->Flags = WVL_M_DISK_CACHE_VALID_ | WVL_M_DISK_CACHE_REF_;
+    block->Next = *link;
+    *link = block;
+    return;
+  }
+
+/* Note a use of a cached block.  The caller must hold the lock. */
+static VOID WvlDiskCacheTouch_(
+    IN WVL_SP_DISK_CACHE cache,
+    IN WVL_SP_DISK_CACHE_BLOCK_ block
+  ) {
+    if (block->Flags & WVL_M_DISK_CACHE_AHEAD_) {
+        block->Flags &= ~WVL_M_DISK_CACHE_AHEAD_;
+        cache->AheadHits++;
+      }
+    block->Flags |= WVL_M_DISK_CACHE_REF_;
+    return;
+  }
+
+/**
+ * Find a block to replace, with the CLOCK policy.
+ *
+ * @v cache             The cache.
+ * @ret WVL_SP_DISK_CACHE_BLOCK_        An unused block, or NULL if no
+ *                                      block can be replaced.
+ *
+ * The caller must hold the cache's lock.  Dirty and pinned blocks aren't
+ * replaced.
+ */
+static WVL_SP_DISK_CACHE_BLOCK_ WvlDiskCacheVictim_(
+    IN WVL_SP_DISK_CACHE cache
+  ) {
+    WVL_SP_DISK_CACHE_BLOCK_ block;
+    UINT32 sweep;
+
+    for (sweep = cache->BlockCount * 2; sweep; sweep--) {
+        block = cache->Blocks + cache->Hand;
+        if (++cache->Hand == cache->BlockCount)
+          cache->Hand = 0;
+
+        if (!(block->Flags & WVL_M_DISK_CACHE_VALID_)) {
+            if (!block->Data) {
+                block->Data = wv_malloc(cache->BlockSize);
+                if (!block->Data)
+                  return NULL;
+                cache->BlocksUsed++;
+              }
+            return block;
+          }
+        if (
+            block->Pins ||
+            block->Flags & (
+                WVL_M_DISK_CACHE_DIRTY_ | WVL_M_DISK_CACHE_FLUSHING_
+              )
+          )
+          continue;
+        if (block->Flags & WVL_M_DISK_CACHE_REF_) {
+            block->Flags &= ~WVL_M_DISK_CACHE_REF_;
+            continue;
+          }
+        if (block->Flags & WVL_M_DISK_CACHE_AHEAD_) {
+            cache->AheadWasted++;
+            WvlDiskReadAheadWaste(cache->ReadAhead);
+          }
+        WvlDiskCacheUnhash_(cache, block);
+        block->Flags = 0;
+        cache->Evictions++;
+        return block;
+      }
+    return NULL;
+  }
+
+/**
+ * Find where a request and a block overlap.
+ *
+ * @v disk              The disk with the cache.
+ * @v index             The block's index.
+ * @v start_sector      The first sector of the request.
+ * @v sector_count      The number of sectors in the request.
+ * @v request_offset    Filled with the byte offset into the request.
+ * @v block_offset      Filled with the byte offset into the block.
+ * @ret UINT32          The number of bytes in both.
+ */
+static UINT32 WvlDiskCacheOverlap_(
+    IN WVL_SP_DISK_T disk,
+    IN ULONGLONG index,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    OUT UINT32 * request_offset,
+    OUT UINT32 * block_offset
+  ) {
+    ULONGLONG first = index * disk->Cache->BlockSectors;
+    ULONGLONG lo = start_sector, hi = start_sector + sector_count;
+
+    if (lo < first)
+      lo = first;
+    if (hi > first + disk->Cache->BlockSectors)
+      hi = first + disk->Cache->BlockSectors;
+    *request_offset = (UINT32) (lo - start_sector) * disk->SectorSize;
+    *block_offset = (UINT32) (lo - first) * disk->SectorSize;
+    return (UINT32) (hi - lo) * disk->SectorSize;
+  }
+
+/* Count one of our own IRPs at the disk. */
+static VOID WvlDiskCacheHold_(IN WVL_SP_DISK_CACHE cache) {
+    InterlockedIncrement(&cache->Outstanding);
+    return;
+  }
+
+/* Note that one of our own IRPs at the disk is done. */
+static VOID WvlDiskCacheRelease_(IN WVL_SP_DISK_CACHE cache) {
+    if (!InterlockedDecrement(&cache->Outstanding))
+      KeSetEvent(&cache->Idle, 0, FALSE);
+    return;
+  }
+
+/* Finish a flush, once its last write is done. */
+static VOID WvlDiskCacheFlushDone_(IN WVL_SP_DISK_CACHE_FLUSH_ flush) {
+    PIO_STACK_LOCATION io_stack_loc;
+
+    if (InterlockedDecrement(&flush->Pending))
+      return;
+    if (flush->Irp) {
+        if (!NT_SUCCESS(flush->Status)) {
+            io_stack_loc = IoGetCurrentIrpStackLocation(flush->Irp);
+            io_stack_loc->Parameters.Scsi.Srb->SrbStatus = SRB_STATUS_ERROR;
+          }
+        WvlIrpComplete(flush->Irp, 0, flush->Status);
+      }
+    if (flush->Event)
+      KeSetEvent(flush->Event, 0, FALSE);
+    wv_free(flush);
+    return;
+  }
+
+/**
+ * Write a disk's dirty cache blocks to the disk.
+ *
+ * @v disk              The disk.
+ * @v irp               Optional.  A SCSI IRP to complete when the dirty
+ *                      blocks have been written.
+ * @v event             Optional.  An event to signal when the dirty
+ *                      blocks have been written.
+ * @ret NTSTATUS        STATUS_PENDING if the IRP will be completed and
+ *                      the event will be signalled, else the status of
+ *                      the operation.
+ */
+static NTSTATUS WvlDiskCacheFlush_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp,
+    IN PKEVENT event
+  ) {
+    WVL_SP_DISK_CACHE cache = disk->Cache;
+    WVL_SP_DISK_CACHE_BLOCK_ block;
+    WVL_SP_DISK_CACHE_FLUSH_ flush;
+    WVL_SP_DISK_CACHE_IO_ io;
+    PIRP sub_irp;
+    KIRQL irql;
+    UINT32 i;
+
+    if (!cache || !cache->WriteBack || !cache->DirtyCount)
+      return STATUS_SUCCESS;
+
+    flush = wv_mallocz(sizeof *flush);
+    if (!flush) {
+        DBG("Couldn't flush cache!\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+      }
+    flush->Pending = 1;
+    flush->Status = STATUS_SUCCESS;
+    flush->Irp = irp;
+    flush->Event = event;
+    if (irp)
+      IoMarkIrpPending(irp);
+
+    io = NULL;
+    for (i = 0; i < cache->BlockCount; i++) {
+        block = cache->Blocks + i;
+        /* Snapshot the block, so it can be written to while flushing. */
+        if (!io) {
+            io = wv_mallocz(sizeof *io);
+            if (io)
+              io->Bounce = wv_malloc(cache->BlockSize);
+            if (!io || !io->Bounce) {
+                flush->Status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+              }
+          }
+        KeAcquireSpinLock(&cache->Lock, &irql);
+        if (
+            (block->Flags & (
+                WVL_M_DISK_CACHE_DIRTY_ | WVL_M_DISK_CACHE_FLUSHING_
+              )) != WVL_M_DISK_CACHE_DIRTY_
+          ) {
+            KeReleaseSpinLock(&cache->Lock, irql);
+            continue;
+          }
+        WvlCopyMemory(io->Bounce, block->Data, cache->BlockSize);
+        block->Flags &= ~WVL_M_DISK_CACHE_DIRTY_;
+        block->Flags |= WVL_M_DISK_CACHE_FLUSHING_;
+        cache->DirtyCount--;
+        io->StartSector = block->Index * cache->BlockSectors;
+        KeReleaseSpinLock(&cache->Lock, irql);
+
+        io->Kind = WvlDiskCacheIoFlush_;
+        io->Disk = disk;
+        io->Block = block;
+        io->Flush = flush;
+        io->SectorCount = cache->BlockSectors;
+        sub_irp = WvlDiskScsiSubIrp(
+            disk,
+            WvlDiskIoModeWrite,
+            io->StartSector,
+            io->SectorCount,
+            io->Bounce,
+            NULL,
+            &io->Srb,
+            WvlDiskCacheIoDone,
+            io
+          );
+        if (!sub_irp) {
+            /* Put the block back as it was. */
+            KeAcquireSpinLock(&cache->Lock, &irql);
+            block->Flags &= ~WVL_M_DISK_CACHE_FLUSHING_;
+            if (!(block->Flags & WVL_M_DISK_CACHE_DIRTY_)) {
+                block->Flags |= WVL_M_DISK_CACHE_DIRTY_;
+                cache->DirtyCount++;
+              }
+            KeReleaseSpinLock(&cache->Lock, irql);
+            flush->Status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+          }
+        InterlockedIncrement(&flush->Pending);
+        WvlDiskCacheHold_(cache);
+        disk->disk_ops.Io(
+            disk,
+            WvlDiskIoModeWrite,
+            io->StartSector,
+            io->SectorCount,
+            io->Bounce,
+            sub_irp
+          );
+        io = NULL;
+      }
+    if (io)
+      wv_free(io->Bounce);
+    wv_free(io);
+
+    WvlDiskCacheFlushDone_(flush);
+    return STATUS_PENDING;
+  }
+
+/* See the header for details. */
+WVL_M_LIB NTSTATUS STDCALL WvlDiskCacheFlush(
+    IN WVL_SP_DISK_T Disk,
+    IN PIRP Irp
+  ) {
+    return WvlDiskCacheFlush_(Disk, Irp, NULL);
+  }
+
+/* Finish one of our own IRPs at the disk. */
+NTSTATUS STDCALL WvlDiskCacheIoDone(
+    IN PDEVICE_OBJECT dev_obj,
+    IN PIRP sub_irp,
+    IN PVOID context
+  ) {
+    WVL_SP_DISK_CACHE_IO_ io = context;
+    WVL_SP_DISK_T disk = io->Disk;
+    WVL_SP_DISK_CACHE cache = disk->Cache;
+    WVL_SP_DISK_CACHE_BLOCK_ block;
+    NTSTATUS status = sub_irp->IoStatus.Status;
+    UINT32 request_offset, block_offset, len;
+    ULONGLONG index;
+    PUCHAR data;
+    KIRQL irql;
+    UINT32 i;
+
+    WvlDiskScsiSubIrpFree(sub_irp);
+    KeAcquireSpinLock(&cache->Lock, &irql);
+    switch (io->Kind) {
+        case WvlDiskCacheIoFill_:
+          if (!io->Irp)
+            cache->AheadIos--;
+          if (!NT_SUCCESS(status))
+            goto unpin;
+          /*
+           * The cache has the latest copy of any block it holds.  Blocks
+           * which were dirty when the fill began are still held: the
+           * disk's copy which was read is stale.
+           */
+          for (index = io->FirstBlock; index <= io->LastBlock; index++) {
+              len = WvlDiskCacheOverlap_(
+                  disk,
+                  index,
+                  io->StartSector,
+                  io->SectorCount,
+                  &request_offset,
+                  &block_offset
+                );
+              data = io->Bounce + (
+                  (index - io->FirstBlock) * cache->BlockSize
+                );
+              block = WvlDiskCacheFind_(cache, index);
+              if (block && !io->Irp)
+                continue;
+              if (block) {
+                  WvlDiskCacheTouch_(cache, block);
+                  WvlCopyMemory(
+                      io->Buffer + request_offset,
+                      block->Data + block_offset,
+                      len
+                    );
+                  continue;
+                }
+              if (io->Irp) {
+                  WvlCopyMemory(
+                      io->Buffer + request_offset,
+                      data + block_offset,
+                      len
+                    );
+                }
+              /* Keep whole blocks which no write could have changed. */
+              if (
+                  !io->Keep ||
+                  io->Generation != cache->Generation ||
+                  (index + 1) * cache->BlockSectors > disk->LBADiskSize
+                )
+                continue;
+              block = WvlDiskCacheVictim_(cache);
+              if (!block)
+                continue;
+              WvlCopyMemory(block->Data, data, cache->BlockSize);
+              WvlDiskCacheHash_(cache, block, index);
+              if (!io->Irp) {
+                  block->Flags |= WVL_M_DISK_CACHE_AHEAD_;
+                  cache->AheadBlocks++;
+                }
+            }
+          unpin:
+
+          for (i = 0; i < io->PinnedCount; i++)
+            io->Pinned[i]->Pins--;
+          break;
+
+        case WvlDiskCacheIoWrite_:
+          cache->Writes--;
+          cache->Generation++;
+          break;
+
+        case WvlDiskCacheIoFlush_:
+          io->Block->Flags &= ~WVL_M_DISK_CACHE_FLUSHING_;
+          /* A fill which began before the write landed is stale. */
+          cache->Generation++;
+          cache->Flushes++;
+          if (!NT_SUCCESS(status)) {
+              /* Try again with the next flush. */
+              if (!(io->Block->Flags & WVL_M_DISK_CACHE_DIRTY_)) {
+                  io->Block->Flags |= WVL_M_DISK_CACHE_DIRTY_;
+                  cache->DirtyCount++;
+                }
+              io->Flush->Status = status;
+            }
+          break;
+      }
+    KeReleaseSpinLock(&cache->Lock, irql);
+
+    if (io->Kind == WvlDiskCacheIoFlush_) {
+        WvlDiskCacheFlushDone_(io->Flush);
+      } else if (io->Irp) {
+        WvlIrpComplete(
+            io->Irp,
+            NT_SUCCESS(status) ? io->SectorCount * disk->SectorSize : 0,
+            status
+          );
+      }
+    wv_free(io->Pinned);
+    wv_free(io->Bounce);
+    wv_free(io);
+    WvlDiskCacheRelease_(cache);
+    /* The IRP is gone. */
+    return STATUS_MORE_PROCESSING_REQUIRED;
+  }
+
+/**
+ * Read whole blocks from the disk, for a read which missed the cache.
+ *
+ * @v disk              The disk.
+ * @v start_sector      The first sector of the read.
+ * @v sector_count      The number of sectors in the read.
+ * @v buffer            The read's buffer.
+ * @v irp               The read's IRP, or NULL to read ahead.
+ * @v keep              Can the blocks read be kept?
+ * @v generation        The cache's generation when the read began.
+ * @ret NTSTATUS        The status of the operation.
+ */
+static NTSTATUS WvlDiskCacheFill_(
+    IN WVL_SP_DISK_T disk,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer,
+    IN PIRP irp,
+    IN BOOLEAN keep,
+    IN UINT32 generation
+  ) {
+    WVL_SP_DISK_CACHE cache = disk->Cache;
+    WVL_SP_DISK_CACHE_BLOCK_ block;
+    WVL_SP_DISK_CACHE_IO_ io;
+    ULONGLONG first, end, index;
+    PIRP sub_irp;
+    KIRQL irql;
+
+    io = wv_mallocz(sizeof *io);
+    if (!io)
+      goto err_io;
+    io->Kind = WvlDiskCacheIoFill_;
+    io->Disk = disk;
+    io->Irp = irp;
+    io->Buffer = buffer;
+    io->StartSector = start_sector;
+    io->SectorCount = sector_count;
+    io->FirstBlock = start_sector / cache->BlockSectors;
+    io->LastBlock = (start_sector + sector_count - 1) / cache->BlockSectors;
+    io->Keep = keep;
+    io->Generation = generation;
+
+    first = io->FirstBlock * cache->BlockSectors;
+    end = (io->LastBlock + 1) * cache->BlockSectors;
+    if (end > disk->LBADiskSize)
+      end = disk->LBADiskSize;
+    io->Bounce = wv_malloc((UINT32) (end - first) * disk->SectorSize);
+    if (!io->Bounce)
+      goto err_bounce;
+    /* Only a write-back cache has blocks newer than the disk's. */
+    if (cache->WriteBack) {
+        io->Pinned = wv_malloc(
+            (UINT32) (io->LastBlock - io->FirstBlock + 1) *
+            sizeof *io->Pinned
+          );
+        if (!io->Pinned)
+          goto err_pinned;
+      }
+
+    sub_irp = WvlDiskScsiSubIrp(
+        disk,
+        WvlDiskIoModeRead,
+        first,
+        (UINT32) (end - first),
+        io->Bounce,
+        NULL,
+        &io->Srb,
+        WvlDiskCacheIoDone,
+        io
+      );
+    if (!sub_irp)
+      goto err_irp;
+
+    /* Keep blocks which the disk's copy is older than until it's read. */
+    if (io->Pinned) {
+        KeAcquireSpinLock(&cache->Lock, &irql);
+        for (index = io->FirstBlock; index <= io->LastBlock; index++) {
+            block = WvlDiskCacheFind_(cache, index);
+            if (!block || !(block->Flags & (
+                WVL_M_DISK_CACHE_DIRTY_ | WVL_M_DISK_CACHE_FLUSHING_
+              )))
+              continue;
+            block->Pins++;
+            io->Pinned[io->PinnedCount++] = block;
+          }
+        KeReleaseSpinLock(&cache->Lock, irql);
+      }
+
+    if (irp)
+      IoMarkIrpPending(irp);
+    WvlDiskCacheHold_(cache);
+    disk->disk_ops.Io(
+        disk,
+        WvlDiskIoModeRead,
+        first,
+        (UINT32) (end - first),
+        io->Bounce,
+        sub_irp
+      );
+    return STATUS_PENDING;
+
+    err_irp:
+
+    wv_free(io->Pinned);
+    err_pinned:
+
+    wv_free(io->Bounce);
+    err_bounce:
+
+    wv_free(io);
+    err_io:
+
+    DBG("Couldn't read through cache!\n");
+    if (!irp)
+      return STATUS_INSUFFICIENT_RESOURCES;
+    /* Without dirty blocks, the disk can be read directly. */
+    if (!cache->WriteBack)
+      return disk->disk_ops.Io(
+          disk,
+          WvlDiskIoModeRead,
+          start_sector,
+          sector_count,
+          buffer,
+          irp
+        );
+    return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+  }
+
+/* Send a write on to the disk, noting when it's done. */
+static NTSTATUS WvlDiskCacheWriteThrough_(
+    IN WVL_SP_DISK_T disk,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer,
+    IN PIRP irp
+  ) {
+    WVL_SP_DISK_CACHE cache = disk->Cache;
+    WVL_SP_DISK_CACHE_IO_ io;
+    PIRP sub_irp;
+    KIRQL irql;
+
+    io = wv_mallocz(sizeof *io);
+    if (!io)
+      goto err_io;
+    io->Kind = WvlDiskCacheIoWrite_;
+    io->Disk = disk;
+    io->Irp = irp;
+    io->SectorCount = sector_count;
+    sub_irp = WvlDiskScsiSubIrp(
+        disk,
+        WvlDiskIoModeWrite,
+        start_sector,
+        sector_count,
+        buffer,
+        irp,
+        &io->Srb,
+        WvlDiskCacheIoDone,
+        io
+      );
+    if (!sub_irp)
+      goto err_irp;
+
+    KeAcquireSpinLock(&cache->Lock, &irql);
+    cache->Writes++;
+    cache->Generation++;
+    KeReleaseSpinLock(&cache->Lock, irql);
+
+    IoMarkIrpPending(irp);
+    WvlDiskCacheHold_(cache);
+    disk->disk_ops.Io(
+        disk,
+        WvlDiskIoModeWrite,
+        start_sector,
+        sector_count,
+        buffer,
+        sub_irp
+      );
+    return STATUS_PENDING;
+
+    err_irp:
+
+    wv_free(io);
+    err_io:
+
+    DBG("Couldn't write through cache!\n");
+    return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+  }
+
+/* The most to read ahead of a stream at once, in sectors. */
+static UINT32 WvlDiskCacheAheadMax_(IN WVL_SP_DISK_T disk) {
+    WVL_SP_DISK_CACHE cache = disk->Cache;
+    UINT32 max = WvlDiskReadAheadMax * 1024 / disk->SectorSize;
+    UINT32 limit;
+
+    /* Leave half of what the disk can have in flight for other reads. */
+    limit = WvlDiskMaxInFlightLen(disk) / 2 / disk->SectorSize;
+    if (max > limit)
+      max = limit;
+    /*
+     * Let every stream read ahead at once without their blocks pushing
+     * each other out: a stream can be up to a window and a half ahead.
+     */
+    limit = cache->BlockCount * cache->BlockSectors /
+      (2 * WVL_M_DISK_READAHEAD_STREAMS);
+    if (max > limit)
+      max = limit;
+    return max;
+  }
+
+/**
+ * Read sectors ahead into the cache, for a sequential stream.
+ *
+ * @v disk              The disk.
+ * @v start_sector      The first sector to read ahead.
+ * @v sector_count      The number of sectors to read ahead.
+ *
+ * Only whole blocks which aren't cached already are read.  The stream
+ * detector keeps the range within what the disk can have in flight.
+ */
+static VOID WvlDiskCacheReadAhead_(
+    IN WVL_SP_DISK_T disk,
+    IN ULONGLONG start_sector,
+    IN UINT32 sector_count
+  ) {
+    WVL_SP_DISK_CACHE cache = disk->Cache;
+    ULONGLONG first, end;
+    UINT32 generation;
+    NTSTATUS status;
+    KIRQL irql;
+
+    first = (start_sector + cache->BlockSectors - 1) / cache->BlockSectors;
+    end = (start_sector + sector_count + cache->BlockSectors - 1) /
+      cache->BlockSectors;
+    if (end > disk->LBADiskSize / cache->BlockSectors)
+      end = disk->LBADiskSize / cache->BlockSectors;
+
+    KeAcquireSpinLock(&cache->Lock, &irql);
+    while (first < end && WvlDiskCacheFind_(cache, first))
+      first++;
+    while (end > first && WvlDiskCacheFind_(cache, end - 1))
+      end--;
+    if (
+        first == end ||
+        cache->Writes ||
+        cache->AheadIos >= WVL_M_DISK_CACHE_AHEAD_IOS_
+      ) {
+        KeReleaseSpinLock(&cache->Lock, irql);
+        return;
+      }
+    cache->AheadIos++;
+    generation = cache->Generation;
+    KeReleaseSpinLock(&cache->Lock, irql);
+
+    status = WvlDiskCacheFill_(
+        disk,
+        first * cache->BlockSectors,
+        (UINT32) (end - first) * cache->BlockSectors,
+        NULL,
+        NULL,
+        TRUE,
+        generation
+      );
+    if (status != STATUS_PENDING) {
+        KeAcquireSpinLock(&cache->Lock, &irql);
+        cache->AheadIos--;
+        KeReleaseSpinLock(&cache->Lock, irql);
+      }
+    return;
+  }
+
+/* Disk I/O through a cache.  See WVL_F_DISK_IO in the header. */
+NTSTATUS STDCALL WvlDiskCacheIo(
+    IN WVL_SP_DISK_T disk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer,
+    IN PIRP irp
+  ) {
+    WVL_SP_DISK_CACHE cache = disk->Cache;
+    WVL_SP_DISK_CACHE_BLOCK_ block;
+    UINT32 request_offset, block_offset, len, generation;
+    UINT32 ahead_max, ahead_count;
+    ULONGLONG index, first, last, ahead_start;
+    BOOLEAN through, keep, flush, ahead;
+    NTSTATUS status;
+    KIRQL irql;
+
+    if (
+        !sector_count ||
+        start_sector < 0 ||
+        (ULONGLONG) start_sector + sector_count > disk->LBADiskSize
+      )
+      return WvlIrpComplete(irp, 0, STATUS_INVALID_PARAMETER);
+    first = start_sector / cache->BlockSectors;
+    last = (start_sector + sector_count - 1) / cache->BlockSectors;
+
+    if (mode == WvlDiskIoModeRead) {
+        ahead_max = cache->ReadAhead ? WvlDiskCacheAheadMax_(disk) : 0;
+        KeAcquireSpinLock(&cache->Lock, &irql);
+        ahead = cache->ReadAhead && WvlDiskReadAheadNote(
+            cache->ReadAhead,
+            start_sector,
+            sector_count,
+            ahead_max,
+            &ahead_start,
+            &ahead_count
+          );
+        for (index = first; index <= last; index++) {
+            if (!WvlDiskCacheFind_(cache, index))
+              break;
+          }
+        if (index <= last) {
+            cache->Misses++;
+            keep = !cache->Writes;
+            generation = cache->Generation;
+            KeReleaseSpinLock(&cache->Lock, irql);
+            status = WvlDiskCacheFill_(
+                disk,
+                start_sector,
+                sector_count,
+                buffer,
+                irp,
+                keep,
+                generation
+              );
+            if (ahead)
+              WvlDiskCacheReadAhead_(disk, ahead_start, ahead_count);
+            return status;
+          }
+        for (index = first; index <= last; index++) {
+            block = WvlDiskCacheFind_(cache, index);
+            WvlDiskCacheTouch_(cache, block);
+            len = WvlDiskCacheOverlap_(
+                disk,
+                index,
+                start_sector,
+                sector_count,
+                &request_offset,
+                &block_offset
+              );
+            WvlCopyMemory(
+                buffer + request_offset,
+                block->Data + block_offset,
+                len
+              );
+          }
+        cache->Hits++;
+        KeReleaseSpinLock(&cache->Lock, irql);
+        status = WvlIrpComplete(
+            irp,
+            sector_count * disk->SectorSize,
+            STATUS_SUCCESS
+          );
+        if (ahead)
+          WvlDiskCacheReadAhead_(disk, ahead_start, ahead_count);
+        return status;
+      }
+
+    /* Update cached blocks and, in write-back mode, absorb the write. */
+    through = !cache->WriteBack;
+    KeAcquireSpinLock(&cache->Lock, &irql);
+    for (index = first; index <= last; index++) {
+        len = WvlDiskCacheOverlap_(
+            disk,
+            index,
+            start_sector,
+            sector_count,
+            &request_offset,
+            &block_offset
+          );
+        block = WvlDiskCacheFind_(cache, index);
+        if (!block && cache->WriteBack && len == cache->BlockSize) {
+            block = WvlDiskCacheVictim_(cache);
+            if (block)
+              WvlDiskCacheHash_(cache, block, index);
+          }
+        if (!block) {
+            through = TRUE;
+            continue;
+          }
+        WvlCopyMemory(
+            block->Data + block_offset,
+            buffer + request_offset,
+            len
+          );
+        block->Flags |= WVL_M_DISK_CACHE_REF_;
+        if (cache->WriteBack && !(block->Flags & WVL_M_DISK_CACHE_DIRTY_)) {
+            block->Flags |= WVL_M_DISK_CACHE_DIRTY_;
+            cache->DirtyCount++;
+          }
+      }
+    cache->Generation++;
+    flush = cache->WriteBack && cache->DirtyCount > cache->BlockCount / 2;
+    KeReleaseSpinLock(&cache->Lock, irql);
+
+    if (flush)
+      WvlDiskCacheFlush_(disk, NULL, NULL);
+    if (through) {
+        return WvlDiskCacheWriteThrough_(
+            disk,
+            start_sector,
+            sector_count,
+            buffer,
+            irp
+          );
+      }
+    return WvlIrpComplete(
+        irp,
+        sector_count * disk->SectorSize,
+        STATUS_SUCCESS
+      );
+  }
+
+/* Make cached blocks read back as zeroes, for an unmapped range. */
+VOID STDCALL WvlDiskCacheUnmap(
+    IN WVL_SP_DISK_T disk,
+    IN LONGLONG start_sector,
+    IN ULONGLONG sector_count
+  ) {
+    WVL_SP_DISK_CACHE cache = disk->Cache;
+    WVL_SP_DISK_CACHE_BLOCK_ block;
+    ULONGLONG first, lo, hi;
+    KIRQL irql;
+    UINT32 i;
+
+    if (!cache)
+      return;
+    KeAcquireSpinLock(&cache->Lock, &irql);
+    /* The range can be much larger than the cache. */
+    for (i = 0; i < cache->BlockCount; i++) {
+        block = cache->Blocks + i;
+        if (!(block->Flags & WVL_M_DISK_CACHE_VALID_))
+          continue;
+        first = block->Index * cache->BlockSectors;
+        lo = (ULONGLONG) start_sector > first ? start_sector : first;
+        hi = first + cache->BlockSectors;
+        if (hi > start_sector + sector_count)
+          hi = start_sector + sector_count;
+        if (lo >= hi)
+          continue;
+        if (
+            hi - lo == cache->BlockSectors &&
+            !(block->Flags & WVL_M_DISK_CACHE_FLUSHING_)
+          ) {
+            if (block->Flags & WVL_M_DISK_CACHE_DIRTY_)
+              cache->DirtyCount--;
+            WvlDiskCacheUnhash_(cache, block);
+            block->Flags = 0;
+            continue;
+          }
+        RtlZeroMemory(
+            block->Data + (UINT32) (lo - first) * disk->SectorSize,
+            (UINT32) (hi - lo) * disk->SectorSize
+          );
+        /* A write of the old data could land after the unmap. */
+        if (
+            (block->Flags & (
+                WVL_M_DISK_CACHE_DIRTY_ | WVL_M_DISK_CACHE_FLUSHING_
+              )) == WVL_M_DISK_CACHE_FLUSHING_
+          ) {
+            block->Flags |= WVL_M_DISK_CACHE_DIRTY_;
+            cache->DirtyCount++;
+          }
+      }
+    cache->Generation++;
+    KeReleaseSpinLock(&cache->Lock, irql);
+    return;
+  }
+
+/* Fill in cache statistics for IOCTL_WV_CACHE_STATS. */
+VOID STDCALL WvlDiskCacheStats(
+    IN WVL_SP_DISK_T disk,
+    OUT WV_SP_CACHE_STATS stats
+  ) {
+    WVL_SP_DISK_CACHE cache = disk->Cache;
+    KIRQL irql;
+
+    RtlZeroMemory(stats, sizeof *stats);
+    if (!cache)
+      return;
+    KeAcquireSpinLock(&cache->Lock, &irql);
+    stats->Hits = cache->Hits;
+    stats->Misses = cache->Misses;
+    stats->Evictions = cache->Evictions;
+    stats->Flushes = cache->Flushes;
+    stats->AheadBlocks = cache->AheadBlocks;
+    stats->AheadHits = cache->AheadHits;
+    stats->AheadWasted = cache->AheadWasted;
+    stats->BlockSize = cache->BlockSize;
+    stats->BlockCount = cache->BlockCount;
+    stats->BlocksUsed = cache->BlocksUsed;
+    stats->DirtyCount = cache->DirtyCount;
+    stats->WriteBack = cache->WriteBack;
+    KeReleaseSpinLock(&cache->Lock, irql);
+    return;
+  }
+
+/* See the header for details. */
+WVL_M_LIB NTSTATUS STDCALL WvlDiskCacheCreate(IN OUT WVL_SP_DISK_T Disk) {
+    WVL_SP_DISK_CACHE cache;
+    UINT32 size, block_size, block_count, buckets;
+    BOOLEAN ahead;
+
+    /* A disk which reads ahead needs somewhere to put what it reads. */
+    ahead = Disk->ReadAhead && WvlDiskReadAheadMax;
+    size = WvlDiskCacheSize;
+    if (!size && ahead)
+      size = WvlDiskReadAheadBuffer;
+    if (Disk->Cache || !size || Disk->NoCache)
+      return STATUS_SUCCESS;
+
+    /* Use a power of two within the limits, of whole sectors. */
+    block_size = WVL_M_DISK_CACHE_BLOCK_MIN_;
+    while (
+        block_size < WvlDiskCacheBlockSize &&
+        block_size < WVL_M_DISK_CACHE_BLOCK_MAX_
+      )
+      block_size <<= 1;
+    if (
+        !Disk->SectorSize ||
+        block_size % Disk->SectorSize ||
+        Disk->LBADiskSize < block_size / Disk->SectorSize
+      ) {
+        DBG("Can't cache a disk with this geometry!\n");
+        return STATUS_INVALID_PARAMETER;
+      }
+    block_count = WVL_M_DISK_CACHE_BLOCKS_MAX_;
+    if (size < block_count / (1024 * 1024 / block_size))
+      block_count = size * (1024 * 1024 / block_size);
+    for (buckets = 1; buckets < block_count; buckets <<= 1)
+      ;
+
+    cache = wv_mallocz(sizeof *cache);
+    if (!cache)
+      goto err_cache;
+    KeInitializeSpinLock(&cache->Lock);
+    KeInitializeEvent(&cache->Idle, NotificationEvent, FALSE);
+    cache->Outstanding = 1;
+    cache->BlockSize = block_size;
+    cache->BlockSectors = block_size / Disk->SectorSize;
+    cache->BlockCount = block_count;
+    cache->WriteBack = WvlDiskCacheWriteBack;
+    cache->BucketMask = buckets - 1;
+    cache->Blocks = wv_mallocz(block_count * sizeof *cache->Blocks);
+    if (!cache->Blocks)
+      goto err_blocks;
+    cache->Buckets = wv_mallocz(buckets * sizeof *cache->Buckets);
+    if (!cache->Buckets)
+      goto err_buckets;
+    if (ahead) {
+        cache->ReadAhead = WvlDiskReadAheadCreate();
+        if (!cache->ReadAhead)
+          goto err_readahead;
+      }
+
+    Disk->Cache = cache;
+    DBG(
+        "Disk %p cache: %u blocks of %u bytes, write-%s%s\n",
+        (PVOID) Disk,
+        block_count,
+        block_size,
+        cache->WriteBack ? "back" : "through",
+        ahead ? ", read-ahead" : ""
+      );
+    return STATUS_SUCCESS;
+
+    err_readahead:
+
+    wv_free(cache->Buckets);
+    err_buckets:
+
+    wv_free(cache->Blocks);
+    err_blocks:
+
+    wv_free(cache);
+    err_cache:
+
+    DBG("Couldn't create cache!\n");
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+/* See the header for details. */
+WVL_M_LIB VOID STDCALL WvlDiskCacheFree(IN OUT WVL_SP_DISK_T Disk) {
+    WVL_SP_DISK_CACHE cache = Disk->Cache;
+    KEVENT flushed;
+    UINT32 i;
+
+    if (!cache)
+      return;
+
+    /* Write any dirty blocks, then wait for all of our IRPs. */
+    KeInitializeEvent(&flushed, NotificationEvent, FALSE);
+    if (WvlDiskCacheFlush_(Disk, NULL, &flushed) == STATUS_PENDING) {
+        KeWaitForSingleObject(&flushed, Executive, KernelMode, FALSE, NULL);
+      }
+    if (InterlockedDecrement(&cache->Outstanding)) {
+        KeWaitForSingleObject(
+            &cache->Idle,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL
+          );
+      }
+    if (cache->DirtyCount)
+      DBG("Lost %u dirty cache blocks!\n", cache->DirtyCount);
+
+    Disk->Cache = NULL;
+    for (i = 0; i < cache->BlockCount; i++)
+      wv_free(cache->Blocks[i].Data);
+    wv_free(cache->Blocks);
+    wv_free(cache->Buckets);
+    WvlDiskReadAheadFree(cache->ReadAhead);
+    wv_free(cache);
+    return;
+  }
@@ -41,8 +41,12 @@
 #include "bus.h"
 #include "device.h"
 #include "disk.h"
+#include "mount.h"
 #include "debug.h"
 
+/* From cache.c */
+extern VOID STDCALL WvlDiskCacheStats(IN WVL_SP_DISK_T, OUT WV_SP_CACHE_STATS);
+
 static NTSTATUS STDCALL WvlDiskDevCtlStorageQueryProp_(
     IN WVL_SP_DISK_T disk,
     IN PIRP irp
@@ -53,6 +57,9 @@ static NTSTATUS STDCALL WvlDiskDevCtlStorageQueryProp_(
     UINT32 copy_size;
     STORAGE_ADAPTER_DESCRIPTOR storage_adapter_desc;
     STORAGE_DEVICE_DESCRIPTOR storage_dev_desc;
+#ifdef IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES
+    DEVICE_TRIM_DESCRIPTOR trim_desc;
+#endif
 
     if (
         storage_prop_query->PropertyId == StorageAdapterProperty &&
@@ -116,6 +123,31 @@ static NTSTATUS STDCALL WvlDiskDevCtlStorageQueryProp_(
         status = STATUS_SUCCESS;
       }
 
+#ifdef IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES
+    if (
+        storage_prop_query->PropertyId == StorageDeviceTrimProperty &&
+        storage_prop_query->QueryType == PropertyStandardQuery
+      ) {
+        copy_size = (
+            io_stack_loc->Parameters.DeviceIoControl.OutputBufferLength <
+            sizeof (DEVICE_TRIM_DESCRIPTOR) ?
+            io_stack_loc->Parameters.DeviceIoControl.OutputBufferLength :
+            sizeof (DEVICE_TRIM_DESCRIPTOR)
+          );
+        trim_desc.Version = sizeof (DEVICE_TRIM_DESCRIPTOR);
+        trim_desc.Size = sizeof (DEVICE_TRIM_DESCRIPTOR);
+        trim_desc.TrimEnabled = (
+            disk->disk_ops.Unmap && !disk->Overlay
+          );
+        RtlCopyMemory(
+            irp->AssociatedIrp.SystemBuffer,
+            &trim_desc,
+            copy_size
+          );
+        status = STATUS_SUCCESS;
+      }
+#endif
+
     if (status == STATUS_INVALID_PARAMETER) {
         DBG(
             "!!Invalid IOCTL_STORAGE_QUERY_PROPERTY "
@@ -182,6 +214,72 @@ static NTSTATUS STDCALL WvlDiskDevCtlScsiGetAddr_(
     return WvlIrpComplete(irp, (ULONG_PTR) copy_size, STATUS_SUCCESS);
   }
 
+/* Report the disk's block cache counters. */
+static NTSTATUS STDCALL WvlDiskDevCtlCacheStats_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp
+  ) {
+    PIO_STACK_LOCATION io_stack_loc = IoGetCurrentIrpStackLocation(irp);
+
+    if (
+        io_stack_loc->Parameters.DeviceIoControl.OutputBufferLength <
+        sizeof (WV_S_CACHE_STATS)
+      )
+      return WvlIrpComplete(irp, 0, STATUS_BUFFER_TOO_SMALL);
+    WvlDiskCacheStats(disk, irp->AssociatedIrp.SystemBuffer);
+    return WvlIrpComplete(irp, sizeof (WV_S_CACHE_STATS), STATUS_SUCCESS);
+  }
+
+#ifdef IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES
+/* Pass a TRIM on to the disk.  Partial sectors are left alone. */
+static NTSTATUS STDCALL WvlDiskDevCtlManageDataSet_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp
+  ) {
+    PIO_STACK_LOCATION io_stack_loc = IoGetCurrentIrpStackLocation(irp);
+    PDEVICE_MANAGE_DATA_SET_ATTRIBUTES attrs = irp->AssociatedIrp.SystemBuffer;
+    UINT32 len = io_stack_loc->Parameters.DeviceIoControl.InputBufferLength;
+    PDEVICE_DATA_SET_RANGE range;
+    UINT32 i, count;
+    ULONGLONG first, end;
+    NTSTATUS status;
+
+    if (
+        len < sizeof *attrs ||
+        attrs->DataSetRangesOffset > len ||
+        attrs->DataSetRangesLength > len - attrs->DataSetRangesOffset
+      )
+      return WvlIrpComplete(irp, 0, STATUS_INVALID_PARAMETER);
+    if (
+        attrs->Action != DeviceDsmAction_Trim ||
+        !disk->disk_ops.Unmap ||
+        disk->Overlay
+      )
+      return WvlIrpComplete(irp, 0, STATUS_NOT_SUPPORTED);
+
+    range = (PDEVICE_DATA_SET_RANGE) (
+        (PUCHAR) attrs + attrs->DataSetRangesOffset
+      );
+    count = attrs->DataSetRangesLength / sizeof *range;
+    for (i = 0; i < count; i++) {
+        if (range[i].StartingOffset < 0)
+          continue;
+        first = (
+            (ULONGLONG) range[i].StartingOffset + disk->SectorSize - 1
+          ) / disk->SectorSize;
+        end = (
+            (ULONGLONG) range[i].StartingOffset + range[i].LengthInBytes
+          ) / disk->SectorSize;
+        if (end <= first)
+          continue;
+        status = WvlDiskUnmap(disk, first, end - first);
+        if (!NT_SUCCESS(status))
+          return WvlIrpComplete(irp, 0, status);
+      }
+    return WvlIrpComplete(irp, 0, STATUS_SUCCESS);
+  }
+#endif
+
 /**
  * Handle a disk IRP_MJ_DEVICE_CONTROL IRP.
  *
@@ -205,6 +303,14 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskDevCtl(
         case IOCTL_SCSI_GET_ADDRESS:
           return WvlDiskDevCtlScsiGetAddr_(Disk, Irp);
 
+        case IOCTL_WV_CACHE_STATS:
+          return WvlDiskDevCtlCacheStats_(Disk, Irp);
+
+#ifdef IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES
+        case IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES:
+          return WvlDiskDevCtlManageDataSet_(Disk, Irp);
+#endif
+
         /* Some cases that pop up on Windows Server 2003. */
         #if 0
         case IOCTL_MOUNTDEV_UNIQUE_ID_CHANGE_NOTIFY:
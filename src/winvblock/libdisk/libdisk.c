@@ -37,6 +37,19 @@
 #include "disk.h"
 #include "debug.h"
 
+/* From overlay.c */
+extern WVL_F_DISK_IO WvlDiskOverlayIo;
+extern IO_COMPLETION_ROUTINE WvlDiskOverlayReadDone;
+
+/* From cache.c */
+extern WVL_F_DISK_IO WvlDiskCacheIo;
+extern IO_COMPLETION_ROUTINE WvlDiskCacheIoDone;
+extern VOID STDCALL WvlDiskCacheUnmap(
+    IN WVL_SP_DISK_T,
+    IN LONGLONG,
+    IN ULONGLONG
+  );
+
 #ifndef _MSC_VER
 static long long __divdi3(long long u, long long v) {
     return u / v;
@@ -325,6 +338,43 @@ WVL_M_LIB VOID STDCALL WvlDiskInit(IN OUT WVL_SP_DISK_T Disk) {
     return;
   }
 
+/**
+ * Check whether a buffer holds only zeroes.
+ *
+ * @v Buffer            The buffer to check.
+ * @v Length            The length of the buffer, in bytes.
+ * @ret BOOLEAN         TRUE if every byte is zero.
+ *
+ * Disks can use this to release, rather than write, zeroed sectors.
+ * A non-zero buffer usually differs early, so this is cheap for those.
+ */
+WVL_M_LIB BOOLEAN STDCALL WvlDiskIsZero(IN PVOID Buffer, IN UINT32 Length) {
+    PUCHAR bytes = Buffer;
+    ULONG_PTR * words;
+
+    /* Check any unaligned head a byte at a time. */
+    while (Length && (ULONG_PTR) bytes % sizeof *words) {
+        if (*bytes++)
+          return FALSE;
+        Length--;
+      }
+    /* Then a word at a time. */
+    words = (ULONG_PTR *) bytes;
+    while (Length >= sizeof *words) {
+        if (*words++)
+          return FALSE;
+        Length -= sizeof *words;
+      }
+    /* Then any tail. */
+    bytes = (PUCHAR) words;
+    while (Length) {
+        if (*bytes++)
+          return FALSE;
+        Length--;
+      }
+    return TRUE;
+  }
+
 /* See WVL_F_DISK_IO in the header for details. */
 WVL_M_LIB NTSTATUS STDCALL WvlDiskIo(
     IN WVL_SP_DISK_T Disk,
@@ -334,17 +384,63 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskIo(
     IN PUCHAR Buffer,
     IN PIRP Irp
   ) {
-    if (Disk->disk_ops.Io) {
-        return Disk->disk_ops.Io(
-            Disk,
-            Mode,
-            StartSector,
-            SectorCount,
-            Buffer,
-            Irp
-          );
+    PIO_COMPLETION_ROUTINE done;
+
+    if (!Disk->disk_ops.Io)
+      return WvlIrpComplete(Irp, 0, STATUS_DRIVER_INTERNAL_ERROR);
+
+    /* The overlay's and cache's own IRPs go straight to the disk. */
+    done = IoGetCurrentIrpStackLocation(Irp)->CompletionRoutine;
+    if (done != WvlDiskOverlayReadDone && done != WvlDiskCacheIoDone) {
+        if (Disk->Overlay) {
+            return WvlDiskOverlayIo(
+                Disk,
+                Mode,
+                StartSector,
+                SectorCount,
+                Buffer,
+                Irp
+              );
+          }
+        if (Disk->Cache) {
+            return WvlDiskCacheIo(
+                Disk,
+                Mode,
+                StartSector,
+                SectorCount,
+                Buffer,
+                Irp
+              );
+          }
       }
-    return WvlIrpComplete(Irp, 0, STATUS_DRIVER_INTERNAL_ERROR);
+    return Disk->disk_ops.Io(
+        Disk,
+        Mode,
+        StartSector,
+        SectorCount,
+        Buffer,
+        Irp
+      );
+  }
+
+/* See WVL_F_DISK_UNMAP in the header for details. */
+WVL_M_LIB NTSTATUS STDCALL WvlDiskUnmap(
+    IN WVL_SP_DISK_T Disk,
+    IN LONGLONG StartSector,
+    IN ULONGLONG SectorCount
+  ) {
+    /* Unmapping the disk beneath an overlay would change what it reads. */
+    if (!Disk->disk_ops.Unmap || Disk->Overlay)
+      return STATUS_NOT_SUPPORTED;
+    /* Trim the range to the disk. */
+    if (StartSector < 0 || (ULONGLONG) StartSector >= Disk->LBADiskSize)
+      return STATUS_SUCCESS;
+    if (SectorCount > Disk->LBADiskSize - StartSector)
+      SectorCount = Disk->LBADiskSize - StartSector;
+    if (!SectorCount)
+      return STATUS_SUCCESS;
+    WvlDiskCacheUnmap(Disk, StartSector, SectorCount);
+    return Disk->disk_ops.Unmap(Disk, StartSector, SectorCount);
   }
 
 /* See WVL_F_DISK_MAX_XFER_LEN in the header for details. */
@@ -354,3 +450,10 @@ WVL_M_LIB UINT32 WvlDiskMaxXferLen(IN WVL_SP_DISK_T Disk) {
       return Disk->disk_ops.MaxXferLen(Disk);
     return 1024 * 1024;
   }
+
+/* See WvlDiskMaxInFlightLen in the header for details. */
+WVL_M_LIB UINT32 WvlDiskMaxInFlightLen(IN WVL_SP_DISK_T Disk) {
+    if (Disk->disk_ops.MaxInFlightLen)
+      return Disk->disk_ops.MaxInFlightLen(Disk);
+    return WvlDiskMaxXferLen(Disk);
+  }
@@ -2,7 +2,7 @@
 
 set libname=libdisk
 
-set c=libdisk.c dev_ctl.c scsi.c pnp.c
+set c=libdisk.c dev_ctl.c scsi.c pnp.c overlay.c cache.c readahead.c
 
 echo !INCLUDE $(NTMAKEENV)\makefile.def	> makefile
 
@@ -0,0 +1,551 @@
+/**
+ * Copyright (C) 2009-2011, Shao Miller <shao.miller@yrdsb.edu.on.ca>.
+ * Copyright 2006-2008, V.
+ * For WinAoE contact information, see http://winaoe.org/
+ *
+ * This file is part of WinVBlock, derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Copy-on-write disk overlay.
+ *
+ * An overlay sits between WvlDiskIo and a disk's I/O routine.  Writes
+ * never reach the disk; they are kept in RAM, in extents allocated
+ * when first written, with a bit for each sector that holds data.  The
+ * extents are kept in an extent map and come from extent.c, as for a
+ * sparse RAM disk, so overlays share its budget.
+ * Reads are served from RAM where every sector is held, passed to the
+ * disk where none is, and otherwise read from the disk and then
+ * patched with the sectors held in RAM.
+ */
+
+#include <ntddk.h>
+#include <scsi.h>
+#include <srb.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "irp.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "copy.h"
+#include "extmap.h"
+#include "extent.h"
+#include "debug.h"
+
+/*** Macros */
+
+/* The amount of RAM allocated at a time for written sectors. */
+#define WVL_M_DISK_OVERLAY_EXTENT_SIZE_ WV_M_EXTENT_SIZE
+/* The most sectors an extent can hold, with the smallest sector size. */
+#define WVL_M_DISK_OVERLAY_SECTORS_MAX_ (WVL_M_DISK_OVERLAY_EXTENT_SIZE_ / 512)
+
+/*** Object types */
+
+typedef struct WVL_DISK_OVERLAY_EXTENT_ {
+    WV_SP_EXTENT Extent;
+    /* One bit for each sector held in the extent. */
+    UCHAR Valid[WVL_M_DISK_OVERLAY_SECTORS_MAX_ / 8];
+  } WVL_S_DISK_OVERLAY_EXTENT_, * WVL_SP_DISK_OVERLAY_EXTENT_;
+
+struct WVL_DISK_OVERLAY {
+    /* Protects the extent map and the extents' contents. */
+    KSPIN_LOCK Lock;
+    /* The extent map.  Each extent is a WVL_S_DISK_OVERLAY_EXTENT_. */
+    WV_S_EXTMAP Map;
+    UINT32 SectorsPerExtent;
+  };
+
+/* A read which needs the disk, then the overlay. */
+typedef struct WVL_DISK_OVERLAY_READ_ {
+    WVL_SP_DISK_T Disk;
+    /* The original request. */
+    PIRP Irp;
+    PUCHAR Buffer;
+    LONGLONG StartSector;
+    UINT32 SectorCount;
+    /* What the disk is sent. */
+    SCSI_REQUEST_BLOCK Srb;
+  } WVL_S_DISK_OVERLAY_READ_, * WVL_SP_DISK_OVERLAY_READ_;
+
+/*** Function declarations */
+IO_COMPLETION_ROUTINE WvlDiskOverlayReadDone;
+WVL_F_DISK_IO WvlDiskOverlayIo;
+static WV_F_EXTMAP_FREE WvlDiskOverlayExtentFree_;
+
+/* From scsi.c */
+extern PIRP STDCALL WvlDiskScsiSubIrp(
+    IN WVL_SP_DISK_T,
+    IN WVL_E_DISK_IO_MODE,
+    IN LONGLONG,
+    IN UINT32,
+    IN PUCHAR,
+    IN PIRP,
+    IN PSCSI_REQUEST_BLOCK,
+    IN PIO_COMPLETION_ROUTINE,
+    IN PVOID
+  );
+extern VOID STDCALL WvlDiskScsiSubIrpFree(IN PIRP);
+
+/* From cache.c */
+extern WVL_F_DISK_IO WvlDiskCacheIo;
+
+/*** Function definitions */
+
+/**
+ * Free an overlay's extent.
+ *
+ * @v ptr               The WVL_S_DISK_OVERLAY_EXTENT_ to free, or NULL.
+ */
+static VOID WvlDiskOverlayExtentFree_(IN PVOID ptr) {
+    WVL_SP_DISK_OVERLAY_EXTENT_ extent = ptr;
+
+    if (!extent)
+      return;
+    WvExtentFree(extent->Extent);
+    wv_free(extent);
+  }
+
+/**
+ * Allocate an extent for an overlay.
+ *
+ * @ret WVL_SP_DISK_OVERLAY_EXTENT_     The extent, holding no sectors,
+ *                                      or NULL.
+ */
+static WVL_SP_DISK_OVERLAY_EXTENT_ WvlDiskOverlayExtentAlloc_(void) {
+    WVL_SP_DISK_OVERLAY_EXTENT_ extent;
+
+    extent = wv_mallocz(sizeof *extent);
+    if (!extent)
+      return NULL;
+    extent->Extent = WvExtentAlloc();
+    if (!extent->Extent) {
+        wv_free(extent);
+        return NULL;
+      }
+    return extent;
+  }
+
+/**
+ * Count the sectors of a range which an overlay holds.
+ *
+ * @v overlay           The overlay.
+ * @v start_sector      The first sector of the range.
+ * @v sector_count      The number of sectors in the range.
+ * @ret UINT32          The number of those sectors held by the overlay.
+ */
+static UINT32 WvlDiskOverlayCount_(
+    IN WVL_SP_DISK_OVERLAY overlay,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count
+  ) {
+    WVL_SP_DISK_OVERLAY_EXTENT_ extent;
+    UINT32 held = 0, index, sector;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&overlay->Lock, &irql);
+    while (sector_count) {
+        index = (UINT32) (start_sector / overlay->SectorsPerExtent);
+        sector = (UINT32) (start_sector % overlay->SectorsPerExtent);
+        extent = WvExtMapGet(&overlay->Map, index);
+        if (!extent) {
+            /* Skip the rest of the extent. */
+            sector = overlay->SectorsPerExtent - sector;
+            if (sector > sector_count)
+              sector = sector_count;
+            start_sector += sector;
+            sector_count -= sector;
+            continue;
+          }
+        if (extent->Valid[sector >> 3] & (1 << (sector & 7)))
+          held++;
+        start_sector++;
+        sector_count--;
+      }
+    KeReleaseSpinLock(&overlay->Lock, irql);
+    return held;
+  }
+
+/**
+ * Copy the sectors of a range which an overlay holds to a buffer.
+ *
+ * @v disk              The disk with the overlay.
+ * @v start_sector      The first sector of the range.
+ * @v sector_count      The number of sectors in the range.
+ * @v buffer            The buffer for the range.  Sectors which the
+ *                      overlay doesn't hold are left alone.
+ * @ret NTSTATUS        The status of the operation.
+ */
+static NTSTATUS WvlDiskOverlayCopyOut_(
+    IN WVL_SP_DISK_T disk,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    OUT PUCHAR buffer
+  ) {
+    WVL_SP_DISK_OVERLAY overlay = disk->Overlay;
+    WVL_SP_DISK_OVERLAY_EXTENT_ extent;
+    UINT32 index, sector, run;
+    NTSTATUS status = STATUS_SUCCESS;
+    PUCHAR data;
+    KIRQL irql;
+
+    KeAcquireSpinLock(&overlay->Lock, &irql);
+    while (sector_count) {
+        index = (UINT32) (start_sector / overlay->SectorsPerExtent);
+        sector = (UINT32) (start_sector % overlay->SectorsPerExtent);
+        extent = WvExtMapGet(&overlay->Map, index);
+        /* Find a run of sectors which are all held, or all not held. */
+        run = 0;
+        do {
+            run++;
+          } while (
+            run < sector_count &&
+            sector + run < overlay->SectorsPerExtent &&
+            extent &&
+            !(extent->Valid[sector >> 3] & (1 << (sector & 7))) ==
+            !(extent->Valid[(sector + run) >> 3] & (1 << ((sector + run) & 7)))
+          );
+        if (!extent) {
+            run = overlay->SectorsPerExtent - sector;
+            if (run > sector_count)
+              run = sector_count;
+          } else if (extent->Valid[sector >> 3] & (1 << (sector & 7))) {
+            data = WvExtentMap(extent->Extent);
+            if (!data) {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+              }
+            WvlCopyMemory(
+                buffer,
+                data + sector * disk->SectorSize,
+                run * disk->SectorSize
+              );
+            WvExtentUnmap(extent->Extent);
+          }
+        start_sector += run;
+        sector_count -= run;
+        buffer += run * disk->SectorSize;
+      }
+    KeReleaseSpinLock(&overlay->Lock, irql);
+    return status;
+  }
+
+/**
+ * Get an extent of an overlay for writing, allocating it if needed.
+ *
+ * @v overlay           The overlay.
+ * @v index             The extent's index.
+ * @v irql              Receives the IRQL to restore, upon success.
+ * @ret WVL_SP_DISK_OVERLAY_EXTENT_     The extent, or NULL if memory is
+ *                                      exhausted.
+ *
+ * Upon success, the overlay's lock is held, and the caller must release it.
+ */
+static WVL_SP_DISK_OVERLAY_EXTENT_ WvlDiskOverlayExtentGet_(
+    IN WVL_SP_DISK_OVERLAY overlay,
+    IN UINT32 index,
+    OUT PKIRQL irql
+  ) {
+    PVOID * table = NULL;
+    PVOID extent = NULL;
+    WVL_SP_DISK_OVERLAY_EXTENT_ got;
+    BOOLEAN has_table;
+
+    KeAcquireSpinLock(&overlay->Lock, irql);
+    got = WvExtMapGet(&overlay->Map, index);
+    if (got)
+      return got;
+    has_table = (BOOLEAN) WvExtMapHasTable(&overlay->Map, index);
+    KeReleaseSpinLock(&overlay->Lock, *irql);
+
+    /* Allocate without holding the lock, then check again. */
+    if (!has_table) {
+        table = WvExtMapTableAlloc();
+        if (!table)
+          goto err_table;
+      }
+    extent = WvlDiskOverlayExtentAlloc_();
+    if (!extent)
+      goto err_extent;
+
+    KeAcquireSpinLock(&overlay->Lock, irql);
+    got = WvExtMapInsert(&overlay->Map, index, &table, &extent);
+    /* Anything left over lost a race, so is freed here. */
+    WvlDiskOverlayExtentFree_(extent);
+    wv_free(table);
+    return got;
+
+    err_extent:
+
+    wv_free(table);
+    err_table:
+
+    DBG("Could not allocate overlay extent %u!\n", index);
+    return NULL;
+  }
+
+/**
+ * Write a range of sectors to an overlay.
+ *
+ * @v disk              The disk with the overlay.
+ * @v start_sector      The first sector of the range.
+ * @v sector_count      The number of sectors in the range.
+ * @v buffer            The data for the range.
+ * @ret NTSTATUS        The status of the operation.
+ */
+static NTSTATUS WvlDiskOverlayWrite_(
+    IN WVL_SP_DISK_T disk,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer
+  ) {
+    WVL_SP_DISK_OVERLAY overlay = disk->Overlay;
+    WVL_SP_DISK_OVERLAY_EXTENT_ extent;
+    UINT32 index, sector, count, i;
+    PUCHAR data;
+    KIRQL irql;
+
+    while (sector_count) {
+        index = (UINT32) (start_sector / overlay->SectorsPerExtent);
+        sector = (UINT32) (start_sector % overlay->SectorsPerExtent);
+        count = overlay->SectorsPerExtent - sector;
+        if (count > sector_count)
+          count = sector_count;
+
+        extent = WvlDiskOverlayExtentGet_(overlay, index, &irql);
+        if (!extent)
+          return STATUS_INSUFFICIENT_RESOURCES;
+        data = WvExtentMap(extent->Extent);
+        if (!data) {
+            KeReleaseSpinLock(&overlay->Lock, irql);
+            return STATUS_INSUFFICIENT_RESOURCES;
+          }
+        WvlCopyMemory(
+            data + sector * disk->SectorSize,
+            buffer,
+            count * disk->SectorSize
+          );
+        WvExtentUnmap(extent->Extent);
+        for (i = sector; i < sector + count; i++)
+          extent->Valid[i >> 3] |= 1 << (i & 7);
+        KeReleaseSpinLock(&overlay->Lock, irql);
+
+        start_sector += count;
+        sector_count -= count;
+        buffer += count * disk->SectorSize;
+      }
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Read a range from a disk, then patch it from the disk's overlay.
+ *
+ * @v disk              The disk with the overlay.
+ * @v start_sector      The first sector of the range.
+ * @v sector_count      The number of sectors in the range.
+ * @v buffer            The buffer for the range.
+ * @v irp               The IRP for the read, to be completed.
+ * @ret NTSTATUS        The status of the operation.
+ *
+ * The disk is sent a SCSI READ(16) IRP of our own, for the same buffer.
+ */
+static NTSTATUS WvlDiskOverlayRead_(
+    IN WVL_SP_DISK_T disk,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer,
+    IN PIRP irp
+  ) {
+    WVL_SP_DISK_OVERLAY_READ_ read;
+    WVL_FP_DISK_IO io;
+    PIRP sub_irp;
+
+    read = wv_mallocz(sizeof *read);
+    if (!read)
+      goto err_read;
+    read->Disk = disk;
+    read->Irp = irp;
+    read->Buffer = buffer;
+    read->StartSector = start_sector;
+    read->SectorCount = sector_count;
+
+    sub_irp = WvlDiskScsiSubIrp(
+        disk,
+        WvlDiskIoModeRead,
+        start_sector,
+        sector_count,
+        buffer,
+        irp,
+        &read->Srb,
+        WvlDiskOverlayReadDone,
+        read
+      );
+    if (!sub_irp)
+      goto err_irp;
+
+    IoMarkIrpPending(irp);
+    io = disk->Cache ? WvlDiskCacheIo : disk->disk_ops.Io;
+    io(disk, WvlDiskIoModeRead, start_sector, sector_count, buffer, sub_irp);
+    return STATUS_PENDING;
+
+    err_irp:
+
+    wv_free(read);
+    err_read:
+
+    DBG("Couldn't read through overlay!\n");
+    return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+  }
+
+/* Finish a read from WvlDiskOverlayRead_. */
+NTSTATUS STDCALL WvlDiskOverlayReadDone(
+    IN PDEVICE_OBJECT dev_obj,
+    IN PIRP sub_irp,
+    IN PVOID context
+  ) {
+    WVL_SP_DISK_OVERLAY_READ_ read = context;
+    NTSTATUS status = sub_irp->IoStatus.Status;
+
+    if (NT_SUCCESS(status)) {
+        status = WvlDiskOverlayCopyOut_(
+            read->Disk,
+            read->StartSector,
+            read->SectorCount,
+            read->Buffer
+          );
+      }
+    WvlDiskScsiSubIrpFree(sub_irp);
+    WvlIrpComplete(
+        read->Irp,
+        NT_SUCCESS(status) ? read->SectorCount * read->Disk->SectorSize : 0,
+        status
+      );
+    wv_free(read);
+    /* The IRP is gone. */
+    return STATUS_MORE_PROCESSING_REQUIRED;
+  }
+
+/* Disk I/O through an overlay.  See WVL_F_DISK_IO in the header. */
+NTSTATUS STDCALL WvlDiskOverlayIo(
+    IN WVL_SP_DISK_T disk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer,
+    IN PIRP irp
+  ) {
+    WVL_FP_DISK_IO io;
+    NTSTATUS status;
+    UINT32 held;
+
+    if (
+        start_sector < 0 ||
+        (ULONGLONG) start_sector + sector_count > disk->LBADiskSize
+      )
+      return WvlIrpComplete(irp, 0, STATUS_INVALID_PARAMETER);
+
+    if (mode == WvlDiskIoModeWrite) {
+        status = WvlDiskOverlayWrite_(disk, start_sector, sector_count, buffer);
+        return WvlIrpComplete(
+            irp,
+            NT_SUCCESS(status) ? sector_count * disk->SectorSize : 0,
+            status
+          );
+      }
+
+    held = WvlDiskOverlayCount_(disk->Overlay, start_sector, sector_count);
+    if (!held) {
+        io = disk->Cache ? WvlDiskCacheIo : disk->disk_ops.Io;
+        return io(disk, mode, start_sector, sector_count, buffer, irp);
+      }
+    if (held == sector_count) {
+        status = WvlDiskOverlayCopyOut_(
+            disk,
+            start_sector,
+            sector_count,
+            buffer
+          );
+        return WvlIrpComplete(
+            irp,
+            NT_SUCCESS(status) ? sector_count * disk->SectorSize : 0,
+            status
+          );
+      }
+    return WvlDiskOverlayRead_(disk, start_sector, sector_count, buffer, irp);
+  }
+
+/* See the header for details. */
+WVL_M_LIB NTSTATUS STDCALL WvlDiskOverlayCreate(IN OUT WVL_SP_DISK_T Disk) {
+    WVL_SP_DISK_OVERLAY overlay;
+    ULONGLONG extents;
+
+    if (Disk->Overlay)
+      return STATUS_SUCCESS;
+    if (
+        Disk->SectorSize < 512 ||
+        Disk->SectorSize > WVL_M_DISK_OVERLAY_EXTENT_SIZE_ ||
+        WVL_M_DISK_OVERLAY_EXTENT_SIZE_ % Disk->SectorSize ||
+        !Disk->LBADiskSize
+      ) {
+        DBG("Can't overlay a disk with this geometry!\n");
+        return STATUS_INVALID_PARAMETER;
+      }
+
+    overlay = wv_mallocz(sizeof *overlay);
+    if (!overlay)
+      goto err_overlay;
+    KeInitializeSpinLock(&overlay->Lock);
+    overlay->SectorsPerExtent =
+      WVL_M_DISK_OVERLAY_EXTENT_SIZE_ / Disk->SectorSize;
+    extents = (
+        Disk->LBADiskSize + overlay->SectorsPerExtent - 1
+      ) / overlay->SectorsPerExtent;
+    if (extents > WV_M_EXTMAP_MAX_EXTENTS)
+      goto err_extents;
+    /* Only the table of tables is allocated up-front. */
+    if (!WvExtMapInit(&overlay->Map, (UINT32) extents))
+      goto err_tables;
+
+    Disk->Overlay = overlay;
+    DBG("Disk %p now has a copy-on-write overlay\n", (PVOID) Disk);
+    return STATUS_SUCCESS;
+
+    err_tables:
+    err_extents:
+
+    wv_free(overlay);
+    err_overlay:
+
+    DBG("Couldn't create overlay!\n");
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+/* See the header for details. */
+WVL_M_LIB VOID STDCALL WvlDiskOverlayFree(IN OUT WVL_SP_DISK_T Disk) {
+    WVL_SP_DISK_OVERLAY overlay = Disk->Overlay;
+
+    if (!overlay)
+      return;
+    Disk->Overlay = NULL;
+    WvExtMapFree(&overlay->Map, WvlDiskOverlayExtentFree_);
+    wv_free(overlay);
+    return;
+  }
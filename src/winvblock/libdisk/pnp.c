@@ -241,6 +241,8 @@ static NTSTATUS STDCALL WvlDiskPnpSimple_(
           DBG("IRP_MN_START_DEVICE\n");
           disk->OldState = disk->State;
           disk->State = WvlDiskStateStarted;
+          /* A disk works without its cache. */
+          WvlDiskCacheCreate(disk);
           status = STATUS_SUCCESS;
           break;
 
@@ -273,6 +275,7 @@ static NTSTATUS STDCALL WvlDiskPnpSimple_(
 
         case IRP_MN_REMOVE_DEVICE:
           DBG("IRP_MN_REMOVE_DEVICE\n");
+          WvlDiskCacheFree(disk);
           disk->OldState = disk->State;
           disk->State = WvlDiskStateNotStarted;
           status = STATUS_SUCCESS;
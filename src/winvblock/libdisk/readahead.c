@@ -0,0 +1,140 @@
+/**
+ * Copyright (C) 2009-2011, Shao Miller <shao.miller@yrdsb.edu.on.ca>.
+ * Copyright 2006-2008, V.
+ * For WinAoE contact information, see http://winaoe.org/
+ *
+ * This file is part of WinVBlock, derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Sequential read detection, for read-ahead.
+ *
+ * Each disk which reads ahead tracks a few streams of reads.  A read
+ * which starts where a stream's last read ended, or within what has
+ * already been read ahead for it, continues that stream; any other
+ * read starts a new stream in place of the least recently used one.
+ * This lets several interleaved sequential readers each be detected.
+ *
+ * Once a stream has two reads in a row, the sectors after it are read
+ * ahead, into the disk's block cache.  Each time a stream's reader gets
+ * within half a window of the end of what was read ahead, the next
+ * window is read ahead and the window doubles, up to a limit given by
+ * the caller.  When blocks which were read ahead are replaced without
+ * being used, every stream's window is halved.
+ *
+ * src/host/rasim replays traces through this file unchanged.  The
+ * caller does the locking.
+ */
+
+#include "wv_stdlib.h"
+#include "readahead.h"
+
+/* Create a disk's stream detector. */
+WVL_SP_DISK_READAHEAD WvlDiskReadAheadCreate(void) {
+    return wv_mallocz(sizeof (WVL_S_DISK_READAHEAD));
+  }
+
+/* Release a disk's stream detector. */
+void WvlDiskReadAheadFree(WVL_SP_DISK_READAHEAD ra) {
+    wv_free(ra);
+    return;
+  }
+
+/**
+ * Note a read, and find what to read ahead of it.
+ *
+ * @v ra                The disk's stream detector.
+ * @v start_sector      The first sector read.
+ * @v sector_count      The number of sectors read.
+ * @v window_max        The most to read ahead at once, in sectors.
+ * @v ahead_start       Filled with the first sector to read ahead.
+ * @v ahead_count       Filled with the number of sectors to read ahead.
+ * @ret int             1 if sectors should be read ahead, else 0.
+ *
+ * The caller serializes calls for a disk, and is expected to read ahead
+ * whatever is returned; the range can extend past the end of the disk.
+ */
+int WvlDiskReadAheadNote(
+    WVL_SP_DISK_READAHEAD ra,
+    unsigned long long start_sector,
+    unsigned int sector_count,
+    unsigned int window_max,
+    unsigned long long * ahead_start,
+    unsigned int * ahead_count
+  ) {
+    WVL_SP_DISK_READAHEAD_STREAM stream, victim;
+    unsigned long long end = start_sector + sector_count;
+    unsigned int i;
+
+    ra->Clock++;
+    victim = ra->Streams;
+    for (i = 0; i < WVL_M_DISK_READAHEAD_STREAMS; i++) {
+        stream = ra->Streams + i;
+        if (
+            stream->Run &&
+            start_sector >= stream->Next &&
+            start_sector <= stream->Ahead
+          )
+          break;
+        if (!stream->Run) {
+            victim = stream;
+            continue;
+          }
+        if (victim->Run && ra->Clock - stream->Used > ra->Clock - victim->Used)
+          victim = stream;
+      }
+    if (i == WVL_M_DISK_READAHEAD_STREAMS) {
+        /* A new stream. */
+        victim->Next = victim->Ahead = end;
+        victim->Window = 0;
+        victim->Run = 1;
+        victim->Used = ra->Clock;
+        return 0;
+      }
+
+    stream->Run++;
+    stream->Used = ra->Clock;
+    stream->Next = end;
+    /* The reader has overtaken reading ahead. */
+    if (stream->Ahead < end)
+      stream->Ahead = end;
+    if (!stream->Window)
+      stream->Window = sector_count * 2;
+    if (stream->Window > window_max)
+      stream->Window = window_max;
+    if (!stream->Window || stream->Ahead - end >= stream->Window / 2)
+      return 0;
+
+    *ahead_start = stream->Ahead;
+    *ahead_count = (unsigned int) (end + stream->Window - stream->Ahead);
+    stream->Ahead = end + stream->Window;
+    /* Ramp up while the stream lasts. */
+    stream->Window = stream->Window < window_max / 2 ?
+      stream->Window * 2 :
+      window_max;
+    return 1;
+  }
+
+/* Shrink every stream's window, after a read-ahead block went unused. */
+void WvlDiskReadAheadWaste(WVL_SP_DISK_READAHEAD ra) {
+    unsigned int i;
+
+    for (i = 0; i < WVL_M_DISK_READAHEAD_STREAMS; i++)
+      ra->Streams[i].Window /= 2;
+    return;
+  }
@@ -29,6 +29,7 @@
 #include <scsi.h>
 #include <ntdddisk.h>
 #include <ntddcdrm.h>
+#include <srb.h>
 
 #include "portable.h"
 #include "winvblock.h"
@@ -65,6 +66,8 @@ WVL_F_DISK_SCSI_ WvlDiskScsiReadCapacity_;
 WVL_F_DISK_SCSI_ WvlDiskScsiReadCapacity16_;
 WVL_F_DISK_SCSI_ WvlDiskScsiModeSense_;
 WVL_F_DISK_SCSI_ WvlDiskScsiReadToc_;
+WVL_F_DISK_SCSI_ WvlDiskScsiUnmap_;
+WVL_F_DISK_SCSI_ WvlDiskScsiFlush_;
 WV_F_DEV_SCSI disk_scsi__dispatch;
 
 #if _WIN32_WINNT <= 0x0600
@@ -141,6 +144,39 @@ typedef struct _DISK_CDB16 DISK_CDB16, * PDISK_CDB16;
 }
 #endif          /* if _WIN32_WINNT <= 0x0600 */
 
+#ifndef SCSIOP_UNMAP
+#  define SCSIOP_UNMAP 0x42
+#endif
+#ifndef SCSIOP_SYNCHRONIZE_CACHE16
+#  define SCSIOP_SYNCHRONIZE_CACHE16 0x91
+#endif
+#ifndef SCSIOP_WRITE_SAME
+#  define SCSIOP_WRITE_SAME 0x41
+#endif
+#ifndef SCSIOP_WRITE_SAME16
+#  define SCSIOP_WRITE_SAME16 0x93
+#endif
+
+/* The UNMAP parameter list header and block descriptors (SBC-3). */
+#define WVL_M_DISK_UNMAP_HEADER_SIZE_ 8
+#define WVL_M_DISK_UNMAP_DESC_SIZE_ 16
+
+/* Vital product data pages (SPC-3, SBC-3). */
+#define WVL_M_DISK_VPD_SUPPORTED_ 0x00
+#define WVL_M_DISK_VPD_BLOCK_LIMITS_ 0xB0
+#define WVL_M_DISK_VPD_PROVISIONING_ 0xB2
+#define WVL_M_DISK_VPD_BLOCK_LIMITS_SIZE_ 0x40
+#define WVL_M_DISK_VPD_PROVISIONING_SIZE_ 8
+
+/* READ CAPACITY(16) data, with the provisioning bits (SBC-3). */
+#define WVL_M_DISK_READ_CAPACITY16_SIZE_ 32
+#define WVL_M_DISK_READ_CAPACITY16_LBPME_ 0x80
+#define WVL_M_DISK_READ_CAPACITY16_LBPRZ_ 0x40
+
+/* Whether a disk can pass unmapped sectors on. */
+#define WVL_M_DISK_CAN_UNMAP_(disk) \
+  ((disk)->disk_ops.Unmap && !(disk)->Overlay)
+
 static NTSTATUS STDCALL WvlDiskScsiReadWrite_(
     IN WVL_SP_DISK_T disk,
     IN PIRP irp,
@@ -308,6 +344,7 @@ static NTSTATUS STDCALL WvlDiskScsiReadCapacity16_(
   ) {
     UINT32 temp;
     LONGLONG big_temp;
+    PUCHAR data;
 
     temp = disk->SectorSize;
     REVERSE_BYTES(
@@ -321,7 +358,100 @@ static NTSTATUS STDCALL WvlDiskScsiReadCapacity16_(
         &big_temp
       );
     irp->IoStatus.Information = sizeof (READ_CAPACITY_DATA_EX);
+
+    /* Report thin provisioning, if there's room for the full reply. */
+    if (srb->DataTransferLength >= WVL_M_DISK_READ_CAPACITY16_SIZE_) {
+        data = srb->DataBuffer;
+        RtlZeroMemory(
+            data + sizeof (READ_CAPACITY_DATA_EX),
+            WVL_M_DISK_READ_CAPACITY16_SIZE_ - sizeof (READ_CAPACITY_DATA_EX)
+          );
+        if (WVL_M_DISK_CAN_UNMAP_(disk)) {
+            data[14] =
+              WVL_M_DISK_READ_CAPACITY16_LBPME_ |
+              WVL_M_DISK_READ_CAPACITY16_LBPRZ_;
+          }
+        irp->IoStatus.Information = WVL_M_DISK_READ_CAPACITY16_SIZE_;
+      }
+    srb->SrbStatus = SRB_STATUS_SUCCESS;
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Reply to an INQUIRY for vital product data.
+ *
+ * A standard INQUIRY, or one for a page we don't have, gets no data, as
+ * before.  The block limits and logical block provisioning pages are
+ * only offered for a disk which can unmap, so that Windows will send it
+ * UNMAP and WRITE SAME.
+ */
+static NTSTATUS STDCALL WvlDiskScsiInquiry_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp,
+    IN PSCSI_REQUEST_BLOCK srb,
+    IN PCDB cdb,
+    OUT PBOOLEAN completion
+  ) {
+    UCHAR page[WVL_M_DISK_VPD_BLOCK_LIMITS_SIZE_];
+    UINT32 len, temp;
+    BOOLEAN can_unmap = WVL_M_DISK_CAN_UNMAP_(disk) ? TRUE : FALSE;
+
     srb->SrbStatus = SRB_STATUS_SUCCESS;
+    irp->IoStatus.Information = 0;
+    /* Not EVPD. */
+    if (!(cdb->AsByte[1] & 1))
+      return STATUS_SUCCESS;
+
+    RtlZeroMemory(page, sizeof page);
+    page[1] = cdb->AsByte[2];
+    switch (cdb->AsByte[2]) {
+        case WVL_M_DISK_VPD_SUPPORTED_:
+          len = 4;
+          page[len++] = WVL_M_DISK_VPD_SUPPORTED_;
+          if (can_unmap) {
+              page[len++] = WVL_M_DISK_VPD_BLOCK_LIMITS_;
+              page[len++] = WVL_M_DISK_VPD_PROVISIONING_;
+            }
+          break;
+
+        case WVL_M_DISK_VPD_BLOCK_LIMITS_:
+          if (!can_unmap)
+            goto err_page;
+          len = WVL_M_DISK_VPD_BLOCK_LIMITS_SIZE_;
+          /* WSNZ: a WRITE SAME of zero blocks isn't "to the end". */
+          page[4] = 1;
+          /* No limits on UNMAP LBAs or descriptors. */
+          temp = 0xFFFFFFFF;
+          REVERSE_BYTES(page + 20, &temp);
+          REVERSE_BYTES(page + 24, &temp);
+          break;
+
+        case WVL_M_DISK_VPD_PROVISIONING_:
+          if (!can_unmap)
+            goto err_page;
+          len = WVL_M_DISK_VPD_PROVISIONING_SIZE_;
+          /* LBPU, LBPWS, LBPWS10 and LBPRZ. */
+          page[5] = 0x80 | 0x40 | 0x20 | 0x04;
+          /* Thin provisioned. */
+          page[6] = 2;
+          break;
+
+        default:
+          goto err_page;
+      }
+    /* The page length. */
+    page[3] = (UCHAR) (len - 4);
+
+    if (len > srb->DataTransferLength)
+      len = srb->DataTransferLength;
+    RtlCopyMemory(srb->DataBuffer, page, len);
+    srb->DataTransferLength = len;
+    irp->IoStatus.Information = len;
+    return STATUS_SUCCESS;
+
+    err_page:
+
+    DBG("Unsupported VPD page %02x\n", cdb->AsByte[2]);
     return STATUS_SUCCESS;
   }
 
@@ -376,6 +506,108 @@ static NTSTATUS STDCALL WvlDiskScsiReadToc_(
     return STATUS_SUCCESS;
   }
 
+static NTSTATUS STDCALL WvlDiskScsiUnmap_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp,
+    IN PSCSI_REQUEST_BLOCK srb,
+    IN PCDB cdb,
+    OUT PBOOLEAN completion
+  ) {
+    PUCHAR desc = srb->DataBuffer;
+    UINT32 len = srb->DataTransferLength;
+    USHORT desc_len;
+    LONGLONG start_sector;
+    UINT32 sector_count;
+    NTSTATUS status;
+
+    if (!WVL_M_DISK_CAN_UNMAP_(disk) || len < WVL_M_DISK_UNMAP_HEADER_SIZE_) {
+        srb->SrbStatus = SRB_STATUS_ERROR;
+        return STATUS_NOT_SUPPORTED;
+      }
+    REVERSE_BYTES_SHORT(&desc_len, desc + 2);
+    if (desc_len > len - WVL_M_DISK_UNMAP_HEADER_SIZE_)
+      desc_len = (USHORT) (len - WVL_M_DISK_UNMAP_HEADER_SIZE_);
+    desc += WVL_M_DISK_UNMAP_HEADER_SIZE_;
+    while (desc_len >= WVL_M_DISK_UNMAP_DESC_SIZE_) {
+        REVERSE_BYTES_QUAD(&start_sector, desc);
+        REVERSE_BYTES(&sector_count, desc + 8);
+        status = WvlDiskUnmap(disk, start_sector, sector_count);
+        if (!NT_SUCCESS(status)) {
+            srb->SrbStatus = SRB_STATUS_ERROR;
+            return status;
+          }
+        desc += WVL_M_DISK_UNMAP_DESC_SIZE_;
+        desc_len -= WVL_M_DISK_UNMAP_DESC_SIZE_;
+      }
+    srb->SrbStatus = SRB_STATUS_SUCCESS;
+    return STATUS_SUCCESS;
+  }
+
+/**
+ * Handle a WRITE SAME of zeroes by unmapping the sectors.
+ *
+ * Unmapped sectors read back as zeroes, so this is done with or without
+ * the UNMAP bit.  Any other data isn't supported.
+ */
+static NTSTATUS STDCALL WvlDiskScsiWriteSame_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp,
+    IN PSCSI_REQUEST_BLOCK srb,
+    IN PCDB cdb,
+    OUT PBOOLEAN completion
+  ) {
+    LONGLONG start_sector;
+    UINT32 sector_count;
+    USHORT short_count;
+    UINT32 temp;
+    NTSTATUS status;
+
+    if (cdb->AsByte[0] == SCSIOP_WRITE_SAME16) {
+        REVERSE_BYTES_QUAD(&start_sector, cdb->AsByte + 2);
+        REVERSE_BYTES(&sector_count, cdb->AsByte + 10);
+      } else {
+        REVERSE_BYTES(&temp, cdb->AsByte + 2);
+        start_sector = temp;
+        REVERSE_BYTES_SHORT(&short_count, cdb->AsByte + 7);
+        sector_count = short_count;
+      }
+    if (
+        !WVL_M_DISK_CAN_UNMAP_(disk) ||
+        !sector_count ||
+        srb->DataTransferLength < disk->SectorSize ||
+        !WvlDiskIsZero(srb->DataBuffer, disk->SectorSize)
+      ) {
+        srb->SrbStatus = SRB_STATUS_ERROR;
+        return STATUS_NOT_SUPPORTED;
+      }
+    status = WvlDiskUnmap(disk, start_sector, sector_count);
+    if (!NT_SUCCESS(status)) {
+        srb->SrbStatus = SRB_STATUS_ERROR;
+        return status;
+      }
+    srb->SrbStatus = SRB_STATUS_SUCCESS;
+    return STATUS_SUCCESS;
+  }
+
+static NTSTATUS STDCALL WvlDiskScsiFlush_(
+    IN WVL_SP_DISK_T disk,
+    IN PIRP irp,
+    IN PSCSI_REQUEST_BLOCK srb,
+    IN PCDB cdb,
+    OUT PBOOLEAN completion
+  ) {
+    NTSTATUS status;
+
+    /* The cache sets SrbStatus on failure, if it completes the IRP. */
+    srb->SrbStatus = SRB_STATUS_SUCCESS;
+    status = WvlDiskCacheFlush(disk, irp);
+    if (status == STATUS_PENDING)
+      *completion = TRUE;
+      else if (!NT_SUCCESS(status))
+      srb->SrbStatus = SRB_STATUS_ERROR;
+    return status;
+  }
+
 /**
  * Handle a disk SCSI IRP.
  *
@@ -466,6 +698,15 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskScsi(
                 break;
 
               case SCSIOP_INQUIRY:
+                status = WvlDiskScsiInquiry_(
+                    disk,
+                    irp,
+                    srb,
+                    cdb,
+                    &completion
+                  );
+                break;
+
               case SCSIOP_MEDIUM_REMOVAL:
                 irp->IoStatus.Information = 0;
                 srb->SrbStatus = SRB_STATUS_SUCCESS;
@@ -482,6 +723,38 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskScsi(
                   );
                 break;
 
+              case SCSIOP_SYNCHRONIZE_CACHE:
+              case SCSIOP_SYNCHRONIZE_CACHE16:
+                status = WvlDiskScsiFlush_(
+                    disk,
+                    irp,
+                    srb,
+                    cdb,
+                    &completion
+                  );
+                break;
+
+              case SCSIOP_UNMAP:
+                status = WvlDiskScsiUnmap_(
+                    disk,
+                    irp,
+                    srb,
+                    cdb,
+                    &completion
+                  );
+                break;
+
+              case SCSIOP_WRITE_SAME:
+              case SCSIOP_WRITE_SAME16:
+                status = WvlDiskScsiWriteSame_(
+                    disk,
+                    irp,
+                    srb,
+                    cdb,
+                    &completion
+                  );
+                break;
+
               default:
                 DBG("Invalid SCSIOP (%02x)!!\n", cdb->AsByte[0]);
                 srb->SrbStatus = SRB_STATUS_ERROR;
@@ -503,7 +776,7 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskScsi(
 
         case SRB_FUNCTION_SHUTDOWN:
         case SRB_FUNCTION_FLUSH:
-          srb->SrbStatus = SRB_STATUS_SUCCESS;
+          status = WvlDiskScsiFlush_(disk, irp, srb, cdb, &completion);
           break;
 
         default:
@@ -519,3 +792,142 @@ WVL_M_LIB NTSTATUS STDCALL WvlDiskScsi(
       }
     return status;
   }
+
+/**
+ * Check whether a disk SCSI IRP would unmap sectors.
+ *
+ * @v Irp               The IRP_MJ_SCSI IRP.
+ * @ret BOOLEAN         TRUE for an UNMAP or a WRITE SAME.
+ *
+ * A disk whose unmap routine must run at PASSIVE_LEVEL, or in its own
+ * thread, can use this to pass such IRPs to WvlDiskScsi from there.
+ */
+WVL_M_LIB BOOLEAN STDCALL WvlDiskScsiUnmaps(IN PIRP Irp) {
+    PSCSI_REQUEST_BLOCK srb =
+      IoGetCurrentIrpStackLocation(Irp)->Parameters.Scsi.Srb;
+
+    if (srb->Function != SRB_FUNCTION_EXECUTE_SCSI)
+      return FALSE;
+    switch (srb->Cdb[0]) {
+        case SCSIOP_UNMAP:
+        case SCSIOP_WRITE_SAME:
+        case SCSIOP_WRITE_SAME16:
+          return TRUE;
+
+        default:
+          return FALSE;
+      }
+  }
+
+/**
+ * Build a SCSI READ(16) or WRITE(16) IRP for a disk's I/O routine.
+ *
+ * @v disk              The disk which will be sent the IRP.
+ * @v mode              Read or write.
+ * @v start_sector      The first sector to read or write.
+ * @v sector_count      The number of sectors to read or write.
+ * @v buffer            The data buffer.
+ * @v parent            Optional.  An IRP whose MDL describes the buffer.
+ *                      If NULL, the buffer must be in non-paged pool.
+ * @v srb               A SCSI request block for the IRP, which must
+ *                      remain valid until the IRP is completed.
+ * @v done              The IRP's completion routine.  This must call
+ *                      WvlDiskScsiSubIrpFree and return
+ *                      STATUS_MORE_PROCESSING_REQUIRED.
+ * @v context           Context for the completion routine.
+ * @ret PIRP            The IRP, or NULL if it couldn't be built.
+ *
+ * Some disks process a SCSI IRP again from another thread, so the
+ * disk library passes its own requests to a disk in this form.
+ */
+PIRP STDCALL WvlDiskScsiSubIrp(
+    IN WVL_SP_DISK_T disk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer,
+    IN PIRP parent,
+    IN PSCSI_REQUEST_BLOCK srb,
+    IN PIO_COMPLETION_ROUTINE done,
+    IN PVOID context
+  ) {
+    UINT32 len = sector_count * disk->SectorSize;
+    PIO_STACK_LOCATION io_stack_loc;
+    PUCHAR va;
+    PMDL mdl;
+    PIRP irp;
+    int i;
+
+    /* Describe the buffer. */
+    if (parent && parent->MdlAddress) {
+        va = (PUCHAR) MmGetMdlVirtualAddress(parent->MdlAddress) + (
+            buffer -
+            (PUCHAR) MmGetSystemAddressForMdlSafe(
+                parent->MdlAddress,
+                HighPagePriority
+              )
+          );
+        mdl = IoAllocateMdl(va, len, FALSE, FALSE, NULL);
+        if (!mdl)
+          goto err_mdl;
+        IoBuildPartialMdl(parent->MdlAddress, mdl, va, len);
+      } else {
+        mdl = IoAllocateMdl(buffer, len, FALSE, FALSE, NULL);
+        if (!mdl)
+          goto err_mdl;
+        MmBuildMdlForNonPagedPool(mdl);
+      }
+
+    RtlZeroMemory(srb, sizeof *srb);
+    srb->Length = sizeof *srb;
+    srb->Function = SRB_FUNCTION_EXECUTE_SCSI;
+    srb->SrbFlags = (
+        mode == WvlDiskIoModeWrite ? SRB_FLAGS_DATA_OUT : SRB_FLAGS_DATA_IN
+      );
+    srb->DataBuffer = MmGetMdlVirtualAddress(mdl);
+    srb->DataTransferLength = len;
+    srb->CdbLength = 16;
+    srb->Cdb[0] = (
+        mode == WvlDiskIoModeWrite ? SCSIOP_WRITE16 : SCSIOP_READ16
+      );
+    for (i = 0; i < 8; i++)
+      srb->Cdb[2 + i] = (UCHAR) (start_sector >> (56 - i * 8));
+    for (i = 0; i < 4; i++)
+      srb->Cdb[10 + i] = (UCHAR) (sector_count >> (24 - i * 8));
+
+    irp = IoAllocateIrp(1, FALSE);
+    if (!irp)
+      goto err_irp;
+    srb->OriginalRequest = irp;
+    irp->MdlAddress = mdl;
+    io_stack_loc = IoGetNextIrpStackLocation(irp);
+    io_stack_loc->MajorFunction = IRP_MJ_SCSI;
+    io_stack_loc->Parameters.Scsi.Srb = srb;
+    IoSetCompletionRoutine(irp, done, context, TRUE, TRUE, TRUE);
+    IoSetNextIrpStackLocation(irp);
+    return irp;
+
+    err_irp:
+
+    IoFreeMdl(mdl);
+    err_mdl:
+
+    DBG("Couldn't build SCSI IRP!\n");
+    return NULL;
+  }
+
+/**
+ * Free an IRP from WvlDiskScsiSubIrp.
+ *
+ * @v irp               The IRP to free, after it has been completed.
+ */
+VOID STDCALL WvlDiskScsiSubIrpFree(IN PIRP irp) {
+    PMDL mdl = irp->MdlAddress;
+
+    if (mdl->MdlFlags & MDL_PARTIAL)
+      MmPrepareMdlForReuse(mdl);
+    IoFreeMdl(mdl);
+    irp->MdlAddress = NULL;
+    IoFreeIrp(irp);
+    return;
+  }
@@ -44,6 +44,7 @@
 #include "x86.h"
 #include "safehook.h"
 #include "filedisk.h"
+#include "sparse.h"
 #include "dummy.h"
 #include "memdisk.h"
 #include "debug.h"
@@ -668,6 +669,14 @@ static NTSTATUS STDCALL WvMainBusDispatchDeviceControlIrp(
         case IOCTL_FILE_DETACH:
         return WvMainBusDeviceControlDetach(dev_obj, irp);
 
+        case IOCTL_RAM_ATTACH:
+        status = WvSparseAttach(irp);
+        break;
+
+        case IOCTL_FILE_POOL_STATS:
+        status = WvFilediskPoolStats(irp);
+        break;
+
         case IOCTL_WV_DUMMY:
         return WvDummyIoctl(dev_obj, irp);
 
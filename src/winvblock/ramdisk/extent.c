@@ -0,0 +1,245 @@
+/**
+ * Copyright (C) 2009-2011, Shao Miller <shao.miller@yrdsb.edu.on.ca>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * RAM extents.
+ *
+ * An extent's pages come from MmAllocatePagesForMdl, so they don't use
+ * the non-paged pool, nor system address space while they're idle.
+ * Mapped extents whose I/O is done stay mapped, in case they're used
+ * again, until WV_M_EXTENTS_MAPPED are mapped; then the least recently
+ * used are unmapped to make room.
+ *
+ * Pages can't be allocated above APC_LEVEL, so a write which arrives
+ * there gets an extent from the non-paged pool instead, while fewer
+ * than WV_M_EXTENTS_POOL of those are in use.  Either kind counts
+ * against the budget.
+ */
+
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "extent.h"
+#include "debug.h"
+
+/* Protects the mappings of all extents. */
+static KSPIN_LOCK WvExtentLock_;
+
+/* Mapped extents with no I/O, least recently used first. */
+static LIST_ENTRY WvExtentsIdle_;
+
+/* The number of page extents mapped. */
+static UINT32 WvExtentsMapped_;
+
+/* How many more extents may be allocated. */
+static LONG WvExtentsLeft_;
+
+/* How many more extents may come from the non-paged pool. */
+static LONG WvExtentsPoolLeft_;
+
+/**
+ * Set up for allocating extents.
+ *
+ * The budget is half of physical memory.  Must be called at
+ * PASSIVE_LEVEL, before any extent is allocated.
+ */
+VOID WvExtentsInit(void) {
+    PPHYSICAL_MEMORY_RANGE ranges;
+    ULONGLONG bytes = 0, extents;
+    UINT32 i;
+
+    KeInitializeSpinLock(&WvExtentLock_);
+    InitializeListHead(&WvExtentsIdle_);
+    WvExtentsMapped_ = 0;
+    WvExtentsPoolLeft_ = WV_M_EXTENTS_POOL;
+
+    ranges = MmGetPhysicalMemoryRanges();
+    if (ranges) {
+        for (i = 0; ranges[i].NumberOfBytes.QuadPart; i++)
+          bytes += ranges[i].NumberOfBytes.QuadPart;
+        ExFreePool(ranges);
+      }
+    extents = bytes / 2 / WV_M_EXTENT_SIZE;
+    if (extents > 0x7FFFFFFF)
+      extents = 0x7FFFFFFF;
+    DBG("RAM extent budget: %I64u extents\n", extents);
+    WvExtentsLeft_ = (LONG) extents;
+  }
+
+/**
+ * Allocate a zeroed extent.
+ *
+ * @ret WV_SP_EXTENT    The extent, or NULL if memory or the budget is
+ *                      exhausted.
+ */
+WV_SP_EXTENT WvExtentAlloc(void) {
+    static const PHYSICAL_ADDRESS low = { 0 }, skip = { 0 };
+    PHYSICAL_ADDRESS high;
+    WV_SP_EXTENT extent;
+
+    if (InterlockedDecrement(&WvExtentsLeft_) < 0) {
+        DBG("RAM extent budget exhausted\n");
+        goto err_budget;
+      }
+    extent = wv_mallocz(sizeof *extent);
+    if (!extent)
+      goto err_extent;
+
+    /* MmAllocatePagesForMdl can't be called at DISPATCH_LEVEL. */
+    if (KeGetCurrentIrql() > APC_LEVEL) {
+        if (InterlockedDecrement(&WvExtentsPoolLeft_) < 0) {
+            InterlockedIncrement(&WvExtentsPoolLeft_);
+            DBG("RAM extent pool budget exhausted\n");
+            goto err_data;
+          }
+        extent->Data = wv_mallocz(WV_M_EXTENT_SIZE);
+        if (!extent->Data) {
+            InterlockedIncrement(&WvExtentsPoolLeft_);
+            goto err_data;
+          }
+        return extent;
+      }
+
+    /* The pages come zeroed. */
+    high.QuadPart = -1;
+    extent->Mdl = MmAllocatePagesForMdl(low, high, skip, WV_M_EXTENT_SIZE);
+    if (!extent->Mdl)
+      goto err_data;
+    if (MmGetMdlByteCount(extent->Mdl) < WV_M_EXTENT_SIZE)
+      goto err_pages;
+    return extent;
+
+    err_pages:
+
+    MmFreePagesFromMdl(extent->Mdl);
+    ExFreePool(extent->Mdl);
+    err_data:
+
+    wv_free(extent);
+    err_extent:
+
+    err_budget:
+
+    InterlockedIncrement(&WvExtentsLeft_);
+    return NULL;
+  }
+
+/**
+ * Free an extent.
+ *
+ * @v ptr               The WV_S_EXTENT to free, or NULL.  It must have no
+ *                      I/O using it.
+ */
+VOID WvExtentFree(IN PVOID ptr) {
+    WV_SP_EXTENT extent = ptr;
+    KIRQL irql;
+
+    if (!extent)
+      return;
+    if (extent->Mdl) {
+        KeAcquireSpinLock(&WvExtentLock_, &irql);
+        if (extent->Data) {
+            RemoveEntryList(&extent->Idle);
+            MmUnmapLockedPages(extent->Data, extent->Mdl);
+            WvExtentsMapped_--;
+          }
+        KeReleaseSpinLock(&WvExtentLock_, irql);
+        MmFreePagesFromMdl(extent->Mdl);
+        ExFreePool(extent->Mdl);
+      } else {
+        wv_free(extent->Data);
+        InterlockedIncrement(&WvExtentsPoolLeft_);
+      }
+    wv_free(extent);
+    InterlockedIncrement(&WvExtentsLeft_);
+  }
+
+/**
+ * Get an extent mapped for I/O.
+ *
+ * @v extent            The extent.
+ * @ret PUCHAR          Where the extent is mapped, or NULL.
+ *
+ * Each successful call must be matched by a call to WvExtentUnmap.
+ */
+PUCHAR WvExtentMap(IN WV_SP_EXTENT extent) {
+    WV_SP_EXTENT victim;
+    PUCHAR data;
+    KIRQL irql;
+
+    if (!extent->Mdl)
+      return extent->Data;
+
+    KeAcquireSpinLock(&WvExtentLock_, &irql);
+    if (!extent->Data) {
+        while (
+            WvExtentsMapped_ >= WV_M_EXTENTS_MAPPED &&
+            !IsListEmpty(&WvExtentsIdle_)
+          ) {
+            victim = CONTAINING_RECORD(
+                RemoveHeadList(&WvExtentsIdle_),
+                WV_S_EXTENT,
+                Idle
+              );
+            MmUnmapLockedPages(victim->Data, victim->Mdl);
+            victim->Data = NULL;
+            WvExtentsMapped_--;
+          }
+        extent->Data = MmMapLockedPagesSpecifyCache(
+            extent->Mdl,
+            KernelMode,
+            MmCached,
+            NULL,
+            FALSE,
+            NormalPagePriority
+          );
+        if (!extent->Data) {
+            KeReleaseSpinLock(&WvExtentLock_, irql);
+            DBG("Could not map RAM extent!\n");
+            return NULL;
+          }
+        WvExtentsMapped_++;
+      } else if (!extent->Users) {
+        RemoveEntryList(&extent->Idle);
+      }
+    extent->Users++;
+    data = extent->Data;
+    KeReleaseSpinLock(&WvExtentLock_, irql);
+    return data;
+  }
+
+/**
+ * Finish with a mapping from WvExtentMap.
+ *
+ * @v extent            The extent.
+ */
+VOID WvExtentUnmap(IN WV_SP_EXTENT extent) {
+    KIRQL irql;
+
+    if (!extent->Mdl)
+      return;
+    KeAcquireSpinLock(&WvExtentLock_, &irql);
+    if (!--extent->Users)
+      InsertTailList(&WvExtentsIdle_, &extent->Idle);
+    KeReleaseSpinLock(&WvExtentLock_, irql);
+  }
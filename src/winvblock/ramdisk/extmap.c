@@ -0,0 +1,175 @@
+/**
+ * Copyright (C) 2010-2012, Shao Miller <sha0.miller@gmail.com>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Extent maps.
+ *
+ * Only wv_stdlib is needed, which src/host provides with malloc for
+ * extmaptest and extmapbench.  Nothing here takes a lock; the map's
+ * owner does that.
+ */
+
+#include "wv_stdlib.h"
+#include "extmap.h"
+
+/**
+ * Set up an empty extent map.
+ *
+ * @v map               The map to set up.
+ * @v extent_count      The number of extents the map describes.
+ * @ret int             0 if the map would be too large or its table of
+ *                      tables couldn't be allocated, else 1.
+ */
+int WvExtMapInit(WV_SP_EXTMAP map, unsigned int extent_count) {
+    map->Tables = NULL;
+    map->ExtentCount = extent_count;
+    map->ExtentsUsed = 0;
+    map->TableCount = (
+        (extent_count + WV_M_EXTMAP_TABLE_EXTENTS - 1) /
+        WV_M_EXTMAP_TABLE_EXTENTS
+      );
+    if (!extent_count || extent_count > WV_M_EXTMAP_MAX_EXTENTS)
+      return 0;
+    map->Tables = wv_mallocz(map->TableCount * sizeof *map->Tables);
+    return map->Tables != NULL;
+  }
+
+/**
+ * Empty an extent map and release its tables.
+ *
+ * @v map               The map to empty.
+ * @v free_extent       Called for each extent in the map.
+ */
+void WvExtMapFree(WV_SP_EXTMAP map, WV_FP_EXTMAP_FREE free_extent) {
+    unsigned int i, j;
+
+    if (!map->Tables)
+      return;
+    for (i = 0; i < map->TableCount; i++) {
+        if (!map->Tables[i])
+          continue;
+        for (j = 0; j < WV_M_EXTMAP_TABLE_EXTENTS; j++) {
+            if (map->Tables[i][j])
+              free_extent(map->Tables[i][j]);
+          }
+        wv_free(map->Tables[i]);
+      }
+    wv_free(map->Tables);
+    map->Tables = NULL;
+    map->ExtentsUsed = 0;
+  }
+
+/**
+ * Allocate a table for WvExtMapInsert.
+ *
+ * @ret void **         The empty table, or NULL.  wv_free frees it.
+ */
+void ** WvExtMapTableAlloc(void) {
+    return wv_mallocz(WV_M_EXTMAP_TABLE_EXTENTS * sizeof (void *));
+  }
+
+/**
+ * Find an extent.
+ *
+ * @v map               The map.
+ * @v index             The extent's index, which must be in range.
+ * @ret void *          The extent, or NULL if it isn't in the map.
+ */
+void * WvExtMapGet(WV_SP_EXTMAP map, unsigned int index) {
+    void ** table = map->Tables[index / WV_M_EXTMAP_TABLE_EXTENTS];
+
+    if (!table)
+      return NULL;
+    return table[index % WV_M_EXTMAP_TABLE_EXTENTS];
+  }
+
+/**
+ * Check if the table for an extent has been allocated.
+ *
+ * @v map               The map.
+ * @v index             The extent's index, which must be in range.
+ * @ret int             1 if WvExtMapInsert won't need a table, else 0.
+ */
+int WvExtMapHasTable(WV_SP_EXTMAP map, unsigned int index) {
+    return map->Tables[index / WV_M_EXTMAP_TABLE_EXTENTS] != NULL;
+  }
+
+/**
+ * Put an extent into a map, unless it already has one there.
+ *
+ * @v map               The map.
+ * @v index             The extent's index, which must be in range.
+ * @v table             Points to a table from WvExtMapTableAlloc, or to
+ *                      NULL.  If the map needs it, it's taken and set to
+ *                      NULL.
+ * @v extent            Points to the extent.  If the map takes it, it's
+ *                      set to NULL.
+ * @ret void *          The extent now in the map at index, or NULL if a
+ *                      table was needed but not given.
+ *
+ * The caller can allocate without holding its lock, and then free
+ * whatever the map didn't take: another caller might have won a race.
+ */
+void * WvExtMapInsert(
+    WV_SP_EXTMAP map,
+    unsigned int index,
+    void *** table,
+    void ** extent
+  ) {
+    void *** tables = map->Tables + index / WV_M_EXTMAP_TABLE_EXTENTS;
+    void ** slot;
+
+    if (!*tables) {
+        if (!*table)
+          return NULL;
+        *tables = *table;
+        *table = NULL;
+      }
+    slot = *tables + index % WV_M_EXTMAP_TABLE_EXTENTS;
+    if (!*slot && *extent) {
+        *slot = *extent;
+        *extent = NULL;
+        map->ExtentsUsed++;
+      }
+    return *slot;
+  }
+
+/**
+ * Take an extent out of a map.
+ *
+ * @v map               The map.
+ * @v index             The extent's index, which must be in range.
+ * @ret void *          The extent, for the caller to free, or NULL if
+ *                      it wasn't in the map.
+ */
+void * WvExtMapRemove(WV_SP_EXTMAP map, unsigned int index) {
+    void ** table = map->Tables[index / WV_M_EXTMAP_TABLE_EXTENTS];
+    void * extent;
+
+    if (!table)
+      return NULL;
+    extent = table[index % WV_M_EXTMAP_TABLE_EXTENTS];
+    if (extent) {
+        table[index % WV_M_EXTMAP_TABLE_EXTENTS] = NULL;
+        map->ExtentsUsed--;
+      }
+    return extent;
+  }
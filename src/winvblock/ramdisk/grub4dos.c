@@ -66,6 +66,9 @@ VOID WvRamdiskCreateG4dDisk(
     ramdisk->disk->Media = media_type;
     ramdisk->disk->SectorSize = sector_size;
     ramdisk->Dev->Boot = TRUE;
+    /* Keep writes in RAM, if asked to. */
+    if (WvlBootOverlayWanted())
+      WvlDiskOverlayCreate(ramdisk->disk);
      /* Add the ramdisk to the bus. */
     ramdisk->disk->ParentBus = WvBus.Fdo;
     if (!WvBusAddDev(ramdisk->Dev))
@@ -2,7 +2,7 @@
 
 set libname=ramdisk
 
-set c=ramdisk.c memdisk.c grub4dos.c
+set c=ramdisk.c memdisk.c grub4dos.c sparse.c extmap.c extent.c
 
 echo !INCLUDE $(NTMAKEENV)\makefile.def	> makefile
 
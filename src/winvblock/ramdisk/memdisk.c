@@ -104,6 +104,9 @@ static BOOLEAN STDCALL WvMemdiskCheckMbft_(
     ramdisk->disk->Media = media_type;
     ramdisk->disk->SectorSize = sector_size;
     ramdisk->Dev->Boot = TRUE;
+    /* Keep writes in RAM, if asked to. */
+    if (WvlBootOverlayWanted())
+      WvlDiskOverlayCreate(ramdisk->disk);
 
     /* Add the ramdisk to the bus. */
     ramdisk->disk->ParentBus = WvBus.Fdo;
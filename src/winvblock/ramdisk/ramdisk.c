@@ -30,6 +30,7 @@
 #include "winvblock.h"
 #include "wv_stdlib.h"
 #include "irp.h"
+#include "copy.h"
 #include "driver.h"
 #include "bus.h"
 #include "device.h"
@@ -41,13 +42,162 @@
 static WV_F_DEV_FREE WvRamdiskFree_;
 static WVL_F_DISK_IO WvRamdiskIo_;
 
-/* With thanks to karyonix, who makes FiraDisk. */
-static __inline VOID STDCALL WvRamdiskFastCopy_(
-    PVOID dest,
-    const VOID * src,
-    size_t count
+/**
+ * Find the size of one of a RAM disk's chunks.
+ *
+ * @v ramdisk           The RAM disk.
+ * @v index             The chunk's index.
+ * @ret UINT32          The chunk's size.  Only the last may be short.
+ */
+static UINT32 WvRamdiskChunkSize_(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN UINT32 index
+  ) {
+    ULONGLONG size = ramdisk->disk->LBADiskSize * ramdisk->disk->SectorSize;
+
+    size -= (ULONGLONG) index * WV_M_RAMDISK_CHUNK_SIZE;
+    if (size > WV_M_RAMDISK_CHUNK_SIZE)
+      size = WV_M_RAMDISK_CHUNK_SIZE;
+    return (UINT32) size;
+  }
+
+/**
+ * Get part of a chunk of a RAM disk's memory mapped for I/O.
+ *
+ * @v ramdisk           The RAM disk.
+ * @v index             The chunk's index.
+ * @v offset            The offset of the I/O within the chunk.
+ * @v len               The length of the I/O.
+ * @v transient         Set to TRUE if the mapping is just for this I/O.
+ * @ret PUCHAR          Where the I/O's memory is mapped, or NULL.
+ *
+ * Chunks are mapped cached, the first time they're needed, and the
+ * mappings are kept until the RAM disk is freed.  Once too many chunks
+ * are mapped, an unmapped chunk's I/O is mapped just for each request,
+ * until the chunk has seen WV_M_RAMDISK_CHUNK_ADMIT bytes of I/O; then
+ * the least recently used idle chunk is unmapped to make room for it.
+ * Otherwise, random I/O over a disk bigger than the mapped chunks would
+ * map and unmap a whole chunk for nearly every request.  Each
+ * successful call must be matched by a call to WvRamdiskChunkPut_.
+ */
+static PUCHAR WvRamdiskChunkGet_(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN UINT32 index,
+    IN UINT32 offset,
+    IN UINT32 len,
+    OUT PBOOLEAN transient
   ) {
-    __movsd(dest, src, count >> 2);
+    WV_SP_RAMDISK_CHUNK chunk, victim;
+    PHYSICAL_ADDRESS phys_addr;
+    ULONGLONG size;
+    KIRQL irql;
+    PUCHAR map;
+    UINT32 i;
+
+    *transient = FALSE;
+    KeAcquireSpinLock(&ramdisk->ChunkLock, &irql);
+    if (!ramdisk->Chunks) {
+        size = ramdisk->disk->LBADiskSize * ramdisk->disk->SectorSize;
+        ramdisk->ChunkCount = (UINT32) (
+            (size + WV_M_RAMDISK_CHUNK_SIZE - 1) / WV_M_RAMDISK_CHUNK_SIZE
+          );
+        ramdisk->Chunks = wv_mallocz(
+            ramdisk->ChunkCount * sizeof *ramdisk->Chunks
+          );
+        if (!ramdisk->Chunks) {
+            KeReleaseSpinLock(&ramdisk->ChunkLock, irql);
+            DBG("Could not allocate RAM disk chunks!\n");
+            return NULL;
+          }
+      }
+    if (index >= ramdisk->ChunkCount) {
+        KeReleaseSpinLock(&ramdisk->ChunkLock, irql);
+        return NULL;
+      }
+
+    chunk = ramdisk->Chunks + index;
+    phys_addr.QuadPart =
+      ramdisk->DiskBuf + (ULONGLONG) index * WV_M_RAMDISK_CHUNK_SIZE;
+    if (!chunk->Map) {
+        if (ramdisk->ChunksMapped >= WV_M_RAMDISK_CHUNKS_MAPPED) {
+            chunk->Missed += len;
+            if (chunk->Missed < WV_M_RAMDISK_CHUNK_ADMIT) {
+                KeReleaseSpinLock(&ramdisk->ChunkLock, irql);
+                /* Map just this I/O's memory. */
+                phys_addr.QuadPart += offset;
+                map = MmMapIoSpace(phys_addr, len, MmCached);
+                if (!map) {
+                    DBG("Could not map memory for RAM disk!\n");
+                    return NULL;
+                  }
+                *transient = TRUE;
+                return map;
+              }
+            victim = NULL;
+            for (i = 0; i < ramdisk->ChunkCount; i++) {
+                if (
+                    ramdisk->Chunks[i].Map &&
+                    !ramdisk->Chunks[i].Users &&
+                    (!victim || ramdisk->Chunks[i].LastUse < victim->LastUse)
+                  )
+                  victim = ramdisk->Chunks + i;
+              }
+            if (victim) {
+                MmUnmapIoSpace(
+                    victim->Map,
+                    WvRamdiskChunkSize_(ramdisk, (UINT32) (
+                        victim - ramdisk->Chunks
+                      ))
+                  );
+                victim->Map = NULL;
+                ramdisk->ChunksMapped--;
+              }
+          }
+        chunk->Map = MmMapIoSpace(
+            phys_addr,
+            WvRamdiskChunkSize_(ramdisk, index),
+            MmCached
+          );
+        if (!chunk->Map) {
+            KeReleaseSpinLock(&ramdisk->ChunkLock, irql);
+            DBG("Could not map memory for RAM disk!\n");
+            return NULL;
+          }
+        chunk->Missed = 0;
+        ramdisk->ChunksMapped++;
+      }
+    chunk->Users++;
+    chunk->LastUse = ++ramdisk->ChunkClock;
+    map = chunk->Map + offset;
+    KeReleaseSpinLock(&ramdisk->ChunkLock, irql);
+    return map;
+  }
+
+/**
+ * Finish with a mapping from WvRamdiskChunkGet_.
+ *
+ * @v ramdisk           The RAM disk.
+ * @v index             The chunk's index.
+ * @v map               The mapping.
+ * @v len               The length of the I/O.
+ * @v transient         Whether the mapping was just for this I/O.
+ */
+static VOID WvRamdiskChunkPut_(
+    IN WV_SP_RAMDISK_T ramdisk,
+    IN UINT32 index,
+    IN PUCHAR map,
+    IN UINT32 len,
+    IN BOOLEAN transient
+  ) {
+    KIRQL irql;
+
+    if (transient) {
+        MmUnmapIoSpace(map, len);
+        return;
+      }
+    KeAcquireSpinLock(&ramdisk->ChunkLock, &irql);
+    ramdisk->Chunks[index].Users--;
+    KeReleaseSpinLock(&ramdisk->ChunkLock, irql);
   }
 
 /* RAM disk I/O routine. */
@@ -59,9 +209,11 @@ static NTSTATUS STDCALL WvRamdiskIo_(
     IN PUCHAR buffer,
     IN PIRP irp
   ) {
-    PHYSICAL_ADDRESS phys_addr;
-    PUCHAR phys_mem;
     WV_SP_RAMDISK_T ramdisk;
+    ULONGLONG offset;
+    UINT32 remaining, index, chunk_offset, len;
+    BOOLEAN transient;
+    PUCHAR map;
 
     /* Establish pointer to the RAM disk. */
     ramdisk = CONTAINING_RECORD(disk, WV_S_RAMDISK_T, disk);
@@ -75,23 +227,35 @@ static NTSTATUS STDCALL WvRamdiskIo_(
         return STATUS_CANCELLED;
       }
 
-    phys_addr.QuadPart =
-      ramdisk->DiskBuf + (start_sector * disk->SectorSize);
-    /* Possible precision loss. */
-    phys_mem = MmMapIoSpace(
-        phys_addr,
-        sector_count * disk->SectorSize,
-  		  MmNonCached
-      );
-    if (!phys_mem) {
-        DBG("Could not map memory for RAM disk!\n");
-        return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+    /* Copy through each chunk which the request touches. */
+    offset = start_sector * disk->SectorSize;
+    remaining = sector_count * disk->SectorSize;
+    while (remaining) {
+        index = (UINT32) (offset / WV_M_RAMDISK_CHUNK_SIZE);
+        chunk_offset = (UINT32) (offset % WV_M_RAMDISK_CHUNK_SIZE);
+        len = WV_M_RAMDISK_CHUNK_SIZE - chunk_offset;
+        if (len > remaining)
+          len = remaining;
+
+        map = WvRamdiskChunkGet_(
+            ramdisk,
+            index,
+            chunk_offset,
+            len,
+            &transient
+          );
+        if (!map)
+          return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+        if (mode == WvlDiskIoModeWrite)
+          WvlCopyMemory(map, buffer, len);
+          else
+          WvlCopyMemory(buffer, map, len);
+        WvRamdiskChunkPut_(ramdisk, index, map, len, transient);
+
+        offset += len;
+        buffer += len;
+        remaining -= len;
       }
-    if (mode == WvlDiskIoModeWrite)
-      WvRamdiskFastCopy_(phys_mem, buffer, sector_count * disk->SectorSize);
-      else
-      WvRamdiskFastCopy_(buffer, phys_mem, sector_count * disk->SectorSize);
-    MmUnmapIoSpace(phys_mem, sector_count * disk->SectorSize);
     return WvlIrpComplete(
         irp,
         sector_count * disk->SectorSize,
@@ -199,7 +363,8 @@ static NTSTATUS WvRamdiskIrpDispatch(
               if (!ramdisk->Dev->BusNode.Linked) {
                   /* Unlinked _and_ deleted */
                   DBG("Deleting RAM disk PDO: %p", dev_obj);
-                  IoDeleteDevice(dev_obj);
+                  /* This unmaps the chunks, too. */
+                  WvRamdiskFree_(ramdisk->Dev);
                 }
             }
           return status;
@@ -259,6 +424,7 @@ WV_SP_RAMDISK_T STDCALL WvRamdiskCreatePdo(
 
     ramdisk = pdo->DeviceExtension;
     RtlZeroMemory(ramdisk, sizeof *ramdisk);
+    KeInitializeSpinLock(&ramdisk->ChunkLock);
     WvlDiskInit(ramdisk->disk);
     WvDevInit(ramdisk->Dev);
     ramdisk->Dev->Ops.Free = WvRamdiskFree_;
@@ -268,6 +434,7 @@ WV_SP_RAMDISK_T STDCALL WvRamdiskCreatePdo(
     ramdisk->disk->disk_ops.PnpQueryId = WvRamdiskPnpQueryId_;
     ramdisk->disk->disk_ops.PnpQueryDevText = WvDiskPnpQueryDevText;
     ramdisk->disk->ext = ramdisk;
+    ramdisk->disk->NoCache = TRUE;
     ramdisk->disk->DriverObj = WvDriverObj;
 
     /* Set associations for the PDO, device, disk. */
@@ -289,5 +456,26 @@ WV_SP_RAMDISK_T STDCALL WvRamdiskCreatePdo(
  * @v dev               Points to the RAM disk device to delete.
  */
 static VOID STDCALL WvRamdiskFree_(IN WV_SP_DEV_T dev) {
+    WV_SP_RAMDISK_T ramdisk = CONTAINING_RECORD(
+        dev,
+        WV_S_RAMDISK_T,
+        Dev[0]
+      );
+    UINT32 i;
+
+    /* Unmap the memory. */
+    if (ramdisk->Chunks) {
+        for (i = 0; i < ramdisk->ChunkCount; i++) {
+            if (ramdisk->Chunks[i].Map) {
+                MmUnmapIoSpace(
+                    ramdisk->Chunks[i].Map,
+                    WvRamdiskChunkSize_(ramdisk, i)
+                  );
+              }
+          }
+        wv_free(ramdisk->Chunks);
+        ramdisk->Chunks = NULL;
+      }
+    WvlDiskOverlayFree(ramdisk->disk);
     IoDeleteDevice(dev->Self);
   }
@@ -0,0 +1,527 @@
+/**
+ * Copyright (C) 2009-2011, Shao Miller <shao.miller@yrdsb.edu.on.ca>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Sparse RAM disk specifics.
+ *
+ * A sparse RAM disk starts out with no memory at all.  Its sectors
+ * are grouped into extents, and memory for an extent is allocated the
+ * first time the extent is written to.  Reads from an extent that has
+ * never been written return zeroes, and unmapping a whole extent
+ * releases its memory.  Extents come from extent.c, and are only
+ * mapped while I/O copies to or from them.
+ */
+
+#include <stdio.h>
+#include <ntddk.h>
+
+#include "portable.h"
+#include "winvblock.h"
+#include "wv_stdlib.h"
+#include "irp.h"
+#include "driver.h"
+#include "bus.h"
+#include "device.h"
+#include "disk.h"
+#include "mount.h"
+#include "copy.h"
+#include "sparse.h"
+#include "debug.h"
+
+/** Private. */
+static WV_F_DEV_FREE WvSparseFree_;
+static WVL_F_DISK_IO WvSparseIo_;
+static WVL_F_DISK_UNMAP WvSparseUnmap_;
+
+/* For telling sparse RAM disks apart. */
+static LONG WvSparseNextId_;
+
+/**
+ * Get an extent of a sparse RAM disk for writing, allocating it if needed.
+ *
+ * @v sparse            The sparse RAM disk.
+ * @v index             The extent's index.
+ * @v irql              Receives the IRQL to restore, upon success.
+ * @ret WV_SP_EXTENT    The extent, or NULL if memory is exhausted.
+ *
+ * Upon success, the disk's lock is held, and the caller must release it.
+ */
+static WV_SP_EXTENT WvSparseExtentGet_(
+    IN WV_SP_SPARSE_T sparse,
+    IN UINT32 index,
+    OUT PKIRQL irql
+  ) {
+    PVOID * table = NULL;
+    PVOID extent = NULL;
+    WV_SP_EXTENT got;
+    BOOLEAN has_table;
+
+    KeAcquireSpinLock(&sparse->Lock, irql);
+    got = WvExtMapGet(&sparse->Map, index);
+    if (got)
+      return got;
+    has_table = (BOOLEAN) WvExtMapHasTable(&sparse->Map, index);
+    KeReleaseSpinLock(&sparse->Lock, *irql);
+
+    /* Allocate without holding the lock, then check again. */
+    if (!has_table) {
+        table = WvExtMapTableAlloc();
+        if (!table)
+          goto err_table;
+      }
+    extent = WvExtentAlloc();
+    if (!extent)
+      goto err_extent;
+
+    KeAcquireSpinLock(&sparse->Lock, irql);
+    got = WvExtMapInsert(&sparse->Map, index, &table, &extent);
+    /* Anything left over lost a race, so is freed here. */
+    WvExtentFree(extent);
+    wv_free(table);
+    return got;
+
+    err_extent:
+
+    wv_free(table);
+    err_table:
+
+    DBG("Could not allocate sparse RAM disk extent %u!\n", index);
+    return NULL;
+  }
+
+/* Sparse RAM disk I/O routine. */
+static NTSTATUS STDCALL WvSparseIo_(
+    IN WVL_SP_DISK_T disk,
+    IN WVL_E_DISK_IO_MODE mode,
+    IN LONGLONG start_sector,
+    IN UINT32 sector_count,
+    IN PUCHAR buffer,
+    IN PIRP irp
+  ) {
+    WV_SP_SPARSE_T sparse = CONTAINING_RECORD(disk, WV_S_SPARSE_T, disk[0]);
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONGLONG offset;
+    UINT32 remaining, index, extent_offset, len;
+    WV_SP_EXTENT extent;
+    PUCHAR data;
+    KIRQL irql;
+
+    if (sector_count < 1) {
+        /* A silly request. */
+        DBG("sector_count < 1; cancelling\n");
+        return WvlIrpComplete(irp, 0, STATUS_CANCELLED);
+      }
+
+    /* Copy through each extent which the request touches. */
+    offset = start_sector * disk->SectorSize;
+    remaining = sector_count * disk->SectorSize;
+    while (remaining) {
+        index = (UINT32) (offset / WV_M_SPARSE_EXTENT_SIZE);
+        extent_offset = (UINT32) (offset % WV_M_SPARSE_EXTENT_SIZE);
+        len = WV_M_SPARSE_EXTENT_SIZE - extent_offset;
+        if (len > remaining)
+          len = remaining;
+        if (index >= sparse->Map.ExtentCount)
+          return WvlIrpComplete(irp, 0, STATUS_INVALID_PARAMETER);
+
+        if (mode == WvlDiskIoModeWrite && !WvlDiskIsZero(buffer, len)) {
+            extent = WvSparseExtentGet_(sparse, index, &irql);
+            if (!extent)
+              return WvlIrpComplete(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+          } else {
+            /* Zeroes needn't use up memory. */
+            KeAcquireSpinLock(&sparse->Lock, &irql);
+            extent = WvExtMapGet(&sparse->Map, index);
+          }
+        data = extent ? WvExtentMap(extent) : NULL;
+        if (extent && !data) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+          } else if (mode == WvlDiskIoModeWrite) {
+            if (data)
+              WvlCopyMemory(data + extent_offset, buffer, len);
+          } else if (data) {
+            WvlCopyMemory(buffer, data + extent_offset, len);
+          } else {
+            RtlZeroMemory(buffer, len);
+          }
+        if (data)
+          WvExtentUnmap(extent);
+        KeReleaseSpinLock(&sparse->Lock, irql);
+        if (!NT_SUCCESS(status))
+          return WvlIrpComplete(irp, 0, status);
+
+        offset += len;
+        buffer += len;
+        remaining -= len;
+      }
+    return WvlIrpComplete(
+        irp,
+        sector_count * disk->SectorSize,
+        STATUS_SUCCESS
+      );
+  }
+
+/* Sparse RAM disk unmap routine.  Whole extents are released. */
+static NTSTATUS STDCALL WvSparseUnmap_(
+    IN WVL_SP_DISK_T disk,
+    IN LONGLONG start_sector,
+    IN ULONGLONG sector_count
+  ) {
+    WV_SP_SPARSE_T sparse = CONTAINING_RECORD(disk, WV_S_SPARSE_T, disk[0]);
+    ULONGLONG offset, end;
+    UINT32 index, extent_offset, len;
+    WV_SP_EXTENT extent;
+    PUCHAR data;
+    KIRQL irql;
+
+    offset = start_sector * disk->SectorSize;
+    end = offset + sector_count * disk->SectorSize;
+    while (offset < end) {
+        index = (UINT32) (offset / WV_M_SPARSE_EXTENT_SIZE);
+        extent_offset = (UINT32) (offset % WV_M_SPARSE_EXTENT_SIZE);
+        len = WV_M_SPARSE_EXTENT_SIZE - extent_offset;
+        if (len > end - offset)
+          len = (UINT32) (end - offset);
+
+        KeAcquireSpinLock(&sparse->Lock, &irql);
+        if (len == WV_M_SPARSE_EXTENT_SIZE) {
+            extent = WvExtMapRemove(&sparse->Map, index);
+            KeReleaseSpinLock(&sparse->Lock, irql);
+            WvExtentFree(extent);
+            offset += len;
+            continue;
+          }
+        /* Part of an extent must still read back as zeroes. */
+        extent = WvExtMapGet(&sparse->Map, index);
+        data = extent ? WvExtentMap(extent) : NULL;
+        if (data) {
+            RtlZeroMemory(data + extent_offset, len);
+            WvExtentUnmap(extent);
+          }
+        KeReleaseSpinLock(&sparse->Lock, irql);
+        if (extent && !data)
+          return STATUS_INSUFFICIENT_RESOURCES;
+
+        offset += len;
+      }
+    return STATUS_SUCCESS;
+  }
+
+/* Copy sparse RAM disk IDs to the provided buffer. */
+static NTSTATUS STDCALL WvSparsePnpQueryId_(
+    IN PDEVICE_OBJECT dev_obj,
+    IN PIRP irp,
+    IN WVL_SP_DISK_T disk
+  ) {
+    static const WCHAR * hw_ids[WvlDiskMediaTypes] = {
+        WVL_M_WLIT L"\\SparseFloppyDisk",
+        WVL_M_WLIT L"\\SparseHardDisk",
+        WVL_M_WLIT L"\\SparseOpticalDisc"
+      };
+    WCHAR (*buf)[512];
+    NTSTATUS status;
+    WV_SP_SPARSE_T sparse = CONTAINING_RECORD(disk, WV_S_SPARSE_T, disk[0]);
+    BUS_QUERY_ID_TYPE query_type;
+
+    /* Allocate a buffer. */
+    buf = wv_mallocz(sizeof *buf);
+    if (!buf) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_buf;
+      }
+
+    /* Populate the buffer with IDs. */
+    query_type = IoGetCurrentIrpStackLocation(irp)->Parameters.QueryId.IdType;
+    switch (query_type) {
+        case BusQueryDeviceID:
+          swprintf(*buf, hw_ids[disk->Media]);
+          break;
+
+        case BusQueryInstanceID:
+          swprintf(*buf, L"Sparse_%08X", sparse->Id);
+          break;
+
+        case BusQueryHardwareIDs:
+          swprintf(
+              *buf + swprintf(*buf, hw_ids[disk->Media]) + 1,
+              WvlDiskCompatIds[disk->Media]
+            );
+          break;
+
+        case BusQueryCompatibleIDs:
+          swprintf(*buf, WvlDiskCompatIds[disk->Media]);
+          break;
+
+        default:
+          DBG("Unknown query type %d for %p!\n", query_type, sparse);
+          status = STATUS_INVALID_PARAMETER;
+          goto err_query_type;
+      }
+
+    DBG("IRP_MN_QUERY_ID for sparse RAM disk %p.\n", sparse);
+    return WvlIrpComplete(irp, (ULONG_PTR) buf, STATUS_SUCCESS);
+
+    err_query_type:
+
+    wv_free(buf);
+    err_buf:
+
+    return WvlIrpComplete(irp, 0, status);
+  }
+
+static WVL_F_DISK_UNIT_NUM WvSparseUnitNum_;
+static UCHAR STDCALL WvSparseUnitNum_(IN WVL_SP_DISK_T disk) {
+    WV_SP_SPARSE_T sparse = CONTAINING_RECORD(disk, WV_S_SPARSE_T, disk[0]);
+
+    /* Possible precision loss. */
+    return (UCHAR) WvlBusGetNodeNum(&sparse->Dev->BusNode);
+  }
+
+/* Handle an IRP. */
+static NTSTATUS WvSparseIrpDispatch(
+    IN PDEVICE_OBJECT dev_obj,
+    IN PIRP irp
+  ) {
+    PIO_STACK_LOCATION io_stack_loc;
+    WV_SP_SPARSE_T sparse;
+    NTSTATUS status;
+
+    io_stack_loc = IoGetCurrentIrpStackLocation(irp);
+    sparse = dev_obj->DeviceExtension;
+    switch (io_stack_loc->MajorFunction) {
+        case IRP_MJ_SCSI:
+          return WvlDiskScsi(dev_obj, irp, sparse->disk);
+
+        case IRP_MJ_PNP:
+          status = WvlDiskPnp(dev_obj, irp, sparse->disk);
+          /* Note any state change. */
+          sparse->Dev->OldState = sparse->disk->OldState;
+          sparse->Dev->State = sparse->disk->State;
+          if (sparse->Dev->State == WvlDiskStateNotStarted) {
+              if (!sparse->Dev->BusNode.Linked) {
+                  /* Unlinked _and_ deleted */
+                  DBG("Deleting sparse RAM disk PDO: %p", dev_obj);
+                  WvSparseFree_(sparse->Dev);
+                }
+            }
+          return status;
+
+        case IRP_MJ_DEVICE_CONTROL:
+          return WvlDiskDevCtl(
+              sparse->disk,
+              irp,
+              io_stack_loc->Parameters.DeviceIoControl.IoControlCode
+            );
+
+        case IRP_MJ_POWER:
+          return WvlDiskPower(dev_obj, irp, sparse->disk);
+
+        case IRP_MJ_CREATE:
+        case IRP_MJ_CLOSE:
+          /* Always succeed with nothing to do. */
+          return WvlIrpComplete(irp, 0, STATUS_SUCCESS);
+
+        case IRP_MJ_SYSTEM_CONTROL:
+          return WvlDiskSysCtl(dev_obj, irp, sparse->disk);
+
+        default:
+          DBG("Unhandled IRP_MJ_*: %d\n", io_stack_loc->MajorFunction);
+      }
+    return WvlIrpComplete(irp, 0, STATUS_NOT_SUPPORTED);
+  }
+
+/**
+ * Create a sparse RAM disk PDO of the given media type.
+ *
+ * @v MediaType                 The media type for the sparse RAM disk.
+ * @ret WV_SP_SPARSE_T          Points to the new sparse RAM disk, or NULL.
+ *
+ * Returns NULL if the PDO cannot be created.  The caller sets the size
+ * of the disk and allocates its extent map.
+ */
+WV_SP_SPARSE_T STDCALL WvSparseCreatePdo(
+    IN WVL_E_DISK_MEDIA_TYPE MediaType
+  ) {
+    NTSTATUS status;
+    WV_SP_SPARSE_T sparse;
+    PDEVICE_OBJECT pdo;
+
+    DBG("Creating sparse RAM disk PDO...\n");
+
+    /* Create the disk PDO. */
+    status = WvlDiskCreatePdo(
+        WvDriverObj,
+        sizeof *sparse,
+        MediaType,
+        &pdo
+      );
+    if (!NT_SUCCESS(status)) {
+        WvlError("WvlDiskCreatePdo", status);
+        return NULL;
+      }
+
+    sparse = pdo->DeviceExtension;
+    RtlZeroMemory(sparse, sizeof *sparse);
+    KeInitializeSpinLock(&sparse->Lock);
+    sparse->Id = (UINT32) InterlockedIncrement(&WvSparseNextId_);
+    WvlDiskInit(sparse->disk);
+    WvDevInit(sparse->Dev);
+    sparse->Dev->Ops.Free = WvSparseFree_;
+    sparse->Dev->ext = sparse->disk;
+    sparse->disk->disk_ops.Io = WvSparseIo_;
+    sparse->disk->disk_ops.UnitNum = WvSparseUnitNum_;
+    sparse->disk->disk_ops.PnpQueryId = WvSparsePnpQueryId_;
+    sparse->disk->disk_ops.PnpQueryDevText = WvDiskPnpQueryDevText;
+    sparse->disk->disk_ops.Unmap = WvSparseUnmap_;
+    sparse->disk->ext = sparse;
+    sparse->disk->NoCache = TRUE;
+    sparse->disk->DriverObj = WvDriverObj;
+
+    /* Set associations for the PDO, device, disk. */
+    WvDevForDevObj(pdo, sparse->Dev);
+    WvDevSetIrpHandler(pdo, WvSparseIrpDispatch);
+    sparse->Dev->Self = pdo;
+
+    /* Some device parameters. */
+    pdo->Flags |= DO_DIRECT_IO;         /* FIXME? */
+    pdo->Flags |= DO_POWER_INRUSH;      /* FIXME? */
+
+    DBG("New PDO: %p\n", pdo);
+    return sparse;
+  }
+
+/**
+ * Create a sparse RAM disk from a user's request.
+ *
+ * @v irp               The IOCTL_RAM_ATTACH IRP, with a
+ *                      WV_S_MOUNT_RAMDISK in its system buffer.
+ * @ret NTSTATUS        The status of the operation.
+ */
+NTSTATUS STDCALL WvSparseAttach(IN PIRP irp) {
+    PIO_STACK_LOCATION io_stack_loc = IoGetCurrentIrpStackLocation(irp);
+    WV_SP_MOUNT_RAMDISK params = irp->AssociatedIrp.SystemBuffer;
+    static WVL_A_DISK_BOOT_SECT blank;
+    WVL_E_DISK_MEDIA_TYPE media_type;
+    UINT32 sector_size;
+    ULONGLONG extents;
+    WV_SP_SPARSE_T sparse;
+    NTSTATUS status;
+
+    if (
+        !params ||
+        io_stack_loc->Parameters.DeviceIoControl.InputBufferLength <
+        sizeof *params
+      ) {
+        DBG("Invalid request buffer\n");
+        status = STATUS_INVALID_PARAMETER;
+        goto err_params;
+      }
+
+    switch (params->disk.type) {
+        case 'f':
+          media_type = WvlDiskMediaTypeFloppy;
+          sector_size = 512;
+          break;
+
+        case 'c':
+          media_type = WvlDiskMediaTypeOptical;
+          sector_size = 2048;
+          break;
+
+        default:
+          media_type = WvlDiskMediaTypeHard;
+          sector_size = 512;
+          break;
+      }
+    DBG("Media type: %d\n", media_type);
+
+    extents = (
+        params->size + WV_M_SPARSE_EXTENT_SIZE - 1
+      ) / WV_M_SPARSE_EXTENT_SIZE;
+    if (params->size < sector_size || extents > WV_M_EXTMAP_MAX_EXTENTS) {
+        DBG("Invalid sparse RAM disk size!\n");
+        status = STATUS_INVALID_PARAMETER;
+        goto err_params;
+      }
+
+    /* Create the sparse RAM disk PDO. */
+    sparse = WvSparseCreatePdo(media_type);
+    if (sparse == NULL) {
+        DBG("Could not create sparse RAM disk!\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_pdo;
+      }
+
+    /* Only the table of tables of the extent map is allocated up-front. */
+    if (!WvExtMapInit(&sparse->Map, (UINT32) extents)) {
+        DBG("Could not allocate sparse RAM disk extent map!\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto err_tables;
+      }
+
+    /* Set sparse RAM disk parameters. */
+    sparse->disk->Media = media_type;
+    sparse->disk->SectorSize = sector_size;
+    sparse->disk->LBADiskSize = params->size / sector_size;
+    sparse->disk->Cylinders = params->disk.cylinders;
+    sparse->disk->Heads = params->disk.heads;
+    sparse->disk->Sectors = params->disk.sectors;
+    WvlDiskGuessGeometry(&blank, sparse->disk);
+
+    /* Add the sparse RAM disk to the bus. */
+    sparse->disk->ParentBus = WvBus.Fdo;
+    if (!WvBusAddDev(sparse->Dev)) {
+        status = STATUS_UNSUCCESSFUL;
+        goto err_add_child;
+      }
+
+    DBG(
+        "Sparse RAM disk %u: %I64u sectors\n",
+        sparse->Id,
+        sparse->disk->LBADiskSize
+      );
+    return STATUS_SUCCESS;
+
+    WvBusRemoveDev(sparse->Dev);
+    err_add_child:
+
+    err_tables:
+
+    WvSparseFree_(sparse->Dev);
+    err_pdo:
+
+    err_params:
+
+    return status;
+  }
+
+/**
+ * Sparse RAM disk deletion operation.
+ *
+ * @v dev               Points to the sparse RAM disk device to delete.
+ */
+static VOID STDCALL WvSparseFree_(IN WV_SP_DEV_T dev) {
+    WV_SP_SPARSE_T sparse = CONTAINING_RECORD(dev, WV_S_SPARSE_T, Dev[0]);
+
+    /* Release the memory. */
+    WvExtMapFree(&sparse->Map, WvExtentFree);
+    IoDeleteDevice(dev->Self);
+  }
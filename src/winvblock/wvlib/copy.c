@@ -0,0 +1,225 @@
+/**
+ * Copyright (C) 2009-2011, Shao Miller <shao.miller@yrdsb.edu.on.ca>.
+ *
+ * This file is part of WinVBlock, originally derived from WinAoE.
+ *
+ * WinVBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * WinVBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with WinVBlock.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * WinVBlock bulk copy library.
+ */
+
+#include <ntddk.h>
+
+#if defined(_M_IX86) || defined(_M_AMD64)
+#  include <intrin.h>
+#  include <emmintrin.h>
+#  define WVL_M_COPY_X86_ 1
+#endif
+
+#include "portable.h"
+#include "winvblock.h"
+#include "copy.h"
+#include "debug.h"
+
+/*** Constants */
+
+/** Copy methods, from slowest to fastest. */
+enum WVL_E_COPY_METHOD_ {
+    WvlCopyMethodUnknown_,
+    WvlCopyMethodReference_,
+    WvlCopyMethodDwords_,
+    WvlCopyMethodErms_,
+    WvlCopyMethods_
+  };
+
+/*** Function declarations */
+#ifdef WVL_M_COPY_X86_
+static VOID WvlCopyDetect_(void);
+static BOOLEAN WvlCopyStream_(PUCHAR, const UCHAR *, SIZE_T);
+#endif
+
+/*** Objects */
+
+/** The method for ordinary copies, found on first use. */
+static LONG WvlCopyMethod_ = WvlCopyMethodUnknown_;
+
+/** Does the CPU support SSE2 streaming stores? */
+static BOOLEAN WvlCopySse2_ = FALSE;
+
+/*** Function definitions */
+
+WVL_M_LIB VOID STDCALL WvlCopyMemoryReference(
+    OUT PVOID Dest,
+    IN const VOID * Src,
+    IN SIZE_T Length
+  ) {
+    PUCHAR dest = Dest;
+    const UCHAR * src = Src;
+
+    /* Copy whole words when both pointers can be aligned together. */
+    if (
+        Length >= sizeof (ULONG_PTR) &&
+        !(((ULONG_PTR) dest ^ (ULONG_PTR) src) & (sizeof (ULONG_PTR) - 1))
+      ) {
+        while ((ULONG_PTR) dest & (sizeof (ULONG_PTR) - 1)) {
+            *dest++ = *src++;
+            Length--;
+          }
+        while (Length >= sizeof (ULONG_PTR)) {
+            *(PULONG_PTR) dest = *(const ULONG_PTR *) src;
+            dest += sizeof (ULONG_PTR);
+            src += sizeof (ULONG_PTR);
+            Length -= sizeof (ULONG_PTR);
+          }
+      }
+    /* Whatever is left, including the tail. */
+    while (Length--)
+      *dest++ = *src++;
+    return;
+  }
+
+WVL_M_LIB VOID STDCALL WvlCopyMemory(
+    OUT PVOID Dest,
+    IN const VOID * Src,
+    IN SIZE_T Length
+  ) {
+#ifdef WVL_M_COPY_X86_
+    PUCHAR dest = Dest;
+    const UCHAR * src = Src;
+
+    if (WvlCopyMethod_ == WvlCopyMethodUnknown_)
+      WvlCopyDetect_();
+
+    /* Large transfers would only flush the cache. */
+    if (
+        Length >= WVL_M_COPY_STREAM_MIN &&
+        WvlCopySse2_ &&
+        WvlCopyStream_(dest, src, Length)
+      )
+      return;
+
+    switch (WvlCopyMethod_) {
+        case WvlCopyMethodErms_:
+          /* Fast strings make a plain 'rep movsb' the best choice. */
+          __movsb(dest, src, Length);
+          return;
+
+        case WvlCopyMethodDwords_:
+          __movsd((PULONG) dest, (const ULONG *) src, Length >> 2);
+          /* Don't forget the tail. */
+          if (Length & 3)
+            __movsb(dest + (Length & ~3), src + (Length & ~3), Length & 3);
+          return;
+
+        default:
+          break;
+      }
+#endif
+    WvlCopyMemoryReference(Dest, Src, Length);
+    return;
+  }
+
+#ifdef WVL_M_COPY_X86_
+
+/**
+ * Find the copy methods that this CPU supports.
+ *
+ * Racing callers all find the same answer, so there's no lock.
+ */
+static VOID WvlCopyDetect_(void) {
+    int info[4];
+    int max_leaf;
+    LONG method = WvlCopyMethodDwords_;
+
+    __cpuid(info, 0);
+    max_leaf = info[0];
+    if (max_leaf >= 1) {
+        __cpuid(info, 1);
+        /* EDX bit 26: SSE2. */
+        if (info[3] & (1 << 26))
+          WvlCopySse2_ = TRUE;
+      }
+    if (max_leaf >= 7) {
+        __cpuidex(info, 7, 0);
+        /* EBX bit 9: Enhanced REP MOVSB/STOSB. */
+        if (info[1] & (1 << 9))
+          method = WvlCopyMethodErms_;
+      }
+    DBG(
+        "Copy method: %s%s\n",
+        method == WvlCopyMethodErms_ ? "ERMS" : "DWORDs",
+        WvlCopySse2_ ? ", SSE2 streaming" : ""
+      );
+    InterlockedExchange(&WvlCopyMethod_, method);
+    return;
+  }
+
+/**
+ * Copy a large block of memory with non-temporal stores.
+ *
+ * @v dest              Points to the destination.
+ * @v src               Points to the source.
+ * @v len               The number of bytes to copy.
+ * @ret BOOLEAN         FALSE if the SSE state couldn't be saved, in
+ *                      which case nothing has been copied.
+ */
+static BOOLEAN WvlCopyStream_(PUCHAR dest, const UCHAR * src, SIZE_T len) {
+    SIZE_T head;
+    __m128i a, b, c, d;
+#  ifdef _M_IX86
+    KFLOATING_SAVE save;
+
+    /* 32-bit kernel code must save the SSE state before touching it. */
+    if (!NT_SUCCESS(KeSaveFloatingPointState(&save)))
+      return FALSE;
+#  endif
+
+    /* Bring the destination to a 16-byte boundary. */
+    head = (0 - (ULONG_PTR) dest) & 15;
+    WvlCopyMemoryReference(dest, src, head);
+    dest += head;
+    src += head;
+    len -= head;
+
+    /* 64 bytes, one cache line, at a time. */
+    while (len >= 64) {
+        a = _mm_loadu_si128((const __m128i *) src);
+        b = _mm_loadu_si128((const __m128i *) src + 1);
+        c = _mm_loadu_si128((const __m128i *) src + 2);
+        d = _mm_loadu_si128((const __m128i *) src + 3);
+        _mm_stream_si128((__m128i *) dest, a);
+        _mm_stream_si128((__m128i *) dest + 1, b);
+        _mm_stream_si128((__m128i *) dest + 2, c);
+        _mm_stream_si128((__m128i *) dest + 3, d);
+        dest += 64;
+        src += 64;
+        len -= 64;
+      }
+    /* Make the stores visible before anyone looks at the data. */
+    _mm_sfence();
+
+#  ifdef _M_IX86
+    KeRestoreFloatingPointState(&save);
+#  endif
+
+    /* The tail. */
+    WvlCopyMemoryReference(dest, src, len);
+    return TRUE;
+  }
+
+#endif  /* WVL_M_COPY_X86_ */